@@ -1 +1,3 @@
-cl /std:c++latest /EHsc /W4 /WX /diagnostics:caret /diagnostics:color /Zi fredbuf-test.cpp /Fefredbuf-test.exe
\ No newline at end of file
+cl /std:c++latest /EHsc /W4 /WX /diagnostics:caret /diagnostics:color /Zi fredbuf-test.cpp /Fefredbuf-test.exe
+rem The tests of the optional features only run in a build which enables them.
+cl /std:c++latest /EHsc /W4 /WX /diagnostics:caret /diagnostics:color /Zi /DTEXTBUF_CONTENT_HASH /DTEXTBUF_UTF_COUNTS /DTEXTBUF_COLD_BUFFERS fredbuf-test.cpp /Fefredbuf-test-features.exe && fredbuf-test-features.exe
\ No newline at end of file
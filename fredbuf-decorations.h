@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "enum-utils.h"
+#include "types.h"
+
+// Decorations are styled ranges (tokens, search highlights, folding regions) which move with the text they cover.
+// They live in a persistent treap ordered by start: nodes are immutable and shared between copies, so copying a
+// decoration tree is O(1) and the copy is unaffected by later changes to the original, the same way a
+// 'RedBlackTree' root is.  Every node carries a pending shift for its children and the largest end in its
+// subtree, so an edit shifts everything after it in O(log n) and a range query only visits subtrees holding a
+// match.
+
+namespace PieceTree
+{
+    using Editor::CharOffset;
+    using Editor::Length;
+
+    enum class DecorationId : size_t
+    {
+        Invalid = sentinel_for<DecorationId>
+    };
+
+    struct Decoration
+    {
+        DecorationId id;
+        CharOffset first;
+        CharOffset last;
+        // Opaque to the tree, e.g. a token kind or a highlight class.
+        uint64_t style;
+    };
+
+    class DecorationTree
+    {
+    public:
+        // Text inserted at either end of a decoration is not covered by it.  An empty decoration moves with text
+        // inserted at its offset.
+        DecorationId add(CharOffset first, CharOffset last, uint64_t style);
+        // Removes a decoration as last returned by 'find'.
+        void erase(const Decoration& decoration);
+        // Removes every decoration starting in [first, last), e.g. before retokenizing those lines.
+        void erase_starting_in(CharOffset first, CharOffset last);
+        void clear();
+
+        // Queries.
+        size_t size() const;
+        // Appends the decorations overlapping [first, last) to 'out' in order of their start.  Empty decorations
+        // overlap when they lie within the range.
+        void find(std::vector<Decoration>* out, CharOffset first, CharOffset last) const;
+
+        // Edits.  A 'Tree' calls these for its attached decoration trees.
+        void inserted(CharOffset offset, Length length);
+        // Decorations lose the removed text, collapsing to 'offset' if they lay entirely within it.
+        void removed(CharOffset offset, Length length);
+
+    private:
+        struct Node;
+        using NodePtr = std::shared_ptr<const Node>;
+
+        struct Node
+        {
+            // Relative to the pending shifts of the ancestors.
+            size_t first;
+            size_t last;
+            size_t max_last;
+            // Added to every descendant (but not this node).  Negative shifts wrap around.
+            size_t pending;
+            size_t size;
+            uint64_t priority;
+            DecorationId id;
+            uint64_t style;
+            NodePtr left;
+            NodePtr right;
+        };
+
+        static NodePtr make(const Node& data, NodePtr left, NodePtr right);
+        static NodePtr shifted(const NodePtr& n, size_t delta);
+        // Splits 'n' into the decorations ordered before (first, id) and the rest.
+        static void split(NodePtr n, size_t first, DecorationId id, NodePtr* lhs, NodePtr* rhs);
+        static NodePtr merge(const NodePtr& lhs, const NodePtr& rhs);
+        // Adjusts the end of decorations in 'n' which end after 'offset' with 'adjust'.
+        template <typename F>
+        static NodePtr adjust_ends(const NodePtr& n, size_t offset, F adjust);
+        // Appends the decorations of 'n' in order, with their offsets shifted by 'shift' and no children.
+        static void collect(const NodePtr& n, size_t shift, std::vector<Node>* out);
+        uint64_t next_priority();
+
+        NodePtr root;
+        size_t next_id = 0;
+        uint64_t seed = 0x9E3779B97F4A7C15;
+    };
+} // namespace PieceTree
\ No newline at end of file
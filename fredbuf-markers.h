@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "enum-utils.h"
+#include "types.h"
+
+// Markers are offsets which follow the text they are attached to as the document is edited (e.g. diagnostics,
+// bookmarks, breakpoints or cursors).  They live in a treap ordered by offset in which every node carries a
+// pending shift for its children, so an edit shifts every marker after it in O(log n) by splitting the markers
+// it does not touch off and shifting the root of the split.  Only the markers inside a removed range are visited
+// individually.
+
+namespace PieceTree
+{
+    using Editor::CharOffset;
+    using Editor::Length;
+
+    enum class MarkerId : size_t
+    {
+        Invalid = sentinel_for<MarkerId>
+    };
+
+    // Decides which side of text inserted exactly at a marker the marker ends up on.
+    enum class Gravity : bool
+    {
+        // The marker stays before the inserted text, e.g. the start of a selection.
+        Left,
+        // The marker moves after the inserted text, e.g. a cursor.
+        Right
+    };
+
+    struct MarkerPosition
+    {
+        MarkerId id;
+        CharOffset offset;
+    };
+
+    class MarkerTree
+    {
+    public:
+        MarkerId add(CharOffset offset, Gravity gravity = Gravity::Right);
+        void erase(MarkerId id);
+        void clear();
+
+        // Queries.
+        CharOffset offset(MarkerId id) const;
+        Gravity gravity(MarkerId id) const;
+        size_t size() const
+        {
+            return count;
+        }
+        // Appends the markers in [first, last) to 'out' in order of offset.
+        void find(std::vector<MarkerPosition>* out, CharOffset first, CharOffset last) const;
+
+        // Edits.  A 'Tree' calls these for its attached marker trees.
+        void inserted(CharOffset offset, Length length);
+        // Markers inside the removed range collapse to 'offset'.
+        void removed(CharOffset offset, Length length);
+
+    private:
+        using NodeIndex = size_t;
+        static constexpr NodeIndex null_node = static_cast<NodeIndex>(-1);
+
+        struct Node
+        {
+            // Relative to the pending shifts of the ancestors.
+            size_t offset = 0;
+            // Added to every descendant (but not this node) when pushed down.  Negative shifts wrap around.
+            size_t pending = 0;
+            uint64_t priority = 0;
+            NodeIndex left = null_node;
+            NodeIndex right = null_node;
+            NodeIndex parent = null_node;
+            Gravity gravity = Gravity::Right;
+            bool live = false;
+        };
+
+        // Orders markers at the same offset so that those with left gravity come first.  An insertion there
+        // then splits them apart without reordering.
+        static bool precedes(size_t offset, Gravity gravity, size_t other_offset, Gravity other_gravity);
+
+        void push(NodeIndex n);
+        void shift(NodeIndex n, size_t delta);
+        void set_left(NodeIndex n, NodeIndex child);
+        void set_right(NodeIndex n, NodeIndex child);
+        // Splits 'n' into the markers before (offset, gravity) and the rest.
+        void split(NodeIndex n, size_t offset, Gravity gravity, NodeIndex* lhs, NodeIndex* rhs);
+        NodeIndex merge(NodeIndex lhs, NodeIndex rhs);
+        void collect(NodeIndex n, std::vector<NodeIndex>* out);
+        NodeIndex build(std::span<const NodeIndex> sorted);
+        uint64_t next_priority();
+
+        std::vector<Node> nodes;
+        std::vector<NodeIndex> free_nodes;
+        NodeIndex root = null_node;
+        size_t count = 0;
+        uint64_t seed = 0x9E3779B97F4A7C15;
+        // Scratch space for collapsing removed markers.
+        std::vector<NodeIndex> scratch;
+    };
+} // namespace PieceTree
\ No newline at end of file
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
 
 #include "types.h"
 
@@ -33,6 +37,37 @@ namespace PieceTree
 
     enum class LFCount : size_t { };
 
+#ifdef TEXTBUF_CONTENT_HASH
+    // A polynomial hash of content modulo 2^61 - 1.  The hash of a concatenation can be computed from the hashes of
+    // its parts, so it does not depend on how the content is split into pieces.
+    enum class ContentHash : uint64_t { };
+
+    ContentHash combine_hash(ContentHash lhs, ContentHash rhs, Length rhs_length);
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
+    // The number of code points and UTF-16 code units encoded by UTF-8 content.  Bytes are counted as they are
+    // seen so that counts stay additive across piece boundaries: every non-continuation byte starts a code point
+    // and a 4-byte lead byte accounts for both halves of a surrogate pair.
+    struct UTFCounts
+    {
+        size_t code_points = 0;
+        size_t utf16_units = 0;
+
+        bool operator==(const UTFCounts&) const = default;
+    };
+
+    constexpr UTFCounts operator+(const UTFCounts& lhs, const UTFCounts& rhs)
+    {
+        return { .code_points = lhs.code_points + rhs.code_points, .utf16_units = lhs.utf16_units + rhs.utf16_units };
+    }
+
+    constexpr UTFCounts operator-(const UTFCounts& lhs, const UTFCounts& rhs)
+    {
+        return { .code_points = lhs.code_points - rhs.code_points, .utf16_units = lhs.utf16_units - rhs.utf16_units };
+    }
+#endif // TEXTBUF_UTF_COUNTS
+
     struct BufferCursor
     {
         // Relative line in the current buffer.
@@ -60,11 +95,30 @@ namespace PieceTree
 
         PieceTree::Length left_subtree_length = { };
         PieceTree::LFCount left_subtree_lf_count = { };
+        // CR/LF tracking.  A CRLF pair may straddle pieces so each subtree records whether its content starts with
+        // LF or ends with CR.  'piece_crlf_count' only counts pairs entirely within the piece while
+        // 'left_subtree_crlf_count' counts every pair within the left subtree.
+        PieceTree::LFCount piece_crlf_count = { };
+        PieceTree::LFCount left_subtree_crlf_count = { };
+        bool piece_starts_with_lf = false;
+        bool piece_ends_with_cr = false;
+        bool subtree_starts_with_lf = false;
+        bool subtree_ends_with_cr = false;
+#ifdef TEXTBUF_CONTENT_HASH
+        // Opt-in since it grows every node.  Unlike the fields above, the subtree hash covers both children.
+        PieceTree::ContentHash piece_hash = { };
+        PieceTree::ContentHash subtree_hash = { };
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        // Opt-in since it grows every node.
+        PieceTree::UTFCounts piece_utf_counts = { };
+        PieceTree::UTFCounts left_subtree_utf_counts = { };
+#endif // TEXTBUF_UTF_COUNTS
     };
 
     class RedBlackTree;
 
-    NodeData attribute(const NodeData& data, const RedBlackTree& left);
+    NodeData attribute(const NodeData& data, const RedBlackTree& left, const RedBlackTree& right);
 
     enum class Color
     {
@@ -84,8 +138,11 @@ namespace PieceTree
         return "unknown";
     }
 
+    class NodeReclaimer;
+
     class RedBlackTree
     {
+        friend class NodeReclaimer;
         struct Node;
         using NodePtr = std::shared_ptr<const Node>;
 
@@ -117,6 +174,13 @@ namespace PieceTree
         // Mutators.
         RedBlackTree insert(const NodeData& x, Offset at) const;
         RedBlackTree remove(Offset at) const;
+
+        // Bulk construction.
+        // Builds a balanced tree from nodes given in document order in O(n) allocations.
+        static RedBlackTree build(std::span<const NodeData> nodes);
+        // Rebuilds a node from its parts, e.g. when deserializing.  The caller is responsible for the red-black
+        // invariants.
+        static RedBlackTree compose(Color c, const RedBlackTree& left, const NodeData& data, const RedBlackTree& right);
     private:
         RedBlackTree(Color c,
                     const RedBlackTree& lft,
@@ -148,11 +212,42 @@ namespace PieceTree
 
         // General.
         RedBlackTree paint(Color c) const;
+        static RedBlackTree build(std::span<const NodeData> nodes, size_t depth, size_t red_depth);
 
         NodePtr root_node;
     };
 
+    // Dropping the last reference to a large root frees every node it solely owns, right there on the thread
+    // which dropped it.  Retiring the root here instead is O(1) and the nodes are freed later in bounded
+    // batches by 'reclaim', e.g. from an idle callback or a background thread.  Nodes still shared with live
+    // roots are left alone.  Any thread may retire or reclaim.
+    //
+    // Reclaiming skips a node whose reference count is above one.  The count may drop concurrently, since
+    // other roots sharing the node can be dropped on other threads; the node is then freed in place by
+    // whichever thread lets go of it last, which is a missed deferral but never an early free.  A count of one
+    // cannot rise again since only the reclaimer still refers to the node.
+    class NodeReclaimer
+    {
+    public:
+        void retire(RedBlackTree root);
+        // Visits at most 'budget' retired nodes and returns the number of nodes freed.
+        size_t reclaim(size_t budget);
+        // The number of retired nodes not yet visited.
+        size_t pending() const;
+
+    private:
+        mutable std::mutex lock;
+        std::vector<RedBlackTree::NodePtr> nodes;
+    };
+
     // Global queries.
     PieceTree::Length tree_length(const RedBlackTree& root);
     PieceTree::LFCount tree_lf_count(const RedBlackTree& root);
+    PieceTree::LFCount tree_crlf_count(const RedBlackTree& root);
+#ifdef TEXTBUF_CONTENT_HASH
+    PieceTree::ContentHash tree_hash(const RedBlackTree& root);
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+    PieceTree::UTFCounts tree_utf_counts(const RedBlackTree& root);
+#endif // TEXTBUF_UTF_COUNTS
 } // namespace PieceTree
\ No newline at end of file
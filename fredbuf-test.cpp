@@ -1,6 +1,7 @@
 #include <cassert>
 
 #include <format>
+#include <optional>
 #include <source_location>
 
 #include "fredbuf.cpp"
@@ -535,6 +536,2563 @@ void test9()
     assume_buffer(&tree, "Hello, World! My name is fredbuf.");
 }
 
+void test10()
+{
+    TreeBuilder builder;
+    builder.accept("Hello");
+    auto tree = builder.create();
+
+    // Word boundaries split contiguous insertions.
+    tree.history_policy({ .coalesce_words = CoalesceWords::Yes });
+    tree.insert(CharOffset{ 5 }, ",");
+    tree.insert(CharOffset{ 6 }, " ");
+    tree.insert(CharOffset{ 7 }, "W");
+    tree.insert(CharOffset{ 8 }, "orld");
+    assume_buffer(&tree, "Hello, World");
+
+    auto r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    assume_buffer(&tree, "Hello, ");
+
+    r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    assume_buffer(&tree, "Hello");
+
+    r = tree.try_redo(CharOffset{ 0 });
+    assert(r.success);
+    r = tree.try_redo(CharOffset{ 0 });
+    assert(r.success);
+    assume_buffer(&tree, "Hello, World");
+
+    // Bound the number of entries.
+    tree.history_policy({ .max_entries = 2 });
+    for (size_t i = 0; i < 5; ++i)
+    {
+        tree.insert(CharOffset{ 0 }, "x");
+    }
+    assume_buffer(&tree, "xxxxxHello, World");
+    assert(tree.history_retained_bytes() != 0);
+
+    r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    r = tree.try_undo(CharOffset{ 0 });
+    assert(not r.success);
+    assume_buffer(&tree, "xxxHello, World");
+
+    // Bound the retained memory.
+    tree.history_policy({ .max_retained_bytes = 1 });
+    assert(tree.try_redo(CharOffset{ 0 }).success);
+    assert(not tree.try_undo(CharOffset{ 0 }).success);
+    assume_buffer(&tree, "xxxxHello, World");
+
+    // A long redo history does not count against the budget, so it cannot push out the undo entries.
+    tree.history_policy({ });
+    for (size_t i = 0; i < 40; ++i)
+    {
+        tree.insert(CharOffset{ 0 }, "y");
+        tree.commit_head(CharOffset{ 0 });
+    }
+    for (size_t i = 0; i < 30; ++i)
+    {
+        assert(tree.try_undo(CharOffset{ 0 }).success);
+    }
+    tree.history_policy({ .max_retained_bytes = tree.history_retained_bytes() / 4 });
+    size_t undone = 0;
+    while (tree.try_undo(CharOffset{ 0 }).success)
+    {
+        ++undone;
+    }
+    assert(undone != 0);
+    assert(tree.history_retained_bytes() != 0);
+
+    // Jumps account for every entry they cross.  Near the oldest state there is little to undo, so the budget keeps
+    // the whole history there, and jumping to the newest state evicts down to the budget again.
+    tree.history_policy({ });
+    for (size_t i = 0; i < 200; ++i)
+    {
+        tree.insert(CharOffset{ i % 7 }, "z");
+        tree.commit_head(CharOffset{ 0 });
+    }
+    auto first = tree.history_first();
+    auto last = tree.history_last();
+    assert(tree.jump_to(first).success);
+    tree.history_policy({ .max_retained_bytes = tree.history_retained_bytes() / 2 });
+    for (size_t i = 0; i < 50; ++i)
+    {
+        assert(tree.jump_to(HistoryId{ rep(first) + (i * 7) % 10 }).success);
+        assert(tree.jump_to(first).success);
+    }
+    assert(tree.history_first() == first);
+    assert(tree.jump_to(last).success);
+    assert(tree.history_first() != first);
+    assert(tree.jump_to(tree.history_first()).success);
+    assert(tree.history_first() != first);
+
+    // A batch large enough to rebuild the tree leaves its parent holding every node of the old root, which the
+    // budget must see.
+    Tree rebuilt;
+    for (size_t i = 0; i < 500; ++i)
+    {
+        rebuilt.insert(CharOffset{ 0 }, "a", SuppressHistory::Yes);
+    }
+    rebuilt.insert(CharOffset{ 0 }, "b");
+    auto single_edit = rebuilt.history_retained_bytes();
+    assert(single_edit != 0);
+    rebuilt.history_policy({ .max_retained_bytes = 4 * single_edit });
+    assert(rebuilt.try_undo(CharOffset{ 0 }).success);
+    assert(rebuilt.try_redo(CharOffset{ 0 }).success);
+    std::vector<Edit> edits;
+    for (size_t i = 0; i < 40; ++i)
+    {
+        edits.push_back({ .offset = CharOffset{ i * 10 }, .count = Length{ 1 }, .txt = "c" });
+    }
+    rebuilt.apply_edits(edits);
+    assert(rebuilt.history_retained_bytes() <= 4 * single_edit);
+    assert(not rebuilt.try_undo(CharOffset{ 0 }).success);
+}
+
+void test11()
+{
+    TreeBuilder builder;
+    builder.accept("Hello");
+    auto tree = builder.create();
+    auto initial = tree.history_current();
+
+    tree.insert(CharOffset{ 5 }, ", World");
+    auto world = tree.history_current();
+    assume_buffer(&tree, "Hello, World");
+
+    // Undo and create a new branch.  The old branch must remain reachable.
+    auto r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    assert(tree.history_current() == initial);
+    tree.insert(CharOffset{ 5 }, ", fredbuf");
+    auto fredbuf = tree.history_current();
+    assume_buffer(&tree, "Hello, fredbuf");
+
+    auto* entry = tree.history_at(initial);
+    assert(entry != nullptr);
+    assert(entry->children.size() == 2);
+    assert(entry->redo_child == fredbuf);
+    assert(tree.history_at(fredbuf)->parent == initial);
+
+    r = tree.jump_to(world);
+    assert(r.success);
+    assume_buffer(&tree, "Hello, World");
+
+    // Chronological walk.
+    r = tree.history_later();
+    assert(r.success);
+    assume_buffer(&tree, "Hello, fredbuf");
+    r = tree.history_later();
+    assert(not r.success);
+    r = tree.history_earlier();
+    assert(r.success);
+    assume_buffer(&tree, "Hello, World");
+    r = tree.history_earlier();
+    assert(r.success);
+    assume_buffer(&tree, "Hello");
+    r = tree.history_earlier();
+    assert(not r.success);
+
+    // Redo follows the most recently visited branch.
+    tree.jump_to(world);
+    tree.try_undo(CharOffset{ 0 });
+    r = tree.try_redo(CharOffset{ 0 });
+    assert(r.success);
+    assume_buffer(&tree, "Hello, World");
+
+    // Edits made within a state are captured when leaving it.
+    tree.insert(CharOffset{ 12 }, "!", SuppressHistory::Yes);
+    tree.jump_to(fredbuf);
+    tree.jump_to(world);
+    assume_buffer(&tree, "Hello, World!");
+}
+
+std::string buffer_content(const PieceTree::Tree& tree)
+{
+    std::string buf;
+    for (char c : tree)
+    {
+        buf.push_back(c);
+    }
+    return buf;
+}
+
+void test12()
+{
+    TreeBuilder builder;
+    for (int i = 0; i < 64; ++i)
+    {
+        builder.accept(std::format("line {}\n", i));
+    }
+    auto tree = builder.create();
+    auto old_root = tree.head();
+    auto old_buf = buffer_content(tree);
+
+    DiffRanges ranges;
+    tree.diff(&ranges, old_root, tree.head());
+    assert(ranges.empty());
+
+    tree.insert(CharOffset{ 100 }, "abc");
+    tree.diff(&ranges, old_root, tree.head());
+    assert(ranges.size() == 1);
+    assert(ranges[0].old_first == CharOffset{ 100 });
+    assert(ranges[0].old_length == Length{ 0 });
+    assert(ranges[0].new_first == CharOffset{ 100 });
+    assert(ranges[0].new_length == Length{ 3 });
+
+    tree.remove(CharOffset{ 300 }, Length{ 20 });
+    tree.insert(CharOffset{ 5 }, "X\nY");
+    tree.remove(CharOffset{ 0 } + retract(tree.length(), 3), Length{ 3 });
+    tree.diff(&ranges, old_root, tree.head());
+    assert(ranges.size() == 4);
+
+    // Applying the ranges to the old buffer must produce the new buffer.
+    auto new_buf = buffer_content(tree);
+    std::string patched;
+    size_t old_pos = 0;
+    for (auto& range : ranges)
+    {
+        patched.append(old_buf, old_pos, rep(range.old_first) - old_pos);
+        patched.append(new_buf, rep(range.new_first), rep(range.new_length));
+        old_pos = rep(range.old_first) + rep(range.old_length);
+    }
+    patched.append(old_buf, old_pos);
+    assert(patched == new_buf);
+
+    // The reverse direction swaps the roles.
+    tree.diff(&ranges, tree.head(), old_root);
+    assert(ranges.size() == 4);
+    assert(ranges[0].old_length == Length{ 3 });
+    assert(ranges[0].new_length == Length{ 0 });
+}
+
+void test13()
+{
+    // Replace every 'o' with "0\n" (a batch large enough to take the bulk path) and every 'W' with nothing.
+    TreeBuilder builder;
+    std::string expected;
+    for (int i = 0; i < 40; ++i)
+    {
+        auto chunk = std::format("Hello, World {}!\n", i);
+        builder.accept(chunk);
+        expected += chunk;
+    }
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 7 }, "foo");
+    expected.insert(7, "foo");
+    auto before = expected;
+
+    std::vector<Edit> edits;
+    std::string replaced;
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        if (expected[i] == 'o')
+        {
+            edits.push_back({ .offset = CharOffset{ i }, .count = Length{ 1 }, .txt = "0\n" });
+            replaced += "0\n";
+        }
+        else if (expected[i] == 'W')
+        {
+            edits.push_back({ .offset = CharOffset{ i }, .count = Length{ 1 }, .txt = { } });
+        }
+        else
+        {
+            replaced.push_back(expected[i]);
+        }
+    }
+    assert(edits.size() > 32);
+    tree.apply_edits(edits);
+    assume_buffer(&tree, replaced);
+    assert(tree.line_feed_count() == LFCount{ size_t(std::count(begin(replaced), end(replaced), '\n')) });
+
+    // The whole batch is a single undo entry.
+    auto r = tree.try_undo(CharOffset{ 0 });
+    assert(r.success);
+    assume_buffer(&tree, before);
+
+    // Small batches, including pure insertions and removals at the boundaries.
+    Edit small[] = {
+        { .offset = CharOffset{ 0 }, .count = Length{ 0 }, .txt = ">>" },
+        { .offset = CharOffset{ 5 }, .count = Length{ 5 }, .txt = "" },
+        { .offset = CharOffset{ 0 } + Length{ before.size() }, .count = Length{ 0 }, .txt = "<<" },
+    };
+    tree.apply_edits(small);
+    expected = ">>" + before.substr(0, 5) + before.substr(10) + "<<";
+    assume_buffer(&tree, expected);
+}
+
+void test14()
+{
+    // Use tiny pieces so that most matches straddle piece boundaries.
+    TreeBuilder builder;
+    std::string expected;
+    const std::string_view text = "abab\nabcab\nbabcabca\nb";
+    for (int i = 0; i < 8; ++i)
+    {
+        for (size_t j = 0; j < text.size(); j += 3)
+        {
+            builder.accept(text.substr(j, 3));
+        }
+        expected += text;
+    }
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 10 }, "abc");
+    expected.insert(10, "abc");
+    assume_buffer(&tree, expected);
+
+    auto line_of = [&](size_t off) {
+        return Line{ size_t(std::count(begin(expected), begin(expected) + off, '\n')) + 1 };
+    };
+
+    for (std::string_view needle : { "a", "ab", "abca", "b\na", "cabca\nbab", "zzz", "abab\nabcab\nbabcabca\nbabab" })
+    {
+        // find_all matches the naive non-overlapping search.
+        SearchMatches matches;
+        tree.find_all(&matches, needle);
+        size_t idx = 0;
+        for (auto pos = expected.find(needle); pos != std::string::npos; pos = expected.find(needle, pos + needle.size()))
+        {
+            assert(idx < matches.size());
+            assert(matches[idx].offset == CharOffset{ pos });
+            assert(matches[idx].line == line_of(pos));
+            ++idx;
+        }
+        assert(idx == matches.size());
+
+        auto snap = tree.owning_snap();
+        SearchMatches snap_matches;
+        snap.find_all(&snap_matches, needle);
+        assert(snap_matches.size() == matches.size());
+
+        for (size_t from = 0; from <= expected.size(); from += 7)
+        {
+            auto pos = expected.find(needle, from);
+            auto r = tree.find(needle, CharOffset{ from });
+            assert(r.found == (pos != std::string::npos));
+            if (r.found)
+            {
+                assert(r.match.offset == CharOffset{ pos });
+                assert(r.match.line == line_of(pos));
+            }
+
+            pos = from >= needle.size() ? expected.rfind(needle, from - needle.size()) : std::string::npos;
+            r = tree.ref_snap().find(needle, CharOffset{ from }, SearchDirection::Backward);
+            assert(r.found == (pos != std::string::npos));
+            if (r.found)
+            {
+                assert(r.match.offset == CharOffset{ pos });
+            }
+        }
+    }
+}
+
+void test15()
+{
+    TreeBuilder builder;
+    std::string expected;
+    const std::string_view text = "let x1 = 42;\nfoo(bar, 7)\n\nx1 = x1 + 100\n";
+    for (size_t j = 0; j < text.size(); j += 4)
+    {
+        builder.accept(text.substr(j, 4));
+    }
+    expected += text;
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 4 }, "yy");
+    expected.insert(4, "yy");
+    assume_buffer(&tree, expected);
+
+    // Oracle: run the same regex over each line of the materialized buffer.
+    auto oracle = [&](const std::regex& re) {
+        SearchMatches result;
+        size_t line_first = 0;
+        auto line = Line::Beginning;
+        while (true)
+        {
+            auto line_last = expected.find('\n', line_first);
+            auto last = line_last == std::string::npos ? expected.size() : line_last;
+            auto first_it = begin(expected) + line_first;
+            for (std::sregex_iterator i{ first_it, begin(expected) + last, re }; i != std::sregex_iterator{ }; ++i)
+            {
+                result.push_back({ .offset = CharOffset{ line_first + i->position() }, .line = line, .length = Length{ size_t(i->length()) } });
+            }
+            if (line_last == std::string::npos)
+                break;
+            line_first = line_last + 1;
+            line = extend(line);
+        }
+        return result;
+    };
+
+    for (auto* pattern : { "[0-9]+", "^x1", "[a-z]+$", "\\bx1\\b", "o+", "^$", "y+x?1" })
+    {
+        std::regex re{ pattern };
+        SearchMatches matches;
+        tree.find_all_regex(&matches, re);
+        auto expected_matches = oracle(re);
+        assert(matches.size() == expected_matches.size());
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            assert(matches[i].offset == expected_matches[i].offset);
+            assert(matches[i].line == expected_matches[i].line);
+            assert(matches[i].length == expected_matches[i].length);
+        }
+
+        auto snap = tree.ref_snap();
+        if (not expected_matches.empty())
+        {
+            auto r = snap.find_regex(re, CharOffset{ 0 });
+            assert(r.found and r.match.offset == expected_matches.front().offset);
+            r = snap.find_regex(re, CharOffset{ 0 } + tree.length(), SearchDirection::Backward);
+            assert(r.found and r.match.offset == expected_matches.back().offset);
+        }
+    }
+
+    // Starting part way into a line must not let '^' match.
+    std::regex re{ "^x1" };
+    auto r = tree.find_regex(re, CharOffset{ 28 });
+    assert(r.found);
+    assert(r.match.line == Line{ 4 });
+    r = tree.owning_snap().find_regex(re, CharOffset{ 29 });
+    assert(not r.found);
+    r = tree.find_regex(std::regex{ "[0-9]+" }, CharOffset{ 27 }, SearchDirection::Backward);
+    assert(r.found and r.match.offset == CharOffset{ 24 });
+
+    // '$' matches before a CRLF, including one split between pieces.
+    TreeBuilder crlf_builder;
+    crlf_builder.accept("foo\r");
+    crlf_builder.accept("\nbar\r\n");
+    auto crlf = crlf_builder.create();
+    SearchMatches matches;
+    crlf.find_all_regex(&matches, std::regex{ "o$" });
+    assert(matches.size() == 1 and matches[0].offset == CharOffset{ 2 } and matches[0].line == Line{ 1 });
+    crlf.find_all_regex(&matches, std::regex{ "^bar$" });
+    assert(matches.size() == 1 and matches[0].offset == CharOffset{ 5 } and matches[0].length == Length{ 3 });
+    crlf.find_all_regex(&matches, std::regex{ "^bar$" }, "bar");
+    assert(matches.size() == 1 and matches[0].line == Line{ 2 });
+    r = crlf.find_regex(std::regex{ "[a-z]$" }, CharOffset{ 0 });
+    assert(r.found and r.match.offset == CharOffset{ 2 });
+    r = crlf.find_regex(std::regex{ "[a-z]$" }, CharOffset{ 0 } + crlf.length(), SearchDirection::Backward);
+    assert(r.found and r.match.offset == CharOffset{ 7 });
+
+    // A forward search starting on the CR or the LF of a CRLF continues on the next line.
+    TreeBuilder split_builder;
+    split_builder.accept("ab\r\ncd");
+    auto split = split_builder.create();
+    r = split.find_regex(std::regex{ "x" }, CharOffset{ 3 });
+    assert(not r.found);
+    r = split.find_regex(std::regex{ "x" }, CharOffset{ 2 });
+    assert(not r.found);
+    r = split.find_regex(std::regex{ "[a-z]" }, CharOffset{ 3 });
+    assert(r.found and r.match.offset == CharOffset{ 4 } and r.match.line == Line{ 2 });
+    r = split.find_regex(std::regex{ "[a-z]" }, CharOffset{ 2 });
+    assert(r.found and r.match.offset == CharOffset{ 4 } and r.match.line == Line{ 2 });
+    r = split.find_regex(std::regex{ "$" }, CharOffset{ 2 });
+    assert(r.found and r.match.offset == CharOffset{ 2 } and r.match.line == Line{ 1 });
+}
+
+void test16()
+{
+    // Large enough to be split into several partitions with pieces of assorted sizes.
+    TreeBuilder builder;
+    for (size_t i = 0; i < 4096; ++i)
+    {
+        builder.accept(std::format("{}aaa needle{}\n", std::string(i % 97, 'x'), i % 7));
+    }
+    auto tree = builder.create();
+    for (size_t i = 0; i < 64; ++i)
+    {
+        tree.insert(CharOffset{ i * 4099 }, "needle");
+    }
+    auto snap = tree.owning_snap();
+    auto ref = tree.ref_snap();
+    for (std::string_view needle : { "needle", "aa", "le3\nx", "zzz" })
+    {
+        SearchMatches serial;
+        SearchMatches parallel;
+        snap.find_all(&serial, needle);
+        snap.find_all_parallel(&parallel, needle, 8);
+        assert(serial.size() == parallel.size());
+        for (size_t i = 0; i < serial.size(); ++i)
+        {
+            assert(serial[i].offset == parallel[i].offset);
+            assert(serial[i].line == parallel[i].line);
+        }
+        ref.find_all_parallel(&parallel, needle);
+        assert(serial.size() == parallel.size());
+    }
+}
+
+void test17()
+{
+    // Several original buffers spanning many index blocks, with matches placed across block boundaries.
+    TreeBuilder builder;
+    for (size_t b = 0; b < 3; ++b)
+    {
+        std::string buf;
+        for (size_t i = 0; buf.size() < 5 * TrigramIndex::block_length; ++i)
+        {
+            buf += (i % 53 == 0) ? std::format("line {} needle here\n", i) : std::format("line {} filler text\n", i);
+        }
+        builder.accept(buf);
+    }
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 4090 }, "needle");
+    tree.insert(CharOffset{ 10 }, "nee");
+    tree.insert(CharOffset{ 13 }, "dle");
+    tree.build_search_index();
+    SearchMatches expected;
+    SearchMatches actual;
+    auto content = buffer_content(tree);
+    for (std::string_view needle : { "needle", "needle here", "ne", "filler text\nline 1", "absent" })
+    {
+        std::vector<size_t> naive_all;
+        for (auto pos = content.find(needle); pos != std::string::npos; pos = content.find(needle, pos + needle.size()))
+        {
+            naive_all.push_back(pos);
+        }
+        tree.find_all(&expected, needle);
+        assert(expected.size() == naive_all.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            assert(rep(expected[i].offset) == naive_all[i]);
+        }
+        auto first = tree.find(needle, CharOffset{ 100 }, SearchDirection::Forward);
+        auto naive = content.find(needle, 100);
+        assert(first.found == (naive != std::string::npos));
+        assert(not first.found or rep(first.match.offset) == naive);
+        tree.owning_snap().find_all_parallel(&actual, needle, 4);
+        assert(expected.size() == actual.size());
+    }
+
+    // Regex searches narrowed by a required literal agree with full searches.
+    std::regex pattern{ "line (\\d+) needle" };
+    tree.find_all_regex(&expected, pattern);
+    tree.find_all_regex(&actual, pattern, "needle");
+    assert(not expected.empty());
+    assert(expected.size() == actual.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        assert(expected[i].offset == actual[i].offset);
+        assert(expected[i].length == actual[i].length);
+    }
+    tree.ref_snap().find_all_regex(&actual, pattern, "absent");
+    assert(actual.empty());
+}
+
+void test18()
+{
+#ifdef TEXTBUF_CONTENT_HASH
+    // Equal content hashes equally regardless of how it was assembled.
+    TreeBuilder builder;
+    builder.accept("The quick brown fox\n");
+    builder.accept("jumps over the lazy dog\n");
+    auto tree = builder.create();
+    TreeBuilder other_builder;
+    other_builder.accept("The quick brown fox\njumps over the lazy dog\n");
+    auto other = other_builder.create();
+    assert(tree.content_hash() == other.content_hash());
+
+    auto before = tree.content_hash();
+    tree.insert(CharOffset{ 4 }, "very ");
+    assert(tree.content_hash() != before);
+    tree.remove(CharOffset{ 4 }, Length{ 5 });
+    assert(tree.content_hash() == before);
+
+    other.insert(CharOffset{ 0 }, "A");
+    other.remove(CharOffset{ 0 }, Length{ 1 });
+    other.insert(CharOffset{ 10 }, "brown ");
+    other.remove(CharOffset{ 16 }, Length{ 6 });
+    assert(tree.content_hash() == other.content_hash());
+    assert(tree.owning_snap().content_hash() == other.ref_snap().content_hash());
+
+    // Many small edits and undo keep the cached hashes consistent with a fresh build.
+    for (size_t i = 0; i < 200; ++i)
+    {
+        tree.insert(CharOffset{ (i * 7) % rep(tree.length()) }, std::string(1 + i % 5, char('a' + i % 26)));
+        if (i % 3 == 0)
+        {
+            tree.remove(CharOffset{ (i * 13) % rep(tree.length()) }, Length{ 2 });
+        }
+    }
+    TreeBuilder fresh_builder;
+    fresh_builder.accept(buffer_content(tree));
+    auto fresh = fresh_builder.create();
+    assert(tree.content_hash() == fresh.content_hash());
+    while (tree.try_undo(CharOffset{ 0 }).success);
+    assert(tree.content_hash() == before);
+#endif // TEXTBUF_CONTENT_HASH
+}
+
+void test19()
+{
+#ifdef TEXTBUF_UTF_COUNTS
+    // 'é' is 2 bytes, '€' is 3 bytes and '😀' is 4 bytes (a surrogate pair in UTF-16).
+    TreeBuilder builder;
+    builder.accept("caf\xC3\xA9 costs 3\xE2\x82\xAC\n");
+    builder.accept(std::string(300, 'x') + "\xF0\x9F\x98\x80 smile\n");
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 5 }, "\xF0\x9F\x98\x80");
+    tree.insert(CharOffset{ 0 }, "\xE2\x82\xAC=");
+    tree.remove(CharOffset{ 100 }, Length{ 50 });
+
+    // Check every offset against a naive count.  An offset within a sequence maps to the start of its code point.
+    auto content = buffer_content(tree);
+    size_t code_points = 0;
+    size_t utf16_units = 0;
+    size_t floor_code_points = 0;
+    size_t floor_utf16_units = 0;
+    for (size_t i = 0; i <= content.size(); ++i)
+    {
+        auto b = i == content.size() ? uint8_t{ } : uint8_t(content[i]);
+        if ((b & 0xC0) != 0x80)
+        {
+            floor_code_points = code_points;
+            floor_utf16_units = utf16_units;
+        }
+        assert(rep(tree.offset_to_code_point(CharOffset{ i })) == floor_code_points);
+        assert(rep(tree.offset_to_utf16(CharOffset{ i })) == floor_utf16_units);
+        if (i == content.size())
+            break;
+        if ((b & 0xC0) != 0x80)
+        {
+            // Each code point start maps back to itself.
+            assert(rep(tree.code_point_to_offset(CodePointOffset{ code_points })) == i);
+            assert(rep(tree.utf16_to_offset(UTF16Offset{ utf16_units })) == i);
+            if (b >= 0xF0)
+            {
+                // The low surrogate maps to the start of its code point.
+                assert(rep(tree.utf16_to_offset(UTF16Offset{ utf16_units + 1 })) == i);
+            }
+            ++code_points;
+            utf16_units += b >= 0xF0 ? 2 : 1;
+        }
+    }
+    assert(rep(tree.utf16_to_offset(UTF16Offset{ utf16_units + 10 })) == content.size());
+    TreeBuilder e_builder;
+    e_builder.accept("\xC3\xA9");
+    auto e = e_builder.create();
+    assert(e.offset_to_code_point(CharOffset{ 1 }) == CodePointOffset{ 0 });
+    assert(e.ref_snap().offset_to_utf16(CharOffset{ 1 }) == UTF16Offset{ 0 });
+
+    // Columns: "€=café😀 costs 3€" is the first line.
+    assert(tree.utf16_column(CharOffset{ 4 }) == UTF16Offset{ 2 });
+    assert(tree.utf16_column(CharOffset{ 13 }) == UTF16Offset{ 8 });
+    assert(tree.utf16_column_to_offset(Line{ 1 }, UTF16Offset{ 7 }) == CharOffset{ 9 });
+    auto second_line = tree.get_line_range(Line{ 2 });
+    assert(tree.utf16_column(second_line.first + Length{ 3 }) == UTF16Offset{ 3 });
+    assert(tree.ref_snap().utf16_column_to_offset(Line{ 2 }, UTF16Offset{ 1000 }) == second_line.last);
+#endif // TEXTBUF_UTF_COUNTS
+}
+
+void test20()
+{
+    // Sequences split across pieces, followed by a stray continuation byte and a truncated sequence.
+    TreeBuilder builder;
+    builder.accept("a\xE2\x82");
+    builder.accept("\xAC\xF0\x9F");
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 6 }, "\x98\x80\xC3\xA9z");
+    tree.insert(CharOffset{ 11 }, "\x80\xE2\x82!");
+    const std::u32string expected = { U'a', U'\u20AC', U'\U0001F600', U'\u00E9', U'z',
+                                      CodePointWalker::replacement, CodePointWalker::replacement, CodePointWalker::replacement, U'!' };
+    const std::vector<size_t> boundaries = { 0, 1, 4, 8, 10, 11, 12, 13, 14, 15 };
+
+    CodePointWalker walker{ &tree };
+    std::u32string forward;
+    while (not walker.exhausted())
+    {
+        assert(std::find(begin(boundaries), end(boundaries), rep(walker.offset())) != end(boundaries));
+        forward.push_back(walker.next());
+    }
+    assert(forward == expected);
+
+    auto snap = tree.owning_snap();
+    ReverseCodePointWalker reverse_walker{ &snap, CharOffset{ 14 } };
+    std::u32string reverse;
+    while (not reverse_walker.exhausted())
+    {
+        reverse.push_back(reverse_walker.next());
+    }
+    assert(std::equal(rbegin(expected), rend(expected), begin(reverse), end(reverse)));
+
+    // Starting within a sequence yields that whole code point first.
+    ReverseCodePointWalker mid_walker{ &tree, CharOffset{ 6 } };
+    assert(mid_walker.next() == U'\U0001F600');
+    assert(mid_walker.next() == U'\u20AC');
+
+    for (size_t i = 0; i <= 15; ++i)
+    {
+        auto next = *std::upper_bound(begin(boundaries), end(boundaries), std::min<size_t>(i, 14));
+        auto prev = i == 0 ? 0 : *(std::lower_bound(begin(boundaries), end(boundaries), i) - 1);
+        assert(rep(tree.next_codepoint_boundary(CharOffset{ i })) == std::min<size_t>(next, 15));
+        assert(rep(tree.ref_snap().prev_codepoint_boundary(CharOffset{ i })) == prev);
+    }
+}
+
+void test21()
+{
+    // CRLF pairs within pieces, straddling pieces and mixed with bare LFs.
+    TreeBuilder builder;
+    builder.accept("one\r\ntwo\r");
+    builder.accept("\nthree\nfour\r\n\r\n");
+    auto tree = builder.create();
+    assert(tree.crlf_count() == LFCount{ 4 });
+
+    auto check = [&] {
+        auto content = buffer_content(tree);
+        size_t crlfs = 0;
+        size_t line_first = 0;
+        auto line = Line::Beginning;
+        std::string buf;
+        for (size_t i = 0; i <= content.size(); ++i)
+        {
+            if (i != content.size() and content[i] != '\n')
+                continue;
+            const bool has_lf = i != content.size();
+            const bool has_cr = has_lf and i != 0 and content[i - 1] == '\r';
+            crlfs += has_cr;
+            auto line_last = has_cr ? i - 1 : i;
+            auto range = tree.get_line_range_crlf(line);
+            assert(rep(range.first) == line_first);
+            assert(rep(range.last) == line_last);
+            auto incomplete = tree.get_line_content_crlf(&buf, line);
+            assert(buf == content.substr(line_first, line_last - line_first));
+            assert(incomplete == ((has_lf and not has_cr) ? IncompleteCRLF::Yes : IncompleteCRLF::No));
+            auto snap = tree.ref_snap();
+            assert(snap.get_line_range_crlf(line).last == range.last);
+            line_first = i + 1;
+            line = extend(line);
+        }
+        assert(rep(tree.crlf_count()) == crlfs);
+    };
+    check();
+
+    // Split pairs apart and join new ones across pieces.
+    tree.insert(CharOffset{ 4 }, "x");
+    check();
+    tree.insert(CharOffset{ 0 }, "\r");
+    check();
+    tree.insert(CharOffset{ 1 }, "\n\r");
+    check();
+    tree.remove(CharOffset{ 6 }, Length{ 1 });
+    check();
+    tree.insert(CharOffset{ 11 }, "\r");
+    tree.insert(CharOffset{ 12 }, "\n");
+    check();
+    tree.remove(CharOffset{ 3 }, Length{ 6 });
+    check();
+    for (size_t i = 0; i < 100; ++i)
+    {
+        tree.insert(CharOffset{ (i * 7) % rep(tree.length()) }, i % 3 == 0 ? "\r" : i % 3 == 1 ? "\n" : "a\r\n");
+        if (i % 4 == 0)
+        {
+            tree.remove(CharOffset{ (i * 5) % rep(tree.length()) }, Length{ 1 });
+        }
+        check();
+    }
+}
+
+void test22()
+{
+    // Mixed endings, a CRLF pair split across pieces and a lone CR at the end of a piece.
+    TreeBuilder builder;
+    builder.accept("one\r\ntwo\r");
+    builder.accept("\nthree\nfour\r");
+    auto tree = builder.create();
+    tree.insert(CharOffset{ rep(tree.length()) }, "x\r\n\n");
+    const auto original = buffer_content(tree);
+    assert(original == "one\r\ntwo\r\nthree\nfour\rx\r\n\n");
+
+    tree.convert_line_endings(LineEnding::LF);
+    assert(buffer_content(tree) == "one\ntwo\nthree\nfour\rx\n\n");
+    assert(tree.crlf_count() == LFCount{ 0 });
+    assert(tree.line_feed_count() == LFCount{ 5 });
+    std::string buf;
+    tree.get_line_content(&buf, Line{ 4 });
+    assert(buf == "four\rx");
+
+    tree.convert_line_endings(LineEnding::CRLF);
+    assert(buffer_content(tree) == "one\r\ntwo\r\nthree\r\nfour\rx\r\n\r\n");
+    assert(tree.crlf_count() == tree.line_feed_count());
+    tree.get_line_content(&buf, Line{ 3 });
+    assert(buf == "three\r");
+
+    // Already converted, so no undo entry is added.
+    tree.convert_line_endings(LineEnding::CRLF);
+    auto undo = tree.try_undo(CharOffset{ 0 });
+    assert(undo.success);
+    assert(buffer_content(tree) == "one\ntwo\nthree\nfour\rx\n\n");
+    undo = tree.try_undo(CharOffset{ 0 });
+    assert(undo.success);
+    assert(buffer_content(tree) == original);
+
+    // Edits after a conversion work on the new buffer.
+    tree.convert_line_endings(LineEnding::LF);
+    tree.insert(CharOffset{ 3 }, "\r");
+    assert(tree.crlf_count() == LFCount{ 1 });
+    assert(tree.get_line_content_crlf(&buf, Line{ 1 }) == IncompleteCRLF::No);
+    assert(buf == "one");
+}
+
+void test23()
+{
+    TreeBuilder builder;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        builder.accept(std::format("line {}\n", i));
+    }
+    auto tree = builder.create();
+    // Enough pieces for several vectored write batches.
+    for (size_t i = 0; i < 3000; ++i)
+    {
+        tree.insert(CharOffset{ (i * 31) % rep(tree.length()) }, std::string(1 + i % 3, 'a' + i % 26));
+    }
+    auto expected = buffer_content(tree);
+    auto path = std::filesystem::temp_directory_path() / "fredbuf-test23.txt";
+    auto read_back = [&] {
+        std::string content;
+        auto* file = fopen(path.string().c_str(), "rb");
+        assert(file != nullptr);
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof chunk, file)) != 0)
+        {
+            content.append(chunk, n);
+        }
+        fclose(file);
+        return content;
+    };
+
+    auto snap = tree.owning_snap();
+    // The snapshot is saved as of when it was taken.
+    tree.insert(CharOffset{ 0 }, "not saved");
+    std::filesystem::remove(path);
+    auto result = save_file(snap, path);
+    assert(result.success);
+    assert(rep(result.bytes_written) == expected.size());
+    assert(read_back() == expected);
+#ifndef _WIN32
+    // A new file follows the umask like any other newly created file.
+    auto mask = ::umask(0);
+    ::umask(mask);
+    auto perms = std::filesystem::status(path).permissions();
+    assert(static_cast<mode_t>(perms) == (0666 & ~mask));
+#endif // _WIN32
+
+    // Replacing an existing file.
+    tree.remove(CharOffset{ 0 }, Length{ 100 });
+    result = save_file(tree.owning_snap(), path);
+    assert(result.success);
+    assert(read_back() == buffer_content(tree));
+    std::filesystem::remove(path);
+
+    result = save(snap, -1);
+    assert(not result.success);
+    assert(result.error == EBADF);
+}
+
+void test24()
+{
+    TreeBuilder builder;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        builder.accept(std::format("line {:04}\n", i));
+    }
+    auto tree = builder.create();
+    const auto file_length = rep(tree.length());
+    auto path = std::filesystem::temp_directory_path() / "fredbuf-test24.txt";
+    auto result = save_file(tree.owning_snap(), path);
+    assert(result.success);
+    auto on_disk = tree.owning_snap();
+    auto read_back = [&] {
+        std::string content;
+        auto* file = fopen(path.string().c_str(), "rb");
+        assert(file != nullptr);
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof chunk, file)) != 0)
+        {
+            content.append(chunk, n);
+        }
+        fclose(file);
+        return content;
+    };
+    auto fd = ::open(path.string().c_str(), O_RDWR);
+    assert(fd >= 0);
+
+    // Nothing changed.
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 0);
+
+    // Same length edits only patch the edited bytes.
+    tree.remove(CharOffset{ 5 }, Length{ 4 });
+    tree.insert(CharOffset{ 5 }, "HEAD");
+    tree.remove(CharOffset{ 5005 }, Length{ 4 });
+    tree.insert(CharOffset{ 5005 }, "MIDD");
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 8);
+    assert(read_back() == buffer_content(tree));
+    on_disk = tree.owning_snap();
+
+    // Undoing restores the original pieces, which is again only 8 bytes.
+    tree.try_undo(CharOffset{ });
+    tree.try_undo(CharOffset{ });
+    tree.try_undo(CharOffset{ });
+    tree.try_undo(CharOffset{ });
+    assert(rep(tree.length()) == file_length);
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 8);
+    assert(read_back() == buffer_content(tree));
+    on_disk = tree.owning_snap();
+
+    // A length change rewrites the suffix after the first change.
+    tree.insert(CharOffset{ file_length - 20 }, "grow");
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 24);
+    assert(read_back() == buffer_content(tree));
+    on_disk = tree.owning_snap();
+
+    // Shrinking at the end needs no writes at all.
+    tree.remove(CharOffset{ rep(tree.length()) - 10 }, Length{ 10 });
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 0);
+    assert(read_back() == buffer_content(tree));
+
+    // A stale 'on_disk' is detected from the file size and everything is written.
+    tree.insert(CharOffset{ 0 }, "x");
+    result = save_incremental(tree.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == rep(tree.length()));
+    assert(read_back() == buffer_content(tree));
+    ::close(fd);
+
+    // Snapshots which do not share buffers cannot be compared by buffer position, even if their pieces line up.
+    Tree typed_a;
+    typed_a.insert(CharOffset{ }, "AAAAAAAAAA");
+    Tree typed_b;
+    typed_b.insert(CharOffset{ }, "BBBBBBBBBB");
+    assert(save_file(typed_a.owning_snap(), path).success);
+    fd = ::open(path.string().c_str(), O_RDWR);
+    assert(fd >= 0);
+    result = save_incremental(typed_b.owning_snap(), typed_a.owning_snap(), fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 10);
+    assert(read_back() == "BBBBBBBBBB");
+    ::close(fd);
+
+    // Neither can those taken on either side of 'restore_session'.
+    auto session = std::filesystem::temp_directory_path() / "fredbuf-test24.session";
+    assert(typed_b.save_session(session).success);
+    assert(save_file(typed_a.owning_snap(), path).success);
+    on_disk = typed_a.owning_snap();
+    assert(typed_a.restore_session(session).success);
+    fd = ::open(path.string().c_str(), O_RDWR);
+    assert(fd >= 0);
+    result = save_incremental(typed_a.owning_snap(), on_disk, fd);
+    assert(result.success);
+    assert(rep(result.bytes_written) == 10);
+    assert(read_back() == "BBBBBBBBBB");
+    ::close(fd);
+    std::filesystem::remove(session);
+    std::filesystem::remove(path);
+}
+
+void test25()
+{
+    std::string expected;
+    for (size_t i = 0; i < 5000; ++i)
+    {
+        expected += std::format("line {}\r\n", i);
+    }
+    auto path = std::filesystem::temp_directory_path() / "fredbuf-test25.txt";
+    {
+        auto* file = fopen(path.string().c_str(), "wb");
+        assert(file != nullptr);
+        fwrite(expected.data(), 1, expected.size(), file);
+        fclose(file);
+    }
+
+    // Small chunks split CRLF pairs across buffers.
+    Tree tree;
+    ProgressiveLoader loader{ path, Length{ 4093 } };
+    bool edited = false;
+    LoadProgress progress;
+    do
+    {
+        progress = loader.pump(&tree);
+        assert(rep(tree.length()) == rep(progress.loaded) + (edited ? 4 : 0));
+        if (not edited and rep(progress.loaded) != 0)
+        {
+            tree.insert(CharOffset{ 0 }, "EDIT");
+            edited = true;
+        }
+        std::this_thread::yield();
+    } while (not progress.finished);
+    assert(progress.error == 0);
+    assert(rep(progress.loaded) == expected.size());
+    assert(edited);
+    assert(buffer_content(tree) == "EDIT" + expected);
+    assert(rep(tree.line_count()) == 5001);
+    assert(tree.crlf_count() == LFCount{ 5000 });
+
+    // Undo keeps the text loaded after the edit.
+    auto result = tree.try_undo(CharOffset{ });
+    assert(result.success);
+    assert(buffer_content(tree) == expected);
+    result = tree.try_redo(CharOffset{ });
+    assert(result.success);
+    assert(buffer_content(tree) == "EDIT" + expected);
+
+    // Text typed at the end of the partial document stays after the rest of the file, and every state of a long
+    // history gains the chunks loaded after it was left.
+    Tree typed;
+    ProgressiveLoader appending{ path, Length{ 97 } };
+    std::string suffix;
+    do
+    {
+        progress = appending.pump(&typed, 1);
+        if (rep(progress.loaded) != 0)
+        {
+            typed.commit_head(CharOffset{ 0 } + typed.length());
+            typed.insert(CharOffset{ 0 } + typed.length(), "!", SuppressHistory::Yes);
+            suffix += '!';
+        }
+        std::this_thread::yield();
+    } while (not progress.finished);
+    assert(buffer_content(typed) == expected + suffix);
+    while (not suffix.empty())
+    {
+        assert(typed.try_undo(CharOffset{ }).success);
+        suffix.pop_back();
+        assert(buffer_content(typed) == expected + suffix);
+    }
+    assert(typed.jump_to(typed.history_last()).success);
+    typed.insert(CharOffset{ 0 } + typed.length(), "?");
+    assert(buffer_content(typed).ends_with("!?"));
+    std::filesystem::remove(path);
+
+    Tree missing;
+    ProgressiveLoader failing{ path };
+    do
+    {
+        progress = failing.pump(&missing);
+    } while (not progress.finished);
+    assert(progress.error == ENOENT);
+    assert(rep(missing.length()) == 0);
+}
+
+void test26()
+{
+#ifdef TEXTBUF_COLD_BUFFERS
+    TreeBuilder builder;
+    std::string expected;
+    for (size_t chunk = 0; chunk < 8; ++chunk)
+    {
+        std::string txt;
+        for (size_t i = 0; i < 500; ++i)
+        {
+            txt += std::format("2024-01-01 12:00:{:02} INFO worker {} finished job {}\n", i % 60, chunk, chunk * 500 + i);
+        }
+        builder.accept(txt);
+        expected += txt;
+    }
+    // An empty buffer and one too short to hold a match.
+    builder.accept("");
+    builder.accept("end");
+    expected += "end";
+    auto tree = builder.create();
+
+    tree.compress_cold_buffers(1);
+    auto footprint = tree.buffer_footprint();
+    assert(footprint.resident_bytes * 4 < expected.size());
+    assert(footprint.compressed_bytes * 3 < expected.size());
+
+    // Everything reads back the same after decompressing on demand.
+    assert(buffer_content(tree) == expected);
+    std::string line;
+    tree.get_line_content(&line, Line{ 2501 });
+    assert(line == "2024-01-01 12:00:00 INFO worker 5 finished job 2500");
+    assert(tree.at(CharOffset{ expected.size() - 1 }) == 'd');
+    assert(tree.buffer_footprint().resident_bytes >= expected.size() - 3);
+
+    // Cold buffers age out again.
+    tree.compress_cold_buffers(0);
+    assert(tree.buffer_footprint().resident_bytes == 0);
+
+    // Edits, snapshots and search work across cold buffers.
+    tree.insert(CharOffset{ 0 }, "head\n");
+    expected.insert(0, "head\n");
+    auto snap = tree.owning_snap();
+    tree.compress_cold_buffers(0);
+    std::string from_thread;
+    std::thread reader{ [&] {
+        TreeWalker walker{ &snap };
+        while (not walker.exhausted())
+        {
+            from_thread.push_back(walker.next());
+        }
+    } };
+    reader.join();
+    assert(from_thread == expected);
+    auto found = tree.find("job 3999\n", CharOffset{ });
+    assert(found.found);
+    assert(rep(found.match.offset) == expected.find("job 3999\n"));
+    assert(buffer_content(tree) == expected);
+
+    // A buffer larger than a block is compressed block by block, and the budget holds on every load: a buffer
+    // larger than the budget is read without being kept.
+    {
+        std::string big;
+        for (size_t i = 0; big.size() < 3 * ColdBuffer::block_length; ++i)
+        {
+            big += std::format("{} lorem ipsum dolor sit amet {}\n", i, i % 7);
+        }
+        TreeBuilder big_builder;
+        big_builder.accept(big);
+        big_builder.accept("tail\n");
+        auto big_tree = big_builder.create();
+        big_tree.compress_cold_buffers(0);
+        big_tree.cold_buffer_budget(64);
+        assert(buffer_content(big_tree) == big + "tail\n");
+        auto big_footprint = big_tree.buffer_footprint();
+        assert(big_footprint.resident_bytes <= 64);
+        assert(big_footprint.compressed_bytes * 2 < big.size());
+        assert(big_footprint.read_errors == 0);
+
+        // Reading part of a cold buffer loads only the blocks covering it, which stay cached in least recently
+        // used order.
+        constexpr auto block_length = ColdBuffer::block_length;
+        big_tree.compress_cold_buffers(0);
+        big_tree.cold_buffer_budget(2 * block_length);
+        auto faults = [&] { return big_tree.buffer_footprint().page_faults; };
+        auto before = faults();
+        auto offset = 2 * block_length + 100;
+        assert(big_tree.at(CharOffset{ offset }) == big[offset]);
+        assert(faults() == before + 1);
+        assert(big_tree.buffer_footprint().resident_bytes == block_length);
+        assert(big_tree.at(CharOffset{ offset + 1 }) == big[offset + 1]);
+        assert(big_tree.at(CharOffset{ 0 }) == big[0]);
+        assert(big_tree.at(CharOffset{ offset }) == big[offset]);
+        assert(faults() == before + 2);
+        // Block 1 evicts block 0, which was used least recently.
+        assert(big_tree.at(CharOffset{ block_length }) == big[block_length]);
+        assert(big_tree.at(CharOffset{ offset }) == big[offset]);
+        assert(faults() == before + 3);
+        assert(big_tree.at(CharOffset{ 0 }) == big[0]);
+        assert(faults() == before + 4);
+        assert(big_tree.buffer_footprint().resident_bytes == 2 * block_length);
+        std::string big_line;
+        big_tree.get_line_content(&big_line, big_tree.line_at(CharOffset{ offset }));
+        auto line_first = big.rfind('\n', offset) + 1;
+        assert(big_line == big.substr(line_first, big.find('\n', offset) - line_first));
+    }
+
+    // Malformed compressed text is rejected without reading or writing out of bounds.
+    {
+        auto text = expected.substr(0, ColdBuffer::block_length);
+        auto block = compress_text(text);
+        std::string out(text.size(), '\0');
+        assert(decompress_text(out.data(), out.size(), block));
+        assert(out == text);
+        assert(not decompress_text(out.data(), out.size() - 1, block));
+        for (size_t n = 0; n < block.size(); n += 7)
+        {
+            assert(not decompress_text(out.data(), out.size(), std::string_view{ block }.substr(0, n)));
+        }
+        uint64_t state = 0x9E3779B97F4A7C15;
+        auto random = [&](size_t bound) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return static_cast<size_t>(state % bound);
+        };
+        for (size_t i = 0; i < 2000; ++i)
+        {
+            auto corrupt = block;
+            corrupt[random(corrupt.size())] = static_cast<char>(random(256));
+            decompress_text(out.data(), out.size(), corrupt);
+        }
+    }
+#endif // TEXTBUF_COLD_BUFFERS
+}
+
+void test27()
+{
+#ifdef TEXTBUF_COLD_BUFFERS
+    std::string expected;
+    for (size_t i = 0; i < 4000; ++i)
+    {
+        expected += std::format("trace {} value {}\n", i, i * 7);
+    }
+    auto path = std::filesystem::temp_directory_path() / "fredbuf-test27.txt";
+    {
+        auto* file = fopen(path.string().c_str(), "wb");
+        assert(file != nullptr);
+        fwrite(expected.data(), 1, expected.size(), file);
+        fclose(file);
+    }
+
+    Tree tree;
+    assert(tree.load_paged(path, Length{ 4096 }) == 0);
+    constexpr size_t budget = 4 * 4096;
+    tree.cold_buffer_budget(budget);
+    assert(tree.length() == Length{ expected.size() });
+    assert(rep(tree.line_count()) == 4001);
+    assert(tree.buffer_footprint().resident_bytes == 0);
+
+    // Line lookups are answered from the resident line starts.
+    assert(tree.line_at(CharOffset{ expected.find("trace 2000 ") }) == Line{ 2001 });
+    assert(rep(tree.get_line_range_with_newline(Line{ 3001 }).first) == expected.find("trace 3000 "));
+    assert(tree.buffer_footprint().page_faults == 0);
+
+    // Searches on several threads hold on to the blocks they scan while the others evict them.
+    {
+        tree.cold_buffer_budget(1);
+        auto snap = tree.owning_snap();
+        SearchMatches matches;
+        snap.find_all_parallel(&matches, "value 7", 4);
+        size_t count = 0;
+        for (auto p = expected.find("value 7"); p != std::string::npos; p = expected.find("value 7", p + 1))
+        {
+            assert(count < matches.size() and rep(matches[count].offset) == p);
+            ++count;
+        }
+        assert(matches.size() == count);
+        snap.find_all_regex(&matches, std::regex{ "^trace 3[0-9]{3} " });
+        assert(matches.size() == 1000);
+        assert(rep(matches.front().offset) == expected.find("trace 3000 "));
+        tree.cold_buffer_budget(budget);
+    }
+
+    // Walking the whole file pages every block in and stays within the budget.
+    assert(buffer_content(tree) == expected);
+    auto footprint = tree.buffer_footprint();
+    assert(footprint.page_faults >= expected.size() / 4096);
+    assert(footprint.resident_bytes <= budget);
+    assert(footprint.read_errors == 0);
+
+    std::string line;
+    tree.get_line_content(&line, Line{ 1235 });
+    assert(line == "trace 1234 value 8638");
+    assert(tree.at(CharOffset{ 0 }) == 't');
+
+    // Edits and undo on top of paged text.
+    tree.insert(CharOffset{ 6 }, "paged ");
+    tree.remove(CharOffset{ expected.size() - 100 }, Length{ 50 });
+    auto edited = expected;
+    edited.insert(6, "paged ");
+    edited.erase(expected.size() - 100, 50);
+    assert(buffer_content(tree) == edited);
+
+    // Snapshots page in through their own cache.
+    auto snap = tree.owning_snap();
+    std::string from_thread;
+    std::thread reader{ [&] {
+        ReverseTreeWalker walker{ &snap, CharOffset{ edited.size() - 1 } };
+        while (not walker.exhausted())
+        {
+            from_thread.push_back(walker.next());
+        }
+    } };
+    reader.join();
+    std::reverse(from_thread.begin(), from_thread.end());
+    assert(from_thread == edited);
+
+    assert(tree.try_undo(CharOffset{ }).success);
+    assert(tree.try_undo(CharOffset{ }).success);
+    assert(buffer_content(tree) == expected);
+    assert(tree.buffer_footprint().resident_bytes <= budget);
+    std::filesystem::remove(path);
+
+    // Saving incrementally over the file being paged from leaves both intact: the tree keeps reading the text it
+    // loaded rather than what the save wrote over it.
+    {
+        std::string original;
+        for (size_t i = 0; original.size() < 508890; ++i)
+        {
+            original += std::format("record {} of the paged file\n", i);
+        }
+        original.resize(508890);
+        {
+            auto* file = fopen(path.string().c_str(), "wb");
+            assert(file != nullptr);
+            fwrite(original.data(), 1, original.size(), file);
+            fclose(file);
+        }
+        Tree paged;
+        assert(paged.load_paged(path, Length{ 4096 }) == 0);
+        paged.cold_buffer_budget(8192);
+        auto on_disk = paged.owning_snap();
+        paged.insert(CharOffset{ 0 }, "HEADER\n");
+        auto fd = ::open(path.string().c_str(), O_RDWR);
+        assert(fd >= 0);
+        auto saved = save_incremental(paged.owning_snap(), on_disk, fd);
+        assert(saved.success);
+        std::string content(original.size() + 7, '\0');
+        assert(::pread(fd, content.data(), content.size(), 0) == static_cast<ssize_t>(content.size()));
+        assert(content == "HEADER\n" + original);
+        assert(buffer_content(paged) == content);
+        assert(paged.buffer_footprint().read_errors == 0);
+
+        // Shrinking rewrites and truncates the file the same way.
+        on_disk = paged.owning_snap();
+        paged.remove(CharOffset{ 0 }, Length{ 7 + 100000 });
+        saved = save_incremental(paged.owning_snap(), on_disk, fd);
+        assert(saved.success);
+        // Read one byte more than expected to see the truncation.
+        content.assign(original.size() - 100000 + 1, '\0');
+        assert(::pread(fd, content.data(), content.size(), 0) == static_cast<ssize_t>(content.size() - 1));
+        content.pop_back();
+        assert(content == original.substr(100000));
+        assert(buffer_content(paged) == content);
+        assert(paged.try_undo(CharOffset{ }).success);
+        assert(buffer_content(paged) == "HEADER\n" + original);
+        ::close(fd);
+        std::filesystem::remove(path);
+    }
+
+    // Loading replaces everything: the next insertion starts an undo entry of its own and whatever was attached
+    // to the old text is cleared.
+    {
+        auto* file = fopen(path.string().c_str(), "wb");
+        assert(file != nullptr);
+        fwrite("abc", 1, 3, file);
+        fclose(file);
+        Tree reloaded;
+        MarkerTree markers;
+        DecorationTree decorations;
+        reloaded.attach_markers(&markers);
+        reloaded.attach_decorations(&decorations);
+        reloaded.insert(CharOffset{ 0 }, "x");
+        markers.add(CharOffset{ 1 });
+        decorations.add(CharOffset{ 0 }, CharOffset{ 1 }, 0);
+        assert(reloaded.load_paged(path) == 0);
+        assert(markers.size() == 0 and decorations.size() == 0);
+        reloaded.insert(CharOffset{ 1 }, "Y");
+        assert(buffer_content(reloaded) == "aYbc");
+        assert(reloaded.try_undo(CharOffset{ }).success);
+        assert(buffer_content(reloaded) == "abc");
+        reloaded.detach_markers(&markers);
+        reloaded.detach_decorations(&decorations);
+        std::filesystem::remove(path);
+    }
+
+    Tree missing;
+    assert(missing.load_paged(path) == ENOENT);
+    assert(rep(missing.length()) == 0);
+#endif // TEXTBUF_COLD_BUFFERS
+}
+
+void test28()
+{
+    // One writer appends numbered lines while readers check that every snapshot they see is consistent.  The lines
+    // are long enough for the mod buffer to move to new chunks while readers hold snapshots of the old ones.
+    Tree tree;
+    SnapshotPublisher publisher{ tree };
+    std::atomic<bool> writing = true;
+    auto read = [&] {
+        size_t last_generation = 0;
+        while (writing)
+        {
+            auto published = publisher.acquire();
+            assert(published->generation >= last_generation);
+            last_generation = published->generation;
+            auto& snap = published->snap;
+            std::string content;
+            TreeWalker walker{ &snap };
+            while (not walker.exhausted())
+            {
+                content.push_back(walker.next());
+            }
+            std::string expected;
+            for (size_t i = 0; i < rep(snap.line_count()) - 1; ++i)
+            {
+                expected += std::format("{:080}\n", i);
+            }
+            assert(content == expected);
+        }
+    };
+    std::thread readers[] = { std::thread{ read }, std::thread{ read }, std::thread{ read } };
+    for (size_t i = 0; i < 500; ++i)
+    {
+        tree.insert(CharOffset{ rep(tree.length()) }, std::format("{:080}\n", i));
+        publisher.publish(tree);
+        // Undo and redo move the root backwards and forwards through states readers have already seen.
+        if (i % 50 == 49)
+        {
+            assert(tree.try_undo(CharOffset{ }).success);
+            publisher.publish(tree);
+            assert(tree.try_redo(CharOffset{ }).success);
+            publisher.publish(tree);
+        }
+    }
+    writing = false;
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
+    assert(publisher.acquire()->generation == 520);
+    assert(rep(publisher.acquire()->snap.line_count()) == 501);
+
+    // Typing one character at a time extends one piece until the mod buffer moves to a new chunk, and snapshots
+    // taken before keep their text.
+    auto before = publisher.acquire();
+    const auto before_content = buffer_content(tree);
+    std::string typed;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        typed.push_back(char('a' + i % 26));
+        tree.insert(CharOffset{ rep(tree.length()) }, typed.substr(i));
+    }
+    publisher.publish(tree);
+    auto snapshot_content = [](const OwningSnapshot& snap) {
+        std::string content;
+        TreeWalker walker{ &snap };
+        while (not walker.exhausted())
+        {
+            content.push_back(walker.next());
+        }
+        return content;
+    };
+    assert(snapshot_content(before->snap) == before_content);
+    assert(snapshot_content(publisher.acquire()->snap) == before_content + typed);
+    assert(buffer_content(tree) == before_content + typed);
+
+    // A copy of the tree shares the mod buffer until one of them appends past the other.
+    Tree copy = tree;
+    tree.insert(CharOffset{ }, "tree");
+    copy.insert(CharOffset{ }, "copy");
+    tree.insert(CharOffset{ rep(tree.length()) }, "tree");
+    copy.insert(CharOffset{ rep(copy.length()) }, "copy");
+    assert(buffer_content(tree) == "tree" + before_content + typed + "tree");
+    assert(buffer_content(copy) == "copy" + before_content + typed + "copy");
+    assert(snapshot_content(publisher.acquire()->snap) == before_content + typed);
+}
+
+void test29()
+{
+    // Freeing happens in bounded batches and only touches nodes the retired root solely owns.
+    RedBlackTree root;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        root = root.insert({ .piece = { .length = Length{ 1 } } }, CharOffset{ i });
+    }
+    auto shared = root.left();
+    NodeReclaimer reclaimer;
+    reclaimer.retire(std::move(root));
+    assert(reclaimer.pending() == 1);
+    size_t freed = 0;
+    while (reclaimer.pending() != 0)
+    {
+        auto batch = reclaimer.reclaim(10);
+        assert(batch <= 10);
+        freed += batch;
+    }
+    assert(freed == 1000 - rep(tree_length(shared)));
+    assert(rep(tree_length(shared)) == rep(shared.root().left_subtree_length) + 1 + rep(tree_length(shared.right())));
+
+    // Evicted history goes to the reclaimer.
+    auto deferred = std::make_shared<NodeReclaimer>();
+    Tree tree;
+    tree.defer_reclamation(deferred);
+    tree.history_policy({ .max_entries = 2 });
+    std::string expected;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        tree.insert(CharOffset{ 0 }, "x");
+        tree.commit_head(CharOffset{ 0 });
+        expected += "x";
+    }
+    assert(deferred->pending() != 0);
+    tree.snap_to(RedBlackTree{ });
+    assert(tree.is_empty());
+    while (deferred->pending() != 0)
+    {
+        deferred->reclaim(16);
+    }
+    auto result = tree.try_undo(CharOffset{ });
+    assert(result.success);
+    assert(buffer_content(tree) == expected);
+
+    // Snapshots of the tree, published ones included, retire their root when they are dropped or replaced.
+    {
+        SnapshotPublisher publisher{ tree };
+        tree.insert(CharOffset{ 0 }, "y");
+        // Inserting evicts history as well.
+        const auto before = deferred->pending();
+        publisher.publish(tree);
+        assert(deferred->pending() == before + 1);
+        {
+            auto snap = tree.owning_snap();
+            snap = tree.owning_snap();
+            assert(deferred->pending() == before + 2);
+        }
+        assert(deferred->pending() == before + 3);
+        // The last reader of a superseded snapshot retires it.
+        auto reader = publisher.acquire();
+        publisher.publish(tree);
+        assert(deferred->pending() == before + 3);
+        reader = nullptr;
+        assert(deferred->pending() == before + 4);
+    }
+    while (deferred->pending() != 0)
+    {
+        deferred->reclaim(16);
+    }
+    assert(buffer_content(tree) == "y" + expected);
+}
+
+void test30()
+{
+    uint64_t state = 0x9E3779B97F4A7C15;
+    auto random = [&](size_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<size_t>(state % bound);
+    };
+    auto apply = [](std::string doc, const Change& change) {
+        for (auto i = change.size(); i != 0; --i)
+        {
+            auto& edit = change[i - 1];
+            doc.replace(rep(edit.offset), rep(edit.count), edit.txt);
+        }
+        return doc;
+    };
+    auto random_change = [&](size_t length) {
+        Change change;
+        size_t offset = 0;
+        while (offset <= length and change.size() < 3)
+        {
+            offset += random(length - offset + 1);
+            if (offset > length)
+                break;
+            auto count = random(std::min<size_t>(length - offset, 6) + 1);
+            std::string txt(random(3), static_cast<char>('A' + random(26)));
+            if (count != 0 or not txt.empty())
+            {
+                change.push_back({ .offset = CharOffset{ offset }, .count = Length{ count }, .txt = txt });
+            }
+            // Keep edits apart so the batch stays well formed.
+            offset += count + 1;
+        }
+        return change;
+    };
+
+    // Concurrent changes converge whichever is applied first.
+    Change a_prime;
+    Change b_prime;
+    for (size_t i = 0; i < 20000; ++i)
+    {
+        std::string doc = "abcdefghijklmnop";
+        auto a = random_change(doc.size());
+        auto b = random_change(doc.size());
+        transform_change(&a_prime, a, b, TieBreak::AppliedFirst);
+        transform_change(&b_prime, b, a, TieBreak::ChangeFirst);
+        assert(apply(apply(doc, b), a_prime) == apply(apply(doc, a), b_prime));
+    }
+
+    // Text inserted inside a concurrently removed range survives.
+    TreeBuilder builder;
+    builder.accept("hello world");
+    auto tree = builder.create();
+    CollabSession session{ &tree };
+    auto base = session.revision();
+    auto rev = session.submit(base, { { .offset = CharOffset{ 2 }, .count = Length{ 0 }, .txt = "XX" } });
+    assert(rev == Revision{ 1 });
+    Change accepted;
+    rev = session.submit(base, { { .offset = CharOffset{ 0 }, .count = Length{ 5 }, .txt = "HOWDY" } }, &accepted);
+    assert(rev == Revision{ 2 });
+    assert(accepted.size() == 2);
+    assert(buffer_content(tree) == "HOWDYXX world");
+    assert(session.changes_since(Revision{ 1 }).size() == 1);
+    // Remote edits do not enter the undo history.
+    assert(not tree.try_undo(CharOffset{ }).success);
+    session.discard_before(Revision{ 1 });
+    assert(session.submit(base, { }) == Revision::Invalid);
+    assert(session.submit(Revision{ 1 }, { { .offset = CharOffset{ 0 }, .count = Length{ 1 }, .txt = { } } }) == Revision{ 3 });
+    // The 'h' was already replaced.
+    assert(buffer_content(tree) == "HOWDYXX world");
+
+    // Many clients editing against stale revisions.
+    constexpr size_t clients = 64;
+    constexpr size_t ops = 5000;
+    Tree shared;
+    shared.insert(CharOffset{ 0 }, std::string(10000, '.'));
+    CollabSession server{ &shared };
+    std::vector<size_t> lengths = { rep(shared.length()) };
+    std::vector<Revision> seen(clients, server.revision());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        auto client = random(clients);
+        auto change = random_change(lengths[rep(seen[client])]);
+        auto result = server.submit(seen[client], change);
+        assert(result != Revision::Invalid);
+        lengths.push_back(rep(shared.length()));
+        // Clients catch up now and then.
+        if (random(4) == 0)
+        {
+            seen[client] = result;
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("collab: %zu ops from %zu clients in %.3fs (%.0f ops/sec)\n", ops, clients, elapsed, ops / elapsed);
+}
+
+void test31()
+{
+    // The original buffers are chunks of a source file so they can be saved by reference.
+    std::string source_text;
+    TreeBuilder builder;
+    for (size_t i = 0; i < 500; ++i)
+    {
+        auto chunk = std::format("line {} of the source\n", i);
+        builder.accept(chunk);
+        source_text += chunk;
+    }
+    auto dir = std::filesystem::temp_directory_path();
+    auto source = dir / "fredbuf-test31.txt";
+    auto session = dir / "fredbuf-test31.session";
+    auto write_file = [](const std::filesystem::path& path, std::string_view txt) {
+        auto* file = fopen(path.string().c_str(), "wb");
+        assert(file != nullptr);
+        fwrite(txt.data(), 1, txt.size(), file);
+        fclose(file);
+    };
+    write_file(source, source_text);
+
+    auto tree = builder.create();
+    tree.insert(CharOffset{ 0 }, "first ");
+    tree.commit_head(CharOffset{ 0 });
+    tree.remove(CharOffset{ 20 }, Length{ 30 });
+    tree.commit_head(CharOffset{ 20 });
+    tree.insert(CharOffset{ 5 }, "uncommitted ");
+    auto edited = buffer_content(tree);
+
+    auto result = tree.save_session(session);
+    assert(result.success);
+    auto embedded_size = std::filesystem::file_size(session);
+    result = tree.save_session(session, { .source = source });
+    assert(result.success);
+    // Referenced buffers do not carry their text.
+    assert(std::filesystem::file_size(session) < embedded_size);
+
+    Tree restored;
+    result = restored.restore_session(session);
+    assert(result.success);
+    assert(buffer_content(restored) == edited);
+    assert(restored.line_count() == tree.line_count());
+    std::string line;
+    std::string expected_line;
+    restored.get_line_content(&line, Line{ 300 });
+    tree.get_line_content(&expected_line, Line{ 300 });
+    assert(line == expected_line);
+
+    // History survives, including the shared structure between roots.
+    while (tree.try_undo(CharOffset{ }).success)
+    {
+        assert(restored.try_undo(CharOffset{ }).success);
+        assert(buffer_content(restored) == buffer_content(tree));
+    }
+    assert(not restored.try_undo(CharOffset{ }).success);
+    assert(buffer_content(restored) == source_text);
+    assert(restored.try_redo(CharOffset{ }).success);
+    assert(buffer_content(restored) == "first " + source_text);
+
+    // Without history, and with every buffer embedded.
+    result = tree.save_session(session, { .source = { }, .history = IncludeHistory::No, .tag = 0 });
+    assert(result.success);
+    result = restored.restore_session(session);
+    assert(result.success);
+    assert(buffer_content(restored) == buffer_content(tree));
+    assert(not restored.try_undo(CharOffset{ }).success);
+
+    // A changed source is detected and leaves the tree alone.
+    result = tree.save_session(session, { .source = source });
+    assert(result.success);
+    source_text[10] = '!';
+    write_file(source, source_text);
+    auto before = buffer_content(restored);
+    result = restored.restore_session(session);
+    assert(not result.success and result.error == EINVAL);
+    assert(buffer_content(restored) == before);
+
+    // So is a truncated session.
+    result = tree.save_session(session);
+    assert(result.success);
+    std::filesystem::resize_file(session, std::filesystem::file_size(session) / 2);
+    result = restored.restore_session(session);
+    assert(not result.success and result.error == EINVAL);
+    assert(buffer_content(restored) == before);
+
+    // A corrupted session either fails to restore or restores a tree which can be walked, never anything in
+    // between.  Short text with many edits keeps most of the session structural.
+    {
+        TreeBuilder small_builder;
+        small_builder.accept("alpha\nbeta\r\ngamma\n");
+        auto small = small_builder.create();
+        for (size_t i = 0; i < 30; ++i)
+        {
+            small.insert(CharOffset{ (i * 7) % rep(small.length()) }, i % 3 == 0 ? "x\r\n" : "yz");
+            if (i % 4 == 0)
+            {
+                small.remove(CharOffset{ i % rep(small.length()) }, Length{ 2 });
+            }
+            small.commit_head(CharOffset{ i });
+        }
+        // The parent of the oldest remaining entry has been evicted.
+        small.history_policy({ .max_entries = 10 });
+        assert(small.save_session(session).success);
+        Tree trimmed;
+        assert(trimmed.restore_session(session).success);
+        size_t undo_count = 0;
+        while (trimmed.try_undo(CharOffset{ }).success)
+        {
+            ++undo_count;
+        }
+        assert(undo_count == 10);
+        std::string bytes(std::filesystem::file_size(session), '\0');
+        auto* file = fopen(session.string().c_str(), "rb");
+        assert(file != nullptr);
+        assert(fread(bytes.data(), 1, bytes.size(), file) == bytes.size());
+        fclose(file);
+
+        uint64_t state = 0x2545F4914F6CDD1D;
+        auto random = [&](size_t bound) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return static_cast<size_t>(state % bound);
+        };
+        size_t restored_count = 0;
+        for (size_t i = 0; i < 3000; ++i)
+        {
+            auto corrupt = bytes;
+            for (size_t n = 1 + random(3); n != 0; --n)
+            {
+                // Small values hit ids, counts and offsets more often than random bytes do.
+                auto word = random(corrupt.size() / sizeof(uint64_t)) * sizeof(uint64_t);
+                if (random(2) == 0)
+                {
+                    uint64_t value = random(64);
+                    std::memcpy(corrupt.data() + word, &value, sizeof(value));
+                }
+                else
+                {
+                    corrupt[word + random(sizeof(uint64_t))] ^= static_cast<char>(1 + random(255));
+                }
+            }
+            write_file(session, corrupt);
+            Tree fuzzed;
+            if (not fuzzed.restore_session(session).success)
+            {
+                assert(fuzzed.is_empty());
+                continue;
+            }
+            ++restored_count;
+            auto content = buffer_content(fuzzed);
+            assert(content.size() == rep(fuzzed.length()));
+            for (size_t l = 1; l <= rep(fuzzed.line_count()); ++l)
+            {
+                fuzzed.get_line_content(&line, Line{ l });
+            }
+            while (fuzzed.try_undo(CharOffset{ }).success)
+            {
+                assert(buffer_content(fuzzed).size() == rep(fuzzed.length()));
+            }
+        }
+        // Some corruptions are harmless, e.g. in the tag or in a history offset.
+        assert(restored_count != 0);
+    }
+
+    // Restoring a set of open documents.
+    constexpr size_t document_count = 200;
+    std::vector<std::filesystem::path> sessions;
+    for (size_t i = 0; i < document_count; ++i)
+    {
+        TreeBuilder doc_builder;
+        for (size_t j = 0; j < 200; ++j)
+        {
+            doc_builder.accept(std::format("document {} line {}\n", i, j));
+        }
+        auto doc = doc_builder.create();
+        for (size_t j = 0; j < 20; ++j)
+        {
+            doc.insert(CharOffset{ j * 37 }, "edit");
+            doc.commit_head(CharOffset{ j * 37 });
+        }
+        sessions.push_back(dir / std::format("fredbuf-test31-{}.session", i));
+        assert(doc.save_session(sessions.back()).success);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Tree> documents(document_count);
+    for (size_t i = 0; i < document_count; ++i)
+    {
+        assert(documents[i].restore_session(sessions[i]).success);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    printf("restored %zu sessions in %lldms\n", document_count, static_cast<long long>(elapsed.count()));
+    for (auto& path : sessions)
+    {
+        std::filesystem::remove(path);
+    }
+    std::filesystem::remove(session);
+    std::filesystem::remove(source);
+}
+
+void test32()
+{
+    auto dir = std::filesystem::temp_directory_path();
+    JournalOptions options{ .journal = dir / "fredbuf-test32.journal",
+                            .checkpoint = dir / "fredbuf-test32.session",
+                            .checkpoint_records = 0 };
+    TreeBuilder builder;
+    builder.accept("The quick brown fox\njumps over the lazy dog\n");
+    auto tree = builder.create();
+    EditJournal journal{ &tree, options };
+    assert(journal.error() == 0);
+
+    // Typing coalesces into one undo group, which replay must reproduce.
+    std::string_view typed = "very ";
+    for (size_t i = 0; i < typed.size(); ++i)
+    {
+        journal.insert(CharOffset{ 4 + i }, typed.substr(i, 1));
+    }
+    journal.remove(CharOffset{ 0 }, Length{ 4 });
+    journal.commit_head(CharOffset{ 0 });
+    journal.insert(CharOffset{ 0 }, "A ", SuppressHistory::Yes);
+    journal.insert(CharOffset{ rep(tree.length()) }, "end\n");
+    assert(journal.try_undo(CharOffset{ }).success);
+    assert(journal.try_redo(CharOffset{ }).success);
+    assert(journal.try_undo(CharOffset{ }).success);
+    assert(journal.sync().success);
+
+    auto check_recovery = [&](const Tree& expected) {
+        Tree recovered;
+        auto result = EditJournal::recover(&recovered, options);
+        assert(result.success);
+        assert(buffer_content(recovered) == buffer_content(expected));
+        return recovered;
+    };
+    {
+        auto recovered = check_recovery(tree);
+        // The history replays too.  The walk on 'tree' bypasses the journal, so return to where it was after.
+        auto current = tree.history_current();
+        while (recovered.try_undo(CharOffset{ }).success)
+        {
+            assert(tree.try_undo(CharOffset{ }).success);
+            assert(buffer_content(recovered) == buffer_content(tree));
+        }
+        assert(not tree.try_undo(CharOffset{ }).success);
+        while (recovered.try_redo(CharOffset{ }).success)
+        {
+            assert(tree.try_redo(CharOffset{ }).success);
+            assert(buffer_content(recovered) == buffer_content(tree));
+        }
+        assert(tree.jump_to(current).success);
+    }
+
+    // A torn record at the end is dropped.
+    journal.insert(CharOffset{ 0 }, "torn ");
+    assert(journal.sync().success);
+    auto expected = buffer_content(tree);
+    {
+        auto* file = fopen(options.journal.string().c_str(), "ab");
+        assert(file != nullptr);
+        fwrite("\0\1\2", 1, 3, file);
+        fclose(file);
+    }
+    auto recovered = check_recovery(tree);
+
+    // A crash after replacing the checkpoint but before replacing the journal does not replay the journal twice.
+    auto stale = dir / "fredbuf-test32.stale";
+    std::filesystem::copy_file(options.journal, stale, std::filesystem::copy_options::overwrite_existing);
+    assert(journal.checkpoint().success);
+    std::filesystem::rename(stale, options.journal);
+    check_recovery(tree);
+    assert(journal.checkpoint().success);
+
+    // Periodic checkpoints bound the journal.
+    {
+        Tree periodic;
+        auto bounded = options;
+        bounded.checkpoint_records = 100;
+        EditJournal writer{ &periodic, bounded };
+        for (size_t i = 0; i < 250; ++i)
+        {
+            writer.insert(CharOffset{ rep(periodic.length()) }, "ab");
+        }
+        assert(writer.sync().success);
+        Tree restored;
+        auto result = EditJournal::recover(&restored, bounded);
+        assert(result.success);
+        assert(result.replayed < 100);
+        assert(buffer_content(restored) == buffer_content(periodic));
+    }
+
+    // Without history in the checkpoint, undo and redo past it still replay.
+    {
+        Tree live;
+        auto no_history = options;
+        no_history.history = IncludeHistory::No;
+        EditJournal writer{ &live, no_history };
+        writer.insert(CharOffset{ 0 }, "abc");
+        writer.commit_head(CharOffset{ 3 });
+        writer.insert(CharOffset{ 1 }, "xy");
+        assert(writer.checkpoint().success);
+        while (writer.try_undo(CharOffset{ }).success);
+        assert(buffer_content(live).empty());
+        assert(writer.sync().success);
+        Tree restored;
+        auto result = EditJournal::recover(&restored, no_history);
+        assert(result.success);
+        assert(buffer_content(restored).empty());
+        assert(writer.try_redo(CharOffset{ }).success);
+        writer.insert(CharOffset{ 3 }, "d");
+        assert(writer.sync().success);
+        result = EditJournal::recover(&restored, no_history);
+        assert(result.success);
+        assert(buffer_content(restored) == buffer_content(live));
+    }
+
+    // A single small edit reaches the disk once 'sync_interval' passes, without waiting for more edits.
+    {
+        Tree idle;
+        auto prompt = options;
+        prompt.sync_interval = std::chrono::milliseconds{ 20 };
+        EditJournal writer{ &idle, prompt };
+        auto header_size = std::filesystem::file_size(prompt.journal);
+        // Let the flusher go idle first.
+        std::this_thread::sleep_for(prompt.sync_interval);
+        auto start = std::chrono::steady_clock::now();
+        writer.insert(CharOffset{ 0 }, "x");
+        while (std::filesystem::file_size(prompt.journal) == header_size)
+        {
+            assert(std::chrono::steady_clock::now() - start < std::chrono::seconds{ 5 });
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+        }
+        printf("a single edit reached the journal after %.2fms\n",
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Journal overhead per keystroke: the same edits with and without the journal, with the flusher writing
+    // groups in the background.  The best of several rounds filters out scheduling noise.
+    {
+        constexpr size_t edit_count = 20000;
+        constexpr size_t rounds = 5;
+        auto plain_time = std::chrono::steady_clock::duration::max();
+        auto journaled_time = std::chrono::steady_clock::duration::max();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            Tree plain;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < edit_count; ++i)
+            {
+                plain.insert(CharOffset{ i }, "x");
+            }
+            plain_time = std::min(plain_time, std::chrono::steady_clock::now() - start);
+            Tree journaled;
+            EditJournal writer{ &journaled, options };
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < edit_count; ++i)
+            {
+                writer.insert(CharOffset{ i }, "x");
+            }
+            journaled_time = std::min(journaled_time, std::chrono::steady_clock::now() - start);
+            assert(buffer_content(journaled) == buffer_content(plain));
+        }
+        auto per_edit = [&](std::chrono::steady_clock::duration time) {
+            return std::chrono::duration<double, std::micro>(time).count() / edit_count;
+        };
+        printf("%zu edits: %.3fus per edit without the journal, %.3fus with it (%.3fus overhead)\n",
+               edit_count,
+               per_edit(plain_time),
+               per_edit(journaled_time),
+               per_edit(journaled_time) - per_edit(plain_time));
+    }
+
+    // Worst-case keystroke time on a multi-MB document whose checkpoints write every original buffer: the
+    // keystroke reaching 'checkpoint_records' only captures the state, and the flusher writes it.
+    {
+        std::string line = "lorem ipsum dolor sit amet, consectetur adipiscing elit\n";
+        TreeBuilder big_builder;
+        for (size_t chunk = 0; chunk < 64; ++chunk)
+        {
+            std::string txt;
+            while (txt.size() < 128 * 1024)
+            {
+                txt += line;
+            }
+            big_builder.accept(txt);
+        }
+        auto big = big_builder.create();
+        auto frequent = options;
+        frequent.checkpoint_records = 1000;
+        constexpr size_t edit_count = 5000;
+        auto worst = std::chrono::steady_clock::duration::zero();
+        {
+            EditJournal writer{ &big, frequent };
+            for (size_t i = 0; i < edit_count; ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                writer.insert(CharOffset{ 1000 + i }, "x");
+                worst = std::max(worst, std::chrono::steady_clock::now() - start);
+            }
+            assert(writer.sync().success);
+            Tree restored;
+            auto result = EditJournal::recover(&restored, frequent);
+            assert(result.success);
+            assert(result.replayed < frequent.checkpoint_records + 1);
+            assert(buffer_content(restored) == buffer_content(big));
+        }
+        printf("%zu edits on a %zu byte document with a checkpoint every %zu records: %.3fms worst case per edit\n",
+               edit_count,
+               rep(big.length()),
+               frequent.checkpoint_records,
+               std::chrono::duration<double, std::milli>(worst).count());
+    }
+
+    // Recovery time against journal length.
+    for (size_t length : { 500, 2000, 8000 })
+    {
+        Tree journaled;
+        {
+            EditJournal writer{ &journaled, options };
+            for (size_t i = 0; i < length; ++i)
+            {
+                writer.insert(CharOffset{ i }, "x");
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        Tree restored;
+        auto result = EditJournal::recover(&restored, options);
+        auto recovery_time = std::chrono::steady_clock::now() - start;
+        assert(result.success and result.replayed == length + 1);
+        assert(buffer_content(restored) == buffer_content(journaled));
+        printf("journal of %zu records recovered in %.2fms\n",
+               length,
+               std::chrono::duration<double, std::milli>(recovery_time).count());
+    }
+    std::filesystem::remove(options.journal);
+    std::filesystem::remove(options.checkpoint);
+}
+
+void test33()
+{
+    uint64_t state = 0x2545F4914F6CDD1D;
+    auto random = [&](size_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<size_t>(state % bound);
+    };
+
+    // Compare against shifting every marker by hand.
+    struct Expected
+    {
+        MarkerId id;
+        size_t offset;
+        Gravity gravity;
+    };
+    std::vector<Expected> expected;
+    MarkerTree markers;
+    Tree tree;
+    tree.attach_markers(&markers);
+    tree.insert(CharOffset{ 0 }, std::string(200, 'x'));
+    for (size_t i = 0; i < 100; ++i)
+    {
+        auto offset = random(201);
+        auto gravity = random(2) == 0 ? Gravity::Left : Gravity::Right;
+        expected.push_back({ .id = markers.add(CharOffset{ offset }, gravity), .offset = offset, .gravity = gravity });
+    }
+    auto model_insert = [&](size_t offset, size_t length) {
+        for (auto& e : expected)
+        {
+            if (e.offset > offset or (e.offset == offset and e.gravity == Gravity::Right))
+            {
+                e.offset += length;
+            }
+        }
+    };
+    auto model_remove = [&](size_t offset, size_t length) {
+        for (auto& e : expected)
+        {
+            if (e.offset >= offset + length)
+            {
+                e.offset -= length;
+            }
+            else if (e.offset > offset)
+            {
+                e.offset = offset;
+            }
+        }
+    };
+    auto check = [&] {
+        assert(markers.size() == expected.size());
+        for (auto& e : expected)
+        {
+            assert(markers.offset(e.id) == CharOffset{ e.offset });
+            assert(markers.gravity(e.id) == e.gravity);
+        }
+        auto first = random(rep(tree.length()) + 1);
+        auto last = first + random(50);
+        std::vector<MarkerPosition> found;
+        markers.find(&found, CharOffset{ first }, CharOffset{ last });
+        size_t in_range = 0;
+        for (auto& e : expected)
+        {
+            in_range += e.offset >= first and e.offset < last;
+        }
+        assert(found.size() == in_range);
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            assert(i == 0 or found[i - 1].offset <= found[i].offset);
+            assert(markers.offset(found[i].id) == found[i].offset);
+        }
+    };
+    // Every edit gets a history state of its own, so undo and redo map the markers through exactly that edit.
+    enum class EditKind { Insert, Remove, Batch };
+    struct StateEdit
+    {
+        EditKind kind;
+        size_t offset;
+        size_t count;
+    };
+    std::map<HistoryId, StateEdit> state_edits;
+    for (size_t step = 0; step < 3000; ++step)
+    {
+        auto length = rep(tree.length());
+        switch (random(8))
+        {
+        case 0:
+        case 1:
+        {
+            auto offset = random(length + 1);
+            auto count = 1 + random(5);
+            tree.commit_head(CharOffset{ offset });
+            tree.insert(CharOffset{ offset }, std::string(count, 'i'));
+            model_insert(offset, count);
+            state_edits[tree.history_current()] = { .kind = EditKind::Insert, .offset = offset, .count = count };
+            break;
+        }
+        case 2:
+        case 3:
+        {
+            if (length == 0)
+                break;
+            auto offset = random(length);
+            auto count = 1 + random(std::min<size_t>(length - offset, 20));
+            tree.remove(CharOffset{ offset }, Length{ count });
+            model_remove(offset, count);
+            state_edits[tree.history_current()] = { .kind = EditKind::Remove, .offset = offset, .count = count };
+            break;
+        }
+        case 4:
+        {
+            // A replacement as a single batch.
+            if (length <= 10)
+                break;
+            auto offset = random(length - 10);
+            Edit edits[] = { { .offset = CharOffset{ offset }, .count = Length{ 3 }, .txt = "abcde" },
+                             { .offset = CharOffset{ offset + 5 }, .count = Length{ 2 }, .txt = "" } };
+            tree.apply_edits(edits);
+            model_remove(offset + 5, 2);
+            model_remove(offset, 3);
+            model_insert(offset, 5);
+            state_edits[tree.history_current()] = { .kind = EditKind::Batch, .offset = offset, .count = 0 };
+            break;
+        }
+        case 6:
+        {
+            // The model only knows how to invert single edits.
+            auto edit = state_edits.find(tree.history_current());
+            if (edit != state_edits.end() and edit->second.kind == EditKind::Batch)
+                break;
+            if (not tree.try_undo(CharOffset{ }).success or edit == state_edits.end())
+                break;
+            if (edit->second.kind == EditKind::Insert)
+            {
+                model_remove(edit->second.offset, edit->second.count);
+            }
+            else
+            {
+                model_insert(edit->second.offset, edit->second.count);
+            }
+            break;
+        }
+        case 7:
+        {
+            auto child = tree.history_at(tree.history_current())->redo_child;
+            if (tree.history_at(child) == nullptr)
+                break;
+            auto edit = state_edits.find(child);
+            if (edit != state_edits.end() and edit->second.kind == EditKind::Batch)
+                break;
+            assert(tree.try_redo(CharOffset{ }).success);
+            if (edit == state_edits.end())
+                break;
+            if (edit->second.kind == EditKind::Insert)
+            {
+                model_insert(edit->second.offset, edit->second.count);
+            }
+            else
+            {
+                model_remove(edit->second.offset, edit->second.count);
+            }
+            break;
+        }
+        case 5:
+        {
+            if (not expected.empty() and random(2) == 0)
+            {
+                auto i = random(expected.size());
+                markers.erase(expected[i].id);
+                expected.erase(expected.begin() + static_cast<ptrdiff_t>(i));
+            }
+            else
+            {
+                auto offset = random(length + 1);
+                auto gravity = random(2) == 0 ? Gravity::Left : Gravity::Right;
+                expected.push_back({ .id = markers.add(CharOffset{ offset }, gravity), .offset = offset, .gravity = gravity });
+            }
+            break;
+        }
+        }
+        check();
+    }
+    tree.detach_markers(&markers);
+    tree.insert(CharOffset{ 0 }, "detached");
+    check();
+
+    // Line ending conversions map markers one line ending at a time, and so does undoing them.
+    Tree crlf;
+    crlf.insert(CharOffset{ 0 }, "a\r\nb\r\nc");
+    MarkerTree endings;
+    crlf.attach_markers(&endings);
+    auto b = endings.add(CharOffset{ 3 });
+    auto line_end = endings.add(CharOffset{ 1 }, Gravity::Left);
+    auto c = endings.add(CharOffset{ 6 });
+    crlf.convert_line_endings(LineEnding::LF);
+    assert(buffer_content(crlf) == "a\nb\nc");
+    assert(endings.offset(b) == CharOffset{ 2 } and endings.offset(line_end) == CharOffset{ 1 } and endings.offset(c) == CharOffset{ 4 });
+    assert(crlf.try_undo(CharOffset{ }).success);
+    assert(endings.offset(b) == CharOffset{ 3 } and endings.offset(line_end) == CharOffset{ 1 } and endings.offset(c) == CharOffset{ 6 });
+    assert(crlf.try_redo(CharOffset{ }).success);
+    assert(endings.offset(b) == CharOffset{ 2 } and endings.offset(line_end) == CharOffset{ 1 } and endings.offset(c) == CharOffset{ 4 });
+    crlf.detach_markers(&endings);
+
+    // Many markers on a large document: each keystroke costs O(log n) regardless of the marker count.
+    constexpr size_t diagnostic_count = 100000;
+    MarkerTree diagnostics;
+    for (size_t i = 0; i < diagnostic_count; ++i)
+    {
+        diagnostics.add(CharOffset{ i * 10 }, i % 2 == 0 ? Gravity::Left : Gravity::Right);
+    }
+    constexpr size_t keystrokes = 100000;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keystrokes; ++i)
+    {
+        auto offset = CharOffset{ random(diagnostic_count * 10) };
+        if (i % 4 == 3)
+        {
+            diagnostics.removed(offset, Length{ 1 });
+        }
+        else
+        {
+            diagnostics.inserted(offset, Length{ 1 });
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("%zu markers: %.3fus per keystroke\n", diagnostic_count, elapsed / keystrokes);
+    assert(diagnostics.size() == diagnostic_count);
+}
+
+void test34()
+{
+    uint64_t state = 0xD1B54A32D192ED03;
+    auto random = [&](size_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<size_t>(state % bound);
+    };
+
+    struct Expected
+    {
+        DecorationId id;
+        size_t first;
+        size_t last;
+        uint64_t style;
+    };
+    std::vector<Expected> expected;
+    DecorationTree decorations;
+    Tree tree;
+    tree.attach_decorations(&decorations);
+    tree.insert(CharOffset{ 0 }, std::string(300, 'x'));
+    auto add = [&] {
+        auto first = random(rep(tree.length()) + 1);
+        auto last = first + random(std::min<size_t>(rep(tree.length()) - first, 30) + 1);
+        auto style = random(8);
+        expected.push_back({ .id = decorations.add(CharOffset{ first }, CharOffset{ last }, style),
+                             .first = first,
+                             .last = last,
+                             .style = style });
+    };
+    for (size_t i = 0; i < 100; ++i)
+    {
+        add();
+    }
+    auto model_insert = [&](size_t offset, size_t length) {
+        for (auto& e : expected)
+        {
+            if (e.first >= offset)
+            {
+                e.first += length;
+                e.last += length;
+            }
+            else if (e.last > offset)
+            {
+                e.last += length;
+            }
+        }
+    };
+    auto model_remove = [&](size_t offset, size_t length) {
+        auto clip = [&](size_t x) { return x >= offset + length ? x - length : std::min(x, offset); };
+        for (auto& e : expected)
+        {
+            e.first = clip(e.first);
+            e.last = clip(e.last);
+        }
+    };
+    auto check = [&](const DecorationTree& tree_decorations, const std::vector<Expected>& model, size_t length) {
+        assert(tree_decorations.size() == model.size());
+        auto first = random(length + 1);
+        auto last = first + random(60);
+        std::vector<Decoration> found;
+        tree_decorations.find(&found, CharOffset{ first }, CharOffset{ last });
+        std::vector<Expected> overlapping;
+        for (auto& e : model)
+        {
+            if (e.first < last and (e.last > first or e.first >= first))
+            {
+                overlapping.push_back(e);
+            }
+        }
+        std::sort(overlapping.begin(), overlapping.end(), [](const Expected& lhs, const Expected& rhs) {
+            return std::pair{ lhs.first, lhs.id } < std::pair{ rhs.first, rhs.id };
+        });
+        assert(found.size() == overlapping.size());
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            assert(found[i].id == overlapping[i].id);
+            assert(found[i].first == CharOffset{ overlapping[i].first });
+            assert(found[i].last == CharOffset{ overlapping[i].last });
+            assert(found[i].style == overlapping[i].style);
+        }
+    };
+
+    std::optional<OwningSnapshot> snap;
+    std::vector<Expected> snap_expected;
+    size_t snap_length = 0;
+    // As in test33, every edit gets a history state of its own so undo and redo can be modelled.
+    struct StateEdit
+    {
+        bool insert;
+        size_t offset;
+        size_t count;
+    };
+    std::map<HistoryId, StateEdit> state_edits;
+    for (size_t step = 0; step < 2000; ++step)
+    {
+        auto length = rep(tree.length());
+        switch (random(9))
+        {
+        case 0:
+        case 1:
+        {
+            auto offset = random(length + 1);
+            auto count = 1 + random(5);
+            tree.commit_head(CharOffset{ offset });
+            tree.insert(CharOffset{ offset }, std::string(count, 'i'));
+            model_insert(offset, count);
+            state_edits[tree.history_current()] = { .insert = true, .offset = offset, .count = count };
+            break;
+        }
+        case 2:
+        case 3:
+        {
+            if (length == 0)
+                break;
+            auto offset = random(length);
+            auto count = 1 + random(std::min<size_t>(length - offset, 20));
+            tree.remove(CharOffset{ offset }, Length{ count });
+            model_remove(offset, count);
+            state_edits[tree.history_current()] = { .insert = false, .offset = offset, .count = count };
+            break;
+        }
+        case 7:
+        {
+            auto edit = state_edits.find(tree.history_current());
+            if (not tree.try_undo(CharOffset{ }).success or edit == state_edits.end())
+                break;
+            if (edit->second.insert)
+            {
+                model_remove(edit->second.offset, edit->second.count);
+            }
+            else
+            {
+                model_insert(edit->second.offset, edit->second.count);
+            }
+            break;
+        }
+        case 8:
+        {
+            auto child = tree.history_at(tree.history_current())->redo_child;
+            if (tree.history_at(child) == nullptr)
+                break;
+            assert(tree.try_redo(CharOffset{ }).success);
+            auto edit = state_edits.find(child);
+            if (edit == state_edits.end())
+                break;
+            if (edit->second.insert)
+            {
+                model_insert(edit->second.offset, edit->second.count);
+            }
+            else
+            {
+                model_remove(edit->second.offset, edit->second.count);
+            }
+            break;
+        }
+        case 4:
+        {
+            if (not expected.empty() and random(2) == 0)
+            {
+                // Erase one as found.
+                auto i = random(expected.size());
+                auto& e = expected[i];
+                decorations.erase({ .id = e.id, .first = CharOffset{ e.first }, .last = CharOffset{ e.last }, .style = e.style });
+                expected.erase(expected.begin() + static_cast<ptrdiff_t>(i));
+            }
+            else
+            {
+                add();
+            }
+            break;
+        }
+        case 5:
+        {
+            auto first = random(length + 1);
+            auto last = first + random(10);
+            decorations.erase_starting_in(CharOffset{ first }, CharOffset{ last });
+            std::erase_if(expected, [&](const Expected& e) { return e.first >= first and e.first < last; });
+            break;
+        }
+        case 6:
+        {
+            // Snapshots keep the decorations as of the snapshot.
+            snap.emplace(tree.owning_snap());
+            snap_expected = expected;
+            snap_length = length;
+            break;
+        }
+        }
+        check(decorations, expected, rep(tree.length()));
+        if (snap)
+        {
+            assert(snap->decorations().size() == 1);
+            check(snap->decorations().front(), snap_expected, snap_length);
+        }
+    }
+
+    // A highlighting thread reads the decorations of a snapshot while the tree is edited.
+    {
+        auto frozen = tree.owning_snap();
+        std::vector<Decoration> before;
+        frozen.decorations().front().find(&before, CharOffset{ }, CharOffset{ rep(tree.length()) + 1 });
+        std::thread highlighter{ [&] {
+            for (size_t i = 0; i < 100; ++i)
+            {
+                std::vector<Decoration> found;
+                frozen.decorations().front().find(&found, CharOffset{ }, CharOffset{ sentinel_for<CharOffset> });
+                assert(found.size() == before.size());
+            }
+        } };
+        for (size_t i = 0; i < 200; ++i)
+        {
+            tree.insert(CharOffset{ random(rep(tree.length()) + 1) }, "abc");
+            decorations.add(CharOffset{ 0 }, CharOffset{ 1 }, 0);
+        }
+        highlighter.join();
+    }
+    tree.detach_decorations(&decorations);
+
+    // Line ending conversions and undoing them map decorations one line ending at a time.
+    Tree crlf;
+    crlf.insert(CharOffset{ 0 }, "a\r\nb\r\nc");
+    DecorationTree spans;
+    crlf.attach_decorations(&spans);
+    auto b = spans.add(CharOffset{ 3 }, CharOffset{ 4 }, 1);
+    auto ab = spans.add(CharOffset{ 0 }, CharOffset{ 4 }, 2);
+    auto range_of = [&](DecorationId id) {
+        std::vector<Decoration> found;
+        spans.find(&found, CharOffset{ }, CharOffset{ rep(crlf.length()) + 1 });
+        auto match = std::find_if(begin(found), end(found), [&](const Decoration& d) { return d.id == id; });
+        assert(match != end(found));
+        return std::pair{ rep(match->first), rep(match->last) };
+    };
+    crlf.convert_line_endings(LineEnding::LF);
+    assert(range_of(b) == std::pair(size_t{ 2 }, size_t{ 3 }) and range_of(ab) == std::pair(size_t{ 0 }, size_t{ 3 }));
+    assert(crlf.try_undo(CharOffset{ }).success);
+    assert(range_of(b) == std::pair(size_t{ 3 }, size_t{ 4 }) and range_of(ab) == std::pair(size_t{ 0 }, size_t{ 4 }));
+    assert(crlf.try_redo(CharOffset{ }).success);
+    assert(range_of(b) == std::pair(size_t{ 2 }, size_t{ 3 }) and range_of(ab) == std::pair(size_t{ 0 }, size_t{ 3 }));
+    crlf.detach_decorations(&spans);
+
+    // Per-frame viewport queries and keystrokes against many decorations.
+    constexpr size_t token_count = 100000;
+    DecorationTree tokens;
+    for (size_t i = 0; i < token_count; ++i)
+    {
+        tokens.add(CharOffset{ i * 10 }, CharOffset{ i * 10 + 1 + i % 8 }, i % 16);
+    }
+    constexpr size_t frames = 10000;
+    size_t visible = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < frames; ++i)
+    {
+        auto offset = CharOffset{ random(token_count * 10) };
+        if (i % 4 == 3)
+        {
+            tokens.removed(offset, Length{ 1 });
+        }
+        else
+        {
+            tokens.inserted(offset, Length{ 1 });
+        }
+        std::vector<Decoration> found;
+        auto first = random(token_count * 10);
+        tokens.find(&found, CharOffset{ first }, CharOffset{ first + 4000 });
+        visible += found.size();
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("%zu decorations: %.3fus per keystroke and viewport query (%zu visible on average)\n",
+           token_count,
+           elapsed / frames,
+           visible / frames);
+    assert(tokens.size() == token_count);
+}
+
 int main()
 {
     test1();
@@ -546,4 +3104,29 @@ int main()
     test7();
     test8();
     test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test25();
+    test26();
+    test27();
+    test28();
+    test29();
+    test30();
+    test31();
+    test32();
+    test33();
+    test34();
 }
\ No newline at end of file
@@ -1,12 +1,38 @@
 #include "fredbuf.h"
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 
+#include <algorithm>
+#include <bit>
 #include <memory>
+#include <iterator>
+#include <queue>
+#include <regex>
 #include <string_view>
 #include <string>
+#include <thread>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif // _WIN32
+
 #include "enum-utils.h"
 #include "scope-guard.h"
 
@@ -66,8 +92,13 @@ namespace PieceTree
                 const RedBlackTree& lft,
                 const NodeData& val,
                 const RedBlackTree& rgt)
-        : root_node(std::make_shared<Node>(c, lft.root_node, attribute(val, lft), rgt.root_node))
+        : root_node(std::make_shared<Node>(c, lft.root_node, attribute(val, lft, rgt), rgt.root_node))
+    {
+    }
+
+    RedBlackTree RedBlackTree::compose(Color c, const RedBlackTree& left, const NodeData& data, const RedBlackTree& right)
     {
+        return RedBlackTree(c, left, data, right);
     }
 
     RedBlackTree::RedBlackTree(const NodePtr& node)
@@ -150,6 +181,28 @@ namespace PieceTree
         return RedBlackTree(c, left(), root(), right());
     }
 
+    RedBlackTree RedBlackTree::build(std::span<const NodeData> nodes)
+    {
+        // Splitting at the midpoint keeps every path within one node of 'floor(log2(n + 1))', so painting the
+        // nodes on the final, partially filled, level red yields the same black height on every path.
+        size_t red_depth = 0;
+        while ((size_t{ 1 } << (red_depth + 1)) <= nodes.size() + 1)
+        {
+            ++red_depth;
+        }
+        return build(nodes, 0, red_depth);
+    }
+
+    RedBlackTree RedBlackTree::build(std::span<const NodeData> nodes, size_t depth, size_t red_depth)
+    {
+        if (nodes.empty())
+            return RedBlackTree();
+        auto mid = nodes.size() / 2;
+        auto lft = build(nodes.first(mid), depth + 1, red_depth);
+        auto rgt = build(nodes.subspan(mid + 1), depth + 1, red_depth);
+        return RedBlackTree(depth == red_depth ? Color::Red : Color::Black, lft, nodes[mid], rgt);
+    }
+
     PieceTree::Length tree_length(const RedBlackTree& root)
     {
         if (root.is_empty())
@@ -164,1552 +217,5442 @@ namespace PieceTree
         return root.root().left_subtree_lf_count + root.root().piece.newline_count + tree_lf_count(root.right());
     }
 
-    NodeData attribute(const NodeData& data, const RedBlackTree& left)
+    PieceTree::LFCount tree_crlf_count(const RedBlackTree& root)
     {
-        auto new_data = data;
-        new_data.left_subtree_length = tree_length(left);
-        new_data.left_subtree_lf_count = tree_lf_count(left);
-        return new_data;
+        if (root.is_empty())
+            return { };
+        auto& data = root.root();
+        auto count = data.left_subtree_crlf_count + data.piece_crlf_count + tree_crlf_count(root.right());
+        // Pairs straddling this piece and either subtree.
+        if (data.piece_starts_with_lf and not root.left().is_empty() and root.left().root().subtree_ends_with_cr)
+        {
+            count = extend(count);
+        }
+        if (data.piece_ends_with_cr and not root.right().is_empty() and root.right().root().subtree_starts_with_lf)
+        {
+            count = extend(count);
+        }
+        return count;
     }
 
-    struct RedBlackTree::ColorTree
+#ifdef TEXTBUF_CONTENT_HASH
+    namespace
     {
-        const Color color;
-        const RedBlackTree tree;
+        constexpr uint64_t hash_modulus = (uint64_t{ 1 } << 61) - 1;
+        constexpr uint64_t hash_base = 0x5BD1E9955BD1E995 % hash_modulus;
 
-        static ColorTree double_black()
+        // Computes 'a * b mod 2^61 - 1' without a 128-bit multiply.
+        uint64_t mul_mod(uint64_t a, uint64_t b)
         {
-            return ColorTree();
+            uint64_t a_lo = uint32_t(a);
+            uint64_t a_hi = a >> 32;
+            uint64_t b_lo = uint32_t(b);
+            uint64_t b_hi = b >> 32;
+            uint64_t lo = a_lo * b_lo;
+            uint64_t mid = a_lo * b_hi + a_hi * b_lo;
+            uint64_t hi = a_hi * b_hi;
+            uint64_t result = (lo & hash_modulus) + (lo >> 61) + (hi << 3) + (mid >> 29) + ((mid << 35) >> 3) + 1;
+            result = (result & hash_modulus) + (result >> 61);
+            result = (result & hash_modulus) + (result >> 61);
+            return result - 1;
         }
 
-        explicit ColorTree(RedBlackTree const &tree)
-            : color(tree.is_empty() ? Color::Black : tree.root_color()), tree(tree)
+        uint64_t add_mod(uint64_t a, uint64_t b)
         {
+            auto result = a + b;
+            return result >= hash_modulus ? result - hash_modulus : result;
         }
 
-        explicit ColorTree(Color c, const RedBlackTree& lft, const NodeData& x, const RedBlackTree& rgt)
-            : color(c), tree(c, lft, x, rgt)
+        uint64_t hash_power(size_t exponent)
         {
+            uint64_t result = 1;
+            uint64_t base = hash_base;
+            while (exponent != 0)
+            {
+                if (exponent & 1)
+                {
+                    result = mul_mod(result, base);
+                }
+                base = mul_mod(base, base);
+                exponent >>= 1;
+            }
+            return result;
         }
 
-    private:
-        ColorTree(): color(Color::DoubleBlack)
+        uint64_t hash_char(uint64_t hash, char c)
         {
+            // Bias each byte so that leading NULs still affect the hash.
+            return add_mod(mul_mod(hash, hash_base), uint64_t(uint8_t(c)) + 1);
         }
-    };
+    } // namespace [anon]
 
-    struct WalkResult
+    ContentHash combine_hash(ContentHash lhs, ContentHash rhs, Length rhs_length)
     {
-        RedBlackTree tree;
-        Offset accumulated_offset;
-    };
+        return ContentHash{ add_mod(mul_mod(rep(lhs), hash_power(rep(rhs_length))), rep(rhs)) };
+    }
 
-    WalkResult pred(const RedBlackTree& root, Offset start_offset)
+    PieceTree::ContentHash tree_hash(const RedBlackTree& root)
     {
-        RedBlackTree t = root.left();
-        while (!t.right().is_empty())
-        {
-            start_offset = start_offset + t.root().left_subtree_length + t.root().piece.length;
-            t = t.right();
-        }
-        // Add the final offset from the last right node.
-        start_offset = start_offset + t.root().left_subtree_length;
-        return { .tree = t, .accumulated_offset = start_offset };
+        if (root.is_empty())
+            return { };
+        return root.root().subtree_hash;
     }
+#endif // TEXTBUF_CONTENT_HASH
 
+#ifdef TEXTBUF_UTF_COUNTS
+    PieceTree::UTFCounts tree_utf_counts(const RedBlackTree& root)
+    {
+        if (root.is_empty())
+            return { };
+        return root.root().left_subtree_utf_counts + root.root().piece_utf_counts + tree_utf_counts(root.right());
+    }
+#endif // TEXTBUF_UTF_COUNTS
 
-#ifdef EXPERIMENTAL_REMOVE
-    RedBlackTree RedBlackTree::remove(Offset at) const
+    void NodeReclaimer::retire(RedBlackTree root)
     {
-        auto t = rem(at, Offset{ 0 }).tree;
-        if (t.is_empty())
-            return RedBlackTree();
-        return RedBlackTree(Color::Black, t.left(), t.root(), t.right());
+        if (root.is_empty())
+            return;
+        std::lock_guard guard{ lock };
+        nodes.push_back(std::move(root.root_node));
     }
 
-    RedBlackTree::ColorTree RedBlackTree::remove_double_black(Color c, ColorTree const &lft, const NodeData& x, ColorTree const &rgt)
+    size_t NodeReclaimer::reclaim(size_t budget)
     {
-        if (lft.color == Color::DoubleBlack)
+        std::vector<RedBlackTree::NodePtr> work;
         {
-            auto left = lft.tree.is_empty() ? RedBlackTree() : lft.tree.paint(Color::Black);
-
-            if (rgt.color == Color::Black)
+            std::lock_guard guard{ lock };
+            auto count = std::min(budget, nodes.size());
+            work.assign(std::make_move_iterator(nodes.end() - count), std::make_move_iterator(nodes.end()));
+            nodes.resize(nodes.size() - count);
+        }
+        size_t freed = 0;
+        size_t visited = 0;
+        while (not work.empty() and visited != budget)
+        {
+            auto node = std::move(work.back());
+            work.pop_back();
+            ++visited;
+            // A node shared with a live root only loses our reference (see the class comment for races).
+            if (node.use_count() != 1)
+                continue;
+            // Pairs with the release of the last other reference, so its owner's reads of the node happen before
+            // the writes below.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // We are the last owner, so unlink the children before the node goes away to keep its destruction
+            // from cascading.
+            auto& owned = const_cast<RedBlackTree::Node&>(*node);
+            if (owned.left != nullptr)
             {
-                assert(c != Color::DoubleBlack);
-                return ColorTree(extend(c), left, x, rgt.tree.paint(Color::Red));
+                work.push_back(std::move(owned.left));
             }
-            else
-                return ColorTree(Color::Black, RedBlackTree(Color::Black, left, x, rgt.tree.left().paint(Color::Red)), rgt.tree.root(), rgt.tree.right());
+            if (owned.right != nullptr)
+            {
+                work.push_back(std::move(owned.right));
+            }
+            node = nullptr;
+            ++freed;
         }
-        else if (rgt.color == Color::DoubleBlack)
+        if (not work.empty())
         {
-            auto right = rgt.tree.is_empty() ? RedBlackTree() : rgt.tree.paint(Color::Black);
+            std::lock_guard guard{ lock };
+            nodes.insert(nodes.end(), std::make_move_iterator(work.begin()), std::make_move_iterator(work.end()));
+        }
+        return freed;
+    }
 
-            if (lft.color == Color::Black)
+    size_t NodeReclaimer::pending() const
+    {
+        std::lock_guard guard{ lock };
+        return nodes.size();
+    }
+
+    MarkerId MarkerTree::add(CharOffset offset, Gravity gravity)
+    {
+        NodeIndex n;
+        if (free_nodes.empty())
+        {
+            n = nodes.size();
+            nodes.emplace_back();
+        }
+        else
+        {
+            n = free_nodes.back();
+            free_nodes.pop_back();
+        }
+        nodes[n] = { .offset = rep(offset), .priority = next_priority(), .gravity = gravity, .live = true };
+        NodeIndex lhs;
+        NodeIndex rhs;
+        split(root, rep(offset), gravity, &lhs, &rhs);
+        root = merge(merge(lhs, n), rhs);
+        nodes[root].parent = null_node;
+        ++count;
+        return MarkerId{ n };
+    }
+
+    void MarkerTree::erase(MarkerId id)
+    {
+        auto n = rep(id);
+        assert(n < nodes.size() and nodes[n].live);
+        push(n);
+        auto parent = nodes[n].parent;
+        auto replacement = merge(nodes[n].left, nodes[n].right);
+        if (parent == null_node)
+        {
+            root = replacement;
+            if (root != null_node)
             {
-                assert(c != Color::DoubleBlack);
-                return ColorTree(extend(c), lft.tree.paint(Color::Red), x, right);
+                nodes[root].parent = null_node;
             }
-            else
-                return ColorTree(Color::Black, lft.tree.left(), lft.tree.root(), RedBlackTree(Color::Black, lft.tree.right().paint(Color::Red), x, right));
+        }
+        else if (nodes[parent].left == n)
+        {
+            set_left(parent, replacement);
         }
         else
-            return ColorTree(c, lft.tree, x, rgt.tree);
+        {
+            set_right(parent, replacement);
+        }
+        nodes[n].live = false;
+        free_nodes.push_back(n);
+        --count;
     }
 
-    RedBlackTree::ColorTree RedBlackTree::rem(Offset at, Offset total) const
+    void MarkerTree::clear()
     {
-        if (is_empty())
-            return ColorTree(RedBlackTree());
-        const NodeData& y = root();
-        if (at < total + y.left_subtree_length)
-            return remove_double_black(root_color(), left().rem(at, total), y, ColorTree(right()));
-        if (at == total + y.left_subtree_length)
-            return remove_node();
-        return remove_double_black(root_color(), ColorTree(left()), y, right().rem(at, total + y.left_subtree_length + y.piece.length));
+        nodes.clear();
+        free_nodes.clear();
+        root = null_node;
+        count = 0;
     }
 
-    RedBlackTree::ColorTree RedBlackTree::remove_node() const
+    CharOffset MarkerTree::offset(MarkerId id) const
     {
-        if (not left().is_empty()
-            and not right().is_empty())
+        auto n = rep(id);
+        assert(n < nodes.size() and nodes[n].live);
+        auto offset = nodes[n].offset;
+        for (auto p = nodes[n].parent; p != null_node; p = nodes[p].parent)
         {
-            auto [p, off] = pred(*this, Offset(0));
-            const NodeData& x = p.root();
+            offset += nodes[p].pending;
+        }
+        return CharOffset{ offset };
+    }
 
-            Color c = root_color();
+    Gravity MarkerTree::gravity(MarkerId id) const
+    {
+        assert(rep(id) < nodes.size() and nodes[rep(id)].live);
+        return nodes[rep(id)].gravity;
+    }
 
-            return remove_double_black(c, left().rem(off, Offset(0)), x, ColorTree(right()));
-        }
-        else if (not left().is_empty())
+    void MarkerTree::find(std::vector<MarkerPosition>* out, CharOffset first, CharOffset last) const
+    {
+        auto visit = [&](auto& self, NodeIndex n, size_t shift) -> void {
+            if (n == null_node)
+                return;
+            auto& node = nodes[n];
+            auto offset = node.offset + shift;
+            if (offset >= rep(first))
+            {
+                self(self, node.left, shift + node.pending);
+            }
+            if (offset >= rep(first) and offset < rep(last))
+            {
+                out->push_back({ .id = MarkerId{ n }, .offset = CharOffset{ offset } });
+            }
+            if (offset < rep(last))
+            {
+                self(self, node.right, shift + node.pending);
+            }
+        };
+        visit(visit, root, 0);
+    }
+
+    void MarkerTree::inserted(CharOffset offset, Length length)
+    {
+        if (rep(length) == 0 or root == null_node)
+            return;
+        // Everything from the markers with right gravity at 'offset' onwards moves.
+        NodeIndex staying;
+        NodeIndex moving;
+        split(root, rep(offset), Gravity::Right, &staying, &moving);
+        shift(moving, rep(length));
+        root = merge(staying, moving);
+        nodes[root].parent = null_node;
+    }
+
+    void MarkerTree::removed(CharOffset offset, Length length)
+    {
+        if (rep(length) == 0 or root == null_node)
+            return;
+        const auto first = rep(offset);
+        const auto last = first + rep(length);
+        NodeIndex before;
+        NodeIndex rest;
+        NodeIndex inside;
+        NodeIndex at_end;
+        NodeIndex after;
+        split(root, first, Gravity::Left, &before, &rest);
+        split(rest, last, Gravity::Left, &inside, &rest);
+        split(rest, last + 1, Gravity::Left, &at_end, &after);
+        // The markers inside the range and at its end all land on 'first'.  Re-establish the gravity order
+        // among them before rebuilding.
+        scratch.clear();
+        collect(inside, &scratch);
+        collect(at_end, &scratch);
+        for (auto n : scratch)
         {
-            return ColorTree(left().paint(Color::Black));
+            nodes[n].offset = first;
         }
-        else if (not right().is_empty())
+        std::stable_partition(scratch.begin(), scratch.end(), [&](NodeIndex n) {
+            return nodes[n].gravity == Gravity::Left;
+        });
+        shift(after, -rep(length));
+        root = merge(merge(before, build(scratch)), after);
+        if (root != null_node)
         {
-            return ColorTree(right().paint(Color::Black));
+            nodes[root].parent = null_node;
         }
-        else if (root_color() == Color::Black)
+    }
+
+    bool MarkerTree::precedes(size_t offset, Gravity gravity, size_t other_offset, Gravity other_gravity)
+    {
+        return offset < other_offset
+               or (offset == other_offset and gravity == Gravity::Left and other_gravity == Gravity::Right);
+    }
+
+    void MarkerTree::push(NodeIndex n)
+    {
+        auto& node = nodes[n];
+        if (node.pending == 0)
+            return;
+        shift(node.left, node.pending);
+        shift(node.right, node.pending);
+        node.pending = 0;
+    }
+
+    void MarkerTree::shift(NodeIndex n, size_t delta)
+    {
+        if (n == null_node)
+            return;
+        nodes[n].offset += delta;
+        nodes[n].pending += delta;
+    }
+
+    void MarkerTree::set_left(NodeIndex n, NodeIndex child)
+    {
+        nodes[n].left = child;
+        if (child != null_node)
         {
-            return ColorTree::double_black();
+            nodes[child].parent = n;
         }
-        return ColorTree(RedBlackTree());
     }
-#else
-    RedBlackTree RedBlackTree::remove(Offset at) const
+
+    void MarkerTree::set_right(NodeIndex n, NodeIndex child)
     {
-        auto t = rem(*this, at, Offset{ 0 });
-        if (t.is_empty())
-            return RedBlackTree();
-        return RedBlackTree(Color::Black, t.left(), t.root(), t.right());
+        nodes[n].right = child;
+        if (child != null_node)
+        {
+            nodes[child].parent = n;
+        }
     }
 
-    RedBlackTree RedBlackTree::fuse(const RedBlackTree& left, const RedBlackTree& right)
+    void MarkerTree::split(NodeIndex n, size_t offset, Gravity gravity, NodeIndex* lhs, NodeIndex* rhs)
     {
-        // match: (left, right)
-        // case: (None, r)
-        if (left.is_empty())
-            return right;
-        if (right.is_empty())
-            return left;
-        // match: (left.color, right.color)
-        // case: (B, R)
-        if (left.root_color() == Color::Black and right.root_color() == Color::Red)
+        if (n == null_node)
         {
-            return RedBlackTree(Color::Red,
-                                fuse(left, right.left()),
-                                right.root(),
-                                right.right());
+            *lhs = null_node;
+            *rhs = null_node;
+            return;
         }
-        // case: (R, B)
-        if (left.root_color() == Color::Red and right.root_color() == Color::Black)
+        push(n);
+        if (precedes(nodes[n].offset, nodes[n].gravity, offset, gravity))
         {
-            return RedBlackTree(Color::Red,
-                                left.left(),
-                                left.root(),
-                                fuse(left.right(), right));
+            NodeIndex right;
+            split(nodes[n].right, offset, gravity, &right, rhs);
+            set_right(n, right);
+            *lhs = n;
         }
-        // case: (R, R)
-        if (left.root_color() == Color::Red and right.root_color() == Color::Red)
+        else
         {
-            auto fused = fuse(left.right(), right.left());
-            if (not fused.is_empty() and fused.root_color() == Color::Red)
-            {
-                auto new_left = RedBlackTree(Color::Red,
-                                                left.left(),
-                                                left.root(),
-                                                fused.left());
-                auto new_right = RedBlackTree(Color::Red,
-                                                fused.right(),
-                                                right.root(),
-                                                right.right());
-                return RedBlackTree(Color::Red,
-                                    new_left,
-                                    fused.root(),
-                                    new_right);
-            }
-            auto new_right = RedBlackTree(Color::Red,
-                                            fused,
-                                            right.root(),
-                                            right.right());
-            return RedBlackTree(Color::Red,
-                                left.left(),
-                                left.root(),
-                                new_right);
+            NodeIndex left;
+            split(nodes[n].left, offset, gravity, lhs, &left);
+            set_left(n, left);
+            *rhs = n;
         }
-        // case: (B, B)
-        assert(left.root_color() == right.root_color() and left.root_color() == Color::Black);
-        auto fused = fuse(left.right(), right.left());
-        if (not fused.is_empty() and fused.root_color() == Color::Red)
+    }
+
+    MarkerTree::NodeIndex MarkerTree::merge(NodeIndex lhs, NodeIndex rhs)
+    {
+        if (lhs == null_node)
+            return rhs;
+        if (rhs == null_node)
+            return lhs;
+        if (nodes[lhs].priority > nodes[rhs].priority)
         {
-            auto new_left = RedBlackTree(Color::Black,
-                                            left.left(),
-                                            left.root(),
-                                            fused.left());
-            auto new_right = RedBlackTree(Color::Black,
-                                            fused.right(),
-                                            right.root(),
-                                            right.right());
-            return RedBlackTree(Color::Red,
-                                new_left,
-                                fused.root(),
-                                new_right);
+            push(lhs);
+            set_right(lhs, merge(nodes[lhs].right, rhs));
+            return lhs;
         }
-        auto new_right = RedBlackTree(Color::Black,
-                                        fused,
-                                        right.root(),
-                                        right.right());
-        auto new_node = RedBlackTree(Color::Red,
-                                        left.left(),
-                                        left.root(),
-                                        new_right);
-        return balance_left(new_node);
+        push(rhs);
+        set_left(rhs, merge(lhs, nodes[rhs].left));
+        return rhs;
     }
 
-    RedBlackTree RedBlackTree::balance(const RedBlackTree& node)
+    void MarkerTree::collect(NodeIndex n, std::vector<NodeIndex>* out)
     {
-        // Two red children.
-        if (not node.left().is_empty()
-            and node.left().root_color() == Color::Red
-            and not node.right().is_empty()
-            and node.right().root_color() == Color::Red)
-        {
-            auto l = node.left().paint(Color::Black);
-            auto r = node.right().paint(Color::Black);
-            return RedBlackTree(Color::Red,
-                                l,
-                                node.root(),
-                                r);
-        }
-
-        assert(node.root_color() == Color::Black);
-        return balance(node.root_color(), node.left(), node.root(), node.right());
+        if (n == null_node)
+            return;
+        push(n);
+        collect(nodes[n].left, out);
+        out->push_back(n);
+        collect(nodes[n].right, out);
     }
 
-    RedBlackTree RedBlackTree::balance_left(const RedBlackTree& left)
+    MarkerTree::NodeIndex MarkerTree::build(std::span<const NodeIndex> sorted)
     {
-        // match: (color_l, color_r, color_r_l)
-        // case: (Some(R), ..)
-        if (not left.left().is_empty() and left.left().root_color() == Color::Red)
-        {
-            return RedBlackTree(Color::Red,
-                                left.left().paint(Color::Black),
-                                left.root(),
-                                left.right());
-        }
-        // case: (_, Some(B), _)
-        if (not left.right().is_empty() and left.right().root_color() == Color::Black)
-        {
-            auto new_left = RedBlackTree(Color::Black,
-                                            left.left(),
-                                            left.root(),
-                                            left.right().paint(Color::Red));
-            return balance(new_left);
-        }
-        // case: (_, Some(R), Some(B))
-        if (not left.right().is_empty() and left.right().root_color() == Color::Red
-            and not left.right().left().is_empty() and left.right().left().root_color() == Color::Black)
+        // The usual stack-based construction of a treap from sorted keys in linear time.
+        std::vector<NodeIndex> spine;
+        for (auto n : sorted)
         {
-            auto unbalanced_new_right = RedBlackTree(Color::Black,
-                                                        left.right().left().right(),
-                                                        left.right().root(),
-                                                        left.right().right().paint(Color::Red));
-            auto new_right = balance(unbalanced_new_right);
-            auto new_left = RedBlackTree(Color::Black,
-                                            left.left(),
-                                            left.root(),
-                                            left.right().left().left());
-            return RedBlackTree(Color::Red,
-                                new_left,
-                                left.right().left().root(),
-                                new_right);
+            auto& node = nodes[n];
+            node.pending = 0;
+            node.left = null_node;
+            node.right = null_node;
+            NodeIndex last = null_node;
+            while (not spine.empty() and nodes[spine.back()].priority < node.priority)
+            {
+                last = spine.back();
+                spine.pop_back();
+            }
+            set_left(n, last);
+            if (spine.empty())
+            {
+                node.parent = null_node;
+            }
+            else
+            {
+                set_right(spine.back(), n);
+            }
+            spine.push_back(n);
         }
-        assert(!"impossible");
-        return left;
+        return spine.empty() ? null_node : spine.front();
     }
 
-    RedBlackTree RedBlackTree::balance_right(const RedBlackTree& right)
+    uint64_t MarkerTree::next_priority()
     {
-        // match: (color_l, color_l_r, color_r)
-        // case: (.., Some(R))
-        if (not right.right().is_empty() and right.right().root_color() == Color::Red)
-        {
-            return RedBlackTree(Color::Red,
-                                right.left(),
-                                right.root(),
-                                right.right().paint(Color::Black));
-        }
-        // case: (Some(B), ..)
-        if (not right.left().is_empty() and right.left().root_color() == Color::Black)
-        {
-            auto new_right = RedBlackTree(Color::Black,
-                                            right.left().paint(Color::Red),
-                                            right.root(),
-                                            right.right());
-            return balance(new_right);
-        }
-        // case: (Some(R), Some(B), _)
-        if (not right.left().is_empty() and right.left().root_color() == Color::Red
-            and not right.left().right().is_empty() and right.left().right().root_color() == Color::Black)
-        {
-            auto unbalanced_new_left = RedBlackTree(Color::Black,
-                                                    // Note: Because 'left' is red, it must have a left child.
-                                                    right.left().left().paint(Color::Red),
-                                                    right.left().root(),
-                                                    right.left().right().left());
-            auto new_left = balance(unbalanced_new_left);
-            auto new_right = RedBlackTree(Color::Black,
-                                            right.left().right().right(),
-                                            right.root(),
-                                            right.right());
-            return RedBlackTree(Color::Red,
-                                new_left,
-                                right.left().right().root(),
-                                new_right);
-        }
-        assert(!"impossible");
-        return right;
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
     }
 
-    RedBlackTree RedBlackTree::remove_left(const RedBlackTree& root, Offset at, Offset total)
+    DecorationId DecorationTree::add(CharOffset first, CharOffset last, uint64_t style)
     {
-        auto new_left = rem(root.left(), at, total);
-        auto new_node = RedBlackTree(Color::Red,
-                                        new_left,
-                                        root.root(),
-                                        root.right());
-        // In this case, the root was a red node and must've had at least two children.
-        if (not root.left().is_empty()
-            and root.left().root_color() == Color::Black)
-            return balance_left(new_node);
-        return new_node;
+        assert(first <= last);
+        auto id = DecorationId{ next_id++ };
+        NodePtr lhs;
+        NodePtr rhs;
+        split(root, rep(first), id, &lhs, &rhs);
+        auto n = make({ .first = rep(first),
+                        .last = rep(last),
+                        .max_last = rep(last),
+                        .pending = 0,
+                        .size = 1,
+                        .priority = next_priority(),
+                        .id = id,
+                        .style = style,
+                        .left = nullptr,
+                        .right = nullptr },
+                      nullptr,
+                      nullptr);
+        root = merge(merge(lhs, n), rhs);
+        return id;
     }
 
-    RedBlackTree RedBlackTree::remove_right(const RedBlackTree& root, Offset at, Offset total)
+    void DecorationTree::erase(const Decoration& decoration)
     {
-        const NodeData& y = root.root();
-        auto new_right = rem(root.right(), at, total + y.left_subtree_length + y.piece.length);
-        auto new_node = RedBlackTree(Color::Red,
-                                        root.left(),
-                                        root.root(),
-                                        new_right);
-        // In this case, the root was a red node and must've had at least two children.
-        if (not root.right().is_empty()
-            and root.right().root_color() == Color::Black)
-            return balance_right(new_node);
-        return new_node;
+        NodePtr lhs;
+        NodePtr rest;
+        NodePtr match;
+        NodePtr rhs;
+        split(root, rep(decoration.first), decoration.id, &lhs, &rest);
+        split(rest, rep(decoration.first), extend(decoration.id), &match, &rhs);
+        root = merge(lhs, rhs);
     }
 
-    RedBlackTree RedBlackTree::rem(const RedBlackTree& root, Offset at, Offset total)
+    void DecorationTree::erase_starting_in(CharOffset first, CharOffset last)
     {
-        if (root.is_empty())
-            return RedBlackTree();
-        const NodeData& y = root.root();
-        if (at < total + y.left_subtree_length)
-            return remove_left(root, at, total);
-        if (at == total + y.left_subtree_length)
-            return fuse(root.left(), root.right());
-        return remove_right(root, at, total);
+        NodePtr lhs;
+        NodePtr rest;
+        NodePtr starting;
+        NodePtr rhs;
+        split(root, rep(first), DecorationId{ }, &lhs, &rest);
+        split(rest, rep(last), DecorationId{ }, &starting, &rhs);
+        root = merge(lhs, rhs);
     }
-#endif // EXPERIMENTAL_REMOVE
 
-#ifdef TEXTBUF_DEBUG
-    // Borrowed from https://github.com/dotnwat/persistent-rbtree/blob/master/tree.h:checkConsistency.
-    int check_black_node_invariant(const RedBlackTree& node)
+    void DecorationTree::clear()
     {
-        if (node.is_empty())
-            return 1;
-        if (node.root_color() == Color::Red and
-            ((not node.left().is_empty() and node.left().root_color() == Color::Red)
-            or (not node.right().is_empty() and node.right().root_color() == Color::Red)))
-        {
-            return 1;
-        }
-        auto l = check_black_node_invariant(node.left());
-        auto r = check_black_node_invariant(node.right());
+        root = nullptr;
+    }
 
-        if (l != 0 and r != 0 and l != r)
-            return 0;
+    size_t DecorationTree::size() const
+    {
+        return root == nullptr ? 0 : root->size;
+    }
 
-        if (l != 0 and r != 0)
-            return node.root_color() == Color::Red ? l : l + 1;
-        return 0;
+    void DecorationTree::find(std::vector<Decoration>* out, CharOffset first, CharOffset last) const
+    {
+        auto visit = [&](auto& self, const NodePtr& n, size_t shift) -> void {
+            if (n == nullptr or n->max_last + shift < rep(first))
+                return;
+            self(self, n->left, shift + n->pending);
+            auto start = n->first + shift;
+            auto end = n->last + shift;
+            // Everything after this starts too late as well.
+            if (start >= rep(last))
+                return;
+            if (end > rep(first) or start >= rep(first))
+            {
+                out->push_back({ .id = n->id, .first = CharOffset{ start }, .last = CharOffset{ end }, .style = n->style });
+            }
+            self(self, n->right, shift + n->pending);
+        };
+        visit(visit, root, 0);
     }
 
-    void satisfies_rb_invariants(const RedBlackTree& root)
+    void DecorationTree::inserted(CharOffset offset, Length length)
     {
-        // 1. Every node is either red or black.
-        // 2. All NIL nodes (figure 1) are considered black.
-        // 3. A red node does not have a red child.
-        // 4. Every path from a given node to any of its descendant NIL nodes goes through the same number of black nodes.
+        if (rep(length) == 0 or root == nullptr)
+            return;
+        // Decorations starting at or after 'offset' move; those straddling it grow.
+        NodePtr lhs;
+        NodePtr rhs;
+        split(root, rep(offset), DecorationId{ }, &lhs, &rhs);
+        lhs = adjust_ends(lhs, rep(offset), [&](size_t last) { return last + rep(length); });
+        root = merge(lhs, shifted(rhs, rep(length)));
+    }
 
-        // The internal nodes in this RB tree can be totally black so we will not count them directly, we'll just track
-        // odd nodes as either red or black.
-        // Measure the number of black nodes we need to validate.
-        if (root.is_empty()
-            or (root.left().is_empty() and root.right().is_empty()))
+    void DecorationTree::removed(CharOffset offset, Length length)
+    {
+        if (rep(length) == 0 or root == nullptr)
             return;
-        assert(check_black_node_invariant(root) != 0);
+        const auto first = rep(offset);
+        const auto last = first + rep(length);
+        auto clip = [&](size_t end) { return end >= last ? end - rep(length) : first; };
+        NodePtr before;
+        NodePtr rest;
+        NodePtr inside;
+        NodePtr at_end;
+        NodePtr after;
+        split(root, first, DecorationId{ }, &before, &rest);
+        split(rest, last, DecorationId{ }, &inside, &rest);
+        split(rest, last + 1, DecorationId{ }, &at_end, &after);
+        before = adjust_ends(before, first, clip);
+        // The decorations inside the range and at its end all start at 'first' now, so put them back in order of
+        // id.
+        std::vector<Node> collapsed;
+        collect(inside, 0, &collapsed);
+        for (auto& data : collapsed)
+        {
+            data.first = first;
+            data.last = clip(data.last);
+        }
+        collect(at_end, -rep(length), &collapsed);
+        std::sort(collapsed.begin(), collapsed.end(), [](const Node& lhs, const Node& rhs) { return lhs.id < rhs.id; });
+        NodePtr middle;
+        for (auto& data : collapsed)
+        {
+            middle = merge(middle, make(data, nullptr, nullptr));
+        }
+        root = merge(merge(before, middle), shifted(after, -rep(length)));
     }
-#endif // TEXTBUF_DEBUG
-} // namespace PieceTree
 
-namespace PieceTree
-{
-    namespace
+    DecorationTree::NodePtr DecorationTree::make(const Node& data, NodePtr left, NodePtr right)
     {
-        void populate_line_starts(LineStarts* starts, std::string_view buf)
+        auto node = data;
+        node.pending = 0;
+        node.size = 1;
+        node.max_last = node.last;
+        for (auto* child : { &left, &right })
         {
-            starts->clear();
-            LineStart start { };
-            starts->push_back(start);
-            const auto len = buf.size();
-            for (size_t i = 0; i < len; ++i)
+            if (*child != nullptr)
             {
-                char c = buf[i];
-                if (c == '\n')
-                {
-                    start = LineStart{ i + 1 };
-                    starts->push_back(start);
-                }
+                node.size += (*child)->size;
+                node.max_last = std::max(node.max_last, (*child)->max_last);
             }
         }
+        node.left = std::move(left);
+        node.right = std::move(right);
+        return std::make_shared<const Node>(std::move(node));
+    }
 
-        void compute_buffer_meta(BufferMeta* meta, const RedBlackTree& root)
+    DecorationTree::NodePtr DecorationTree::shifted(const NodePtr& n, size_t delta)
+    {
+        if (n == nullptr or delta == 0)
+            return n;
+        auto node = *n;
+        node.first += delta;
+        node.last += delta;
+        node.max_last += delta;
+        node.pending += delta;
+        return std::make_shared<const Node>(std::move(node));
+    }
+
+    void DecorationTree::split(NodePtr n, size_t first, DecorationId id, NodePtr* lhs, NodePtr* rhs)
+    {
+        if (n == nullptr)
         {
-            meta->lf_count = tree_lf_count(root);
-            meta->total_content_length = tree_length(root);
+            *lhs = nullptr;
+            *rhs = nullptr;
+            return;
         }
-    } // namespace [anon]
+        auto left = shifted(n->left, n->pending);
+        auto right = shifted(n->right, n->pending);
+        if (n->first < first or (n->first == first and n->id < id))
+        {
+            NodePtr middle;
+            split(right, first, id, &middle, rhs);
+            *lhs = make(*n, std::move(left), std::move(middle));
+        }
+        else
+        {
+            NodePtr middle;
+            split(left, first, id, lhs, &middle);
+            *rhs = make(*n, std::move(middle), std::move(right));
+        }
+    }
 
-    const CharBuffer* BufferCollection::buffer_at(BufferIndex index) const
+    DecorationTree::NodePtr DecorationTree::merge(const NodePtr& lhs, const NodePtr& rhs)
     {
-        if (index == BufferIndex::ModBuf)
-            return &mod_buffer;
-        return orig_buffers[rep(index)].get();
+        if (lhs == nullptr)
+            return rhs;
+        if (rhs == nullptr)
+            return lhs;
+        if (lhs->priority > rhs->priority)
+            return make(*lhs, shifted(lhs->left, lhs->pending), merge(shifted(lhs->right, lhs->pending), rhs));
+        return make(*rhs, merge(lhs, shifted(rhs->left, rhs->pending)), shifted(rhs->right, rhs->pending));
     }
 
-    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
+    template <typename F>
+    DecorationTree::NodePtr DecorationTree::adjust_ends(const NodePtr& n, size_t offset, F adjust)
     {
-        auto& starts = buffer_at(index)->line_starts;
-        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
+        // Only subtrees with a decoration ending after 'offset' are copied.
+        if (n == nullptr or n->max_last <= offset)
+            return n;
+        auto data = *n;
+        if (data.last > offset)
+        {
+            data.last = adjust(data.last);
+        }
+        return make(data,
+                    adjust_ends(shifted(n->left, n->pending), offset, adjust),
+                    adjust_ends(shifted(n->right, n->pending), offset, adjust));
     }
 
-    Tree::Tree():
-        buffers{ }
+    void DecorationTree::collect(const NodePtr& n, size_t shift, std::vector<Node>* out)
     {
-        build_tree();
+        if (n == nullptr)
+            return;
+        collect(n->left, shift + n->pending, out);
+        auto& data = out->emplace_back(*n);
+        data.first += shift;
+        data.last += shift;
+        data.left = nullptr;
+        data.right = nullptr;
+        collect(n->right, shift + n->pending, out);
     }
 
-    Tree::Tree(Buffers&& buffers):
-        buffers{ std::move(buffers) }
+    uint64_t DecorationTree::next_priority()
     {
-        build_tree();
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
     }
 
-    void Tree::build_tree()
+    NodeData attribute(const NodeData& data, const RedBlackTree& left, const RedBlackTree& right)
     {
-        buffers.mod_buffer.line_starts.clear();
-        buffers.mod_buffer.buffer.clear();
-        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
-        buffers.mod_buffer.line_starts.push_back({});
-        last_insert = { };
+        auto new_data = data;
+        new_data.left_subtree_length = tree_length(left);
+        new_data.left_subtree_lf_count = tree_lf_count(left);
+        new_data.left_subtree_crlf_count = tree_crlf_count(left);
+        new_data.subtree_starts_with_lf = left.is_empty() ? data.piece_starts_with_lf : left.root().subtree_starts_with_lf;
+        new_data.subtree_ends_with_cr = right.is_empty() ? data.piece_ends_with_cr : right.root().subtree_ends_with_cr;
+#ifdef TEXTBUF_CONTENT_HASH
+        auto hash = combine_hash(tree_hash(left), data.piece_hash, data.piece.length);
+        new_data.subtree_hash = combine_hash(hash, tree_hash(right), tree_length(right));
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        new_data.left_subtree_utf_counts = tree_utf_counts(left);
+#endif // TEXTBUF_UTF_COUNTS
+        return new_data;
+    }
 
-        const auto buf_count = buffers.orig_buffers.size();
-        CharOffset offset = { };
-        for (size_t i = 0; i < buf_count; ++i)
+    struct RedBlackTree::ColorTree
+    {
+        const Color color;
+        const RedBlackTree tree;
+
+        static ColorTree double_black()
         {
-            const auto& buf = *buffers.orig_buffers[i];
-            assert(not buf.line_starts.empty());
-            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
-            if (buf.buffer.empty())
-                continue;
-            auto last_line = Line{ buf.line_starts.size() - 1 };
-            // Create a new node that spans this buffer and retains an index to it.
-            // Insert the node into the balanced tree.
-            Piece piece {
-                .index = BufferIndex{ i },
-                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
-                .last = { .line = last_line, .column = Column{ buf.buffer.size() - rep(buf.line_starts[rep(last_line)]) } },
-                .length = Length{ buf.buffer.size() },
-                // Note: the number of newlines
-                .newline_count = LFCount{ rep(last_line) }
-            };
-            root = root.insert({ piece }, offset);
-            offset = offset + piece.length;
+            return ColorTree();
         }
 
-        compute_buffer_meta();
-    }
-
-    void Tree::internal_insert(CharOffset offset, std::string_view txt)
-    {
-        assert(not txt.empty());
-        end_last_insert = extend(offset, txt.size());
-        ScopeGuard guard{ [&] {
-            compute_buffer_meta();
-#ifdef TEXTBUF_DEBUG
-            satisfies_rb_invariants(root);
-#endif // TEXTBUF_DEBUG
-        } };
-        if (root.is_empty())
+        explicit ColorTree(RedBlackTree const &tree)
+            : color(tree.is_empty() ? Color::Black : tree.root_color()), tree(tree)
         {
-            auto piece = build_piece(txt);
-            root = root.insert({ piece }, CharOffset{ 0 });
-            return;
         }
 
-        auto result = node_at(&buffers, root, offset);
-        // If the offset is beyond the buffer, just select the last node.
-        if (result.node == nullptr)
+        explicit ColorTree(Color c, const RedBlackTree& lft, const NodeData& x, const RedBlackTree& rgt)
+            : color(c), tree(c, lft, x, rgt)
         {
-            auto off = CharOffset{ 0 };
-            if (meta.total_content_length != Length{})
-            {
-                off = off + retract(meta.total_content_length);
-            }
-            result = node_at(&buffers, root, off);
         }
 
-        // There are 3 cases:
-        // 1. We are inserting at the beginning of an existing node.
-        // 2. We are inserting at the end of an existing node.
-        // 3. We are inserting in the middle of the node.
-        auto [node, remainder, node_start_offset, line] = result;
-        assert(node != nullptr);
-        auto insert_pos = buffer_position(&buffers, node->piece, remainder);
-        // Case #1.
-        if (node_start_offset == offset)
+    private:
+        ColorTree(): color(Color::DoubleBlack)
         {
-            // There's a bonus case here.  If our last insertion point was the same as this piece's
-            // last and it inserted into the mod buffer, then we can simply 'extend' this piece by
-            // the following process:
-            // 1. Fetch the previous node (if we can) and compare.
-            // 2. Build the new piece.
-            // 3. Remove the old piece.
-            // 4. Extend the old piece's length to the length of the newly created piece.
-            // 5. Re-insert the new piece.
-            if (offset != CharOffset{})
-            {
-                auto prev_node_result = node_at(&buffers, root, retract(offset));
-                if (prev_node_result.node->piece.index == BufferIndex::ModBuf
-                    and prev_node_result.node->piece.last == last_insert)
-                {
-                    auto new_piece = build_piece(txt);
-                    combine_pieces(prev_node_result, new_piece);
-                    return;
-                }
-            }
-            auto piece = build_piece(txt);
-            root = root.insert({ piece }, offset);
-            return;
         }
+    };
 
-        const bool inside_node = offset < node_start_offset + node->piece.length;
+    struct WalkResult
+    {
+        RedBlackTree tree;
+        Offset accumulated_offset;
+    };
 
-        // Case #2.
-        if (not inside_node)
+    WalkResult pred(const RedBlackTree& root, Offset start_offset)
+    {
+        RedBlackTree t = root.left();
+        while (!t.right().is_empty())
         {
-            // There's a bonus case here.  If our last insertion point was the same as this piece's
-            // last and it inserted into the mod buffer, then we can simply 'extend' this piece by
-            // the following process:
-            // 1. Build the new piece.
-            // 2. Remove the old piece.
-            // 3. Extend the old piece's length to the length of the newly created piece.
-            // 4. Re-insert the new piece.
-            if (node->piece.index == BufferIndex::ModBuf and node->piece.last == last_insert)
-            {
-                auto new_piece = build_piece(txt);
-                combine_pieces(result, new_piece);
-                return;
-            }
-            // Insert the new piece at the end.
-            auto piece = build_piece(txt);
-            root = root.insert({ piece }, offset);
-            return;
+            start_offset = start_offset + t.root().left_subtree_length + t.root().piece.length;
+            t = t.right();
         }
+        // Add the final offset from the last right node.
+        start_offset = start_offset + t.root().left_subtree_length;
+        return { .tree = t, .accumulated_offset = start_offset };
+    }
 
-        // Case #3.
-        // The basic approach here is to split the existing node into two pieces
-        // and insert the new piece in between them.
-        auto new_len_right = distance(buffers.buffer_offset(node->piece.index, insert_pos),
-                                        buffers.buffer_offset(node->piece.index, node->piece.last));
-        auto new_piece_right = node->piece;
-        new_piece_right.first = insert_pos;
-        new_piece_right.length = new_len_right;
-        new_piece_right.newline_count = line_feed_count(&buffers, node->piece.index, insert_pos, node->piece.last);
-
-        // Remove the original node tail.
-        auto new_piece_left = trim_piece_right(&buffers, node->piece, insert_pos);
-
-        auto new_piece = build_piece(txt);
-
-        // Remove the original node.
-        root = root.remove(node_start_offset);
-
-        // Insert the left.
-        root = root.insert({ new_piece_left }, node_start_offset);
-
-        // Insert the new mid.
-        node_start_offset = node_start_offset + new_piece_left.length;
-        root = root.insert({ new_piece }, node_start_offset);
 
-        // Insert remainder.
-        node_start_offset = node_start_offset + new_piece.length;
-        root = root.insert({ new_piece_right }, node_start_offset);
+#ifdef EXPERIMENTAL_REMOVE
+    RedBlackTree RedBlackTree::remove(Offset at) const
+    {
+        auto t = rem(at, Offset{ 0 }).tree;
+        if (t.is_empty())
+            return RedBlackTree();
+        return RedBlackTree(Color::Black, t.left(), t.root(), t.right());
     }
 
-    void Tree::internal_remove(CharOffset offset, Length count)
+    RedBlackTree::ColorTree RedBlackTree::remove_double_black(Color c, ColorTree const &lft, const NodeData& x, ColorTree const &rgt)
     {
-        assert(rep(count) != 0 and not root.is_empty());
-        ScopeGuard guard{ [&] {
-            compute_buffer_meta();
-#ifdef TEXTBUF_DEBUG
-            satisfies_rb_invariants(root);
-#endif // TEXTBUF_DEBUG
-        } };
-        auto first = node_at(&buffers, root, offset);
-        auto last = node_at(&buffers, root, offset + count);
-        auto first_node = first.node;
-        auto last_node = last.node;
-
-        auto start_split_pos = buffer_position(&buffers, first_node->piece, first.remainder);
-
-        // Simple case: the range of characters we want to delete are
-        // held directly within this node.  Remove the node, resize it
-        // then add it back.
-        if (first_node == last_node)
+        if (lft.color == Color::DoubleBlack)
         {
-            auto end_split_pos = buffer_position(&buffers, first_node->piece, last.remainder);
-            // We're going to shrink the node starting from the beginning.
-            if (first.start_offset == offset)
+            auto left = lft.tree.is_empty() ? RedBlackTree() : lft.tree.paint(Color::Black);
+
+            if (rgt.color == Color::Black)
             {
-                // Delete the entire node.
-                if (count == first_node->piece.length)
-                {
-                    root = root.remove(first.start_offset);
-                    return;
-                }
-                // Shrink the node.
-                auto new_piece = trim_piece_left(&buffers, first_node->piece, end_split_pos);
-                // Remove the old one and update.
-                root = root.remove(first.start_offset)
-                            .insert({ new_piece }, first.start_offset);
-                return;
+                assert(c != Color::DoubleBlack);
+                return ColorTree(extend(c), left, x, rgt.tree.paint(Color::Red));
             }
+            else
+                return ColorTree(Color::Black, RedBlackTree(Color::Black, left, x, rgt.tree.left().paint(Color::Red)), rgt.tree.root(), rgt.tree.right());
+        }
+        else if (rgt.color == Color::DoubleBlack)
+        {
+            auto right = rgt.tree.is_empty() ? RedBlackTree() : rgt.tree.paint(Color::Black);
 
-            // Trim the tail of this piece.
-            if (first.start_offset + first_node->piece.length == offset + count)
+            if (lft.color == Color::Black)
             {
-                auto new_piece = trim_piece_right(&buffers, first_node->piece, start_split_pos);
-                // Remove the old one and update.
-                root = root.remove(first.start_offset)
-                            .insert({ new_piece }, first.start_offset);
-                return;
+                assert(c != Color::DoubleBlack);
+                return ColorTree(extend(c), lft.tree.paint(Color::Red), x, right);
             }
-
-            // The removed buffer is somewhere in the middle.  Trim it in both directions.
-            auto [left, right] = shrink_piece(&buffers, first_node->piece, start_split_pos, end_split_pos);
-            root = root.remove(first.start_offset)
-                        // Note: We insert right first so that the 'left' will be inserted
-                        // to the right node's left.
-                        .insert({ right }, first.start_offset)
-                        .insert({ left }, first.start_offset);
-            return;
+            else
+                return ColorTree(Color::Black, lft.tree.left(), lft.tree.root(), RedBlackTree(Color::Black, lft.tree.right().paint(Color::Red), x, right));
         }
+        else
+            return ColorTree(c, lft.tree, x, rgt.tree);
+    }
 
-        // Traverse nodes and delete all nodes within the offset range. First we will build the
-        // partial pieces for the nodes that will eventually make up this range.
-        // There are four cases here:
-        // 1. The entire first node is deleted as well as all of the last node.
-        // 2. Part of the first node is deleted and all of the last node.
-        // 3. Part of the first node is deleted and part of the last node.
-        // 4. The entire first node is deleted and part of the last node.
+    RedBlackTree::ColorTree RedBlackTree::rem(Offset at, Offset total) const
+    {
+        if (is_empty())
+            return ColorTree(RedBlackTree());
+        const NodeData& y = root();
+        if (at < total + y.left_subtree_length)
+            return remove_double_black(root_color(), left().rem(at, total), y, ColorTree(right()));
+        if (at == total + y.left_subtree_length)
+            return remove_node();
+        return remove_double_black(root_color(), ColorTree(left()), y, right().rem(at, total + y.left_subtree_length + y.piece.length));
+    }
 
-        auto new_first = trim_piece_right(&buffers, first_node->piece, start_split_pos);
-        if (last_node == nullptr)
+    RedBlackTree::ColorTree RedBlackTree::remove_node() const
+    {
+        if (not left().is_empty()
+            and not right().is_empty())
         {
-            remove_node_range(first, count);
+            auto [p, off] = pred(*this, Offset(0));
+            const NodeData& x = p.root();
+
+            Color c = root_color();
+
+            return remove_double_black(c, left().rem(off, Offset(0)), x, ColorTree(right()));
         }
-        else
+        else if (not left().is_empty())
         {
-            auto end_split_pos = buffer_position(&buffers, last_node->piece, last.remainder);
-            auto new_last = trim_piece_left(&buffers, last_node->piece, end_split_pos);
-            remove_node_range(first, count);
-            // There's an edge case here where we delete all the nodes up to 'last' but
-            // last itself remains untouched.  The test of 'remainder' in 'last' can identify
-            // this scenario to avoid inserting a duplicate of 'last'.
-            if (last.remainder != Length{})
-            {
-                if (new_last.length != Length{})
-                {
-                    root = root.insert({ new_last }, first.start_offset);
-                }
-            }
+            return ColorTree(left().paint(Color::Black));
         }
-
-        if (new_first.length != Length{})
+        else if (not right().is_empty())
         {
-            root = root.insert({ new_first }, first.start_offset);
+            return ColorTree(right().paint(Color::Black));
         }
-    }
-
-    // Fetches the length of the piece starting from the first line to 'index' or to the end of
-    // the piece.
-    Length Tree::accumulate_value(const BufferCollection* buffers, const Piece& piece, Line index)
-    {
-        auto* buffer = buffers->buffer_at(piece.index);
-        auto& line_starts = buffer->line_starts;
-        // Extend it so we can capture the entire line content including newline.
-        auto expected_start = extend(piece.first.line, rep(index) + 1);
-        auto first = rep(line_starts[rep(piece.first.line)]) + rep(piece.first.column);
-        if (expected_start > piece.last.line)
+        else if (root_color() == Color::Black)
         {
-            auto last = rep(line_starts[rep(piece.last.line)]) + rep(piece.last.column);
-            return Length{ last - first };
+            return ColorTree::double_black();
         }
-        auto last = rep(line_starts[rep(expected_start)]);
-        return Length{ last - first };
+        return ColorTree(RedBlackTree());
     }
-
-    // Fetches the length of the piece starting from the first line to 'index' or to the end of
-    // the piece.
-    Length Tree::accumulate_value_no_lf(const BufferCollection* buffers, const Piece& piece, Line index)
+#else
+    RedBlackTree RedBlackTree::remove(Offset at) const
     {
-        auto* buffer = buffers->buffer_at(piece.index);
-        auto& line_starts = buffer->line_starts;
-        // Extend it so we can capture the entire line content including newline.
-        auto expected_start = extend(piece.first.line, rep(index) + 1);
-        auto first = rep(line_starts[rep(piece.first.line)]) + rep(piece.first.column);
-        if (expected_start > piece.last.line)
-        {
-            auto last = rep(line_starts[rep(piece.last.line)]) + rep(piece.last.column);
-            if (last == first)
-                return Length{ };
-            if (buffer->buffer[last - 1] == '\n')
-                return Length{ last - 1 - first };
-            return Length{ last - first };
-        }
-        auto last = rep(line_starts[rep(expected_start)]);
-        if (last == first)
-            return Length{ };
-        if (buffer->buffer[last - 1] == '\n')
-            return Length{ last - 1 - first };
-        return Length{ last - first };
+        auto t = rem(*this, at, Offset{ 0 });
+        if (t.is_empty())
+            return RedBlackTree();
+        return RedBlackTree(Color::Black, t.left(), t.root(), t.right());
     }
 
-    void Tree::populate_from_node(std::string* buf, const BufferCollection* buffers, const PieceTree::RedBlackTree& node)
+    RedBlackTree RedBlackTree::fuse(const RedBlackTree& left, const RedBlackTree& right)
     {
-        auto& buffer = buffers->buffer_at(node.root().piece.index)->buffer;
-        auto old_buf_size = buf->size();
-        // We know we want the first line (index 0).
-        auto accumulated_value = accumulate_value(buffers, node.root().piece, node.root().piece.first.line);
-        auto start_offset = buffers->buffer_offset(node.root().piece.index, node.root().piece.first);
-        auto first = buffer.data() + rep(start_offset);
-        auto last = first + rep(accumulated_value);
-        buf->resize(buf->size() + std::distance(first, last));
-        std::copy(first, last, buf->data() + old_buf_size);
+        // match: (left, right)
+        // case: (None, r)
+        if (left.is_empty())
+            return right;
+        if (right.is_empty())
+            return left;
+        // match: (left.color, right.color)
+        // case: (B, R)
+        if (left.root_color() == Color::Black and right.root_color() == Color::Red)
+        {
+            return RedBlackTree(Color::Red,
+                                fuse(left, right.left()),
+                                right.root(),
+                                right.right());
+        }
+        // case: (R, B)
+        if (left.root_color() == Color::Red and right.root_color() == Color::Black)
+        {
+            return RedBlackTree(Color::Red,
+                                left.left(),
+                                left.root(),
+                                fuse(left.right(), right));
+        }
+        // case: (R, R)
+        if (left.root_color() == Color::Red and right.root_color() == Color::Red)
+        {
+            auto fused = fuse(left.right(), right.left());
+            if (not fused.is_empty() and fused.root_color() == Color::Red)
+            {
+                auto new_left = RedBlackTree(Color::Red,
+                                                left.left(),
+                                                left.root(),
+                                                fused.left());
+                auto new_right = RedBlackTree(Color::Red,
+                                                fused.right(),
+                                                right.root(),
+                                                right.right());
+                return RedBlackTree(Color::Red,
+                                    new_left,
+                                    fused.root(),
+                                    new_right);
+            }
+            auto new_right = RedBlackTree(Color::Red,
+                                            fused,
+                                            right.root(),
+                                            right.right());
+            return RedBlackTree(Color::Red,
+                                left.left(),
+                                left.root(),
+                                new_right);
+        }
+        // case: (B, B)
+        assert(left.root_color() == right.root_color() and left.root_color() == Color::Black);
+        auto fused = fuse(left.right(), right.left());
+        if (not fused.is_empty() and fused.root_color() == Color::Red)
+        {
+            auto new_left = RedBlackTree(Color::Black,
+                                            left.left(),
+                                            left.root(),
+                                            fused.left());
+            auto new_right = RedBlackTree(Color::Black,
+                                            fused.right(),
+                                            right.root(),
+                                            right.right());
+            return RedBlackTree(Color::Red,
+                                new_left,
+                                fused.root(),
+                                new_right);
+        }
+        auto new_right = RedBlackTree(Color::Black,
+                                        fused,
+                                        right.root(),
+                                        right.right());
+        auto new_node = RedBlackTree(Color::Red,
+                                        left.left(),
+                                        left.root(),
+                                        new_right);
+        return balance_left(new_node);
     }
 
-    void Tree::populate_from_node(std::string* buf, const BufferCollection* buffers, const PieceTree::RedBlackTree& node, Line line_index)
+    RedBlackTree RedBlackTree::balance(const RedBlackTree& node)
     {
-        auto accumulated_value = accumulate_value(buffers, node.root().piece, line_index);
-        Length prev_accumulated_value = { };
-        if (line_index != Line::IndexBeginning)
+        // Two red children.
+        if (not node.left().is_empty()
+            and node.left().root_color() == Color::Red
+            and not node.right().is_empty()
+            and node.right().root_color() == Color::Red)
         {
-            prev_accumulated_value = accumulate_value(buffers, node.root().piece, retract(line_index));
+            auto l = node.left().paint(Color::Black);
+            auto r = node.right().paint(Color::Black);
+            return RedBlackTree(Color::Red,
+                                l,
+                                node.root(),
+                                r);
         }
-        auto& buffer = buffers->buffer_at(node.root().piece.index)->buffer;
-        auto start_offset = buffers->buffer_offset(node.root().piece.index, node.root().piece.first);
 
-        auto first = buffer.data() + rep(start_offset) + rep(prev_accumulated_value);
-        auto last = buffer.data() + rep(start_offset) + rep(accumulated_value);
-        auto old_buf_size = buf->size();
-        buf->resize(buf->size() + std::distance(first, last));
-        std::copy(first, last, buf->data() + old_buf_size);
+        assert(node.root_color() == Color::Black);
+        return balance(node.root_color(), node.left(), node.root(), node.right());
     }
 
-    template <Tree::Accumulator accumulate>
-    void Tree::line_start(CharOffset* offset, const BufferCollection* buffers, const PieceTree::RedBlackTree& node, Line line)
+    RedBlackTree RedBlackTree::balance_left(const RedBlackTree& left)
     {
-        if (node.is_empty())
-            return;
-        assert(line != Line::IndexBeginning);
-        auto line_index = rep(retract(line));
-        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        // match: (color_l, color_r, color_r_l)
+        // case: (Some(R), ..)
+        if (not left.left().is_empty() and left.left().root_color() == Color::Red)
         {
-            line_start<accumulate>(offset, buffers, node.left(), line);
+            return RedBlackTree(Color::Red,
+                                left.left().paint(Color::Black),
+                                left.root(),
+                                left.right());
         }
-        // The desired line is directly within the node.
-        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) >= line_index)
+        // case: (_, Some(B), _)
+        if (not left.right().is_empty() and left.right().root_color() == Color::Black)
         {
-            line_index -= rep(node.root().left_subtree_lf_count);
-            Length len = node.root().left_subtree_length;
-            if (line_index != 0)
-            {
-                len = len + (*accumulate)(buffers, node.root().piece, Line{ line_index - 1 });
-            }
-            *offset = *offset + len;
+            auto new_left = RedBlackTree(Color::Black,
+                                            left.left(),
+                                            left.root(),
+                                            left.right().paint(Color::Red));
+            return balance(new_left);
         }
-        // assemble the LHS and RHS.
-        else
+        // case: (_, Some(R), Some(B))
+        if (not left.right().is_empty() and left.right().root_color() == Color::Red
+            and not left.right().left().is_empty() and left.right().left().root_color() == Color::Black)
         {
-            // This case implies that 'left_subtree_lf_count' is strictly < line_index.
-            // The content is somewhere in the middle.
-            line_index -= rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
-            *offset = *offset + node.root().left_subtree_length + node.root().piece.length;
-            line_start<accumulate>(offset, buffers, node.right(), Line{ line_index + 1 });
+            auto unbalanced_new_right = RedBlackTree(Color::Black,
+                                                        left.right().left().right(),
+                                                        left.right().root(),
+                                                        left.right().right().paint(Color::Red));
+            auto new_right = balance(unbalanced_new_right);
+            auto new_left = RedBlackTree(Color::Black,
+                                            left.left(),
+                                            left.root(),
+                                            left.right().left().left());
+            return RedBlackTree(Color::Red,
+                                new_left,
+                                left.right().left().root(),
+                                new_right);
         }
+        assert(!"impossible");
+        return left;
     }
 
-    void Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& root, const RedBlackTree& node, Line line)
+    RedBlackTree RedBlackTree::balance_right(const RedBlackTree& right)
     {
-        if (node.is_empty())
-            return;
-        assert(line != Line::IndexBeginning);
-        auto line_index = rep(retract(line));
-        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        // match: (color_l, color_l_r, color_r)
+        // case: (.., Some(R))
+        if (not right.right().is_empty() and right.right().root_color() == Color::Red)
         {
-            line_end_crlf(offset, buffers, root, node.left(), line);
+            return RedBlackTree(Color::Red,
+                                right.left(),
+                                right.root(),
+                                right.right().paint(Color::Black));
         }
-        // The desired line is directly within the node.
-        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) >= line_index)
+        // case: (Some(B), ..)
+        if (not right.left().is_empty() and right.left().root_color() == Color::Black)
         {
-            line_index -= rep(node.root().left_subtree_lf_count);
-            Length len = node.root().left_subtree_length;
-            if (line_index != 0)
-            {
-                len = len + accumulate_value_no_lf(buffers, node.root().piece, Line{ line_index - 1 });
-            }
-
-            // If the length is anything but 0, we need to check if the last character was a carriage return.
-            if (len != Length{})
-            {
-                auto last_char_offset = *offset + retract(len);
-                if (char_at(buffers, root, last_char_offset) == '\r' and char_at(buffers, root, extend(last_char_offset)) == '\n')
-                {
-                    len = retract(len);
-                }
-            }
-            *offset = *offset + len;
+            auto new_right = RedBlackTree(Color::Black,
+                                            right.left().paint(Color::Red),
+                                            right.root(),
+                                            right.right());
+            return balance(new_right);
         }
-        // assemble the LHS and RHS.
-        else
+        // case: (Some(R), Some(B), _)
+        if (not right.left().is_empty() and right.left().root_color() == Color::Red
+            and not right.left().right().is_empty() and right.left().right().root_color() == Color::Black)
         {
-            // This case implies that 'left_subtree_lf_count + piece NL count' is strictly < line_index.
-            // The content is somewhere in the middle.
-            auto& piece = node.root().piece;
-            line_index -= rep(node.root().left_subtree_lf_count + piece.newline_count);
-            *offset = *offset + node.root().left_subtree_length + piece.length;
-            line_end_crlf(offset, buffers, root, node.right(), Line{ line_index + 1 });
+            auto unbalanced_new_left = RedBlackTree(Color::Black,
+                                                    // Note: Because 'left' is red, it must have a left child.
+                                                    right.left().left().paint(Color::Red),
+                                                    right.left().root(),
+                                                    right.left().right().left());
+            auto new_left = balance(unbalanced_new_left);
+            auto new_right = RedBlackTree(Color::Black,
+                                            right.left().right().right(),
+                                            right.root(),
+                                            right.right());
+            return RedBlackTree(Color::Red,
+                                new_left,
+                                right.left().right().root(),
+                                new_right);
         }
+        assert(!"impossible");
+        return right;
     }
 
-    LineRange Tree::get_line_range(Line line) const
+    RedBlackTree RedBlackTree::remove_left(const RedBlackTree& root, Offset at, Offset total)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
-        return range;
+        auto new_left = rem(root.left(), at, total);
+        auto new_node = RedBlackTree(Color::Red,
+                                        new_left,
+                                        root.root(),
+                                        root.right());
+        // In this case, the root was a red node and must've had at least two children.
+        if (not root.left().is_empty()
+            and root.left().root_color() == Color::Black)
+            return balance_left(new_node);
+        return new_node;
     }
 
-    LineRange Tree::get_line_range_crlf(Line line) const
+    RedBlackTree RedBlackTree::remove_right(const RedBlackTree& root, Offset at, Offset total)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_end_crlf(&range.last, &buffers, root, root, extend(line));
-        return range;
+        const NodeData& y = root.root();
+        auto new_right = rem(root.right(), at, total + y.left_subtree_length + y.piece.length);
+        auto new_node = RedBlackTree(Color::Red,
+                                        root.left(),
+                                        root.root(),
+                                        new_right);
+        // In this case, the root was a red node and must've had at least two children.
+        if (not root.right().is_empty()
+            and root.right().root_color() == Color::Black)
+            return balance_right(new_node);
+        return new_node;
     }
 
-    LineRange Tree::get_line_range_with_newline(Line line) const
+    RedBlackTree RedBlackTree::rem(const RedBlackTree& root, Offset at, Offset total)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
-        return range;
+        if (root.is_empty())
+            return RedBlackTree();
+        const NodeData& y = root.root();
+        if (at < total + y.left_subtree_length)
+            return remove_left(root, at, total);
+        if (at == total + y.left_subtree_length)
+            return fuse(root.left(), root.right());
+        return remove_right(root, at, total);
     }
+#endif // EXPERIMENTAL_REMOVE
 
-    OwningSnapshot Tree::owning_snap() const
+#ifdef TEXTBUF_DEBUG
+    // Borrowed from https://github.com/dotnwat/persistent-rbtree/blob/master/tree.h:checkConsistency.
+    int check_black_node_invariant(const RedBlackTree& node)
     {
-        return OwningSnapshot{ this };
-    }
+        if (node.is_empty())
+            return 1;
+        if (node.root_color() == Color::Red and
+            ((not node.left().is_empty() and node.left().root_color() == Color::Red)
+            or (not node.right().is_empty() and node.right().root_color() == Color::Red)))
+        {
+            return 1;
+        }
+        auto l = check_black_node_invariant(node.left());
+        auto r = check_black_node_invariant(node.right());
 
-    ReferenceSnapshot Tree::ref_snap() const
-    {
-        return ReferenceSnapshot{ this };
-    }
+        if (l != 0 and r != 0 and l != r)
+            return 0;
 
-    Line Tree::line_at(CharOffset offset) const
-    {
-        if (is_empty())
-            return Line::Beginning;
-        auto result = node_at(&buffers, root, offset);
-        return result.line;
+        if (l != 0 and r != 0)
+            return node.root_color() == Color::Red ? l : l + 1;
+        return 0;
     }
 
-    char Tree::at(CharOffset offset) const
+    void satisfies_rb_invariants(const RedBlackTree& root)
     {
-        return char_at(&buffers, root, offset);
-    }
+        // 1. Every node is either red or black.
+        // 2. All NIL nodes (figure 1) are considered black.
+        // 3. A red node does not have a red child.
+        // 4. Every path from a given node to any of its descendant NIL nodes goes through the same number of black nodes.
 
-    char Tree::char_at(const BufferCollection* buffers, const RedBlackTree& node, CharOffset offset)
-    {
-        auto result = node_at(buffers, node, offset);
-        if (result.node == nullptr)
-            return '\0';
-        auto* buffer = buffers->buffer_at(result.node->piece.index);
-        auto buf_offset = buffers->buffer_offset(result.node->piece.index, result.node->piece.first);
-        const char* p = buffer->buffer.data() + rep(buf_offset) + rep(result.remainder);
-        return *p;
+        // The internal nodes in this RB tree can be totally black so we will not count them directly, we'll just track
+        // odd nodes as either red or black.
+        // Measure the number of black nodes we need to validate.
+        if (root.is_empty()
+            or (root.left().is_empty() and root.right().is_empty()))
+            return;
+        assert(check_black_node_invariant(root) != 0);
     }
+#endif // TEXTBUF_DEBUG
+} // namespace PieceTree
 
-    void Tree::assemble_line(std::string* buf, const PieceTree::RedBlackTree& node, Line line) const
+namespace PieceTree
+{
+    namespace
     {
-        if (node.is_empty())
-            return;
-        // Trying this new logic for now.
-#if 1
-        CharOffset line_offset{ };
-        line_start<&Tree::accumulate_value>(&line_offset, &buffers, node, line);
-        TreeWalker walker{ this, line_offset };
-        while (not walker.exhausted())
+        void populate_line_starts(LineStarts* starts, std::string_view buf)
         {
-            char c = walker.next();
-            if (c == '\n')
-                break;
-            buf->push_back(c);
+            starts->clear();
+            LineStart start { };
+            starts->push_back(start);
+            const auto len = buf.size();
+            for (size_t i = 0; i < len; ++i)
+            {
+                char c = buf[i];
+                if (c == '\n')
+                {
+                    start = LineStart{ i + 1 };
+                    starts->push_back(start);
+                }
+            }
         }
-#else
-        assert(line != Line::IndexBeginning);
-        auto line_index = rep(retract(line));
-        if (rep(node.root().left_subtree_lf_count) >= line_index)
+
+        void compute_buffer_meta(BufferMeta* meta, const RedBlackTree& root)
         {
-            assemble_line(buf, node.left(), line);
-            const bool same_index = rep(node.root().left_subtree_lf_count) == line_index;
-            if (same_index)
+            meta->lf_count = tree_lf_count(root);
+            meta->crlf_count = tree_crlf_count(root);
+            meta->total_content_length = tree_length(root);
+        }
+
+        void copy_decorations(std::vector<DecorationTree>* out, const std::vector<DecorationTree*>& attached)
+        {
+            out->reserve(attached.size());
+            for (auto* decorations : attached)
             {
-                populate_from_node(buf, node);
-                // Visit the RHS if this piece did not introduce a newline.
-                if (rep(node.root().piece.newline_count) == 0)
+                // Copies share every node, so this is O(1) per tree.
+                out->push_back(*decorations);
+            }
+        }
+
+        // Extends 'counts' to cover every line start of a buffer.  'buf' holds the buffer from offset 'buf_first' on,
+        // including the byte before each line feed not yet counted.
+        void populate_crlf_counts(CRLFCounts* counts, std::string_view buf, size_t buf_first, const LineStarts& starts)
+        {
+            if (counts->empty())
+            {
+                counts->push_back({ });
+            }
+            for (auto i = counts->size(); i < starts.size(); ++i)
+            {
+                auto lf = rep(starts[i]) - 1;
+                auto count = counts->back();
+                if (lf != 0 and buf[lf - 1 - buf_first] == '\r')
                 {
-                    assemble_line(buf, node.right(), retract(line, rep(node.root().left_subtree_lf_count)));
+                    count = extend(count);
                 }
+                counts->push_back(count);
             }
         }
-        // The desired line is directly within the node.
-        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) > line_index)
+
+        // The approximate footprint of a single node allocated through 'std::make_shared' (node plus control block).
+        constexpr size_t node_footprint = sizeof(NodeData) + 2 * sizeof(std::shared_ptr<const void>) + sizeof(Color) + 2 * sizeof(long);
+
+        // The span a Fenwick tree node covers.
+        size_t lowest_bit(size_t i)
         {
-            line_index -= rep(node.root().left_subtree_lf_count);
-            populate_from_node(buf, node, Line{ line_index });
-            return;
+            return i & (~i + 1);
         }
-        // assemble the LHS and RHS.
-        else
+
+        // Each edit path-copies roughly one root-to-leaf path, so a history root retains about that many nodes
+        // which are no longer referenced by the root that replaced it.  This stands in until the replacing root
+        // exists and 'unshared_bytes' can count them.
+        size_t estimate_retained_bytes(const RedBlackTree& root)
         {
-            // This case implies that 'left_subtree_lf_count' is strictly < line_index.
-            // The content is somewhere in the middle.  We only need to populate from this node if the line index is exactly
-            assemble_line(buf, node.left(), line);
-            line_index -= rep(node.root().left_subtree_lf_count);
-            populate_from_node(buf, node, Line{ line_index });
-            if (rep(node.root().piece.newline_count) <= line_index)
+            size_t black_height = 0;
+            auto node = root;
+            while (not node.is_empty())
             {
-                assemble_line(buf, node.right(), retract(line, rep(node.root().left_subtree_lf_count + node.root().piece.newline_count)));
+                if (node.root_color() == Color::Black)
+                    ++black_height;
+                node = node.left();
             }
+            return (2 * black_height + 1) * node_footprint;
         }
-#endif
-    }
 
-    void Tree::get_line_content(std::string* buf, Line line) const
-    {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return;
-        assemble_line(buf, root, line);
-    }
+        bool is_word_break(char c)
+        {
+            return c == ' ' or c == '\t' or c == '\n' or c == '\r';
+        }
+    } // namespace [anon]
 
-    void OwningSnapshot::get_line_content(std::string* buf, Line line) const
+#ifdef TEXTBUF_CONTENT_HASH
+    namespace
     {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return;
-        if (root.is_empty())
-            return;
-        CharOffset line_offset{ };
-        Tree::line_start<&Tree::accumulate_value>(&line_offset, &buffers, root, line);
-        TreeWalker walker{ this, line_offset };
-        while (not walker.exhausted())
+        // 'buf' holds the buffer from offset 'buf_first' on, which is at most the first byte not yet hashed.
+        void extend_prefix_hashes(PrefixHashes* prefix, std::string_view buf, size_t buf_first)
         {
-            char c = walker.next();
-            if (c == '\n')
-                break;
-            buf->push_back(c);
+            constexpr auto stride = PrefixHashes::stride;
+            static_assert(ChunkedText::alignment % stride == 0);
+            if (prefix->hashes.empty())
+            {
+                prefix->hashes.push_back({ });
+            }
+            while (prefix->hashes.size() * stride <= buf_first + buf.size())
+            {
+                auto hash = rep(prefix->hashes.back());
+                for (char c : buf.substr((prefix->hashes.size() - 1) * stride - buf_first, stride))
+                {
+                    hash = hash_char(hash, c);
+                }
+                prefix->hashes.push_back(ContentHash{ hash });
+            }
         }
-    }
 
-    void ReferenceSnapshot::get_line_content(std::string* buf, Line line) const
-    {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return;
-        if (root.is_empty())
-            return;
-        CharOffset line_offset{ };
-        Tree::line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
-        TreeWalker walker{ this, line_offset };
-        while (not walker.exhausted())
+        uint64_t prefix_hash(const BufferCollection* buffers, BufferIndex index, const PrefixHashes& prefix, size_t length)
         {
-            char c = walker.next();
-            if (c == '\n')
-                break;
-            buf->push_back(c);
+            constexpr auto stride = PrefixHashes::stride;
+            auto block = length / stride;
+            auto hash = rep(prefix.hashes[block]);
+            BufferPin pin;
+            for (char c : buffers->buffer_text(index, CharOffset{ block * stride }, Length{ length - block * stride }, &pin))
+            {
+                hash = hash_char(hash, c);
+            }
+            return hash;
         }
-    }
 
+        ContentHash piece_hash(const BufferCollection* buffers, const Piece& piece)
+        {
+            auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+            auto last = first + rep(piece.length);
+            auto& prefix = piece.index == BufferIndex::ModBuf ? buffers->mod_hashes
+                                                              : *buffers->orig_hashes[rep(piece.index)];
+            // hash(buf[first, last)) = hash(buf[0, last)) - hash(buf[0, first)) * base^(last - first)
+            auto head = mul_mod(prefix_hash(buffers, piece.index, prefix, first), hash_power(last - first));
+            return ContentHash{ add_mod(prefix_hash(buffers, piece.index, prefix, last), hash_modulus - head) };
+        }
+    } // namespace [anon]
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
     namespace
     {
-        template <typename TreeT>
-        [[nodiscard]] IncompleteCRLF trim_crlf(std::string* buf, TreeT* tree, CharOffset line_offset)
+        UTFCounts byte_utf_counts(char c)
+        {
+            auto b = uint8_t(c);
+            size_t starts = (b & 0xC0) != 0x80;
+            return { .code_points = starts, .utf16_units = starts + (b >= 0xF0) };
+        }
+
+        UTFCounts count_utf(std::string_view s)
         {
-            TreeWalker walker{ tree, line_offset };
-            auto prev_char = '\0';
-            while (not walker.exhausted())
+            constexpr uint64_t high_bits = 0x8080808080808080;
+            UTFCounts counts{ };
+            size_t i = 0;
+            // Eight bytes at a time: continuation bytes are '10xxxxxx' and 4-byte lead bytes are '11110xxx'.
+            for (; i + 8 <= s.size(); i += 8)
             {
-                char c = walker.next();
-                if (c == '\n')
+                uint64_t w;
+                std::memcpy(&w, s.data() + i, sizeof w);
+                auto continuations = w & ~(w << 1) & high_bits;
+                auto four_byte_leads = w & (w << 1) & (w << 2) & (w << 3) & high_bits;
+                size_t code_points = 8 - std::popcount(continuations);
+                counts.code_points += code_points;
+                counts.utf16_units += code_points + std::popcount(four_byte_leads);
+            }
+            for (; i < s.size(); ++i)
+            {
+                counts = counts + byte_utf_counts(s[i]);
+            }
+            return counts;
+        }
+
+        // 'buf' holds the buffer from offset 'buf_first' on, which is at most the first byte not yet counted.
+        void extend_prefix_utf_counts(PrefixUTFCounts* prefix, std::string_view buf, size_t buf_first)
+        {
+            constexpr auto stride = PrefixUTFCounts::stride;
+            static_assert(ChunkedText::alignment % stride == 0);
+            if (prefix->counts.empty())
+            {
+                prefix->counts.push_back({ });
+            }
+            while (prefix->counts.size() * stride <= buf_first + buf.size())
+            {
+                auto block = buf.substr((prefix->counts.size() - 1) * stride - buf_first, stride);
+                prefix->counts.push_back(prefix->counts.back() + count_utf(block));
+            }
+        }
+
+        const PrefixUTFCounts& buffer_utf_counts(const BufferCollection* buffers, BufferIndex index)
+        {
+            if (index == BufferIndex::ModBuf)
+                return buffers->mod_utf_counts;
+            return *buffers->orig_utf_counts[rep(index)];
+        }
+
+        UTFCounts prefix_utf_counts(const BufferCollection* buffers, BufferIndex index, size_t length)
+        {
+            constexpr auto stride = PrefixUTFCounts::stride;
+            auto block = length / stride;
+            BufferPin pin;
+            auto tail = buffers->buffer_text(index, CharOffset{ block * stride }, Length{ length - block * stride }, &pin);
+            return buffer_utf_counts(buffers, index).counts[block] + count_utf(tail);
+        }
+
+        UTFCounts piece_utf_counts(const BufferCollection* buffers, const Piece& piece)
+        {
+            auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+            return prefix_utf_counts(buffers, piece.index, first + rep(piece.length)) - prefix_utf_counts(buffers, piece.index, first);
+        }
+
+        // Finds the first byte in [first, last) of the buffer at which the running count of 'field' exceeds
+        // 'target'.  This is the lead byte of the code point holding unit 'target', which comes before the next
+        // prefix sample.
+        size_t find_utf_unit(const BufferCollection* buffers, BufferIndex index, size_t first, size_t last, size_t target, size_t UTFCounts::* field)
+        {
+            constexpr auto stride = PrefixUTFCounts::stride;
+            auto& prefix = buffer_utf_counts(buffers, index);
+            // Find the first sample past 'target'.
+            size_t low = 0;
+            size_t high = prefix.counts.size();
+            while (low < high)
+            {
+                auto mid = low + (high - low) / 2;
+                if (target < prefix.counts[mid].*field)
                 {
-                    if (prev_char == '\r')
-                    {
-                        buf->pop_back();
-                        return IncompleteCRLF::No;
-                    }
-                    return IncompleteCRLF::Yes;
+                    high = mid;
+                }
+                else
+                {
+                    low = mid + 1;
                 }
-                buf->push_back(c);
-                prev_char = c;
             }
-            // End of the buffer is not an incomplete CRLF.
-            return IncompleteCRLF::No;
+            auto p = std::max(first, (low - 1) * stride);
+            auto units = prefix_utf_counts(buffers, index, p).*field;
+            BufferPin pin;
+            for (char c : buffers->buffer_text(index, CharOffset{ p }, Length{ std::min(last, (p / stride + 1) * stride) - p }, &pin))
+            {
+                units += byte_utf_counts(c).*field;
+                if (units > target)
+                    return p;
+                ++p;
+            }
+            return last;
         }
     } // namespace [anon]
+#endif // TEXTBUF_UTF_COUNTS
 
-    IncompleteCRLF Tree::get_line_content_crlf(std::string* buf, Line line) const
+    namespace
     {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return IncompleteCRLF::No;
-        auto node = root;
-        if (node.is_empty())
-            return IncompleteCRLF::No;
-        // Trying this new logic for now.
-        CharOffset line_offset{ };
-        line_start<&Tree::accumulate_value>(&line_offset, &buffers, node, line);
-        return trim_crlf(buf, this, line_offset);
-    }
+        // Extends the data derived from the mod buffer over the text appended since.
+        void extend_mod_buffer_data(BufferCollection* buffers)
+        {
+            size_t first = 0;
+            auto txt = buffers->mod_buffer.buffer.last_chunk(&first);
+            populate_crlf_counts(&buffers->mod_crlf_counts, txt, first, buffers->mod_buffer.line_starts);
+#ifdef TEXTBUF_CONTENT_HASH
+            extend_prefix_hashes(&buffers->mod_hashes, txt, first);
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+            extend_prefix_utf_counts(&buffers->mod_utf_counts, txt, first);
+#endif // TEXTBUF_UTF_COUNTS
+        }
+    } // namespace [anon]
 
-    IncompleteCRLF OwningSnapshot::get_line_content_crlf(std::string* buf, Line line) const
+    std::string_view ChunkedText::text(size_t first, size_t count) const
     {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return IncompleteCRLF::No;
-        auto node = root;
-        if (node.is_empty())
-            return IncompleteCRLF::No;
-        // Trying this new logic for now.
-        CharOffset line_offset{ };
-        Tree::line_start<&Tree::accumulate_value>(&line_offset, &buffers, node, line);
-        return trim_crlf(buf, this, line_offset);
+        if (count == 0)
+            return { };
+        // Each chunk is larger than the ones before, so most text is in the last few.
+        auto chunk = chunk_count - 1;
+        while (storage->firsts[chunk] > first)
+        {
+            --chunk;
+        }
+        return { storage->chunks[chunk].get() + (first - storage->firsts[chunk]), count };
     }
 
-    IncompleteCRLF ReferenceSnapshot::get_line_content_crlf(std::string* buf, Line line) const
+    std::string_view ChunkedText::last_chunk(size_t* first) const
     {
-        // Reset the buffer.
-        buf->clear();
-        if (line == Line::IndexBeginning)
-            return IncompleteCRLF::No;
-        auto node = root;
-        if (node.is_empty())
-            return IncompleteCRLF::No;
-        // Trying this new logic for now.
-        CharOffset line_offset{ };
-        Tree::line_start<&Tree::accumulate_value>(&line_offset, buffers, node, line);
-        return trim_crlf(buf, this, line_offset);
+        *first = 0;
+        if (chunk_count == 0)
+            return { };
+        *first = storage->firsts[chunk_count - 1];
+        return { storage->chunks[chunk_count - 1].get(), length - *first };
     }
 
-    Line OwningSnapshot::line_at(CharOffset offset) const
+    bool ChunkedText::fits(size_t count) const
     {
-        if (is_empty())
-            return Line::Beginning;
-        auto result = Tree::node_at(&buffers, root, offset);
-        return result.line;
+        return chunk_count != 0 and length + count <= storage->firsts[chunk_count - 1] + storage->capacities[chunk_count - 1];
     }
 
-    Line ReferenceSnapshot::line_at(CharOffset offset) const
+    bool ChunkedText::extends(const ChunkedText& previous) const
     {
-        if (is_empty())
-            return Line::Beginning;
-        auto result = Tree::node_at(buffers, root, offset);
-        return result.line;
+        // Every byte of the shared chunks is written once, by the copy allowed to append at the time.
+        return previous.length == 0 or (storage == previous.storage and previous.length <= length);
     }
 
-    LineRange OwningSnapshot::get_line_range(Line line) const
+    void ChunkedText::append(std::string_view txt)
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        Tree::line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
-        return range;
+        if (txt.empty())
+            return;
+        if (length + txt.size() > reserved)
+        {
+            reserve(txt.size());
+        }
+        auto chunk = chunk_count - 1;
+        std::copy(txt.begin(), txt.end(), storage->chunks[chunk].get() + (length - storage->firsts[chunk]));
+        length += txt.size();
     }
 
-    LineRange ReferenceSnapshot::get_line_range(Line line) const
+    void ChunkedText::clear()
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
-        Tree::line_start<&Tree::accumulate_value_no_lf>(&range.last, buffers, root, extend(line));
-        return range;
+        storage = nullptr;
+        length = 0;
+        chunk_count = 0;
+        reserved = 0;
     }
 
-    LineRange OwningSnapshot::get_line_range_crlf(Line line) const
+    void ChunkedText::reserve(size_t count)
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        Tree::line_end_crlf(&range.last, &buffers, root, root, extend(line));
-        return range;
+        const bool room = fits(count);
+        // A new chunk repeats the text from the alignment boundary before the last byte.
+        const auto next_first = length == 0 ? 0 : (length - 1) / alignment * alignment;
+        const auto next_capacity = std::max({ first_chunk_length,
+                                              chunk_count == 0 ? 0 : 2 * storage->capacities[chunk_count - 1],
+                                              length - next_first + count });
+        const auto claim = room ? storage->firsts[chunk_count - 1] + storage->capacities[chunk_count - 1]
+                                : next_first + next_capacity;
+        auto expected = reserved;
+        if (storage == nullptr or not storage->claimed.compare_exchange_strong(expected, claim))
+        {
+            // Either there is no text yet or another copy appended past this one.  Either way the text moves to a
+            // chunk of its own.
+            auto own = std::make_shared<Storage>();
+            own->capacities[0] = std::max(first_chunk_length, 2 * (length + count));
+            own->chunks[0].reset(new char[own->capacities[0]]);
+            auto* out = own->chunks[0].get();
+            for_each_chunk([&](std::string_view chunk) {
+                out = std::copy(chunk.begin(), chunk.end(), out);
+            });
+            own->claimed = own->capacities[0];
+            reserved = own->capacities[0];
+            storage = std::move(own);
+            chunk_count = 1;
+            return;
+        }
+        if (not room)
+        {
+            assert(chunk_count < max_chunks);
+            auto& chunk = storage->chunks[chunk_count];
+            chunk.reset(new char[next_capacity]);
+            auto tail = text(next_first, length - next_first);
+            std::copy(tail.begin(), tail.end(), chunk.get());
+            storage->firsts[chunk_count] = next_first;
+            storage->capacities[chunk_count] = next_capacity;
+            ++chunk_count;
+        }
+        reserved = claim;
     }
 
-    LineRange ReferenceSnapshot::get_line_range_crlf(Line line) const
+    BufferPin BufferCollection::buffer_at(BufferIndex index) const
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
-        Tree::line_end_crlf(&range.last, buffers, root, root, extend(line));
-        return range;
+        assert(index != BufferIndex::ModBuf);
+#ifdef TEXTBUF_COLD_BUFFERS
+        if (orig_buffers[rep(index)] == nullptr)
+        {
+            auto size = orig_cold[rep(index)]->size;
+            if (size == 0)
+                return std::make_shared<CharBuffer>();
+            BufferPin pin;
+            buffer_text(index, CharOffset{ }, Length{ size }, &pin);
+            return pin;
+        }
+        return orig_buffers[rep(index)];
+#else
+        return orig_buffers[rep(index)].get();
+#endif // TEXTBUF_COLD_BUFFERS
     }
 
-    LineRange OwningSnapshot::get_line_range_with_newline(Line line) const
+    std::string_view BufferCollection::buffer_text(BufferIndex index, CharOffset first, Length count, BufferPin* pin) const
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        Tree::line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
-        return range;
+        // The mod buffer lives as long as the collection so its pin owns nothing.
+        if (index == BufferIndex::ModBuf)
+        {
+            *pin = { };
+            return mod_buffer.buffer.text(rep(first), rep(count));
+        }
+#ifdef TEXTBUF_COLD_BUFFERS
+        if (orig_buffers[rep(index)] == nullptr)
+        {
+            if (count == Length{ })
+                return { };
+            constexpr auto block_length = ColdBuffer::block_length;
+            auto& cold = *orig_cold[rep(index)];
+            auto offset = rep(first);
+            const auto last = offset + rep(count);
+            auto block = offset / block_length;
+            if (last <= (block + 1) * block_length)
+            {
+                *pin = cache.load(rep(index), cold, block);
+                return std::string_view{ (*pin)->buffer }.substr(offset - block * block_length, rep(count));
+            }
+            std::string text;
+            text.reserve(rep(count));
+            for (; offset < last; ++block)
+            {
+                auto loaded = cache.load(rep(index), cold, block);
+                auto block_last = std::min(last, (block + 1) * block_length);
+                text += std::string_view{ loaded->buffer }.substr(offset - block * block_length, block_last - offset);
+                offset = block_last;
+            }
+            *pin = std::make_shared<CharBuffer>(std::move(text), LineStarts{ });
+            return (*pin)->buffer;
+        }
+#endif // TEXTBUF_COLD_BUFFERS
+        *pin = buffer_at(index);
+        return std::string_view{ (*pin)->buffer }.substr(rep(first), rep(count));
     }
 
-    LineRange ReferenceSnapshot::get_line_range_with_newline(Line line) const
+    const LineStarts& BufferCollection::line_starts(BufferIndex index) const
     {
-        LineRange range{ };
-        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
-        Tree::line_start<&Tree::accumulate_value>(&range.last, buffers, root, extend(line));
-        return range;
+        if (index == BufferIndex::ModBuf)
+            return mod_buffer.line_starts;
+#ifdef TEXTBUF_COLD_BUFFERS
+        if (orig_buffers[rep(index)] == nullptr)
+            return orig_cold[rep(index)]->line_starts;
+#endif // TEXTBUF_COLD_BUFFERS
+        return orig_buffers[rep(index)]->line_starts;
     }
 
-    LFCount Tree::line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
+    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
     {
-        // If the end position is the beginning of a new line, then we can just return the difference in lines.
-        if (rep(end.column) == 0)
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        auto& starts = buffers->buffer_at(index)->line_starts;
-        // It means, there is no LF after end.
-        if (end.line == Line{ starts.size() - 1})
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        // Due to the check above, we know that there's at least one more line after 'end.line'.
-        auto next_start_offset = starts[rep(extend(end.line))];
-        auto end_offset = rep(starts[rep(end.line)]) + rep(end.column);
-        // There are more than 1 character after end, which means it can't be LF.
-        if (rep(next_start_offset) > end_offset + 1)
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        // This must be the case.  next_start_offset is a line down, so it is
-        // not possible for end_offset to be < it at this point.
-        assert(end_offset + 1 == rep(next_start_offset));
-        return LFCount{ rep(retract(end.line, rep(start.line))) };
+        auto& starts = line_starts(index);
+        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
     }
 
-    Piece Tree::build_piece(std::string_view txt)
+    namespace
     {
-        auto start_offset = buffers.mod_buffer.buffer.size();
-        populate_line_starts(&scratch_starts, txt);
-        auto start = last_insert;
-        // TODO: Handle CRLF (where the new buffer starts with LF and the end of our buffer ends with CR).
-        // Offset the new starts relative to the existing buffer.
-        for (auto& new_start : scratch_starts)
-        {
-            new_start = extend(new_start, start_offset);
-        }
-        // Append new starts.
-        // Note: we can drop the first start because the algorithm always adds an empty start.
-        auto new_starts_end = scratch_starts.size();
-        buffers.mod_buffer.line_starts.reserve(buffers.mod_buffer.line_starts.size() + new_starts_end);
-        for (size_t i = 1; i < new_starts_end; ++i)
+        char buffer_char(const BufferCollection* buffers, BufferIndex index, size_t offset)
         {
-            buffers.mod_buffer.line_starts.push_back(scratch_starts[i]);
+            BufferPin pin;
+            return buffers->buffer_text(index, CharOffset{ offset }, Length{ 1 }, &pin).front();
         }
-        auto old_size = buffers.mod_buffer.buffer.size();
-        buffers.mod_buffer.buffer.resize(buffers.mod_buffer.buffer.size() + txt.size());
-        auto insert_at = buffers.mod_buffer.buffer.data() + old_size;
-        std::copy(txt.data(), txt.data() + txt.size(), insert_at);
-
-        // Build the new piece for the inserted buffer.
-        auto end_offset = buffers.mod_buffer.buffer.size();
-        auto end_index = buffers.mod_buffer.line_starts.size() - 1;
-        auto end_col = end_offset - rep(buffers.mod_buffer.line_starts[end_index]);
-        BufferCursor end_pos = { .line = Line{ end_index }, .column = Column{ end_col } };
-        Piece piece = { .index = BufferIndex::ModBuf,
-                        .first = start,
-                        .last = end_pos,
-                        .length = Length{ end_offset - start_offset },
-                        .newline_count = line_feed_count(&buffers, BufferIndex::ModBuf, start, end_pos) };
-        // Update the last insertion.
-        last_insert = end_pos;
-        return piece;
-    }
+    } // namespace [anon]
 
-    NodePosition Tree::node_at(const BufferCollection* buffers, RedBlackTree node, CharOffset off)
+#ifdef TEXTBUF_COLD_BUFFERS
+    namespace
     {
-        size_t node_start_offset = 0;
-        size_t newline_count = 0;
-        while (not node.is_empty())
+        constexpr size_t min_match = 4;
+
+        void put_length(std::string* out, size_t length)
         {
-            if (rep(node.root().left_subtree_length) > rep(off))
+            while (length >= 255)
             {
-                node = node.left();
+                out->push_back(static_cast<char>(255));
+                length -= 255;
             }
-            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(off))
+            out->push_back(static_cast<char>(length));
+        }
+
+        // A byte oriented LZ77 in the spirit of LZ4.  Each sequence is a token holding the literal length in its
+        // high nibble and the match length (less 'min_match') in its low nibble, where 15 means that more length
+        // bytes follow, then the literals, then a 2 byte offset back into the output.  The last sequence has
+        // literals only.
+        std::string compress_text(std::string_view in)
+        {
+            constexpr size_t hash_bits = 14;
+            constexpr size_t max_offset = 65535;
+            std::string out;
+            // Holds position + 1 so that 0 means no candidate.
+            std::vector<size_t> table(size_t{ 1 } << hash_bits);
+            auto hash = [&](size_t i) {
+                uint32_t v;
+                std::memcpy(&v, in.data() + i, sizeof v);
+                return (v * 2654435761u) >> (32 - hash_bits);
+            };
+            auto emit = [&](size_t first, size_t last, size_t offset, size_t match) {
+                const auto literals = last - first;
+                const auto extra = match == 0 ? 0 : match - min_match;
+                out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15)));
+                if (literals >= 15)
+                {
+                    put_length(&out, literals - 15);
+                }
+                out.append(in.substr(first, literals));
+                if (match == 0)
+                    return;
+                out.push_back(static_cast<char>(offset & 0xFF));
+                out.push_back(static_cast<char>(offset >> 8));
+                if (extra >= 15)
+                {
+                    put_length(&out, extra - 15);
+                }
+            };
+
+            size_t anchor = 0;
+            size_t i = 0;
+            while (i + min_match <= in.size())
             {
-                node_start_offset += rep(node.root().left_subtree_length);
-                newline_count += rep(node.root().left_subtree_lf_count);
-                // Now we find the line within this piece.
-                auto remainder = Length{ rep(retract(off, rep(node.root().left_subtree_length))) };
-                auto pos = buffer_position(buffers, node.root().piece, remainder);
-                // Note: since buffer_position will return us a newline relative to the buffer itself, we need
-                // to retract it by the starting line of the piece to get the real difference.
-                newline_count += rep(retract(pos.line, rep(node.root().piece.first.line)));
-                return { .node = &node.root(),
-                            .remainder = remainder,
-                            .start_offset = CharOffset{ node_start_offset },
-                            .line = Line{ newline_count + 1 } };
+                auto& slot = table[hash(i)];
+                const auto candidate = slot;
+                slot = i + 1;
+                if (candidate != 0
+                    and i - (candidate - 1) <= max_offset
+                    and std::memcmp(in.data() + candidate - 1, in.data() + i, min_match) == 0)
+                {
+                    const auto from = candidate - 1;
+                    auto length = min_match;
+                    while (i + length < in.size() and in[from + length] == in[i + length])
+                    {
+                        ++length;
+                    }
+                    emit(anchor, i, i - from, length);
+                    i += length;
+                    anchor = i;
+                    continue;
+                }
+                ++i;
             }
-            else
+            emit(anchor, in.size(), 0, 0);
+            return out;
+        }
+
+        // Decompresses 'in' into exactly 'size' bytes at 'out'.  Returns false if 'in' is malformed: it ends
+        // within a sequence, a match reaches back before the start of the output, or it does not produce 'size'
+        // bytes.  Nothing is ever read or written out of bounds.
+        bool decompress_text(char* out, size_t size, std::string_view in)
+        {
+            size_t pos = 0;
+            size_t i = 0;
+            auto get_length = [&](size_t* length) {
+                if (*length != 15)
+                    return true;
+                uint8_t b;
+                do
+                {
+                    if (i == in.size())
+                        return false;
+                    b = static_cast<uint8_t>(in[i++]);
+                    *length += b;
+                } while (b == 255);
+                return true;
+            };
+            while (i < in.size())
             {
-                // If there are no more nodes to traverse to, return this final node.
-                if (node.right().is_empty())
+                const auto token = static_cast<uint8_t>(in[i++]);
+                size_t literals = token >> 4;
+                if (not get_length(&literals) or literals > in.size() - i or literals > size - pos)
+                    return false;
+                std::memcpy(out + pos, in.data() + i, literals);
+                pos += literals;
+                i += literals;
+                if (i == in.size())
+                    break;
+                if (in.size() - i < 2)
+                    return false;
+                const size_t offset = static_cast<uint8_t>(in[i]) | (static_cast<size_t>(static_cast<uint8_t>(in[i + 1])) << 8);
+                i += 2;
+                size_t length = token & 0xF;
+                if (not get_length(&length))
+                    return false;
+                length += min_match;
+                if (offset == 0 or offset > pos or length > size - pos)
+                    return false;
+                // The match may overlap the bytes it produces.
+                for (size_t k = 0; k < length; ++k)
                 {
-                    auto offset_amount = rep(node.root().left_subtree_length);
-                    node_start_offset += offset_amount;
-                    newline_count += rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
-                    // Now we find the line within this piece.
-                    auto remainder = node.root().piece.length;
-                    return { .node = &node.root(),
-                                .remainder = remainder,
-                                .start_offset = CharOffset{ node_start_offset },
-                                .line = Line{ newline_count + 1 } };
+                    out[pos + k] = out[pos - offset + k];
                 }
-                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
-                off = retract(off, offset_amount);
-                node_start_offset += offset_amount;
-                newline_count += rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
-                node = node.right();
+                pos += length;
             }
+            return pos == size;
         }
-        return { };
-    }
 
-    BufferCursor Tree::buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
-    {
-        auto& starts = buffers->buffer_at(piece.index)->line_starts;
-        auto start_offset = rep(starts[rep(piece.first.line)]) + rep(piece.first.column);
-        auto offset = start_offset + rep(remainder);
+        std::vector<std::string> compress_blocks(std::string_view text)
+        {
+            std::vector<std::string> blocks;
+            for (size_t first = 0; first < text.size(); first += ColdBuffer::block_length)
+            {
+                blocks.push_back(compress_text(text.substr(first, ColdBuffer::block_length)));
+            }
+            return blocks;
+        }
 
-        // Binary search for 'offset' between start and ending offset.
-        auto low = rep(piece.first.line);
-        auto high = rep(piece.last.line);
+        bool load_block(std::string* out, const ColdBuffer& cold, size_t block)
+        {
+            const auto first = block * ColdBuffer::block_length;
+            out->assign(std::min(ColdBuffer::block_length, cold.size - first), '\0');
+            if (cold.file != nullptr)
+                return cold.file->read(out->data(), out->size(), cold.file_offset + first);
+            return block < cold.blocks.size() and decompress_text(out->data(), out->size(), cold.blocks[block]);
+        }
 
-        size_t mid = 0;
-        size_t mid_start = 0;
-        size_t mid_stop = 0;
+        // The text between a prefix sample and the offset it is taken for never straddles two blocks.
+#ifdef TEXTBUF_CONTENT_HASH
+        static_assert(ColdBuffer::block_length % PrefixHashes::stride == 0);
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        static_assert(ColdBuffer::block_length % PrefixUTFCounts::stride == 0);
+#endif // TEXTBUF_UTF_COUNTS
+    } // namespace [anon]
 
-        while (low <= high)
-        {
-            mid = low + ((high - low) / 2);
-            mid_start = rep(starts[mid]);
+    BufferCache::BufferCache(const BufferCache& other)
+    {
+        *this = other;
+    }
 
-            if (mid == high)
-                break;
-            mid_stop = rep(starts[mid + 1]);
+    BufferCache& BufferCache::operator=(const BufferCache& other)
+    {
+        if (this == &other)
+            return *this;
+        std::scoped_lock guard{ lock, other.lock };
+        recency = other.recency;
+        entries.clear();
+        for (auto entry = recency.begin(); entry != recency.end(); ++entry)
+        {
+            entries[{ entry->index, entry->block }] = entry;
+        }
+        resident = other.resident;
+        faults = other.faults;
+        errors = other.errors;
+        max_bytes = other.max_bytes;
+        return *this;
+    }
 
-            if (offset < mid_start)
-            {
-                high = mid - 1;
-            }
-            else if (offset >= mid_stop)
-            {
-                low = mid + 1;
-            }
-            else
-            {
-                break;
-            }
+    BufferReference BufferCache::load(size_t index, const ColdBuffer& cold, size_t block) const
+    {
+        std::lock_guard guard{ lock };
+        auto found = entries.find({ index, block });
+        if (found != entries.end())
+        {
+            recency.splice(recency.begin(), recency, found->second);
+            return found->second->text;
         }
+        ++faults;
+        std::string text;
+        if (not load_block(&text, cold, block))
+        {
+            ++errors;
+            std::fill(text.begin(), text.end(), '\0');
+        }
+        auto loaded = std::make_shared<CharBuffer>(std::move(text), LineStarts{ });
+        insert(recency.begin(), { .index = index, .block = block, .text = loaded });
+        // Note: the caller's reference outlives the entry if this block alone exceeds the budget.
+        evict_over_budget();
+        return loaded;
+    }
 
-        return { .line = Line{ mid },
-                    .column = Column{ offset - mid_start } };
+    void BufferCache::insert(Recency::iterator position, Entry entry) const
+    {
+        auto key = std::pair{ entry.index, entry.block };
+        if (auto found = entries.find(key); found != entries.end())
+        {
+            evict(found->second);
+        }
+        resident += entry.text->buffer.size();
+        entries[key] = recency.insert(position, std::move(entry));
     }
 
-    Piece Tree::trim_piece_right(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    void BufferCache::evict(Recency::iterator entry) const
     {
-        auto orig_end_offset = buffers->buffer_offset(piece.index, piece.last);
+        resident -= entry->text->buffer.size();
+        entries.erase({ entry->index, entry->block });
+        recency.erase(entry);
+    }
 
-        auto new_end_offset = buffers->buffer_offset(piece.index, pos);
-        auto new_lf_count = line_feed_count(buffers, piece.index, piece.first, pos);
-
-        auto len_delta = distance(new_end_offset, orig_end_offset);
-        auto new_len = retract(piece.length, rep(len_delta));
-
-        auto new_piece = piece;
-        new_piece.last = pos;
-        new_piece.newline_count = new_lf_count;
-        new_piece.length = new_len;
-
-        return new_piece;
+    void BufferCache::evict_over_budget() const
+    {
+        while (max_bytes != 0 and resident > max_bytes)
+        {
+            evict(std::prev(recency.end()));
+        }
     }
 
-    Piece Tree::trim_piece_left(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    void BufferCache::adopt(size_t index, const CharBuffer& buffer)
     {
-        auto orig_start_offset = buffers->buffer_offset(piece.index, piece.first);
-
-        auto new_start_offset = buffers->buffer_offset(piece.index, pos);
-        auto new_lf_count = line_feed_count(buffers, piece.index, pos, piece.last);
-
-        auto len_delta = distance(orig_start_offset, new_start_offset);
-        auto new_len = retract(piece.length, rep(len_delta));
+        constexpr auto block_length = ColdBuffer::block_length;
+        std::lock_guard guard{ lock };
+        for (size_t first = 0, block = 0; first < buffer.buffer.size(); first += block_length, ++block)
+        {
+            auto text = std::make_shared<CharBuffer>(buffer.buffer.substr(first, block_length), LineStarts{ });
+            insert(recency.end(), { .index = index, .block = block, .text = std::move(text) });
+        }
+        evict_over_budget();
+    }
 
-        auto new_piece = piece;
-        new_piece.first = pos;
-        new_piece.newline_count = new_lf_count;
-        new_piece.length = new_len;
+    void BufferCache::trim(size_t keep)
+    {
+        std::lock_guard guard{ lock };
+        std::vector<size_t> kept;
+        for (auto entry = recency.begin(); entry != recency.end();)
+        {
+            auto next = std::next(entry);
+            if (std::find(kept.begin(), kept.end(), entry->index) == kept.end())
+            {
+                if (kept.size() < keep)
+                {
+                    kept.push_back(entry->index);
+                }
+                else
+                {
+                    evict(entry);
+                }
+            }
+            entry = next;
+        }
+    }
 
-        return new_piece;
+    void BufferCache::budget(size_t bytes)
+    {
+        std::lock_guard guard{ lock };
+        max_bytes = bytes;
+        evict_over_budget();
     }
 
-    Tree::ShrinkResult Tree::shrink_piece(const BufferCollection* buffers, const Piece& piece, const BufferCursor& first, const BufferCursor& last)
+    size_t BufferCache::resident_bytes() const
     {
-        auto left = trim_piece_right(buffers, piece, first);
-        auto right = trim_piece_left(buffers, piece, last);
+        std::lock_guard guard{ lock };
+        return resident;
+    }
 
-        return { .left = left, .right = right };
+    size_t BufferCache::page_faults() const
+    {
+        std::lock_guard guard{ lock };
+        return faults;
     }
 
-    void Tree::combine_pieces(NodePosition existing, Piece new_piece)
+    size_t BufferCache::read_errors() const
     {
-        // This transformation is only valid under the following conditions.
-        assert(existing.node->piece.index == BufferIndex::ModBuf);
-        // This assumes that the piece was just built.
-        assert(existing.node->piece.last == new_piece.first);
-        auto old_piece = existing.node->piece;
-        new_piece.first = old_piece.first;
-        new_piece.newline_count = new_piece.newline_count + old_piece.newline_count;
-        new_piece.length = new_piece.length + old_piece.length;
-        root = root.remove(existing.start_offset)
-                    .insert({ new_piece }, existing.start_offset);
+        std::lock_guard guard{ lock };
+        return errors;
     }
 
-    void Tree::remove_node_range(NodePosition first, Length length)
+    namespace
     {
-        // Remove pieces until we reach the desired length.
-        Length deleted_len{};
-        // Because we could be deleting content in the range starting at 'first' where the piece
-        // length could be much larger than 'length', we need to adjust 'length' to contain the
-        // delta in length within the piece to the end where 'length' starts:
-        // "abcd"  "efg"
-        //     ^     ^
-        //     |_____|
-        //      length to delete = 3
-        // P1 length: 4
-        // P2 length: 3 (though this length does not matter)
-        // We're going to remove all of 'P1' and 'P2' in this range and the caller will re-insert
-        // these pieces with the correct lengths.  If we fail to adjust 'length' we will delete P1
-        // and believe that the entire range was deleted.
-        assert(first.node != nullptr);
-        auto total_length = first.node->piece.length;
-        // (total - remainder) is the section of 'length' where 'first' intersects.
-        length = length - (total_length - first.remainder) + total_length;
-        auto delete_at_offset = first.start_offset;
-        while (deleted_len < length and first.node != nullptr)
+        // On Windows the caller holds the file's lock exclusively since the CRT has no positioned I/O.
+        bool read_at(int fd, char* out, size_t count, size_t offset)
         {
-            deleted_len = deleted_len + first.node->piece.length;
-            root = root.remove(delete_at_offset);
-            first = node_at(&buffers, root, delete_at_offset);
+#ifdef _WIN32
+            if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+                return false;
+#endif // _WIN32
+            while (count != 0)
+            {
+#ifdef _WIN32
+                auto n = _read(fd, out, static_cast<unsigned>(std::min<size_t>(count, INT_MAX)));
+#else
+                auto n = ::pread(fd, out, count, static_cast<off_t>(offset));
+#endif // _WIN32
+                if (n < 0 and errno == EINTR)
+                    continue;
+                // Reading short of the end means the file changed underneath us.
+                if (n <= 0)
+                    return false;
+                out += n;
+                count -= n;
+                offset += n;
+            }
+            return true;
         }
-    }
 
-    void Tree::insert(CharOffset offset, std::string_view txt, SuppressHistory suppress_history)
-    {
-        if (txt.empty())
-            return;
-        // This allows us to undo blocks of code.
-        if (is_no(suppress_history)
-            and (end_last_insert != offset or root.is_empty()))
+        int file_descriptor(std::FILE* file)
         {
-            append_undo(root, offset);
+#ifdef _WIN32
+            return _fileno(file);
+#else
+            return ::fileno(file);
+#endif // _WIN32
         }
-        internal_insert(offset, txt);
-    }
 
-    void Tree::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
-    {
-        // Rule out the obvious noop.
-        if (rep(count) == 0 or root.is_empty())
-            return;
-        if (is_no(suppress_history))
+        bool write_at(int fd, const char* in, size_t count, size_t offset)
         {
-            append_undo(root, offset);
+#ifdef _WIN32
+            if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+                return false;
+#endif // _WIN32
+            while (count != 0)
+            {
+#ifdef _WIN32
+                auto n = _write(fd, in, static_cast<unsigned>(std::min<size_t>(count, INT_MAX)));
+#else
+                auto n = ::pwrite(fd, in, count, static_cast<off_t>(offset));
+#endif // _WIN32
+                if (n < 0 and errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return false;
+                in += n;
+                count -= n;
+                offset += n;
+            }
+            return true;
         }
-        internal_remove(offset, count);
+    } // namespace [anon]
+
+    BackingFile::BackingFile(int fd):
+        fd{ fd }
+    {
+#ifdef _WIN32
+        auto size = _filelengthi64(fd);
+        length = size < 0 ? 0 : static_cast<size_t>(size);
+#else
+        struct stat st;
+        length = ::fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+#endif // _WIN32
     }
 
-    void Tree::compute_buffer_meta()
+    BackingFile::~BackingFile()
     {
-        ::PieceTree::compute_buffer_meta(&meta, root);
+        if (spill != nullptr)
+        {
+            std::fclose(spill);
+        }
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif // _WIN32
     }
 
-    void Tree::append_undo(const RedBlackTree& old_root, CharOffset op_offset)
+    bool BackingFile::read(char* out, size_t count, size_t offset) const
     {
-        // Can't redo if we're creating a new undo entry.
-        if (not redo_stack.empty())
+#ifdef _WIN32
+        std::lock_guard guard{ lock };
+#else
+        std::shared_lock guard{ lock };
+#endif // _WIN32
+        while (count != 0)
         {
-            redo_stack.clear();
+            // The first range preserved after 'offset' and the one which may hold it.
+            auto next = preserved.upper_bound(offset);
+            if (next != preserved.begin())
+            {
+                auto& [first, range] = *std::prev(next);
+                if (offset < first + range.length)
+                {
+                    auto n = std::min(count, first + range.length - offset);
+                    if (not read_at(file_descriptor(spill), out, n, range.spill_offset + (offset - first)))
+                        return false;
+                    out += n;
+                    count -= n;
+                    offset += n;
+                    continue;
+                }
+            }
+            auto n = next == preserved.end() ? count : std::min(count, next->first - offset);
+            if (not read_at(fd, out, n, offset))
+                return false;
+            out += n;
+            count -= n;
+            offset += n;
         }
-        undo_stack.push_front({ .root = old_root, .op_offset = op_offset });
+        return true;
     }
 
-    UndoRedoResult Tree::try_undo(CharOffset op_offset)
+    bool BackingFile::may_alias(int other) const
     {
-        if (undo_stack.empty())
-            return { .success = false, .op_offset = CharOffset{ } };
-        redo_stack.push_front({ .root = root, .op_offset = op_offset });
-        auto [node, undo_offset] = undo_stack.front();
-        root = node;
-        undo_stack.pop_front();
-        compute_buffer_meta();
-        return { .success = true, .op_offset = undo_offset };
+#ifdef _WIN32
+        (void)other;
+        return true;
+#else
+        struct stat mine;
+        struct stat theirs;
+        if (::fstat(fd, &mine) != 0 or ::fstat(other, &theirs) != 0)
+            return true;
+        return mine.st_dev == theirs.st_dev and mine.st_ino == theirs.st_ino;
+#endif // _WIN32
     }
 
-    UndoRedoResult Tree::try_redo(CharOffset op_offset)
+    bool BackingFile::preserve(size_t offset, size_t count) const
     {
-        if (redo_stack.empty())
-            return { .success = false, .op_offset = CharOffset{ } };
-        undo_stack.push_front({ .root = root, .op_offset = op_offset });
-        auto [node, redo_offset] = redo_stack.front();
-        root = node;
-        redo_stack.pop_front();
-        compute_buffer_meta();
-        return { .success = true, .op_offset = redo_offset };
+        std::lock_guard guard{ lock };
+        const auto last = std::min(length, offset + count);
+        std::string chunk;
+        while (offset < last)
+        {
+            auto next = preserved.upper_bound(offset);
+            if (next != preserved.begin())
+            {
+                auto& [first, range] = *std::prev(next);
+                if (offset < first + range.length)
+                {
+                    offset = first + range.length;
+                    continue;
+                }
+            }
+            if (spill == nullptr)
+            {
+                spill = std::tmpfile();
+                if (spill == nullptr)
+                    return false;
+            }
+            constexpr size_t max_chunk = 1 << 20;
+            auto n = std::min({ last - offset, max_chunk, next == preserved.end() ? last - offset : next->first - offset });
+            chunk.resize(n);
+            if (not read_at(fd, chunk.data(), n, offset) or not write_at(file_descriptor(spill), chunk.data(), n, spill_length))
+                return false;
+            preserved[offset] = { .length = n, .spill_offset = spill_length };
+            spill_length += n;
+            offset += n;
+        }
+        return true;
     }
+#endif // TEXTBUF_COLD_BUFFERS
 
-    // Direct history manipulation.
-    void Tree::commit_head(CharOffset offset)
+    Tree::Tree():
+        buffers{ }
     {
-        append_undo(root, offset);
+        build_tree();
     }
 
-    RedBlackTree Tree::head() const
+    Tree::Tree(Buffers&& buffers):
+        buffers{ std::move(buffers) }
     {
-        return root;
+        build_tree();
     }
 
-    void Tree::snap_to(const RedBlackTree& new_root)
+    void Tree::build_tree()
     {
-        root = new_root;
+        buffers.mod_buffer.line_starts.clear();
+        buffers.mod_buffer.buffer.clear();
+        buffers.mod_crlf_counts.clear();
+#ifdef TEXTBUF_CONTENT_HASH
+        buffers.mod_hashes.hashes.clear();
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        buffers.mod_utf_counts.counts.clear();
+#endif // TEXTBUF_UTF_COUNTS
+        populate_orig_buffer_data();
+        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
+        buffers.mod_buffer.line_starts.push_back({});
+        extend_mod_buffer_data(&buffers);
+        last_insert = { };
+
+        const auto buf_count = buffers.orig_buffers.size();
+        CharOffset offset = { };
+        for (size_t i = 0; i < buf_count; ++i)
+        {
+            const auto buf = buffers.buffer_at(BufferIndex{ i });
+            const auto& starts = buffers.line_starts(BufferIndex{ i });
+            assert(not starts.empty());
+            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
+            if (buf->buffer.empty())
+                continue;
+            auto last_line = Line{ starts.size() - 1 };
+            // Create a new node that spans this buffer and retains an index to it.
+            // Insert the node into the balanced tree.
+            Piece piece {
+                .index = BufferIndex{ i },
+                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
+                .last = { .line = last_line, .column = Column{ buf->buffer.size() - rep(starts[rep(last_line)]) } },
+                .length = Length{ buf->buffer.size() },
+                // Note: the number of newlines
+                .newline_count = LFCount{ rep(last_line) }
+            };
+            root = root.insert(node_data(piece), offset);
+            offset = offset + piece.length;
+        }
+
         compute_buffer_meta();
+        reset_history();
     }
 
-#ifdef TEXTBUF_DEBUG
-    void print_piece(const Piece& piece, const Tree* tree, int level)
+    void Tree::populate_orig_buffer_data(size_t first)
     {
-        const char* levels = "|||||||||||||||||||||||||||||||";
-        printf("%.*sidx{%zd}, first{l{%zd}, c{%zd}}, last{l{%zd}, c{%zd}}, len{%zd}, lf{%zd}\n",
-                level, levels,
-                rep(piece.index), rep(piece.first.line), rep(piece.first.column),
-                                  rep(piece.last.line), rep(piece.last.column),
-                    rep(piece.length), rep(piece.newline_count));
-        auto* buffer = tree->buffers.buffer_at(piece.index);
-        auto offset = tree->buffers.buffer_offset(piece.index, piece.first);
-        printf("%.*sPiece content: %.*s\n", level, levels, static_cast<int>(piece.length), buffer->buffer.data() + rep(offset));
+        const auto buf_count = buffers.orig_buffers.size();
+        buffers.orig_crlf_counts.resize(buf_count);
+        for (size_t i = first; i < buf_count; ++i)
+        {
+            if (buffers.orig_crlf_counts[i] == nullptr)
+            {
+                auto counts = std::make_shared<CRLFCounts>();
+                populate_crlf_counts(counts.get(), buffers.buffer_at(BufferIndex{ i })->buffer, 0, buffers.line_starts(BufferIndex{ i }));
+                buffers.orig_crlf_counts[i] = std::move(counts);
+            }
+        }
+#ifdef TEXTBUF_CONTENT_HASH
+        buffers.orig_hashes.resize(buf_count);
+        for (size_t i = first; i < buf_count; ++i)
+        {
+            if (buffers.orig_hashes[i] == nullptr)
+            {
+                auto prefix = std::make_shared<PrefixHashes>();
+                extend_prefix_hashes(prefix.get(), buffers.buffer_at(BufferIndex{ i })->buffer, 0);
+                buffers.orig_hashes[i] = std::move(prefix);
+            }
+        }
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        buffers.orig_utf_counts.resize(buf_count);
+        for (size_t i = first; i < buf_count; ++i)
+        {
+            if (buffers.orig_utf_counts[i] == nullptr)
+            {
+                auto prefix = std::make_shared<PrefixUTFCounts>();
+                extend_prefix_utf_counts(prefix.get(), buffers.buffer_at(BufferIndex{ i })->buffer, 0);
+                buffers.orig_utf_counts[i] = std::move(prefix);
+            }
+        }
+#endif // TEXTBUF_UTF_COUNTS
+        // Keep the search index complete once it has been requested.
+        if (not buffers.orig_indexes.empty())
+        {
+            build_search_index();
+        }
     }
-#endif // TEXTBUF_DEBUG
 
-    void TreeBuilder::accept(std::string_view txt)
+    Piece Tree::append_orig_buffer(CharBuffer&& buf)
     {
-        populate_line_starts(&scratch_starts, txt);
-        buffers.push_back(std::make_shared<CharBuffer>(std::string{ txt }, scratch_starts));
+        assert(not buf.line_starts.empty());
+        auto last_line = Line{ buf.line_starts.size() - 1 };
+        Piece piece {
+            .index = BufferIndex{ buffers.orig_buffers.size() },
+            .first = { .line = Line{ 0 }, .column = Column{ 0 } },
+            .last = { .line = last_line, .column = Column{ buf.buffer.size() - rep(buf.line_starts[rep(last_line)]) } },
+            .length = Length{ buf.buffer.size() },
+            .newline_count = LFCount{ rep(last_line) }
+        };
+        buffers.orig_buffers.push_back(std::make_shared<CharBuffer>(std::move(buf)));
+        populate_orig_buffer_data(rep(piece.index));
+        return piece;
     }
 
-    OwningSnapshot::OwningSnapshot(const Tree* tree):
-        root{ tree->root },
-        meta{ tree->meta },
-        buffers{ tree->buffers } { }
-
-    OwningSnapshot::OwningSnapshot(const Tree* tree, const RedBlackTree& dt):
-        root{ tree->root },
-        meta{ tree->meta },
-        buffers{ tree->buffers }
+    void Tree::append_loaded(CharBuffer&& buf)
     {
-        // Compute the buffer meta for 'dt'.
-        compute_buffer_meta(&meta, dt);
+        if (buf.buffer.empty())
+            return;
+        auto data = node_data(append_orig_buffer(std::move(buf)));
+        if (load_point == CharOffset::Sentinel)
+        {
+            load_point = CharOffset{ } + meta.total_content_length;
+        }
+        root = root.insert(data, load_point);
+        auto at = load_point;
+        text_inserted(at, data.piece.length);
+        load_point = at + data.piece.length;
+        // Loaded text is not an edit, so every state in the history gains it as well.  The other states catch up
+        // when they are entered, so a chunk costs the same however long the history is.
+        loaded_chunks.push_back(data);
+        compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+        satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
     }
 
-    ReferenceSnapshot::ReferenceSnapshot(const Tree* tree):
-        root{ tree->root },
-        meta{ tree->meta },
-        buffers{ &tree->buffers } { }
-
-    ReferenceSnapshot::ReferenceSnapshot(const Tree* tree, const RedBlackTree& dt):
-        root{ dt },
-        meta{ tree->meta },
-        buffers{ &tree->buffers }
+    void Tree::catch_up_loaded(UndoRedoEntry* entry)
     {
-        // Compute the buffer meta for 'dt'.
-        compute_buffer_meta(&meta, dt);
+        if (load_point == CharOffset::Sentinel)
+            return;
+        auto point = entry->load_point == CharOffset::Sentinel ? CharOffset{ } + tree_length(entry->root)
+                                                                : entry->load_point;
+        if (entry->loaded_chunks < loaded_chunks.size())
+        {
+            auto caught_up = entry->root;
+            for (auto i = entry->loaded_chunks; i < loaded_chunks.size(); ++i)
+            {
+                caught_up = caught_up.insert(loaded_chunks[i], point);
+                point = point + loaded_chunks[i].piece.length;
+            }
+            retire(std::move(entry->root));
+            entry->root = std::move(caught_up);
+            entry->loaded_chunks = loaded_chunks.size();
+        }
+        entry->load_point = point;
+        load_point = point;
     }
 
-    TreeWalker::TreeWalker(const Tree* tree, CharOffset offset):
-        buffers{ &tree->buffers },
-        root{ tree->root },
-        meta{ tree->meta },
-        stack{ { root } },
-        total_offset{ offset }
+    void Tree::text_inserted(CharOffset offset, Length length)
     {
-        fast_forward_to(offset);
+        // Text inserted at the load point stays after the rest of the file.
+        if (load_point != CharOffset::Sentinel and offset < load_point)
+        {
+            load_point = load_point + length;
+        }
+        for (auto* markers : marker_trees)
+        {
+            markers->inserted(offset, length);
+        }
+        for (auto* decorations : decoration_trees)
+        {
+            decorations->inserted(offset, length);
+        }
     }
 
-    TreeWalker::TreeWalker(const OwningSnapshot* snap, CharOffset offset):
-        buffers{ &snap->buffers },
-        root{ snap->root },
-        meta{ snap->meta },
-        stack{ { root } },
-        total_offset{ offset }
+    void Tree::text_removed(CharOffset offset, Length length)
     {
-        fast_forward_to(offset);
+        if (load_point != CharOffset::Sentinel and offset < load_point)
+        {
+            load_point = CharOffset{ rep(load_point) - std::min(rep(length), rep(distance(offset, load_point))) };
+        }
+        for (auto* markers : marker_trees)
+        {
+            markers->removed(offset, length);
+        }
+        for (auto* decorations : decoration_trees)
+        {
+            decorations->removed(offset, length);
+        }
+    }
+
+#ifdef TEXTBUF_COLD_BUFFERS
+    void Tree::compress_cold_buffers(size_t resident)
+    {
+        const auto buf_count = buffers.orig_buffers.size();
+        buffers.orig_cold.resize(buf_count);
+        for (size_t i = 0; i < buf_count; ++i)
+        {
+            auto& buf = buffers.orig_buffers[i];
+            if (buf == nullptr)
+                continue;
+            if (buffers.orig_cold[i] == nullptr)
+            {
+                buffers.orig_cold[i] = std::make_shared<ColdBuffer>(compress_blocks(buf->buffer), nullptr, 0, buf->buffer.size(), buf->line_starts);
+            }
+            // The decompressed buffer remains available through the cache until it ages out.
+            buffers.cache.adopt(i, *buf);
+            buf = nullptr;
+        }
+        buffers.cache.trim(resident);
+    }
+
+    int Tree::load_paged(const std::filesystem::path& path, Length block_size)
+    {
+        buffers = { };
+        root = RedBlackTree{ };
+        load_point = CharOffset::Sentinel;
+        build_tree();
+        // Nothing carries over from the old content: the next insertion must not extend one made before, and
+        // attached markers and decorations pointed into the old text.
+        end_last_insert = CharOffset::Sentinel;
+        loaded_chunks.clear();
+        for (auto* markers : marker_trees)
+        {
+            markers->clear();
+        }
+        for (auto* decorations : decoration_trees)
+        {
+            decorations->clear();
+        }
+#ifdef _WIN32
+        auto fd = _open(path.string().c_str(), _O_RDONLY | _O_BINARY);
+#else
+        auto fd = ::open(path.c_str(), O_RDONLY);
+#endif // _WIN32
+        if (fd < 0)
+            return errno;
+        auto file = std::make_shared<BackingFile>(fd);
+        size_t file_offset = 0;
+        std::string block(rep(block_size), '\0');
+        while (true)
+        {
+#ifdef _WIN32
+            auto n = _read(fd, block.data(), static_cast<unsigned>(block.size()));
+#else
+            auto n = ::read(fd, block.data(), block.size());
+#endif // _WIN32
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                auto err = errno;
+                buffers = { };
+                root = RedBlackTree{ };
+                build_tree();
+                return err;
+            }
+            if (n == 0)
+                break;
+            std::string_view txt{ block.data(), static_cast<size_t>(n) };
+            populate_line_starts(&scratch_starts, txt);
+            // The derived per-buffer data is computed while the text is at hand, then the text is dropped.
+            auto piece = append_orig_buffer({ .buffer = std::string{ txt }, .line_starts = scratch_starts });
+            root = root.insert(node_data(piece), CharOffset{ file_offset });
+            buffers.orig_cold.resize(buffers.orig_buffers.size());
+            buffers.orig_cold[rep(piece.index)] = std::make_shared<ColdBuffer>(std::vector<std::string>{ }, file, file_offset, txt.size(), scratch_starts);
+            buffers.orig_buffers[rep(piece.index)] = nullptr;
+            file_offset += txt.size();
+        }
+        compute_buffer_meta();
+        reset_history();
+        return 0;
+    }
+
+    void Tree::cold_buffer_budget(size_t bytes)
+    {
+        buffers.cache.budget(bytes);
+    }
+
+    BufferFootprint Tree::buffer_footprint() const
+    {
+        BufferFootprint footprint{
+            .resident_bytes = buffers.cache.resident_bytes(),
+            .compressed_bytes = 0,
+            .page_faults = buffers.cache.page_faults(),
+            .read_errors = buffers.cache.read_errors()
+        };
+        for (auto& buf : buffers.orig_buffers)
+        {
+            if (buf != nullptr)
+            {
+                footprint.resident_bytes += buf->buffer.size();
+            }
+        }
+        for (auto& cold : buffers.orig_cold)
+        {
+            if (cold != nullptr)
+            {
+                for (auto& block : cold->blocks)
+                {
+                    footprint.compressed_bytes += block.size();
+                }
+            }
+        }
+        return footprint;
+    }
+#endif // TEXTBUF_COLD_BUFFERS
+
+    void Tree::internal_insert(CharOffset offset, std::string_view txt)
+    {
+        assert(not txt.empty());
+        end_last_insert = extend(offset, txt.size());
+        ScopeGuard guard{ [&] {
+            compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+            satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+        } };
+        if (root.is_empty())
+        {
+            auto piece = build_piece(txt);
+            root = root.insert(node_data(piece), CharOffset{ 0 });
+            return;
+        }
+
+        auto result = node_at(&buffers, root, offset);
+        // If the offset is beyond the buffer, just select the last node.
+        if (result.node == nullptr)
+        {
+            auto off = CharOffset{ 0 };
+            if (meta.total_content_length != Length{})
+            {
+                off = off + retract(meta.total_content_length);
+            }
+            result = node_at(&buffers, root, off);
+        }
+
+        // There are 3 cases:
+        // 1. We are inserting at the beginning of an existing node.
+        // 2. We are inserting at the end of an existing node.
+        // 3. We are inserting in the middle of the node.
+        auto [node, remainder, node_start_offset, line] = result;
+        assert(node != nullptr);
+        auto insert_pos = buffer_position(&buffers, node->piece, remainder);
+        // Case #1.
+        if (node_start_offset == offset)
+        {
+            // There's a bonus case here.  If our last insertion point was the same as this piece's
+            // last, it inserted into the mod buffer and the new text goes in the same chunk of it, then
+            // we can simply 'extend' this piece by the following process:
+            // 1. Fetch the previous node (if we can) and compare.
+            // 2. Build the new piece.
+            // 3. Remove the old piece.
+            // 4. Extend the old piece's length to the length of the newly created piece.
+            // 5. Re-insert the new piece.
+            if (offset != CharOffset{})
+            {
+                auto prev_node_result = node_at(&buffers, root, retract(offset));
+                if (prev_node_result.node->piece.index == BufferIndex::ModBuf
+                    and prev_node_result.node->piece.last == last_insert
+                    and buffers.mod_buffer.buffer.fits(txt.size()))
+                {
+                    auto new_piece = build_piece(txt);
+                    combine_pieces(prev_node_result, new_piece);
+                    return;
+                }
+            }
+            auto piece = build_piece(txt);
+            root = root.insert(node_data(piece), offset);
+            return;
+        }
+
+        const bool inside_node = offset < node_start_offset + node->piece.length;
+
+        // Case #2.
+        if (not inside_node)
+        {
+            // There's a bonus case here.  If our last insertion point was the same as this piece's
+            // last, it inserted into the mod buffer and the new text goes in the same chunk of it, then
+            // we can simply 'extend' this piece by the following process:
+            // 1. Build the new piece.
+            // 2. Remove the old piece.
+            // 3. Extend the old piece's length to the length of the newly created piece.
+            // 4. Re-insert the new piece.
+            if (node->piece.index == BufferIndex::ModBuf and node->piece.last == last_insert
+                and buffers.mod_buffer.buffer.fits(txt.size()))
+            {
+                auto new_piece = build_piece(txt);
+                combine_pieces(result, new_piece);
+                return;
+            }
+            // Insert the new piece at the end.
+            auto piece = build_piece(txt);
+            root = root.insert(node_data(piece), offset);
+            return;
+        }
+
+        // Case #3.
+        // The basic approach here is to split the existing node into two pieces
+        // and insert the new piece in between them.
+        auto new_len_right = distance(buffers.buffer_offset(node->piece.index, insert_pos),
+                                        buffers.buffer_offset(node->piece.index, node->piece.last));
+        auto new_piece_right = node->piece;
+        new_piece_right.first = insert_pos;
+        new_piece_right.length = new_len_right;
+        new_piece_right.newline_count = line_feed_count(&buffers, node->piece.index, insert_pos, node->piece.last);
+
+        // Remove the original node tail.
+        auto new_piece_left = trim_piece_right(&buffers, node->piece, insert_pos);
+
+        auto new_piece = build_piece(txt);
+
+        // Remove the original node.
+        root = root.remove(node_start_offset);
+
+        // Insert the left.
+        root = root.insert(node_data(new_piece_left), node_start_offset);
+
+        // Insert the new mid.
+        node_start_offset = node_start_offset + new_piece_left.length;
+        root = root.insert(node_data(new_piece), node_start_offset);
+
+        // Insert remainder.
+        node_start_offset = node_start_offset + new_piece.length;
+        root = root.insert(node_data(new_piece_right), node_start_offset);
+    }
+
+    void Tree::internal_remove(CharOffset offset, Length count)
+    {
+        assert(rep(count) != 0 and not root.is_empty());
+        ScopeGuard guard{ [&] {
+            compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+            satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+        } };
+        auto first = node_at(&buffers, root, offset);
+        auto last = node_at(&buffers, root, offset + count);
+        auto first_node = first.node;
+        auto last_node = last.node;
+
+        auto start_split_pos = buffer_position(&buffers, first_node->piece, first.remainder);
+
+        // Simple case: the range of characters we want to delete are
+        // held directly within this node.  Remove the node, resize it
+        // then add it back.
+        if (first_node == last_node)
+        {
+            auto end_split_pos = buffer_position(&buffers, first_node->piece, last.remainder);
+            // We're going to shrink the node starting from the beginning.
+            if (first.start_offset == offset)
+            {
+                // Delete the entire node.
+                if (count == first_node->piece.length)
+                {
+                    root = root.remove(first.start_offset);
+                    return;
+                }
+                // Shrink the node.
+                auto new_piece = trim_piece_left(&buffers, first_node->piece, end_split_pos);
+                // Remove the old one and update.
+                root = root.remove(first.start_offset)
+                            .insert(node_data(new_piece), first.start_offset);
+                return;
+            }
+
+            // Trim the tail of this piece.
+            if (first.start_offset + first_node->piece.length == offset + count)
+            {
+                auto new_piece = trim_piece_right(&buffers, first_node->piece, start_split_pos);
+                // Remove the old one and update.
+                root = root.remove(first.start_offset)
+                            .insert(node_data(new_piece), first.start_offset);
+                return;
+            }
+
+            // The removed buffer is somewhere in the middle.  Trim it in both directions.
+            auto [left, right] = shrink_piece(&buffers, first_node->piece, start_split_pos, end_split_pos);
+            root = root.remove(first.start_offset)
+                        // Note: We insert right first so that the 'left' will be inserted
+                        // to the right node's left.
+                        .insert(node_data(right), first.start_offset)
+                        .insert(node_data(left), first.start_offset);
+            return;
+        }
+
+        // Traverse nodes and delete all nodes within the offset range. First we will build the
+        // partial pieces for the nodes that will eventually make up this range.
+        // There are four cases here:
+        // 1. The entire first node is deleted as well as all of the last node.
+        // 2. Part of the first node is deleted and all of the last node.
+        // 3. Part of the first node is deleted and part of the last node.
+        // 4. The entire first node is deleted and part of the last node.
+
+        auto new_first = trim_piece_right(&buffers, first_node->piece, start_split_pos);
+        if (last_node == nullptr)
+        {
+            remove_node_range(first, count);
+        }
+        else
+        {
+            auto end_split_pos = buffer_position(&buffers, last_node->piece, last.remainder);
+            auto new_last = trim_piece_left(&buffers, last_node->piece, end_split_pos);
+            remove_node_range(first, count);
+            // There's an edge case here where we delete all the nodes up to 'last' but
+            // last itself remains untouched.  The test of 'remainder' in 'last' can identify
+            // this scenario to avoid inserting a duplicate of 'last'.
+            if (last.remainder != Length{})
+            {
+                if (new_last.length != Length{})
+                {
+                    root = root.insert(node_data(new_last), first.start_offset);
+                }
+            }
+        }
+
+        if (new_first.length != Length{})
+        {
+            root = root.insert(node_data(new_first), first.start_offset);
+        }
+    }
+
+    // Fetches the length of the piece starting from the first line to 'index' or to the end of
+    // the piece.
+    Length Tree::accumulate_value(const BufferCollection* buffers, const Piece& piece, Line index)
+    {
+        auto& line_starts = buffers->line_starts(piece.index);
+        // Extend it so we can capture the entire line content including newline.
+        auto expected_start = extend(piece.first.line, rep(index) + 1);
+        auto first = rep(line_starts[rep(piece.first.line)]) + rep(piece.first.column);
+        if (expected_start > piece.last.line)
+        {
+            auto last = rep(line_starts[rep(piece.last.line)]) + rep(piece.last.column);
+            return Length{ last - first };
+        }
+        auto last = rep(line_starts[rep(expected_start)]);
+        return Length{ last - first };
+    }
+
+    // Fetches the length of the piece starting from the first line to 'index' or to the end of
+    // the piece.
+    Length Tree::accumulate_value_no_lf(const BufferCollection* buffers, const Piece& piece, Line index)
+    {
+        auto& line_starts = buffers->line_starts(piece.index);
+        // Extend it so we can capture the entire line content including newline.
+        auto expected_start = extend(piece.first.line, rep(index) + 1);
+        auto first = rep(line_starts[rep(piece.first.line)]) + rep(piece.first.column);
+        if (expected_start > piece.last.line)
+        {
+            auto last = rep(line_starts[rep(piece.last.line)]) + rep(piece.last.column);
+            if (last == first)
+                return Length{ };
+            if (buffer_char(buffers, piece.index, last - 1) == '\n')
+                return Length{ last - 1 - first };
+            return Length{ last - first };
+        }
+        auto last = rep(line_starts[rep(expected_start)]);
+        if (last == first)
+            return Length{ };
+        // Every line start but the first follows a LF, so the text need not be loaded.
+        return Length{ last - 1 - first };
+    }
+
+    void Tree::populate_from_node(std::string* buf, const BufferCollection* buffers, const PieceTree::RedBlackTree& node)
+    {
+        // We know we want the first line (index 0).
+        auto accumulated_value = accumulate_value(buffers, node.root().piece, node.root().piece.first.line);
+        auto start_offset = buffers->buffer_offset(node.root().piece.index, node.root().piece.first);
+        BufferPin pin;
+        buf->append(buffers->buffer_text(node.root().piece.index, start_offset, accumulated_value, &pin));
+    }
+
+    void Tree::populate_from_node(std::string* buf, const BufferCollection* buffers, const PieceTree::RedBlackTree& node, Line line_index)
+    {
+        auto accumulated_value = accumulate_value(buffers, node.root().piece, line_index);
+        Length prev_accumulated_value = { };
+        if (line_index != Line::IndexBeginning)
+        {
+            prev_accumulated_value = accumulate_value(buffers, node.root().piece, retract(line_index));
+        }
+        auto start_offset = buffers->buffer_offset(node.root().piece.index, node.root().piece.first);
+        BufferPin pin;
+        buf->append(buffers->buffer_text(node.root().piece.index, start_offset + prev_accumulated_value,
+                                         Length{ rep(accumulated_value) - rep(prev_accumulated_value) }, &pin));
+    }
+
+    template <Tree::Accumulator accumulate>
+    void Tree::line_start(CharOffset* offset, const BufferCollection* buffers, const PieceTree::RedBlackTree& node, Line line)
+    {
+        if (node.is_empty())
+            return;
+        assert(line != Line::IndexBeginning);
+        auto line_index = rep(retract(line));
+        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        {
+            line_start<accumulate>(offset, buffers, node.left(), line);
+        }
+        // The desired line is directly within the node.
+        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) >= line_index)
+        {
+            line_index -= rep(node.root().left_subtree_lf_count);
+            Length len = node.root().left_subtree_length;
+            if (line_index != 0)
+            {
+                len = len + (*accumulate)(buffers, node.root().piece, Line{ line_index - 1 });
+            }
+            *offset = *offset + len;
+        }
+        // assemble the LHS and RHS.
+        else
+        {
+            // This case implies that 'left_subtree_lf_count' is strictly < line_index.
+            // The content is somewhere in the middle.
+            line_index -= rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
+            *offset = *offset + node.root().left_subtree_length + node.root().piece.length;
+            line_start<accumulate>(offset, buffers, node.right(), Line{ line_index + 1 });
+        }
+    }
+
+    IncompleteCRLF Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& node, Line line, bool preceded_by_cr)
+    {
+        if (node.is_empty())
+            return IncompleteCRLF::No;
+        assert(line != Line::IndexBeginning);
+        auto line_index = rep(retract(line));
+        auto& data = node.root();
+        if (rep(data.left_subtree_lf_count) >= line_index)
+            return line_end_crlf(offset, buffers, node.left(), line, preceded_by_cr);
+        // The desired line is directly within the node.
+        if (rep(data.left_subtree_lf_count + data.piece.newline_count) >= line_index)
+        {
+            line_index -= rep(data.left_subtree_lf_count);
+            assert(line_index != 0);
+            auto lf_offset = accumulate_value_no_lf(buffers, data.piece, Line{ line_index - 1 });
+            // The CR is either within this piece or ends whatever precedes it.
+            bool cr = false;
+            if (lf_offset != Length{ })
+            {
+                auto first = buffers->buffer_offset(data.piece.index, data.piece.first);
+                cr = buffer_char(buffers, data.piece.index, rep(first) + rep(lf_offset) - 1) == '\r';
+            }
+            else if (not node.left().is_empty())
+            {
+                cr = node.left().root().subtree_ends_with_cr;
+            }
+            else
+            {
+                cr = preceded_by_cr;
+            }
+            *offset = *offset + data.left_subtree_length + lf_offset;
+            if (not cr)
+                return IncompleteCRLF::Yes;
+            *offset = retract(*offset);
+            return IncompleteCRLF::No;
+        }
+        // This case implies that 'left_subtree_lf_count + piece NL count' is strictly < line_index.
+        // The content is somewhere in the middle.
+        line_index -= rep(data.left_subtree_lf_count + data.piece.newline_count);
+        *offset = *offset + data.left_subtree_length + data.piece.length;
+        return line_end_crlf(offset, buffers, node.right(), Line{ line_index + 1 }, data.piece_ends_with_cr);
+    }
+
+    LineRange Tree::get_line_range(Line line) const
+    {
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange Tree::get_line_range_crlf(Line line) const
+    {
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_end_crlf(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange Tree::get_line_range_with_newline(Line line) const
+    {
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    namespace
+    {
+        // A contiguous span of buffer content.  Two segments with the same buffer and buffer offset refer to
+        // identical text.
+        struct DiffSegment
+        {
+            BufferIndex index;
+            size_t buffer_first;
+            Length length;
+        };
+
+        using DiffSegments = std::vector<DiffSegment>;
+
+        enum class SharedSubtree : bool { No, Yes };
+
+        struct DiffToken
+        {
+            RedBlackTree node;
+            CharOffset offset;
+            Length length;
+            // Shared tokens refer to an entire subtree, otherwise the token is only the node's own piece.
+            SharedSubtree shared;
+        };
+
+        using DiffTokens = std::vector<DiffToken>;
+
+        struct DiffFrontierEntry
+        {
+            RedBlackTree node;
+            CharOffset offset;
+            Length length;
+            size_t side;
+        };
+
+        struct DiffSide
+        {
+            std::unordered_set<const void*> seen;
+            DiffTokens tokens;
+        };
+
+        // Explores the unshared portion of both trees, largest subtree first.  A subtree shared by both roots
+        // has the same length in each, and its parent in either tree is strictly longer.  So by the time a
+        // shared subtree is visited from one side, the other side has already discovered it and the subtree
+        // can be pruned without descending into it.
+        void explore_unshared(DiffSide (&sides)[2], const RedBlackTree& old_root, const RedBlackTree& new_root)
+        {
+            auto by_length = [](const DiffFrontierEntry& a, const DiffFrontierEntry& b) { return a.length < b.length; };
+            std::priority_queue<DiffFrontierEntry, std::vector<DiffFrontierEntry>, decltype(by_length)> frontier{ by_length };
+            auto discover = [&](const RedBlackTree& node, CharOffset offset, Length length, size_t side) {
+                if (node.is_empty())
+                    return;
+                sides[side].seen.insert(node.root_ptr());
+                frontier.push({ .node = node, .offset = offset, .length = length, .side = side });
+            };
+            discover(old_root, CharOffset{ }, tree_length(old_root), 0);
+            discover(new_root, CharOffset{ }, tree_length(new_root), 1);
+            while (not frontier.empty())
+            {
+                auto [node, offset, length, side] = frontier.top();
+                frontier.pop();
+                auto& self = sides[side];
+                if (sides[1 - side].seen.contains(node.root_ptr()))
+                {
+                    self.tokens.push_back({ .node = node, .offset = offset, .length = length, .shared = SharedSubtree::Yes });
+                    continue;
+                }
+                auto& data = node.root();
+                auto piece_offset = offset + data.left_subtree_length;
+                self.tokens.push_back({ .node = node, .offset = piece_offset, .length = data.piece.length, .shared = SharedSubtree::No });
+                discover(node.left(), offset, data.left_subtree_length, side);
+                discover(node.right(), piece_offset + data.piece.length, length - data.left_subtree_length - data.piece.length, side);
+            }
+        }
+
+        // The footprint of the nodes of 'old_root' which 'new_root' does not share.
+        size_t unshared_bytes(const RedBlackTree& old_root, const RedBlackTree& new_root)
+        {
+            if (old_root == new_root)
+                return 0;
+            DiffSide sides[2];
+            explore_unshared(sides, old_root, new_root);
+            auto unshared = std::count_if(begin(sides[0].tokens), end(sides[0].tokens), [](const DiffToken& token) { return is_no(token.shared); });
+            return static_cast<size_t>(unshared) * node_footprint;
+        }
+
+        void append_segment(DiffSegments* segments, const BufferCollection* buffers, const Piece& piece)
+        {
+            auto first = buffers->buffer_offset(piece.index, piece.first);
+            segments->push_back({ .index = piece.index, .buffer_first = rep(first), .length = piece.length });
+        }
+
+        void append_segments(DiffSegments* segments, const BufferCollection* buffers, const RedBlackTree& node)
+        {
+            if (node.is_empty())
+                return;
+            append_segments(segments, buffers, node.left());
+            append_segment(segments, buffers, node.root().piece);
+            append_segments(segments, buffers, node.right());
+        }
+
+        void collect_run(DiffSegments* segments, const BufferCollection* buffers, const DiffTokens& tokens, size_t first, size_t last)
+        {
+            segments->clear();
+            for (size_t i = first; i < last; ++i)
+            {
+                // Shared subtrees which could not be aligned are compared piece by piece.
+                if (is_yes(tokens[i].shared))
+                {
+                    append_segments(segments, buffers, tokens[i].node);
+                }
+                else
+                {
+                    append_segment(segments, buffers, tokens[i].node.root().piece);
+                }
+            }
+        }
+
+        Length segments_length(const DiffSegments& segments)
+        {
+            Length len{ };
+            for (auto& seg : segments)
+            {
+                len = len + seg.length;
+            }
+            return len;
+        }
+
+        Length common_prefix(const DiffSegments& a, const DiffSegments& b)
+        {
+            Length common{ };
+            size_t i = 0;
+            size_t j = 0;
+            size_t a_used = 0;
+            size_t b_used = 0;
+            while (i < a.size() and j < b.size())
+            {
+                if (a[i].index != b[j].index
+                    or a[i].buffer_first + a_used != b[j].buffer_first + b_used)
+                    break;
+                auto n = std::min(rep(a[i].length) - a_used, rep(b[j].length) - b_used);
+                common = common + Length{ n };
+                a_used += n;
+                b_used += n;
+                if (a_used == rep(a[i].length))
+                {
+                    ++i;
+                    a_used = 0;
+                }
+                if (b_used == rep(b[j].length))
+                {
+                    ++j;
+                    b_used = 0;
+                }
+            }
+            return common;
+        }
+
+        Length common_suffix(const DiffSegments& a, const DiffSegments& b, Length limit)
+        {
+            Length common{ };
+            size_t i = a.size();
+            size_t j = b.size();
+            size_t a_used = 0;
+            size_t b_used = 0;
+            while (i != 0 and j != 0 and common < limit)
+            {
+                auto& x = a[i - 1];
+                auto& y = b[j - 1];
+                if (x.index != y.index
+                    or x.buffer_first + rep(x.length) - a_used != y.buffer_first + rep(y.length) - b_used)
+                    break;
+                auto n = std::min({ rep(x.length) - a_used, rep(y.length) - b_used, rep(limit - common) });
+                common = common + Length{ n };
+                a_used += n;
+                b_used += n;
+                if (a_used == rep(x.length))
+                {
+                    --i;
+                    a_used = 0;
+                }
+                if (b_used == rep(y.length))
+                {
+                    --j;
+                    b_used = 0;
+                }
+            }
+            return common;
+        }
+
+        void diff_runs(DiffRanges* ranges, const DiffSegments& old_run, CharOffset old_first, const DiffSegments& new_run, CharOffset new_first)
+        {
+            auto old_len = segments_length(old_run);
+            auto new_len = segments_length(new_run);
+            auto prefix = common_prefix(old_run, new_run);
+            auto suffix = common_suffix(old_run, new_run, std::min(old_len, new_len) - prefix);
+            auto old_changed = old_len - prefix - suffix;
+            auto new_changed = new_len - prefix - suffix;
+            if (old_changed == Length{} and new_changed == Length{})
+                return;
+            ranges->push_back({ .old_first = old_first + prefix,
+                                .old_length = old_changed,
+                                .new_first = new_first + prefix,
+                                .new_length = new_changed });
+        }
+    } // namespace [anon]
+
+    void Tree::diff(DiffRanges* ranges, const RedBlackTree& old_root, const RedBlackTree& new_root) const
+    {
+        ranges->clear();
+        if (old_root == new_root)
+            return;
+        DiffSide sides[2];
+        explore_unshared(sides, old_root, new_root);
+
+        auto by_offset = [](const DiffToken& a, const DiffToken& b) { return a.offset < b.offset; };
+        auto& old_tokens = sides[0].tokens;
+        auto& new_tokens = sides[1].tokens;
+        std::sort(begin(old_tokens), end(old_tokens), by_offset);
+        std::sort(begin(new_tokens), end(new_tokens), by_offset);
+
+        // Shared subtrees become anchors which split the documents into runs of unshared content.  Edits
+        // preserve the relative order of existing content so the anchors normally appear in the same order
+        // in both roots; anything out of order is simply treated as unshared content.
+        std::unordered_map<const void*, size_t> new_shared;
+        for (size_t i = 0; i < new_tokens.size(); ++i)
+        {
+            if (is_yes(new_tokens[i].shared))
+            {
+                new_shared[new_tokens[i].node.root_ptr()] = i;
+            }
+        }
+        struct Anchor
+        {
+            size_t old_index;
+            size_t new_index;
+        };
+        std::vector<Anchor> anchors;
+        for (size_t i = 0; i < old_tokens.size(); ++i)
+        {
+            if (is_no(old_tokens[i].shared))
+                continue;
+            auto j = new_shared.find(old_tokens[i].node.root_ptr());
+            assert(j != new_shared.end());
+            if (anchors.empty() or j->second > anchors.back().new_index)
+            {
+                anchors.push_back({ .old_index = i, .new_index = j->second });
+            }
+        }
+
+        DiffSegments old_run;
+        DiffSegments new_run;
+        size_t old_index = 0;
+        size_t new_index = 0;
+        CharOffset old_first{ };
+        CharOffset new_first{ };
+        for (size_t k = 0; k <= anchors.size(); ++k)
+        {
+            auto old_last = k < anchors.size() ? anchors[k].old_index : old_tokens.size();
+            auto new_last = k < anchors.size() ? anchors[k].new_index : new_tokens.size();
+            collect_run(&old_run, &buffers, old_tokens, old_index, old_last);
+            collect_run(&new_run, &buffers, new_tokens, new_index, new_last);
+            diff_runs(ranges, old_run, old_first, new_run, new_first);
+            if (k < anchors.size())
+            {
+                old_first = old_tokens[old_last].offset + old_tokens[old_last].length;
+                new_first = new_tokens[new_last].offset + new_tokens[new_last].length;
+                old_index = old_last + 1;
+                new_index = new_last + 1;
+            }
+        }
+    }
+
+    namespace
+    {
+        // The span is valid for as long as '*pin' is held.
+        std::string_view piece_span(const BufferCollection* buffers, const Piece& piece, BufferPin* pin)
+        {
+            return buffers->buffer_text(piece.index, buffers->buffer_offset(piece.index, piece.first), piece.length, pin);
+        }
+
+        struct SpanEntry
+        {
+            RedBlackTree node;
+            // Document offset of the node's piece.
+            CharOffset piece_offset;
+        };
+
+        // Visits the piece spans of 'root' in document order starting at 'first'.  The visitor is called with
+        // the span, its document offset, its piece and the pin of its buffer, and returns false to stop the walk.
+        // A span is only valid beyond its visit while a copy of the pin is held.
+        template <typename F>
+        void for_each_span(const BufferCollection* buffers, const RedBlackTree& root, CharOffset first, F&& f)
+        {
+            std::vector<SpanEntry> stack;
+            // Descend to the piece containing 'first', remembering the ancestors whose pieces come after it.
+            auto node = root;
+            CharOffset subtree_offset{ };
+            while (not node.is_empty())
+            {
+                auto& data = node.root();
+                auto piece_offset = subtree_offset + data.left_subtree_length;
+                if (first < piece_offset)
+                {
+                    stack.push_back({ node, piece_offset });
+                    node = node.left();
+                }
+                else if (first < piece_offset + data.piece.length)
+                {
+                    stack.push_back({ node, piece_offset });
+                    break;
+                }
+                else
+                {
+                    subtree_offset = piece_offset + data.piece.length;
+                    node = node.right();
+                }
+            }
+
+            while (not stack.empty())
+            {
+                auto [entry, piece_offset] = stack.back();
+                stack.pop_back();
+                auto& piece = entry.root().piece;
+                BufferPin pin;
+                auto span = piece_span(buffers, piece, &pin);
+                auto visit_offset = piece_offset;
+                // Only the first piece can start before 'first'.
+                if (first > piece_offset)
+                {
+                    span.remove_prefix(rep(distance(piece_offset, first)));
+                    visit_offset = first;
+                }
+                if (not f(span, visit_offset, piece, pin))
+                    return;
+                // Queue the leftmost path of the right subtree.
+                auto right = entry.right();
+                auto right_offset = piece_offset + piece.length;
+                while (not right.is_empty())
+                {
+                    stack.push_back({ right, right_offset + right.root().left_subtree_length });
+                    right = right.left();
+                }
+            }
+        }
+
+        // Visits the piece spans of 'root' ending at or before 'last' in reverse document order.
+        template <typename F>
+        void for_each_span_reverse(const BufferCollection* buffers, const RedBlackTree& root, CharOffset last, F&& f)
+        {
+            std::vector<SpanEntry> stack;
+            // Descend to the piece containing 'last - 1', remembering the ancestors whose pieces come before it.
+            auto node = root;
+            CharOffset subtree_offset{ };
+            while (not node.is_empty())
+            {
+                auto& data = node.root();
+                auto piece_offset = subtree_offset + data.left_subtree_length;
+                if (last <= piece_offset)
+                {
+                    node = node.left();
+                }
+                else if (last <= piece_offset + data.piece.length)
+                {
+                    stack.push_back({ node, piece_offset });
+                    break;
+                }
+                else
+                {
+                    stack.push_back({ node, piece_offset });
+                    subtree_offset = piece_offset + data.piece.length;
+                    node = node.right();
+                }
+            }
+
+            while (not stack.empty())
+            {
+                auto [entry, piece_offset] = stack.back();
+                stack.pop_back();
+                auto& piece = entry.root().piece;
+                BufferPin pin;
+                auto span = piece_span(buffers, piece, &pin);
+                // Only the first piece can extend beyond 'last'.
+                if (piece_offset + piece.length > last)
+                {
+                    span.remove_suffix(rep(distance(last, piece_offset + piece.length)));
+                }
+                if (not f(span, piece_offset, piece, pin))
+                    return;
+                // Queue the rightmost path of the left subtree.
+                auto left = entry.left();
+                auto left_offset = CharOffset{ rep(piece_offset) - rep(entry.root().left_subtree_length) };
+                while (not left.is_empty())
+                {
+                    auto& data = left.root();
+                    stack.push_back({ left, left_offset + data.left_subtree_length });
+                    left_offset = left_offset + data.left_subtree_length + data.piece.length;
+                    left = left.right();
+                }
+            }
+        }
+
+        // Finds the first occurrence of 'needle' in [first, last).  The first byte is located with 'memchr',
+        // which is vectorized by every standard library we care about, and candidates are then verified.
+        const char* find_literal_in(const char* first, const char* last, std::string_view needle)
+        {
+            const auto m = needle.size();
+            while (static_cast<size_t>(last - first) >= m)
+            {
+                auto* p = static_cast<const char*>(std::memchr(first, needle.front(), (last - first) - m + 1));
+                if (p == nullptr)
+                    return nullptr;
+                if (std::memcmp(p + 1, needle.data() + 1, m - 1) == 0)
+                    return p;
+                first = p + 1;
+            }
+            return nullptr;
+        }
+
+        // Finds the last occurrence of 'needle' in [first, last).
+        const char* rfind_literal_in(const char* first, const char* last, std::string_view needle)
+        {
+            auto pos = std::string_view{ first, static_cast<size_t>(last - first) }.rfind(needle);
+            if (pos == std::string_view::npos)
+                return nullptr;
+            return first + pos;
+        }
+
+        uint32_t trigram_hash(const char* p)
+        {
+            static_assert(TrigramIndex::block_bits == (size_t{ 1 } << 12));
+            auto v = uint32_t(uint8_t(p[0])) | (uint32_t(uint8_t(p[1])) << 8) | (uint32_t(uint8_t(p[2])) << 16);
+            return (v * 0x9E3779B1u) >> 20;
+        }
+
+        TrigramIndexReference build_trigram_index(std::string_view buf)
+        {
+            auto index = std::make_shared<TrigramIndex>();
+            index->block_count = (buf.size() + TrigramIndex::block_length - 1) / TrigramIndex::block_length;
+            index->bits.resize(index->block_count * TrigramIndex::block_words);
+            // Trigrams belong to the block they start in, even if they end in the next one.
+            for (size_t i = 0; i + 2 < buf.size(); ++i)
+            {
+                auto h = trigram_hash(buf.data() + i);
+                index->bits[(i / TrigramIndex::block_length) * TrigramIndex::block_words + h / 64] |= uint64_t{ 1 } << (h % 64);
+            }
+            return index;
+        }
+
+        // Per original buffer, the blocks in which a match may start.  An empty entry means the buffer must be
+        // scanned in full.
+        using CandidateBlocks = std::vector<std::vector<bool>>;
+
+        bool compute_candidates(CandidateBlocks* candidates, const BufferCollection* buffers, std::string_view needle)
+        {
+            candidates->clear();
+            if (buffers->orig_indexes.empty()
+                or needle.size() < 3
+                or needle.size() > TrigramIndex::block_length)
+                return false;
+            std::vector<uint32_t> hashes;
+            for (size_t i = 0; i + 2 < needle.size(); ++i)
+            {
+                hashes.push_back(trigram_hash(needle.data() + i));
+            }
+            std::sort(begin(hashes), end(hashes));
+            hashes.erase(std::unique(begin(hashes), end(hashes)), end(hashes));
+
+            candidates->resize(buffers->orig_indexes.size());
+            for (size_t i = 0; i < buffers->orig_indexes.size(); ++i)
+            {
+                auto* index = buffers->orig_indexes[i].get();
+                if (index == nullptr)
+                    continue;
+                auto& blocks = (*candidates)[i];
+                blocks.resize(index->block_count);
+                // A match starting in block 'c' is no longer than a block so its trigrams start in 'c' or 'c + 1'.
+                for (size_t c = 0; c < index->block_count; ++c)
+                {
+                    blocks[c] = std::all_of(begin(hashes), end(hashes), [&](uint32_t h) {
+                        return index->may_contain(c, h)
+                                or (c + 1 < index->block_count and index->may_contain(c + 1, h));
+                    });
+                }
+            }
+            return true;
+        }
+
+        // Reports every match of 'needle' starting in [from, last) in document order until 'on_match' returns
+        // false.  Matches which straddle piece boundaries are found by searching a small window made from the
+        // last 'needle.size() - 1' bytes seen so far and the head of the next span.  If 'candidates' is provided,
+        // only the candidate blocks of indexed original buffers are scanned.
+        template <typename F>
+        void search_forward(const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, CharOffset from, CharOffset last, const CandidateBlocks* candidates, F&& report)
+        {
+            const size_t tail = needle.size() - 1;
+            // A match starting just before 'last' may need to read past it.
+            const auto read_limit = last + Length{ tail };
+            auto on_match = [&](CharOffset offset) {
+                return offset < last and report(offset);
+            };
+            std::string carry;
+            std::string window;
+            for_each_span(buffers, root, from, [&](std::string_view span, CharOffset span_offset, const Piece& piece, const BufferPin&) {
+                if (span_offset >= read_limit)
+                    return false;
+                // Only the first span starts within its piece.
+                const size_t lo = rep(buffers->buffer_offset(piece.index, piece.first)) + rep(piece.length) - span.size();
+                span = span.substr(0, rep(distance(span_offset, read_limit)));
+                if (not carry.empty())
+                {
+                    window.assign(carry);
+                    window.append(span.substr(0, tail));
+                    // Only matches starting within the carry straddle the boundary; the rest are found below.
+                    const char* window_first = window.data();
+                    const char* window_last = window.data() + std::min(window.size(), carry.size() + tail);
+                    while (auto* p = find_literal_in(window_first, window_last, needle))
+                    {
+                        auto offset = CharOffset{ rep(span_offset) - carry.size() + (p - window.data()) };
+                        if (not on_match(offset))
+                            return false;
+                        window_first = p + 1;
+                    }
+                }
+
+                auto scan = [&](const char* scan_first, const char* scan_last) {
+                    while (auto* p = find_literal_in(scan_first, scan_last, needle))
+                    {
+                        if (not on_match(span_offset + Length{ static_cast<size_t>(p - span.data()) }))
+                            return false;
+                        scan_first = p + 1;
+                    }
+                    return true;
+                };
+                const std::vector<bool>* blocks = nullptr;
+                if (candidates != nullptr
+                    and piece.index != BufferIndex::ModBuf
+                    and rep(piece.index) < candidates->size()
+                    and not (*candidates)[rep(piece.index)].empty())
+                {
+                    blocks = &(*candidates)[rep(piece.index)];
+                }
+                if (blocks == nullptr)
+                {
+                    if (not scan(span.data(), span.data() + span.size()))
+                        return false;
+                }
+                else
+                {
+                    // Scan each candidate block, extended so that a match starting at the end of the block can
+                    // complete.  The regions never share a starting position so no match is reported twice.
+                    constexpr auto block_length = TrigramIndex::block_length;
+                    auto* base = span.data() - lo;
+                    const size_t hi = lo + span.size();
+                    for (size_t c = lo / block_length; c * block_length < hi; ++c)
+                    {
+                        if (not (*blocks)[c])
+                            continue;
+                        auto block_first = std::max(lo, c * block_length);
+                        auto block_last = std::min(hi, (c + 1) * block_length + tail);
+                        if (not scan(base + block_first, base + block_last))
+                            return false;
+                    }
+                }
+
+                if (span.size() >= tail)
+                {
+                    carry.assign(span.substr(span.size() - tail));
+                }
+                else
+                {
+                    carry.append(span);
+                    if (carry.size() > tail)
+                    {
+                        carry.erase(0, carry.size() - tail);
+                    }
+                }
+                return true;
+            });
+        }
+
+        // Reports every match of 'needle' ending at or before 'last' in reverse document order until
+        // 'on_match' returns false.
+        template <typename F>
+        void search_backward(const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, CharOffset last, F&& on_match)
+        {
+            const size_t tail = needle.size() - 1;
+            std::string carry;
+            std::string window;
+            for_each_span_reverse(buffers, root, last, [&](std::string_view span, CharOffset span_offset, const Piece&, const BufferPin&) {
+                auto head = span.substr(span.size() - std::min(span.size(), tail));
+                if (not carry.empty())
+                {
+                    window.assign(head);
+                    window.append(carry);
+                    // Only matches starting within the head of this span straddle the boundary.
+                    const char* first = window.data();
+                    const char* end = window.data() + window.size();
+                    while (auto* p = rfind_literal_in(first, end, needle))
+                    {
+                        if (static_cast<size_t>(p - first) < head.size())
+                        {
+                            auto offset = span_offset + Length{ span.size() - head.size() + (p - first) };
+                            if (not on_match(offset))
+                                return false;
+                        }
+                        end = p + needle.size() - 1;
+                        if (static_cast<size_t>(end - first) < needle.size())
+                            break;
+                    }
+                }
+
+                auto* first = span.data();
+                auto* end = span.data() + span.size();
+                while (auto* p = rfind_literal_in(first, end, needle))
+                {
+                    if (not on_match(span_offset + Length{ static_cast<size_t>(p - span.data()) }))
+                        return false;
+                    end = p + needle.size() - 1;
+                }
+
+                if (span.size() >= tail)
+                {
+                    carry.assign(span.substr(0, tail));
+                }
+                else
+                {
+                    carry.insert(0, span);
+                    if (carry.size() > tail)
+                    {
+                        carry.resize(tail);
+                    }
+                }
+                return true;
+            });
+        }
+    } // namespace [anon]
+
+    void Tree::build_search_index()
+    {
+        buffers.orig_indexes.resize(buffers.orig_buffers.size());
+        for (size_t i = 0; i < buffers.orig_buffers.size(); ++i)
+        {
+            // Original buffers are immutable so an existing index never goes stale.
+            if (buffers.orig_indexes[i] == nullptr)
+            {
+                auto buffer = buffers.buffer_at(BufferIndex{ i });
+                buffers.orig_indexes[i] = build_trigram_index(buffer->buffer);
+            }
+        }
+    }
+
+    FindResult Tree::find_literal(const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, CharOffset from, SearchDirection direction)
+    {
+        FindResult result{ .found = false, .match = { } };
+        if (needle.empty() or root.is_empty())
+            return result;
+        auto on_match = [&](CharOffset offset) {
+            result = { .found = true, .match = { .offset = offset, .line = node_at(buffers, root, offset).line, .length = Length{ needle.size() } } };
+            return false;
+        };
+        if (direction == SearchDirection::Forward)
+        {
+            CandidateBlocks candidates;
+            auto* filter = compute_candidates(&candidates, buffers, needle) ? &candidates : nullptr;
+            search_forward(buffers, root, needle, from, CharOffset{ } + tree_length(root), filter, on_match);
+        }
+        else
+        {
+            search_backward(buffers, root, needle, from, on_match);
+        }
+        return result;
+    }
+
+    void Tree::find_all_literal(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle)
+    {
+        matches->clear();
+        if (needle.empty() or root.is_empty())
+            return;
+        CandidateBlocks candidates;
+        auto* filter = compute_candidates(&candidates, buffers, needle) ? &candidates : nullptr;
+        CharOffset next_allowed{ };
+        search_forward(buffers, root, needle, CharOffset{ }, CharOffset{ } + tree_length(root), filter, [&](CharOffset offset) {
+            // Skip overlapping matches.
+            if (offset < next_allowed)
+                return true;
+            matches->push_back({ .offset = offset, .line = node_at(buffers, root, offset).line, .length = Length{ needle.size() } });
+            next_allowed = offset + Length{ needle.size() };
+            return true;
+        });
+    }
+
+    void Tree::find_all_literal_parallel(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, size_t thread_count)
+    {
+        // Partitions smaller than this are not worth the cost of a thread.
+        constexpr size_t min_partition_length = size_t{ 1 } << 16;
+        matches->clear();
+        if (needle.empty() or root.is_empty())
+            return;
+        const auto total = tree_length(root);
+        if (thread_count == 0)
+        {
+            thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        thread_count = std::clamp(rep(total) / min_partition_length, size_t{ 1 }, thread_count);
+
+        // Align the partitions to the start of the piece containing each split point.
+        std::vector<CharOffset> bounds{ CharOffset{ } };
+        for (size_t i = 1; i < thread_count; ++i)
+        {
+            auto split = node_at(buffers, root, CharOffset{ rep(total) / thread_count * i });
+            if (split.start_offset > bounds.back())
+            {
+                bounds.push_back(split.start_offset);
+            }
+        }
+        bounds.push_back(CharOffset{ } + total);
+
+        // Each partition reports every match starting within it, including overlapping ones.  Matches which
+        // straddle a partition boundary are read from the next partition (an overlap of 'needle.size() - 1').
+        const auto partitions = bounds.size() - 1;
+        std::vector<SearchMatches> results(partitions);
+        CandidateBlocks candidates;
+        auto* filter = compute_candidates(&candidates, buffers, needle) ? &candidates : nullptr;
+        auto scan = [&](size_t i) {
+            auto* out = &results[i];
+            search_forward(buffers, root, needle, bounds[i], bounds[i + 1], filter, [&](CharOffset offset) {
+                out->push_back({ .offset = offset, .line = node_at(buffers, root, offset).line, .length = Length{ needle.size() } });
+                return true;
+            });
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(partitions - 1);
+        for (size_t i = 1; i < partitions; ++i)
+        {
+            threads.emplace_back(scan, i);
+        }
+        scan(0);
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+
+        // Merge in document order, dropping overlapping matches exactly like the serial search.
+        CharOffset next_allowed{ };
+        for (auto& result : results)
+        {
+            for (auto& match : result)
+            {
+                if (match.offset < next_allowed)
+                    continue;
+                matches->push_back(match);
+                next_allowed = match.offset + match.length;
+            }
+        }
+    }
+
+    FindResult Tree::find(std::string_view needle, CharOffset from, SearchDirection direction) const
+    {
+        return find_literal(&buffers, root, needle, from, direction);
+    }
+
+    void Tree::find_all(SearchMatches* matches, std::string_view needle) const
+    {
+        find_all_literal(matches, &buffers, root, needle);
+    }
+
+    FindResult OwningSnapshot::find(std::string_view needle, CharOffset from, SearchDirection direction) const
+    {
+        return Tree::find_literal(&buffers, root, needle, from, direction);
+    }
+
+    void OwningSnapshot::find_all(SearchMatches* matches, std::string_view needle) const
+    {
+        Tree::find_all_literal(matches, &buffers, root, needle);
+    }
+
+    FindResult ReferenceSnapshot::find(std::string_view needle, CharOffset from, SearchDirection direction) const
+    {
+        return Tree::find_literal(buffers, root, needle, from, direction);
+    }
+
+    void ReferenceSnapshot::find_all(SearchMatches* matches, std::string_view needle) const
+    {
+        Tree::find_all_literal(matches, buffers, root, needle);
+    }
+
+    namespace
+    {
+        // A bidirectional iterator over the characters of a tree which steps through piece spans directly.  This
+        // allows '<regex>' to run over the document without copying it into a contiguous buffer.
+        class SpanIterator
+        {
+        public:
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = char;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const char*;
+            using reference = const char&;
+
+            SpanIterator() = default;
+            SpanIterator(const BufferCollection* buffers, const RedBlackTree* root, CharOffset end_offset, CharOffset offset):
+                buffers{ buffers },
+                root{ root },
+                end_offset{ end_offset }
+            {
+                load(offset);
+            }
+
+            reference operator*() const
+            {
+                return *cur;
+            }
+
+            SpanIterator& operator++()
+            {
+                ++cur;
+                // Step into the next piece unless this is the end of the document.
+                if (cur == last and offset() != end_offset)
+                {
+                    load(offset());
+                }
+                return *this;
+            }
+
+            SpanIterator operator++(int)
+            {
+                auto tmp = *this;
+                ++*this;
+                return tmp;
+            }
+
+            SpanIterator& operator--()
+            {
+                if (cur == first)
+                {
+                    load(retract(offset()));
+                    return *this;
+                }
+                --cur;
+                return *this;
+            }
+
+            SpanIterator operator--(int)
+            {
+                auto tmp = *this;
+                --*this;
+                return tmp;
+            }
+
+            bool operator==(const SpanIterator& other) const
+            {
+                return offset() == other.offset();
+            }
+
+            CharOffset offset() const
+            {
+                return span_offset + Length{ static_cast<size_t>(cur - first) };
+            }
+        private:
+            void load(CharOffset offset)
+            {
+                auto node = *root;
+                CharOffset subtree_offset{ };
+                while (not node.is_empty())
+                {
+                    auto& data = node.root();
+                    auto piece_offset = subtree_offset + data.left_subtree_length;
+                    if (offset < piece_offset)
+                    {
+                        node = node.left();
+                    }
+                    // The end of the document is represented by the end of the last piece.
+                    else if (offset < piece_offset + data.piece.length or node.right().is_empty())
+                    {
+                        auto span = piece_span(buffers, data.piece, &pinned);
+                        first = span.data();
+                        last = span.data() + span.size();
+                        cur = first + rep(distance(piece_offset, offset));
+                        span_offset = piece_offset;
+                        return;
+                    }
+                    else
+                    {
+                        subtree_offset = piece_offset + data.piece.length;
+                        node = node.right();
+                    }
+                }
+            }
+
+            const BufferCollection* buffers = nullptr;
+            const RedBlackTree* root = nullptr;
+            CharOffset end_offset = { };
+            const char* first = nullptr;
+            const char* last = nullptr;
+            const char* cur = nullptr;
+            CharOffset span_offset = { };
+            // The buffer of the current span.  Copies made by '<regex>' share it.
+            BufferPin pinned = { };
+        };
+
+        using SpanMatch = std::match_results<SpanIterator>;
+        using SpanRegexIterator = std::regex_iterator<SpanIterator>;
+
+        SearchMatch to_search_match(const SpanMatch& match, Line line)
+        {
+            auto first = match[0].first.offset();
+            return { .offset = first, .line = line, .length = distance(first, match[0].second.offset()) };
+        }
+    } // namespace [anon]
+
+    FindResult Tree::find_pattern(const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern, CharOffset from, SearchDirection direction)
+    {
+        FindResult result{ .found = false, .match = { } };
+        if (root.is_empty())
+            return result;
+        const auto end_offset = CharOffset{ } + tree_length(root);
+        from = std::min(from, end_offset);
+        const auto last_line = Line{ rep(tree_lf_count(root)) + 1 };
+        auto line = node_at(buffers, root, from).line;
+        // Matching is performed one line at a time.  Line ranges come straight from the LF and CR counts in the
+        // tree so no scanning is required to find them.  A line ends before its CRLF so that '$' matches there.
+        auto line_range = [&](Line l) {
+            LineRange range{ };
+            line_start<&Tree::accumulate_value>(&range.first, buffers, root, l);
+            line_end_crlf(&range.last, buffers, root, extend(l));
+            return range;
+        };
+        SpanMatch match;
+        if (direction == SearchDirection::Forward)
+        {
+            for (; line <= last_line; line = extend(line))
+            {
+                auto range = line_range(line);
+                auto first = std::max(range.first, from);
+                // Starting on the LF of a CRLF leaves nothing of this line to search.
+                if (first > range.last)
+                    continue;
+                // If we start part way into the line, '^' must not match but lookbehind-like assertions such as
+                // '\b' still need the previous character.
+                auto flags = first == range.first ? std::regex_constants::match_default
+                                                  : std::regex_constants::match_prev_avail;
+                SpanIterator it{ buffers, &root, end_offset, first };
+                SpanIterator last{ buffers, &root, end_offset, range.last };
+                if (std::regex_search(it, last, match, pattern, flags))
+                {
+                    result = { .found = true, .match = to_search_match(match, line) };
+                    return result;
+                }
+            }
+            return result;
+        }
+
+        for (; line != Line::IndexBeginning; line = retract(line))
+        {
+            auto range = line_range(line);
+            auto last = std::min(range.last, from);
+            // A truncated line must not let '$' match at 'from'.
+            auto flags = last == range.last ? std::regex_constants::match_default
+                                            : std::regex_constants::match_not_eol;
+            SpanIterator it{ buffers, &root, end_offset, range.first };
+            SpanIterator end{ buffers, &root, end_offset, last };
+            for (SpanRegexIterator i{ it, end, pattern, flags }; i != SpanRegexIterator{ }; ++i)
+            {
+                result = { .found = true, .match = to_search_match(*i, line) };
+            }
+            if (result.found)
+                return result;
+        }
+        return result;
+    }
+
+    void Tree::find_all_pattern(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern)
+    {
+        matches->clear();
+        if (root.is_empty())
+            return;
+        const auto end_offset = CharOffset{ } + tree_length(root);
+        const auto last_line = Line{ rep(tree_lf_count(root)) + 1 };
+        for (auto line = Line::Beginning; line <= last_line; line = extend(line))
+        {
+            LineRange range{ };
+            line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+            line_end_crlf(&range.last, buffers, root, extend(line));
+            SpanIterator it{ buffers, &root, end_offset, range.first };
+            SpanIterator end{ buffers, &root, end_offset, range.last };
+            for (SpanRegexIterator i{ it, end, pattern }; i != SpanRegexIterator{ }; ++i)
+            {
+                matches->push_back(to_search_match(*i, line));
+            }
+        }
+    }
+
+    void Tree::find_all_pattern(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern, std::string_view required)
+    {
+        if (required.empty())
+        {
+            find_all_pattern(matches, buffers, root, pattern);
+            return;
+        }
+        // Every match contains 'required' so only the lines holding it need to run the regex.  The literal search
+        // is where the trigram index pays off.
+        SearchMatches candidates;
+        find_all_literal(&candidates, buffers, root, required);
+        matches->clear();
+        const auto end_offset = CharOffset{ } + tree_length(root);
+        Line previous = Line::IndexBeginning;
+        for (auto& candidate : candidates)
+        {
+            if (candidate.line == previous)
+                continue;
+            previous = candidate.line;
+            LineRange range{ };
+            line_start<&Tree::accumulate_value>(&range.first, buffers, root, candidate.line);
+            line_end_crlf(&range.last, buffers, root, extend(candidate.line));
+            SpanIterator it{ buffers, &root, end_offset, range.first };
+            SpanIterator end{ buffers, &root, end_offset, range.last };
+            for (SpanRegexIterator i{ it, end, pattern }; i != SpanRegexIterator{ }; ++i)
+            {
+                matches->push_back(to_search_match(*i, candidate.line));
+            }
+        }
+    }
+
+    FindResult Tree::find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction) const
+    {
+        return find_pattern(&buffers, root, pattern, from, direction);
+    }
+
+    void Tree::find_all_regex(SearchMatches* matches, const std::regex& pattern) const
+    {
+        find_all_pattern(matches, &buffers, root, pattern);
+    }
+
+    void Tree::find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const
+    {
+        find_all_pattern(matches, &buffers, root, pattern, required);
+    }
+
+    void OwningSnapshot::find_all_parallel(SearchMatches* matches, std::string_view needle, size_t thread_count) const
+    {
+        Tree::find_all_literal_parallel(matches, &buffers, root, needle, thread_count);
+    }
+
+    void ReferenceSnapshot::find_all_parallel(SearchMatches* matches, std::string_view needle, size_t thread_count) const
+    {
+        Tree::find_all_literal_parallel(matches, buffers, root, needle, thread_count);
+    }
+
+    FindResult OwningSnapshot::find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction) const
+    {
+        return Tree::find_pattern(&buffers, root, pattern, from, direction);
+    }
+
+    void OwningSnapshot::find_all_regex(SearchMatches* matches, const std::regex& pattern) const
+    {
+        Tree::find_all_pattern(matches, &buffers, root, pattern);
+    }
+
+    void OwningSnapshot::find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const
+    {
+        Tree::find_all_pattern(matches, &buffers, root, pattern, required);
+    }
+
+    FindResult ReferenceSnapshot::find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction) const
+    {
+        return Tree::find_pattern(buffers, root, pattern, from, direction);
+    }
+
+    void ReferenceSnapshot::find_all_regex(SearchMatches* matches, const std::regex& pattern) const
+    {
+        Tree::find_all_pattern(matches, buffers, root, pattern);
+    }
+
+    void ReferenceSnapshot::find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const
+    {
+        Tree::find_all_pattern(matches, buffers, root, pattern, required);
+    }
+
+#ifdef TEXTBUF_UTF_COUNTS
+    UTF16Offset Tree::offset_to_utf16(CharOffset offset) const
+    {
+        return UTF16Offset{ utf_offset(&buffers, root, offset, &UTFCounts::utf16_units) };
+    }
+
+    CharOffset Tree::utf16_to_offset(UTF16Offset offset) const
+    {
+        return utf_to_offset(&buffers, root, rep(offset), &UTFCounts::utf16_units);
+    }
+
+    CodePointOffset Tree::offset_to_code_point(CharOffset offset) const
+    {
+        return CodePointOffset{ utf_offset(&buffers, root, offset, &UTFCounts::code_points) };
+    }
+
+    CharOffset Tree::code_point_to_offset(CodePointOffset offset) const
+    {
+        return utf_to_offset(&buffers, root, rep(offset), &UTFCounts::code_points);
+    }
+
+    UTF16Offset Tree::utf16_column(CharOffset offset) const
+    {
+        return utf16_column(&buffers, root, offset);
+    }
+
+    CharOffset Tree::utf16_column_to_offset(Line line, UTF16Offset column) const
+    {
+        return utf16_column_to_offset(&buffers, root, line, column);
+    }
+
+    UTF16Offset OwningSnapshot::offset_to_utf16(CharOffset offset) const
+    {
+        return UTF16Offset{ Tree::utf_offset(&buffers, root, offset, &UTFCounts::utf16_units) };
+    }
+
+    CharOffset OwningSnapshot::utf16_to_offset(UTF16Offset offset) const
+    {
+        return Tree::utf_to_offset(&buffers, root, rep(offset), &UTFCounts::utf16_units);
+    }
+
+    CodePointOffset OwningSnapshot::offset_to_code_point(CharOffset offset) const
+    {
+        return CodePointOffset{ Tree::utf_offset(&buffers, root, offset, &UTFCounts::code_points) };
+    }
+
+    CharOffset OwningSnapshot::code_point_to_offset(CodePointOffset offset) const
+    {
+        return Tree::utf_to_offset(&buffers, root, rep(offset), &UTFCounts::code_points);
+    }
+
+    UTF16Offset OwningSnapshot::utf16_column(CharOffset offset) const
+    {
+        return Tree::utf16_column(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::utf16_column_to_offset(Line line, UTF16Offset column) const
+    {
+        return Tree::utf16_column_to_offset(&buffers, root, line, column);
+    }
+
+    UTF16Offset ReferenceSnapshot::offset_to_utf16(CharOffset offset) const
+    {
+        return UTF16Offset{ Tree::utf_offset(buffers, root, offset, &UTFCounts::utf16_units) };
+    }
+
+    CharOffset ReferenceSnapshot::utf16_to_offset(UTF16Offset offset) const
+    {
+        return Tree::utf_to_offset(buffers, root, rep(offset), &UTFCounts::utf16_units);
+    }
+
+    CodePointOffset ReferenceSnapshot::offset_to_code_point(CharOffset offset) const
+    {
+        return CodePointOffset{ Tree::utf_offset(buffers, root, offset, &UTFCounts::code_points) };
+    }
+
+    CharOffset ReferenceSnapshot::code_point_to_offset(CodePointOffset offset) const
+    {
+        return Tree::utf_to_offset(buffers, root, rep(offset), &UTFCounts::code_points);
+    }
+
+    UTF16Offset ReferenceSnapshot::utf16_column(CharOffset offset) const
+    {
+        return Tree::utf16_column(buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::utf16_column_to_offset(Line line, UTF16Offset column) const
+    {
+        return Tree::utf16_column_to_offset(buffers, root, line, column);
+    }
+#endif // TEXTBUF_UTF_COUNTS
+
+    OwningSnapshot Tree::owning_snap() const
+    {
+        return OwningSnapshot{ this };
+    }
+
+    ReferenceSnapshot Tree::ref_snap() const
+    {
+        return ReferenceSnapshot{ this };
+    }
+
+    Line Tree::line_at(CharOffset offset) const
+    {
+        if (is_empty())
+            return Line::Beginning;
+        auto result = node_at(&buffers, root, offset);
+        return result.line;
+    }
+
+    char Tree::at(CharOffset offset) const
+    {
+        return char_at(&buffers, root, offset);
+    }
+
+    char Tree::char_at(const BufferCollection* buffers, const RedBlackTree& node, CharOffset offset)
+    {
+        auto result = node_at(buffers, node, offset);
+        if (result.node == nullptr)
+            return '\0';
+        auto buf_offset = buffers->buffer_offset(result.node->piece.index, result.node->piece.first);
+        return buffer_char(buffers, result.node->piece.index, rep(buf_offset) + rep(result.remainder));
+    }
+
+    void Tree::assemble_line(std::string* buf, const PieceTree::RedBlackTree& node, Line line) const
+    {
+        if (node.is_empty())
+            return;
+        // Trying this new logic for now.
+#if 1
+        CharOffset line_offset{ };
+        line_start<&Tree::accumulate_value>(&line_offset, &buffers, node, line);
+        TreeWalker walker{ this, line_offset };
+        while (not walker.exhausted())
+        {
+            char c = walker.next();
+            if (c == '\n')
+                break;
+            buf->push_back(c);
+        }
+#else
+        assert(line != Line::IndexBeginning);
+        auto line_index = rep(retract(line));
+        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        {
+            assemble_line(buf, node.left(), line);
+            const bool same_index = rep(node.root().left_subtree_lf_count) == line_index;
+            if (same_index)
+            {
+                populate_from_node(buf, node);
+                // Visit the RHS if this piece did not introduce a newline.
+                if (rep(node.root().piece.newline_count) == 0)
+                {
+                    assemble_line(buf, node.right(), retract(line, rep(node.root().left_subtree_lf_count)));
+                }
+            }
+        }
+        // The desired line is directly within the node.
+        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) > line_index)
+        {
+            line_index -= rep(node.root().left_subtree_lf_count);
+            populate_from_node(buf, node, Line{ line_index });
+            return;
+        }
+        // assemble the LHS and RHS.
+        else
+        {
+            // This case implies that 'left_subtree_lf_count' is strictly < line_index.
+            // The content is somewhere in the middle.  We only need to populate from this node if the line index is exactly
+            assemble_line(buf, node.left(), line);
+            line_index -= rep(node.root().left_subtree_lf_count);
+            populate_from_node(buf, node, Line{ line_index });
+            if (rep(node.root().piece.newline_count) <= line_index)
+            {
+                assemble_line(buf, node.right(), retract(line, rep(node.root().left_subtree_lf_count + node.root().piece.newline_count)));
+            }
+        }
+#endif
+    }
+
+    void Tree::get_line_content(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return;
+        assemble_line(buf, root, line);
+    }
+
+    void OwningSnapshot::get_line_content(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return;
+        if (root.is_empty())
+            return;
+        CharOffset line_offset{ };
+        Tree::line_start<&Tree::accumulate_value>(&line_offset, &buffers, root, line);
+        TreeWalker walker{ this, line_offset };
+        while (not walker.exhausted())
+        {
+            char c = walker.next();
+            if (c == '\n')
+                break;
+            buf->push_back(c);
+        }
+    }
+
+    void ReferenceSnapshot::get_line_content(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return;
+        if (root.is_empty())
+            return;
+        CharOffset line_offset{ };
+        Tree::line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
+        TreeWalker walker{ this, line_offset };
+        while (not walker.exhausted())
+        {
+            char c = walker.next();
+            if (c == '\n')
+                break;
+            buf->push_back(c);
+        }
+    }
+
+    namespace
+    {
+        template <typename TreeT>
+        void assemble_range(std::string* buf, const TreeT* tree, CharOffset first, CharOffset last)
+        {
+            TreeWalker walker{ tree, first };
+            for (auto n = first < last ? rep(distance(first, last)) : 0; n != 0; --n)
+            {
+                buf->push_back(walker.next());
+            }
+        }
+    } // namespace [anon]
+
+    IncompleteCRLF Tree::get_line_content_crlf(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return IncompleteCRLF::No;
+        if (root.is_empty())
+            return IncompleteCRLF::No;
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        auto incomplete = line_end_crlf(&range.last, &buffers, root, extend(line));
+        assemble_range(buf, this, range.first, range.last);
+        return incomplete;
+    }
+
+    IncompleteCRLF OwningSnapshot::get_line_content_crlf(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return IncompleteCRLF::No;
+        if (root.is_empty())
+            return IncompleteCRLF::No;
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        auto incomplete = Tree::line_end_crlf(&range.last, &buffers, root, extend(line));
+        assemble_range(buf, this, range.first, range.last);
+        return incomplete;
+    }
+
+    IncompleteCRLF ReferenceSnapshot::get_line_content_crlf(std::string* buf, Line line) const
+    {
+        // Reset the buffer.
+        buf->clear();
+        if (line == Line::IndexBeginning)
+            return IncompleteCRLF::No;
+        if (root.is_empty())
+            return IncompleteCRLF::No;
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        auto incomplete = Tree::line_end_crlf(&range.last, buffers, root, extend(line));
+        assemble_range(buf, this, range.first, range.last);
+        return incomplete;
+    }
+
+    Line OwningSnapshot::line_at(CharOffset offset) const
+    {
+        if (is_empty())
+            return Line::Beginning;
+        auto result = Tree::node_at(&buffers, root, offset);
+        return result.line;
+    }
+
+    Line ReferenceSnapshot::line_at(CharOffset offset) const
+    {
+        if (is_empty())
+            return Line::Beginning;
+        auto result = Tree::node_at(buffers, root, offset);
+        return result.line;
+    }
+
+    LineRange OwningSnapshot::get_line_range(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        Tree::line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange ReferenceSnapshot::get_line_range(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        Tree::line_start<&Tree::accumulate_value_no_lf>(&range.last, buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange OwningSnapshot::get_line_range_crlf(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        Tree::line_end_crlf(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange ReferenceSnapshot::get_line_range_crlf(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        Tree::line_end_crlf(&range.last, buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange OwningSnapshot::get_line_range_with_newline(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        Tree::line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange ReferenceSnapshot::get_line_range_with_newline(Line line) const
+    {
+        LineRange range{ };
+        Tree::line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        Tree::line_start<&Tree::accumulate_value>(&range.last, buffers, root, extend(line));
+        return range;
+    }
+
+    LFCount Tree::line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
+    {
+        // If the end position is the beginning of a new line, then we can just return the difference in lines.
+        if (rep(end.column) == 0)
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        auto& starts = buffers->line_starts(index);
+        // It means, there is no LF after end.
+        if (end.line == Line{ starts.size() - 1})
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        // Due to the check above, we know that there's at least one more line after 'end.line'.
+        auto next_start_offset = starts[rep(extend(end.line))];
+        auto end_offset = rep(starts[rep(end.line)]) + rep(end.column);
+        // There are more than 1 character after end, which means it can't be LF.
+        if (rep(next_start_offset) > end_offset + 1)
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        // This must be the case.  next_start_offset is a line down, so it is
+        // not possible for end_offset to be < it at this point.
+        assert(end_offset + 1 == rep(next_start_offset));
+        return LFCount{ rep(retract(end.line, rep(start.line))) };
+    }
+
+    Piece Tree::build_piece(std::string_view txt)
+    {
+        auto start_offset = buffers.mod_buffer.buffer.size();
+        populate_line_starts(&scratch_starts, txt);
+        auto start = last_insert;
+        // Note: if the new text starts with LF and the mod buffer ends with CR, the pair is adjacent in the mod
+        // buffer but not necessarily in the document.  'node_data' accounts for this when counting CRLF pairs.
+        // Append new starts, offset relative to the existing buffer.
+        // Note: we can drop the first start because the algorithm always adds an empty start.
+        for (size_t i = 1; i < scratch_starts.size(); ++i)
+        {
+            buffers.mod_buffer.line_starts.push_back(extend(scratch_starts[i], start_offset));
+        }
+        buffers.mod_buffer.buffer.append(txt);
+
+        // Build the new piece for the inserted buffer.
+        auto end_offset = buffers.mod_buffer.buffer.size();
+        auto end_index = buffers.mod_buffer.line_starts.size() - 1;
+        auto end_col = end_offset - rep(buffers.mod_buffer.line_starts[end_index]);
+        BufferCursor end_pos = { .line = Line{ end_index }, .column = Column{ end_col } };
+        Piece piece = { .index = BufferIndex::ModBuf,
+                        .first = start,
+                        .last = end_pos,
+                        .length = Length{ end_offset - start_offset },
+                        .newline_count = line_feed_count(&buffers, BufferIndex::ModBuf, start, end_pos) };
+        // Update the last insertion.
+        last_insert = end_pos;
+        extend_mod_buffer_data(&buffers);
+        return piece;
+    }
+
+    NodeData Tree::node_data(const Piece& piece) const
+    {
+        NodeData data{ .piece = piece };
+        if (piece.length != Length{ })
+        {
+            auto& crlf_counts = piece.index == BufferIndex::ModBuf ? buffers.mod_crlf_counts
+                                                                   : *buffers.orig_crlf_counts[rep(piece.index)];
+            auto first = rep(buffers.buffer_offset(piece.index, piece.first));
+            auto last = first + rep(piece.length);
+            data.piece_starts_with_lf = buffer_char(&buffers, piece.index, first) == '\n';
+            data.piece_ends_with_cr = buffer_char(&buffers, piece.index, last - 1) == '\r';
+            data.piece_crlf_count = LFCount{ rep(crlf_counts[rep(piece.last.line)]) - rep(crlf_counts[rep(piece.first.line)]) };
+            // The CR of a pair starting the piece belongs to whatever precedes it in the buffer.
+            if (data.piece_starts_with_lf and first != 0 and buffer_char(&buffers, piece.index, first - 1) == '\r')
+            {
+                data.piece_crlf_count = retract(data.piece_crlf_count);
+            }
+        }
+#ifdef TEXTBUF_CONTENT_HASH
+        data.piece_hash = piece_hash(&buffers, piece);
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        data.piece_utf_counts = piece_utf_counts(&buffers, piece);
+#endif // TEXTBUF_UTF_COUNTS
+        return data;
+    }
+
+#ifdef TEXTBUF_UTF_COUNTS
+    size_t Tree::utf_offset(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset, size_t UTFCounts::* field)
+    {
+        // A code point counts from its first byte, so an offset within it counts from there too.
+        if (offset < CharOffset{ } + tree_length(root))
+        {
+            offset = prev_codepoint_boundary(buffers, root, extend(offset));
+        }
+        size_t units = 0;
+        auto node = root;
+        while (not node.is_empty())
+        {
+            auto& data = node.root();
+            if (offset < CharOffset{ } + data.left_subtree_length)
+            {
+                node = node.left();
+                continue;
+            }
+            units += data.left_subtree_utf_counts.*field;
+            offset = retract(offset, rep(data.left_subtree_length));
+            if (offset < CharOffset{ } + data.piece.length)
+            {
+                auto first = rep(buffers->buffer_offset(data.piece.index, data.piece.first));
+                auto counts = prefix_utf_counts(buffers, data.piece.index, first + rep(offset)) - prefix_utf_counts(buffers, data.piece.index, first);
+                return units + counts.*field;
+            }
+            units += data.piece_utf_counts.*field;
+            offset = retract(offset, rep(data.piece.length));
+            node = node.right();
+        }
+        return units;
+    }
+
+    CharOffset Tree::utf_to_offset(const BufferCollection* buffers, const RedBlackTree& root, size_t units, size_t UTFCounts::* field)
+    {
+        CharOffset offset{ };
+        auto node = root;
+        while (not node.is_empty())
+        {
+            auto& data = node.root();
+            if (units < data.left_subtree_utf_counts.*field)
+            {
+                node = node.left();
+                continue;
+            }
+            units -= data.left_subtree_utf_counts.*field;
+            offset = offset + data.left_subtree_length;
+            if (units < data.piece_utf_counts.*field)
+            {
+                auto first = rep(buffers->buffer_offset(data.piece.index, data.piece.first));
+                auto target = prefix_utf_counts(buffers, data.piece.index, first).*field + units;
+                auto p = find_utf_unit(buffers, data.piece.index, first, first + rep(data.piece.length), target, field);
+                return offset + Length{ p - first };
+            }
+            units -= data.piece_utf_counts.*field;
+            offset = offset + data.piece.length;
+            node = node.right();
+        }
+        return offset;
+    }
+
+    UTF16Offset Tree::utf16_column(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        if (root.is_empty())
+            return { };
+        offset = std::min(offset, CharOffset{ } + tree_length(root));
+        CharOffset line_first{ };
+        line_start<&Tree::accumulate_value>(&line_first, buffers, root, node_at(buffers, root, offset).line);
+        auto field = &UTFCounts::utf16_units;
+        return UTF16Offset{ utf_offset(buffers, root, offset, field) - utf_offset(buffers, root, line_first, field) };
+    }
+
+    CharOffset Tree::utf16_column_to_offset(const BufferCollection* buffers, const RedBlackTree& root, Line line, UTF16Offset column)
+    {
+        if (root.is_empty())
+            return { };
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, buffers, root, extend(line));
+        auto field = &UTFCounts::utf16_units;
+        auto units = utf_offset(buffers, root, range.first, field) + rep(column);
+        return std::min(utf_to_offset(buffers, root, units, field), range.last);
+    }
+#endif // TEXTBUF_UTF_COUNTS
+
+    NodePosition Tree::node_at(const BufferCollection* buffers, RedBlackTree node, CharOffset off)
+    {
+        size_t node_start_offset = 0;
+        size_t newline_count = 0;
+        while (not node.is_empty())
+        {
+            if (rep(node.root().left_subtree_length) > rep(off))
+            {
+                node = node.left();
+            }
+            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(off))
+            {
+                node_start_offset += rep(node.root().left_subtree_length);
+                newline_count += rep(node.root().left_subtree_lf_count);
+                // Now we find the line within this piece.
+                auto remainder = Length{ rep(retract(off, rep(node.root().left_subtree_length))) };
+                auto pos = buffer_position(buffers, node.root().piece, remainder);
+                // Note: since buffer_position will return us a newline relative to the buffer itself, we need
+                // to retract it by the starting line of the piece to get the real difference.
+                newline_count += rep(retract(pos.line, rep(node.root().piece.first.line)));
+                return { .node = &node.root(),
+                            .remainder = remainder,
+                            .start_offset = CharOffset{ node_start_offset },
+                            .line = Line{ newline_count + 1 } };
+            }
+            else
+            {
+                // If there are no more nodes to traverse to, return this final node.
+                if (node.right().is_empty())
+                {
+                    auto offset_amount = rep(node.root().left_subtree_length);
+                    node_start_offset += offset_amount;
+                    newline_count += rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
+                    // Now we find the line within this piece.
+                    auto remainder = node.root().piece.length;
+                    return { .node = &node.root(),
+                                .remainder = remainder,
+                                .start_offset = CharOffset{ node_start_offset },
+                                .line = Line{ newline_count + 1 } };
+                }
+                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
+                off = retract(off, offset_amount);
+                node_start_offset += offset_amount;
+                newline_count += rep(node.root().left_subtree_lf_count + node.root().piece.newline_count);
+                node = node.right();
+            }
+        }
+        return { };
+    }
+
+    BufferCursor Tree::buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
+    {
+        auto& starts = buffers->line_starts(piece.index);
+        auto start_offset = rep(starts[rep(piece.first.line)]) + rep(piece.first.column);
+        auto offset = start_offset + rep(remainder);
+
+        // Binary search for 'offset' between start and ending offset.
+        auto low = rep(piece.first.line);
+        auto high = rep(piece.last.line);
+
+        size_t mid = 0;
+        size_t mid_start = 0;
+        size_t mid_stop = 0;
+
+        while (low <= high)
+        {
+            mid = low + ((high - low) / 2);
+            mid_start = rep(starts[mid]);
+
+            if (mid == high)
+                break;
+            mid_stop = rep(starts[mid + 1]);
+
+            if (offset < mid_start)
+            {
+                high = mid - 1;
+            }
+            else if (offset >= mid_stop)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        return { .line = Line{ mid },
+                    .column = Column{ offset - mid_start } };
+    }
+
+    Piece Tree::trim_piece_right(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    {
+        auto orig_end_offset = buffers->buffer_offset(piece.index, piece.last);
+
+        auto new_end_offset = buffers->buffer_offset(piece.index, pos);
+        auto new_lf_count = line_feed_count(buffers, piece.index, piece.first, pos);
+
+        auto len_delta = distance(new_end_offset, orig_end_offset);
+        auto new_len = retract(piece.length, rep(len_delta));
+
+        auto new_piece = piece;
+        new_piece.last = pos;
+        new_piece.newline_count = new_lf_count;
+        new_piece.length = new_len;
+
+        return new_piece;
+    }
+
+    Piece Tree::trim_piece_left(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    {
+        auto orig_start_offset = buffers->buffer_offset(piece.index, piece.first);
+
+        auto new_start_offset = buffers->buffer_offset(piece.index, pos);
+        auto new_lf_count = line_feed_count(buffers, piece.index, pos, piece.last);
+
+        auto len_delta = distance(orig_start_offset, new_start_offset);
+        auto new_len = retract(piece.length, rep(len_delta));
+
+        auto new_piece = piece;
+        new_piece.first = pos;
+        new_piece.newline_count = new_lf_count;
+        new_piece.length = new_len;
+
+        return new_piece;
+    }
+
+    Tree::ShrinkResult Tree::shrink_piece(const BufferCollection* buffers, const Piece& piece, const BufferCursor& first, const BufferCursor& last)
+    {
+        auto left = trim_piece_right(buffers, piece, first);
+        auto right = trim_piece_left(buffers, piece, last);
+
+        return { .left = left, .right = right };
+    }
+
+    void Tree::combine_pieces(NodePosition existing, Piece new_piece)
+    {
+        // This transformation is only valid under the following conditions.
+        assert(existing.node->piece.index == BufferIndex::ModBuf);
+        // This assumes that the piece was just built.
+        assert(existing.node->piece.last == new_piece.first);
+        auto old_piece = existing.node->piece;
+        new_piece.first = old_piece.first;
+        new_piece.newline_count = new_piece.newline_count + old_piece.newline_count;
+        new_piece.length = new_piece.length + old_piece.length;
+        root = root.remove(existing.start_offset)
+                    .insert(node_data(new_piece), existing.start_offset);
+    }
+
+    void Tree::remove_node_range(NodePosition first, Length length)
+    {
+        // Remove pieces until we reach the desired length.
+        Length deleted_len{};
+        // Because we could be deleting content in the range starting at 'first' where the piece
+        // length could be much larger than 'length', we need to adjust 'length' to contain the
+        // delta in length within the piece to the end where 'length' starts:
+        // "abcd"  "efg"
+        //     ^     ^
+        //     |_____|
+        //      length to delete = 3
+        // P1 length: 4
+        // P2 length: 3 (though this length does not matter)
+        // We're going to remove all of 'P1' and 'P2' in this range and the caller will re-insert
+        // these pieces with the correct lengths.  If we fail to adjust 'length' we will delete P1
+        // and believe that the entire range was deleted.
+        assert(first.node != nullptr);
+        auto total_length = first.node->piece.length;
+        // (total - remainder) is the section of 'length' where 'first' intersects.
+        length = length - (total_length - first.remainder) + total_length;
+        auto delete_at_offset = first.start_offset;
+        while (deleted_len < length and first.node != nullptr)
+        {
+            deleted_len = deleted_len + first.node->piece.length;
+            root = root.remove(delete_at_offset);
+            first = node_at(&buffers, root, delete_at_offset);
+        }
+    }
+
+    void Tree::insert(CharOffset offset, std::string_view txt, SuppressHistory suppress_history)
+    {
+        if (txt.empty())
+            return;
+        // This allows us to undo blocks of code.
+        const bool new_entry = is_no(suppress_history)
+                               and (end_last_insert != offset or root.is_empty() or not coalesce_insert(txt));
+        if (new_entry)
+        {
+            append_undo(offset);
+        }
+        if (policy.coalesce_window != std::chrono::milliseconds{})
+        {
+            last_insert_time = std::chrono::steady_clock::now();
+        }
+        last_insert_char = txt.back();
+        internal_insert(offset, txt);
+        if (new_entry)
+        {
+            measure_parent();
+        }
+        text_inserted(offset, Length{ txt.size() });
+    }
+
+    void Tree::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    {
+        // Rule out the obvious noop.
+        if (rep(count) == 0 or root.is_empty())
+            return;
+        if (is_no(suppress_history))
+        {
+            append_undo(offset);
+        }
+        internal_remove(offset, count);
+        if (is_no(suppress_history))
+        {
+            measure_parent();
+        }
+        text_removed(offset, count);
+    }
+
+    void Tree::apply_edits(std::span<const Edit> edits, SuppressHistory suppress_history)
+    {
+        if (edits.empty())
+            return;
+        if (is_no(suppress_history))
+        {
+            append_undo(edits.front().offset);
+        }
+        internal_apply_edits(edits);
+        if (is_no(suppress_history))
+        {
+            measure_parent();
+        }
+        // Going backwards keeps the offsets of the earlier edits valid.
+        for (auto i = edits.size(); i != 0; --i)
+        {
+            auto& edit = edits[i - 1];
+            text_removed(edit.offset, edit.count);
+            text_inserted(edit.offset, Length{ edit.txt.size() });
+        }
+    }
+
+    void Tree::internal_apply_edits(std::span<const Edit> edits)
+    {
+#ifdef TEXTBUF_DEBUG
+        for (size_t i = 1; i < edits.size(); ++i)
+        {
+            assert(edits[i - 1].offset + edits[i - 1].count <= edits[i].offset);
+        }
+#endif // TEXTBUF_DEBUG
+        // A batch can never extend a previous insertion.
+        ScopeGuard guard{ [&] { end_last_insert = CharOffset::Sentinel; } };
+        size_t total_txt = 0;
+        for (auto& edit : edits)
+        {
+            total_txt += edit.txt.size();
+        }
+
+        // Small batches are cheaper to apply through path copying.  Apply them back to front so the
+        // offsets of earlier edits remain valid.
+        constexpr size_t bulk_edit_threshold = 32;
+        if (edits.size() < bulk_edit_threshold)
+        {
+            for (auto i = edits.size(); i != 0; --i)
+            {
+                auto& edit = edits[i - 1];
+                if (rep(edit.count) != 0 and not root.is_empty())
+                {
+                    internal_remove(edit.offset, edit.count);
+                }
+                if (not edit.txt.empty())
+                {
+                    internal_insert(edit.offset, edit.txt);
+                }
+            }
+            return;
+        }
+
+        // Append all of the inserted text to the mod buffer in one go and carve the new pieces out of it.
+        Piece inserted{ };
+        if (total_txt != 0)
+        {
+            std::string txt;
+            txt.reserve(total_txt);
+            for (auto& edit : edits)
+            {
+                txt.append(edit.txt);
+            }
+            inserted = build_piece(txt);
+        }
+
+        // Gather the existing pieces in document order.
+        std::vector<Piece> pieces;
+        std::vector<RedBlackTree> stack;
+        auto node = root;
+        while (not node.is_empty() or not stack.empty())
+        {
+            while (not node.is_empty())
+            {
+                stack.push_back(node);
+                node = node.left();
+            }
+            node = stack.back();
+            stack.pop_back();
+            pieces.push_back(node.root().piece);
+            node = node.right();
+        }
+
+        // Merge the edits into the piece list.
+        std::vector<NodeData> result;
+        result.reserve(pieces.size() + 2 * edits.size());
+        size_t piece_index = 0;
+        Piece current{ };
+        CharOffset current_start{ };
+        bool have_current = false;
+        auto advance = [&] {
+            if (have_current)
+            {
+                current_start = current_start + current.length;
+            }
+            have_current = piece_index < pieces.size();
+            if (have_current)
+            {
+                current = pieces[piece_index++];
+            }
+        };
+        advance();
+        Length inserted_offset{ };
+        for (auto& edit : edits)
+        {
+            // Retain everything before the edit.
+            while (have_current and current_start + current.length <= edit.offset)
+            {
+                result.push_back(node_data(current));
+                advance();
+            }
+            if (have_current and current_start < edit.offset)
+            {
+                auto pos = buffer_position(&buffers, current, distance(current_start, edit.offset));
+                result.push_back(node_data(trim_piece_right(&buffers, current, pos)));
+                current = trim_piece_left(&buffers, current, pos);
+                current_start = edit.offset;
+            }
+
+            if (not edit.txt.empty())
+            {
+                auto first = buffer_position(&buffers, inserted, inserted_offset);
+                inserted_offset = inserted_offset + Length{ edit.txt.size() };
+                auto last = buffer_position(&buffers, inserted, inserted_offset);
+                result.push_back(node_data(Piece{ .index = BufferIndex::ModBuf,
+                                                  .first = first,
+                                                  .last = last,
+                                                  .length = Length{ edit.txt.size() },
+                                                  .newline_count = line_feed_count(&buffers, BufferIndex::ModBuf, first, last) }));
+            }
+
+            // Drop the removed range.
+            auto removed_end = edit.offset + edit.count;
+            while (have_current and current_start + current.length <= removed_end)
+            {
+                advance();
+            }
+            if (have_current and current_start < removed_end)
+            {
+                auto pos = buffer_position(&buffers, current, distance(current_start, removed_end));
+                current = trim_piece_left(&buffers, current, pos);
+                current_start = removed_end;
+            }
+        }
+        while (have_current)
+        {
+            result.push_back(node_data(current));
+            advance();
+        }
+
+        root = RedBlackTree::build(result);
+        compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+        satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+    }
+
+    void Tree::convert_line_endings(LineEnding target, SuppressHistory suppress_history)
+    {
+        const bool to_crlf = target == LineEnding::CRLF;
+        const auto lf_count = rep(meta.lf_count);
+        const auto crlf_count = rep(meta.crlf_count);
+        if (crlf_count == (to_crlf ? lf_count : 0))
+            return;
+        if (is_no(suppress_history))
+        {
+            append_undo(CharOffset{ });
+        }
+        end_last_insert = CharOffset::Sentinel;
+
+        // Produce the converted text and its line starts in a single pass over the piece spans, using memchr to
+        // skip to each line ending.
+        CharBuffer converted;
+        auto& out = converted.buffer;
+        auto& starts = converted.line_starts;
+        out.reserve(rep(meta.total_content_length) + (to_crlf ? lf_count - crlf_count : 0));
+        starts.push_back({ });
+        // Only needed when converting to LF: a CR which ended the previous span and may precede an LF.
+        bool pending_cr = false;
+        // The offsets of the CRs inserted or removed, for whatever follows the text.
+        const bool track = load_point != CharOffset::Sentinel or not marker_trees.empty() or not decoration_trees.empty();
+        std::vector<CharOffset> changed_crs;
+        for_each_span(&buffers, root, CharOffset{ }, [&](std::string_view span, CharOffset span_offset, const Piece&, const BufferPin&) {
+            const auto* span_first = span.data();
+            auto offset_of = [&](const char* c) { return span_offset + Length{ static_cast<size_t>(c - span_first) }; };
+            if (to_crlf)
+            {
+                while (auto* lf = static_cast<const char*>(std::memchr(span.data(), '\n', span.size())))
+                {
+                    auto head = span.substr(0, lf - span.data());
+                    out.append(head);
+                    if (out.empty() or out.back() != '\r')
+                    {
+                        out.push_back('\r');
+                        if (track)
+                        {
+                            changed_crs.push_back(offset_of(lf));
+                        }
+                    }
+                    out.push_back('\n');
+                    starts.push_back(LineStart{ out.size() });
+                    span.remove_prefix(head.size() + 1);
+                }
+                out.append(span);
+                return true;
+            }
+
+            if (pending_cr and span.front() != '\n')
+            {
+                out.push_back('\r');
+            }
+            else if (pending_cr and track)
+            {
+                changed_crs.push_back(retract(span_offset));
+            }
+            pending_cr = false;
+            while (auto* cr = static_cast<const char*>(std::memchr(span.data(), '\r', span.size())))
+            {
+                auto head = span.substr(0, cr - span.data());
+                out.append(head);
+                span.remove_prefix(head.size() + 1);
+                if (span.empty())
+                {
+                    pending_cr = true;
+                    break;
+                }
+                // Drop the CR of a CRLF pair.
+                if (span.front() != '\n')
+                {
+                    out.push_back('\r');
+                }
+                else if (track)
+                {
+                    changed_crs.push_back(offset_of(cr));
+                }
+            }
+            out.append(span);
+            return true;
+        });
+        if (pending_cr)
+        {
+            out.push_back('\r');
+        }
+        if (not to_crlf)
+        {
+            populate_line_starts(&starts, out);
+        }
+
+        auto piece = append_orig_buffer(std::move(converted));
+        root = RedBlackTree{ }.insert(node_data(piece), CharOffset{ });
+        compute_buffer_meta();
+        if (is_no(suppress_history))
+        {
+            measure_parent();
+        }
+        // Going backwards keeps the offsets of the earlier line endings valid.
+        for (auto i = changed_crs.size(); i != 0; --i)
+        {
+            if (to_crlf)
+            {
+                text_inserted(changed_crs[i - 1], Length{ 1 });
+            }
+            else
+            {
+                text_removed(changed_crs[i - 1], Length{ 1 });
+            }
+        }
+#ifdef TEXTBUF_DEBUG
+        satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+    }
+
+    void Tree::compute_buffer_meta()
+    {
+        ::PieceTree::compute_buffer_meta(&meta, root);
+    }
+
+    void Tree::reset_history()
+    {
+        for (auto& entry : history)
+        {
+            retire(std::move(entry.root));
+        }
+        history.clear();
+        history_base = 0;
+        retained_bytes = 0;
+        // The only state holds every chunk loaded so far.
+        loaded_chunks.clear();
+        history.push_back({ .root = root,
+                            .op_offset = CharOffset{ },
+                            .redo_offset = CharOffset{ },
+                            .parent = HistoryId::Invalid,
+                            .redo_child = HistoryId::Invalid,
+                            .children = { },
+                            .retained_bytes = 0,
+                            .loaded_chunks = 0,
+                            .load_point = load_point });
+        current_state = HistoryId{ 0 };
+        rebuild_retained_sums();
+    }
+
+    const UndoRedoEntry* Tree::history_at(HistoryId id) const
+    {
+        if (rep(id) < history_base or rep(id) - history_base >= history.size())
+            return nullptr;
+        return &history[rep(id) - history_base];
+    }
+
+    UndoRedoEntry& Tree::history_entry(HistoryId id)
+    {
+        assert(history_at(id) != nullptr);
+        return history[rep(id) - history_base];
+    }
+
+    void Tree::leave_current_state()
+    {
+        // The current state may have advanced through coalesced or suppressed edits, so capture the live
+        // root before navigating away from it.
+        auto& entry = history_entry(current_state);
+        entry.root = root;
+        entry.loaded_chunks = loaded_chunks.size();
+        entry.load_point = load_point;
+        set_retained_bytes(current_state, estimate_retained_bytes(root));
+    }
+
+    void Tree::enter_state(HistoryId id)
+    {
+        // The entries between the old and the new state switch between undo and redo, which 'undo_bytes' picks up
+        // from the new current state.
+        auto& entry = history_entry(id);
+        set_retained_bytes(id, 0);
+        // The state being left retains whatever the new root does not share with it.
+        set_retained_bytes(current_state, unshared_bytes(history_entry(current_state).root, entry.root));
+        current_state = id;
+        catch_up_loaded(&entry);
+        map_attached(root, entry.root);
+        root = entry.root;
+        // An insertion after navigating must start a new history entry rather than extend this state.
+        end_last_insert = CharOffset::Sentinel;
+        compute_buffer_meta();
+        evict_history();
+    }
+
+    void Tree::append_undo(CharOffset op_offset)
+    {
+        // Rather than discarding the redo history, the new edit starts a new branch from the current state.
+        leave_current_state();
+        auto parent_id = current_state;
+        auto child_id = HistoryId{ history_base + history.size() };
+        auto& parent = history_entry(parent_id);
+        parent.op_offset = op_offset;
+        parent.children.push_back(child_id);
+        parent.redo_child = child_id;
+        // The root of the new state is captured when we leave it.
+        history.push_back({ .root = root,
+                            .op_offset = CharOffset{ },
+                            .redo_offset = CharOffset{ },
+                            .parent = parent_id,
+                            .redo_child = HistoryId::Invalid,
+                            .children = { },
+                            .retained_bytes = 0,
+                            .loaded_chunks = 0,
+                            .load_point = CharOffset::Sentinel });
+        current_state = child_id;
+        // The new entry retains nothing yet, so its node only sums the entries it covers below it.
+        auto n = retained_sums.size() + 1;
+        retained_sums.push_back(retained_prefix(n - 1) - retained_prefix(n - lowest_bit(n)));
+        evict_history();
+    }
+
+    void Tree::measure_parent()
+    {
+        // An edit which rebuilds the tree (a large batch or a line ending conversion) leaves its parent holding
+        // every node of the old root, far beyond what 'leave_current_state' assumes.
+        auto parent_id = history_entry(current_state).parent;
+        if (history_at(parent_id) == nullptr)
+            return;
+        set_retained_bytes(parent_id, unshared_bytes(history_entry(parent_id).root, root));
+        evict_history();
+    }
+
+    bool Tree::coalesce_insert(std::string_view txt) const
+    {
+        // Contiguous insertions are grouped into a single undo entry unless the policy dictates otherwise.
+        if (policy.coalesce_window != std::chrono::milliseconds{}
+            and std::chrono::steady_clock::now() - last_insert_time > policy.coalesce_window)
+            return false;
+        // Start a new group when a new word begins.
+        if (is_yes(policy.coalesce_words)
+            and is_word_break(last_insert_char)
+            and not is_word_break(txt.front()))
+            return false;
+        return true;
+    }
+
+    void Tree::evict_history()
+    {
+        // The oldest entries are released first.  Since ids are chronological, the oldest entry is always
+        // a root of the remaining history (its parent, if any, was evicted before it).
+        while (history.size() > 1)
+        {
+            const bool over_count = policy.max_entries != 0 and history.size() - 1 > policy.max_entries;
+            const bool over_budget = policy.max_retained_bytes != 0 and undo_bytes() > policy.max_retained_bytes;
+            if (not over_count and not over_budget)
+                return;
+            // The current state is never evicted.
+            if (HistoryId{ history_base } == current_state)
+                return;
+            set_retained_bytes(HistoryId{ history_base }, 0);
+            retire(std::move(history.front().root));
+            history.pop_front();
+            ++history_base;
+            // Drop the evicted prefix once it outweighs the live entries, which keeps eviction amortized O(1).
+            if (history_base - retained_sums_base > history.size())
+            {
+                rebuild_retained_sums();
+            }
+        }
+    }
+
+    void Tree::set_retained_bytes(HistoryId id, size_t bytes)
+    {
+        auto& entry = history_entry(id);
+        auto delta = bytes - entry.retained_bytes;
+        entry.retained_bytes = bytes;
+        retained_bytes += delta;
+        for (auto i = rep(id) - retained_sums_base + 1; i <= retained_sums.size(); i += lowest_bit(i))
+        {
+            retained_sums[i - 1] += delta;
+        }
+    }
+
+    size_t Tree::undo_bytes() const
+    {
+        return retained_prefix(rep(current_state) - retained_sums_base);
+    }
+
+    size_t Tree::retained_prefix(size_t count) const
+    {
+        size_t sum = 0;
+        for (auto i = count; i != 0; i -= lowest_bit(i))
+        {
+            sum += retained_sums[i - 1];
+        }
+        return sum;
+    }
+
+    void Tree::rebuild_retained_sums()
+    {
+        retained_sums_base = history_base;
+        retained_sums.resize(history.size());
+        for (size_t i = 0; i < history.size(); ++i)
+        {
+            retained_sums[i] = history[i].retained_bytes;
+        }
+        for (size_t i = 1; i <= retained_sums.size(); ++i)
+        {
+            auto parent = i + lowest_bit(i);
+            if (parent <= retained_sums.size())
+            {
+                retained_sums[parent - 1] += retained_sums[i - 1];
+            }
+        }
+    }
+
+    void Tree::history_policy(const HistoryPolicy& new_policy)
+    {
+        policy = new_policy;
+        evict_history();
+    }
+
+    UndoRedoResult Tree::try_undo(CharOffset op_offset)
+    {
+        auto child_id = current_state;
+        auto parent_id = history_entry(child_id).parent;
+        if (history_at(parent_id) == nullptr)
+            return { .success = false, .op_offset = CharOffset{ } };
+        leave_current_state();
+        history_entry(child_id).redo_offset = op_offset;
+        history_entry(parent_id).redo_child = child_id;
+        enter_state(parent_id);
+        return { .success = true, .op_offset = history_entry(parent_id).op_offset };
+    }
+
+    UndoRedoResult Tree::try_redo(CharOffset op_offset)
+    {
+        auto child_id = history_entry(current_state).redo_child;
+        if (history_at(child_id) == nullptr)
+            return { .success = false, .op_offset = CharOffset{ } };
+        leave_current_state();
+        history_entry(current_state).op_offset = op_offset;
+        enter_state(child_id);
+        return { .success = true, .op_offset = history_entry(child_id).redo_offset };
+    }
+
+    UndoRedoResult Tree::jump_to(HistoryId id)
+    {
+        if (history_at(id) == nullptr)
+            return { .success = false, .op_offset = CharOffset{ } };
+        if (id != current_state)
+        {
+            leave_current_state();
+            enter_state(id);
+        }
+        return { .success = true, .op_offset = history_entry(id).op_offset };
+    }
+
+    UndoRedoResult Tree::history_earlier()
+    {
+        if (rep(current_state) == history_base)
+            return { .success = false, .op_offset = CharOffset{ } };
+        return jump_to(retract(current_state));
+    }
+
+    UndoRedoResult Tree::history_later()
+    {
+        return jump_to(extend(current_state));
+    }
+
+    // Direct history manipulation.
+    void Tree::commit_head(CharOffset offset)
+    {
+        append_undo(offset);
+    }
+
+    RedBlackTree Tree::head() const
+    {
+        return root;
+    }
+
+    void Tree::snap_to(const RedBlackTree& new_root)
+    {
+        map_attached(root, new_root);
+        auto old_root = std::exchange(root, new_root);
+        retire(std::move(old_root));
+        compute_buffer_meta();
+    }
+
+    void Tree::map_attached(const RedBlackTree& old_root, const RedBlackTree& new_root)
+    {
+        if (marker_trees.empty() and decoration_trees.empty())
+            return;
+        DiffRanges ranges;
+        diff(&ranges, old_root, new_root);
+        // Going backwards keeps the old offsets of the earlier ranges valid.
+        for (auto i = ranges.size(); i != 0; --i)
+        {
+            auto& range = ranges[i - 1];
+            if (not map_line_endings(old_root, new_root, range))
+            {
+                map_attached(range.old_first, range.old_length, range.new_length);
+            }
+        }
+    }
+
+    void Tree::map_attached(CharOffset offset, Length removed, Length inserted)
+    {
+        for (auto* markers : marker_trees)
+        {
+            markers->removed(offset, removed);
+            markers->inserted(offset, inserted);
+        }
+        for (auto* decorations : decoration_trees)
+        {
+            decorations->removed(offset, removed);
+            decorations->inserted(offset, inserted);
+        }
+    }
+
+    bool Tree::map_line_endings(const RedBlackTree& old_root, const RedBlackTree& new_root, const DiffRange& range)
+    {
+        if (range.old_length == Length{ } or range.new_length == Length{ })
+            return false;
+        // Walk both sides together, noting each CR present on one side only.  A mismatch usually shows up within
+        // the first few characters, so ranges changed by ordinary edits are rejected cheaply.
+        struct LineEndingChange
+        {
+            CharOffset offset;
+            bool inserted;
+        };
+        std::vector<LineEndingChange> changes;
+        SpanIterator old_it{ &buffers, &old_root, CharOffset{ } + tree_length(old_root), range.old_first };
+        SpanIterator new_it{ &buffers, &new_root, CharOffset{ } + tree_length(new_root), range.new_first };
+        size_t old_used = 0;
+        size_t new_used = 0;
+        while (old_used < rep(range.old_length) and new_used < rep(range.new_length))
+        {
+            if (*old_it == *new_it)
+            {
+                ++old_it;
+                ++old_used;
+                ++new_it;
+                ++new_used;
+            }
+            else if (*old_it == '\r' and *new_it == '\n')
+            {
+                changes.push_back({ .offset = range.old_first + Length{ old_used }, .inserted = false });
+                ++old_it;
+                ++old_used;
+            }
+            else if (*old_it == '\n' and *new_it == '\r')
+            {
+                changes.push_back({ .offset = range.old_first + Length{ old_used }, .inserted = true });
+                ++new_it;
+                ++new_used;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        if (old_used != rep(range.old_length) or new_used != rep(range.new_length))
+            return false;
+        for (auto i = changes.size(); i != 0; --i)
+        {
+            auto& change = changes[i - 1];
+            map_attached(change.offset, change.inserted ? Length{ } : Length{ 1 }, change.inserted ? Length{ 1 } : Length{ });
+        }
+        return true;
+    }
+
+    void Tree::defer_reclamation(std::shared_ptr<NodeReclaimer> new_reclaimer)
+    {
+        reclaimer = std::move(new_reclaimer);
+    }
+
+    void Tree::attach_markers(MarkerTree* markers)
+    {
+        marker_trees.push_back(markers);
+    }
+
+    void Tree::detach_markers(MarkerTree* markers)
+    {
+        std::erase(marker_trees, markers);
+    }
+
+    void Tree::attach_decorations(DecorationTree* decorations)
+    {
+        decoration_trees.push_back(decorations);
+    }
+
+    void Tree::detach_decorations(DecorationTree* decorations)
+    {
+        std::erase(decoration_trees, decorations);
+    }
+
+    void Tree::retire(RedBlackTree&& old_root)
+    {
+        if (reclaimer != nullptr)
+        {
+            reclaimer->retire(std::move(old_root));
+        }
+        old_root = RedBlackTree{ };
+    }
+
+#ifdef TEXTBUF_DEBUG
+    void print_piece(const Piece& piece, const Tree* tree, int level)
+    {
+        const char* levels = "|||||||||||||||||||||||||||||||";
+        printf("%.*sidx{%zd}, first{l{%zd}, c{%zd}}, last{l{%zd}, c{%zd}}, len{%zd}, lf{%zd}\n",
+                level, levels,
+                rep(piece.index), rep(piece.first.line), rep(piece.first.column),
+                                  rep(piece.last.line), rep(piece.last.column),
+                    rep(piece.length), rep(piece.newline_count));
+        BufferPin pin;
+        auto text = tree->buffers.buffer_text(piece.index, tree->buffers.buffer_offset(piece.index, piece.first), piece.length, &pin);
+        printf("%.*sPiece content: %.*s\n", level, levels, static_cast<int>(text.size()), text.data());
+    }
+#endif // TEXTBUF_DEBUG
+
+    void TreeBuilder::accept(std::string_view txt)
+    {
+        populate_line_starts(&scratch_starts, txt);
+        buffers.push_back(std::make_shared<CharBuffer>(std::string{ txt }, scratch_starts));
+    }
+
+    namespace
+    {
+        enum class Bias : bool { Before, After };
+
+        // Maps 'offset' in a document to the document after 'applied'.  An offset inside a removed range lands
+        // after the text which replaced it, and an offset at the start of an edit lands before or after its
+        // text as 'bias' says.
+        CharOffset map_offset(const Change& applied, CharOffset offset, Bias bias)
+        {
+            size_t added = 0;
+            size_t removed = 0;
+            for (auto& edit : applied)
+            {
+                if (offset < edit.offset)
+                    break;
+                if (offset == edit.offset)
+                    return CharOffset{ rep(offset) + added - removed + (bias == Bias::After ? edit.txt.size() : 0) };
+                if (offset < edit.offset + edit.count)
+                    return CharOffset{ rep(edit.offset) + added - removed + edit.txt.size() };
+                added += edit.txt.size();
+                removed += rep(edit.count);
+            }
+            return CharOffset{ rep(offset) + added - removed };
+        }
+    } // namespace [anon]
+
+    void transform_change(Change* out, const Change& change, const Change& applied, TieBreak tie)
+    {
+        out->clear();
+        auto push = [&](CharOffset offset, Length count, std::string_view txt) {
+            if (rep(count) == 0 and txt.empty())
+                return;
+            // Text followed by a removal at the same offset (or text from consecutive edits) is one edit.
+            if (not out->empty() and out->back().offset == offset and rep(out->back().count) == 0)
+            {
+                out->back().count = count;
+                out->back().txt.append(txt);
+                return;
+            }
+            out->push_back({ .offset = offset, .count = count, .txt = std::string{ txt } });
+        };
+        const auto text_bias = tie == TieBreak::ChangeFirst ? Bias::Before : Bias::After;
+        for (auto& edit : change)
+        {
+            push(map_offset(applied, edit.offset, text_bias), Length{ }, edit.txt);
+            // Whatever 'applied' removed from the range is gone already, and whatever it inserted strictly inside
+            // the range is kept, so the removal becomes the remaining segments.
+            auto segment = [&](CharOffset first, CharOffset last) {
+                push(map_offset(applied, first, Bias::After), distance(first, last), { });
+            };
+            auto cursor = edit.offset;
+            const auto last = edit.offset + edit.count;
+            for (auto& other : applied)
+            {
+                if (other.offset + other.count <= cursor)
+                    continue;
+                if (other.offset >= last)
+                    break;
+                if (cursor < other.offset)
+                {
+                    segment(cursor, other.offset);
+                }
+                cursor = std::max(cursor, other.offset + other.count);
+            }
+            if (cursor < last)
+            {
+                segment(cursor, last);
+            }
+        }
+    }
+
+    CollabSession::CollabSession(Tree* tree):
+        tree{ tree } { }
+
+    Revision CollabSession::submit(Revision base, const Change& change, Change* accepted)
+    {
+        if (rep(base) < log_base or revision() < base)
+            return Revision::Invalid;
+        Change rebased = change;
+        Change scratch;
+        for (auto i = rep(base) - log_base; i < log.size(); ++i)
+        {
+            transform_change(&scratch, rebased, log[i]);
+            std::swap(scratch, rebased);
+        }
+        std::vector<Edit> edits;
+        edits.reserve(rebased.size());
+        for (auto& edit : rebased)
+        {
+            edits.push_back({ .offset = edit.offset, .count = edit.count, .txt = edit.txt });
+        }
+        tree->apply_edits(edits, SuppressHistory::Yes);
+        if (accepted != nullptr)
+        {
+            *accepted = rebased;
+        }
+        log.push_back(std::move(rebased));
+        return revision();
+    }
+
+    std::span<const Change> CollabSession::changes_since(Revision base) const
+    {
+        if (rep(base) < log_base or revision() < base)
+            return { };
+        return std::span{ log }.subspan(rep(base) - log_base);
+    }
+
+    void CollabSession::discard_before(Revision oldest)
+    {
+        auto count = std::min(rep(oldest) - std::min(rep(oldest), log_base), log.size());
+        log.erase(log.begin(), log.begin() + count);
+        log_base += count;
+    }
+
+    SnapshotPublisher::SnapshotPublisher(const Tree& tree):
+        current{ std::make_shared<const PublishedSnapshot>(tree.owning_snap(), 0) } { }
+
+    void SnapshotPublisher::publish(const Tree& tree)
+    {
+        // The snapshot is built entirely before it becomes visible, and the release store orders those writes
+        // before any reader's acquire load.
+        auto next = std::make_shared<const PublishedSnapshot>(tree.owning_snap(), ++generation);
+        current.store(std::move(next), std::memory_order_release);
+    }
+
+    PublishedSnapshotReference SnapshotPublisher::acquire() const
+    {
+        return current.load(std::memory_order_acquire);
+    }
+
+    ProgressiveLoader::ProgressiveLoader(const std::filesystem::path& path, Length chunk_size):
+        reader{ [this, path, chunk_size] { read_file(path, rep(chunk_size)); } } { }
+
+    ProgressiveLoader::~ProgressiveLoader()
+    {
+        cancelled = true;
+        reader.join();
+    }
+
+    void ProgressiveLoader::read_file(std::filesystem::path path, size_t chunk_size)
+    {
+        auto* file = std::fopen(path.string().c_str(), "rb");
+        int err = file == nullptr ? errno : 0;
+        LineStarts starts;
+        while (file != nullptr and not cancelled)
+        {
+            std::string chunk(chunk_size, '\0');
+            auto n = std::fread(chunk.data(), 1, chunk.size(), file);
+            if (n == 0)
+            {
+                if (std::ferror(file))
+                {
+                    err = errno != 0 ? errno : EIO;
+                }
+                break;
+            }
+            chunk.resize(n);
+            populate_line_starts(&starts, chunk);
+            std::lock_guard guard{ lock };
+            ready.push_back({ .buffer = std::move(chunk), .line_starts = starts });
+        }
+        if (file != nullptr)
+        {
+            std::fclose(file);
+        }
+        std::lock_guard guard{ lock };
+        done = true;
+        error = err;
+    }
+
+    LoadProgress ProgressiveLoader::pump(Tree* tree, size_t max_chunks)
+    {
+        std::vector<CharBuffer> chunks;
+        bool finished;
+        int err;
+        {
+            std::lock_guard guard{ lock };
+            auto count = std::min(max_chunks, ready.size());
+            chunks.assign(std::make_move_iterator(ready.begin()), std::make_move_iterator(ready.begin() + count));
+            ready.erase(ready.begin(), ready.begin() + count);
+            finished = done and ready.empty();
+            err = error;
+        }
+        for (auto& chunk : chunks)
+        {
+            loaded = loaded + Length{ chunk.buffer.size() };
+            tree->append_loaded(std::move(chunk));
+        }
+        return { .loaded = loaded, .finished = finished, .error = err };
+    }
+
+    OwningSnapshot::OwningSnapshot(const Tree* tree):
+        root{ tree->root },
+        meta{ tree->meta },
+        buffers{ tree->buffers },
+        reclaimer{ tree->reclaimer }
+    {
+        copy_decorations(&decoration_trees, tree->decoration_trees);
+    }
+
+    OwningSnapshot::OwningSnapshot(const Tree* tree, const RedBlackTree& dt):
+        root{ tree->root },
+        meta{ tree->meta },
+        buffers{ tree->buffers },
+        reclaimer{ tree->reclaimer }
+    {
+        copy_decorations(&decoration_trees, tree->decoration_trees);
+        // Compute the buffer meta for 'dt'.
+        compute_buffer_meta(&meta, dt);
+    }
+
+    OwningSnapshot& OwningSnapshot::operator=(const OwningSnapshot& other)
+    {
+        if (this != &other)
+        {
+            *this = OwningSnapshot{ other };
+        }
+        return *this;
+    }
+
+    OwningSnapshot& OwningSnapshot::operator=(OwningSnapshot&& other)
+    {
+        if (this == &other)
+            return *this;
+        if (reclaimer != nullptr)
+        {
+            reclaimer->retire(std::exchange(root, RedBlackTree{ }));
+        }
+        root = std::move(other.root);
+        meta = other.meta;
+        buffers = std::move(other.buffers);
+        decoration_trees = std::move(other.decoration_trees);
+        reclaimer = std::move(other.reclaimer);
+        return *this;
+    }
+
+    OwningSnapshot::~OwningSnapshot()
+    {
+        if (reclaimer != nullptr)
+        {
+            reclaimer->retire(std::move(root));
+        }
+    }
+
+    ReferenceSnapshot::ReferenceSnapshot(const Tree* tree):
+        root{ tree->root },
+        meta{ tree->meta },
+        buffers{ &tree->buffers } { }
+
+    ReferenceSnapshot::ReferenceSnapshot(const Tree* tree, const RedBlackTree& dt):
+        root{ dt },
+        meta{ tree->meta },
+        buffers{ &tree->buffers }
+    {
+        // Compute the buffer meta for 'dt'.
+        compute_buffer_meta(&meta, dt);
+    }
+
+    TreeWalker::TreeWalker(const Tree* tree, CharOffset offset):
+        buffers{ &tree->buffers },
+        root{ tree->root },
+        meta{ tree->meta },
+        stack{ { root } },
+        total_offset{ offset }
+    {
+        fast_forward_to(offset);
+    }
+
+    TreeWalker::TreeWalker(const OwningSnapshot* snap, CharOffset offset):
+        buffers{ &snap->buffers },
+        root{ snap->root },
+        meta{ snap->meta },
+        stack{ { root } },
+        total_offset{ offset }
+    {
+        fast_forward_to(offset);
     }
 
     TreeWalker::TreeWalker(const ReferenceSnapshot* snap, CharOffset offset):
@@ -1719,341 +5662,2086 @@ namespace PieceTree
         stack{ { root } },
         total_offset{ offset }
     {
-        fast_forward_to(offset);
+        fast_forward_to(offset);
+    }
+
+    char TreeWalker::next()
+    {
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // If this is exhausted, we're done.
+            if (exhausted())
+                return '\0';
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next();
+        }
+        total_offset = total_offset + Length{ 1 };
+        return *first_ptr++;
+    }
+
+    char TreeWalker::current()
+    {
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // If this is exhausted, we're done.
+            if (exhausted())
+                return '\0';
+        }
+        return *first_ptr;
+    }
+
+    void TreeWalker::seek(CharOffset offset)
+    {
+        stack.clear();
+        stack.push_back({ root });
+        total_offset = offset;
+        fast_forward_to(offset);
+    }
+
+    bool TreeWalker::exhausted() const
+    {
+        if (stack.empty())
+            return true;
+        // If we have not exhausted the pointers, we're still active.
+        if (first_ptr != last_ptr)
+            return false;
+        // If there's more than one entry on the stack, we're still active.
+        if (stack.size() > 1)
+            return false;
+        // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
+        // we're done.
+        auto& entry = stack.back();
+        // We descended into a null child, we're done.
+        if (entry.node.is_empty())
+            return true;
+        if (entry.dir == Direction::Right and entry.node.right().is_empty())
+            return true;
+        return false;
+    }
+
+    Length TreeWalker::remaining() const
+    {
+        return meta.total_content_length - distance(CharOffset{}, total_offset);
+    }
+
+    void TreeWalker::populate_ptrs()
+    {
+        if (exhausted())
+            return;
+        if (stack.back().node.is_empty())
+        {
+            stack.pop_back();
+            populate_ptrs();
+            return;
+        }
+
+        auto& [node, dir] = stack.back();
+        if (dir == Direction::Left)
+        {
+            if (not node.left().is_empty())
+            {
+                auto left = node.left();
+                // Change the dir for when we pop back.
+                stack.back().dir = Direction::Center;
+                stack.push_back({ left });
+                populate_ptrs();
+                return;
+            }
+            // Otherwise, let's visit the center, we can actually fallthrough.
+            stack.back().dir = Direction::Center;
+            dir = Direction::Center;
+        }
+
+        if (dir == Direction::Center)
+        {
+            auto& piece = node.root().piece;
+            auto text = buffers->buffer_text(piece.index, buffers->buffer_offset(piece.index, piece.first), piece.length, &pinned);
+            first_ptr = text.data();
+            last_ptr = text.data() + text.size();
+            // Change this direction.
+            stack.back().dir = Direction::Right;
+            return;
+        }
+
+        assert(dir == Direction::Right);
+        auto right = node.right();
+        stack.pop_back();
+        stack.push_back({ right });
+        populate_ptrs();
+    }
+
+    void TreeWalker::fast_forward_to(CharOffset offset)
+    {
+        auto node = root;
+        while (not node.is_empty())
+        {
+            if (rep(node.root().left_subtree_length) > rep(offset))
+            {
+                // For when we revisit this node.
+                stack.back().dir = Direction::Center;
+                node = node.left();
+                stack.push_back({ node });
+            }
+            // It is inside this node.
+            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(offset))
+            {
+                stack.back().dir = Direction::Right;
+                // Make the offset relative to this piece.
+                offset = retract(offset, rep(node.root().left_subtree_length));
+                auto& piece = node.root().piece;
+                auto first_offset = buffers->buffer_offset(piece.index, piece.first) + Length{ rep(offset) };
+                auto text = buffers->buffer_text(piece.index, first_offset, Length{ rep(piece.length) - rep(offset) }, &pinned);
+                first_ptr = text.data();
+                last_ptr = text.data() + text.size();
+                return;
+            }
+            else
+            {
+                assert(not stack.empty());
+                // This parent is no longer relevant.
+                stack.pop_back();
+                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
+                offset = retract(offset, offset_amount);
+                node = node.right();
+                stack.push_back({ node });
+            }
+        }
+    }
+
+    ReverseTreeWalker::ReverseTreeWalker(const Tree* tree, CharOffset offset):
+        buffers{ &tree->buffers },
+        root{ tree->root },
+        meta{ tree->meta },
+        stack{ { root } },
+        total_offset{ offset }
+    {
+        fast_forward_to(offset);
+    }
+
+    ReverseTreeWalker::ReverseTreeWalker(const OwningSnapshot* snap, CharOffset offset):
+        buffers{ &snap->buffers },
+        root{ snap->root },
+        meta{ snap->meta },
+        stack{ { root } },
+        total_offset{ offset }
+    {
+        fast_forward_to(offset);
+    }
+
+    ReverseTreeWalker::ReverseTreeWalker(const ReferenceSnapshot* snap, CharOffset offset):
+        buffers{ snap->buffers },
+        root{ snap->root },
+        meta{ snap->meta },
+        stack{ { root } },
+        total_offset{ offset }
+    {
+        fast_forward_to(offset);
+    }
+
+    char ReverseTreeWalker::next()
+    {
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // If this is exhausted, we're done.
+            if (exhausted())
+                return '\0';
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next();
+        }
+        // Since CharOffset is unsigned, this will end up wrapping, both 'exhausted' and
+        // 'remaining' will return 'true' and '0' respectively.
+        total_offset = retract(total_offset);
+        // A dereference is the pointer value _before_ this actual pointer, just like
+        // STL reverse iterator models.
+        return *(--first_ptr);
+    }
+
+    char ReverseTreeWalker::current()
+    {
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // If this is exhausted, we're done.
+            if (exhausted())
+                return '\0';
+        }
+        return *(first_ptr - 1);
+    }
+
+    void ReverseTreeWalker::seek(CharOffset offset)
+    {
+        stack.clear();
+        stack.push_back({ root });
+        total_offset = offset;
+        fast_forward_to(offset);
+    }
+
+    bool ReverseTreeWalker::exhausted() const
+    {
+        if (stack.empty())
+            return true;
+        // If we have not exhausted the pointers, we're still active.
+        if (first_ptr != last_ptr)
+            return false;
+        // If there's more than one entry on the stack, we're still active.
+        if (stack.size() > 1)
+            return false;
+        // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
+        // we're done.
+        auto& entry = stack.back();
+        // We descended into a null child, we're done.
+        if (entry.node.is_empty())
+            return true;
+        // Do we need this check for reverse iterators?
+        if (entry.dir == Direction::Left and entry.node.left().is_empty())
+            return true;
+        return false;
+    }
+
+    Length ReverseTreeWalker::remaining() const
+    {
+        return distance(CharOffset{}, extend(total_offset));
+    }
+
+    void ReverseTreeWalker::populate_ptrs()
+    {
+        if (exhausted())
+            return;
+        if (stack.back().node.is_empty())
+        {
+            stack.pop_back();
+            populate_ptrs();
+            return;
+        }
+
+        auto& [node, dir] = stack.back();
+        if (dir == Direction::Right)
+        {
+            if (not node.right().is_empty())
+            {
+                auto right = node.right();
+                // Change the dir for when we pop back.
+                stack.back().dir = Direction::Center;
+                stack.push_back({ right });
+                populate_ptrs();
+                return;
+            }
+            // Otherwise, let's visit the center, we can actually fallthrough.
+            stack.back().dir = Direction::Center;
+            dir = Direction::Center;
+        }
+
+        if (dir == Direction::Center)
+        {
+            auto& piece = node.root().piece;
+            auto text = buffers->buffer_text(piece.index, buffers->buffer_offset(piece.index, piece.first), piece.length, &pinned);
+            last_ptr = text.data();
+            first_ptr = text.data() + text.size();
+            // Change this direction.
+            stack.back().dir = Direction::Left;
+            return;
+        }
+
+        assert(dir == Direction::Left);
+        auto left = node.left();
+        stack.pop_back();
+        stack.push_back({ left });
+        populate_ptrs();
+    }
+
+    void ReverseTreeWalker::fast_forward_to(CharOffset offset)
+    {
+        auto node = root;
+        while (not node.is_empty())
+        {
+            if (rep(node.root().left_subtree_length) > rep(offset))
+            {
+                assert(not stack.empty());
+                // This parent is no longer relevant.
+                stack.pop_back();
+                node = node.left();
+                stack.push_back({ node });
+            }
+            // It is inside this node.
+            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(offset))
+            {
+                stack.back().dir = Direction::Left;
+                // Make the offset relative to this piece.
+                offset = retract(offset, rep(node.root().left_subtree_length));
+                auto& piece = node.root().piece;
+                // We extend offset because it is the point where we want to start and because this walker works by dereferencing
+                // 'first_ptr - 1', offset + 1 is our 'begin'.
+                auto text = buffers->buffer_text(piece.index, buffers->buffer_offset(piece.index, piece.first), Length{ rep(extend(offset)) }, &pinned);
+                last_ptr = text.data();
+                first_ptr = text.data() + text.size();
+                return;
+            }
+            else
+            {
+                // For when we revisit this node.
+                stack.back().dir = Direction::Center;
+                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
+                offset = retract(offset, offset_amount);
+                node = node.right();
+                stack.push_back({ node });
+            }
+        }
+    }
+
+    namespace
+    {
+        bool is_continuation(char c)
+        {
+            return (uint8_t(c) & 0xC0) == 0x80;
+        }
+
+        // The length of the sequence introduced by 'lead', or 0 if it cannot begin a sequence.
+        size_t sequence_length(char lead)
+        {
+            auto b = uint8_t(lead);
+            if (b < 0x80)
+                return 1;
+            if (b < 0xC2)
+                return 0;
+            if (b < 0xE0)
+                return 2;
+            if (b < 0xF0)
+                return 3;
+            if (b < 0xF5)
+                return 4;
+            return 0;
+        }
+
+        char32_t decode_sequence(const char* first, size_t length)
+        {
+            char32_t code_point = uint8_t(*first) & (0x7F >> length);
+            for (size_t i = 1; i < length; ++i)
+            {
+                code_point = (code_point << 6) | (uint8_t(first[i]) & 0x3F);
+            }
+            return code_point;
+        }
+
+        // Decodes the code point starting at 'bytes[0]' and returns the number of bytes it occupies.
+        size_t decode_forward(const char* bytes, size_t count, char32_t* code_point)
+        {
+            auto length = sequence_length(bytes[0]);
+            if (length != 0 and length <= count and std::all_of(bytes + 1, bytes + length, is_continuation))
+            {
+                *code_point = length == 1 ? char32_t(bytes[0]) : decode_sequence(bytes, length);
+                return length;
+            }
+            *code_point = CodePointWalker::replacement;
+            return 1;
+        }
+
+        // Decodes the code point ending at 'bytes[0]', where 'bytes' runs backwards through the document, and
+        // returns the number of bytes it occupies.
+        size_t decode_backward(const char* bytes, size_t count, char32_t* code_point)
+        {
+            size_t continuations = 0;
+            while (continuations < count and continuations < 3 and is_continuation(bytes[continuations]))
+            {
+                ++continuations;
+            }
+            if (continuations < count and sequence_length(bytes[continuations]) == continuations + 1)
+            {
+                char sequence[4] = { };
+                std::reverse_copy(bytes, bytes + continuations + 1, sequence);
+                *code_point = continuations == 0 ? char32_t(sequence[0]) : decode_sequence(sequence, continuations + 1);
+                return continuations + 1;
+            }
+            *code_point = CodePointWalker::replacement;
+            return 1;
+        }
+
+        // The reverse walkers start from the last byte of the code point holding 'offset' so that it decodes whole.
+        template <typename T>
+        CharOffset last_byte_of_code_point(const T* text, CharOffset offset)
+        {
+            auto next = text->next_codepoint_boundary(offset);
+            return next == offset ? offset : retract(next);
+        }
+
+        // Copies up to 'count' bytes starting at 'first' and returns how many were copied.
+        size_t copy_bytes(const BufferCollection* buffers, const RedBlackTree& root, CharOffset first, char* out, size_t count)
+        {
+            size_t copied = 0;
+            for_each_span(buffers, root, first, [&](std::string_view span, CharOffset, const Piece&, const BufferPin&) {
+                auto n = std::min(count - copied, span.size());
+                std::memcpy(out + copied, span.data(), n);
+                copied += n;
+                return copied != count;
+            });
+            return copied;
+        }
+    } // namespace [anon]
+
+    CodePointWalker::CodePointWalker(const Tree* tree, CharOffset offset):
+        walker{ tree, offset }
+    {
+    }
+
+    CodePointWalker::CodePointWalker(const OwningSnapshot* snap, CharOffset offset):
+        walker{ snap, offset }
+    {
+    }
+
+    CodePointWalker::CodePointWalker(const ReferenceSnapshot* snap, CharOffset offset):
+        walker{ snap, offset }
+    {
+    }
+
+    void CodePointWalker::fill()
+    {
+        while (pending_count < pending.size() and not walker.exhausted())
+        {
+            pending[pending_count++] = walker.next();
+        }
+    }
+
+    char32_t CodePointWalker::next()
+    {
+        // ASCII doesn't need the lookahead.
+        if (pending_count == 0 and not walker.exhausted() and uint8_t(walker.current()) < 0x80)
+            return char32_t(walker.next());
+        fill();
+        if (pending_count == 0)
+            return U'\0';
+        char32_t code_point;
+        auto consumed = decode_forward(pending.data(), pending_count, &code_point);
+        std::copy(pending.data() + consumed, pending.data() + pending_count, pending.data());
+        pending_count -= consumed;
+        return code_point;
+    }
+
+    bool CodePointWalker::exhausted() const
+    {
+        return pending_count == 0 and walker.exhausted();
+    }
+
+    ReverseCodePointWalker::ReverseCodePointWalker(const Tree* tree, CharOffset offset):
+        walker{ tree, last_byte_of_code_point(tree, offset) }
+    {
+    }
+
+    ReverseCodePointWalker::ReverseCodePointWalker(const OwningSnapshot* snap, CharOffset offset):
+        walker{ snap, last_byte_of_code_point(snap, offset) }
+    {
+    }
+
+    ReverseCodePointWalker::ReverseCodePointWalker(const ReferenceSnapshot* snap, CharOffset offset):
+        walker{ snap, last_byte_of_code_point(snap, offset) }
+    {
+    }
+
+    void ReverseCodePointWalker::fill()
+    {
+        while (pending_count < pending.size() and not walker.exhausted())
+        {
+            pending[pending_count++] = walker.next();
+        }
+    }
+
+    char32_t ReverseCodePointWalker::next()
+    {
+        // ASCII doesn't need the lookahead.
+        if (pending_count == 0 and not walker.exhausted() and uint8_t(walker.current()) < 0x80)
+            return char32_t(walker.next());
+        fill();
+        if (pending_count == 0)
+            return U'\0';
+        char32_t code_point;
+        auto consumed = decode_backward(pending.data(), pending_count, &code_point);
+        std::copy(pending.data() + consumed, pending.data() + pending_count, pending.data());
+        pending_count -= consumed;
+        return code_point;
+    }
+
+    bool ReverseCodePointWalker::exhausted() const
+    {
+        return pending_count == 0 and walker.exhausted();
+    }
+
+    CharOffset Tree::prev_codepoint_boundary(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        offset = std::min(offset, CharOffset{ } + tree_length(root));
+        if (offset == CharOffset{ })
+            return offset;
+        // A code point is at most 4 bytes so the 4 bytes either side of 'offset' decide where it starts.
+        auto first = CharOffset{ rep(offset) - std::min<size_t>(rep(offset), 4) };
+        char window[7];
+        auto count = copy_bytes(buffers, root, first, window, std::size(window));
+        const auto last = rep(distance(first, offset)) - 1;
+        auto start = last;
+        while (start != 0 and last - start < 3 and is_continuation(window[start]))
+        {
+            --start;
+        }
+        auto length = sequence_length(window[start]);
+        if (length > last - start
+            and start + length <= count
+            and std::all_of(window + start + 1, window + start + length, is_continuation))
+            return first + Length{ start };
+        // The byte before 'offset' is not part of a longer sequence.
+        return retract(offset);
+    }
+
+    CharOffset Tree::next_codepoint_boundary(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        const auto end_offset = CharOffset{ } + tree_length(root);
+        if (offset >= end_offset)
+            return end_offset;
+        // Find the start of the code point holding 'offset' first, in case 'offset' is within a sequence.
+        auto first = prev_codepoint_boundary(buffers, root, extend(offset));
+        char window[4];
+        auto count = copy_bytes(buffers, root, first, window, 4);
+        char32_t code_point;
+        return first + Length{ decode_forward(window, count, &code_point) };
+    }
+
+    CharOffset Tree::prev_codepoint_boundary(CharOffset offset) const
+    {
+        return prev_codepoint_boundary(&buffers, root, offset);
+    }
+
+    CharOffset Tree::next_codepoint_boundary(CharOffset offset) const
+    {
+        return next_codepoint_boundary(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::prev_codepoint_boundary(CharOffset offset) const
+    {
+        return Tree::prev_codepoint_boundary(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::next_codepoint_boundary(CharOffset offset) const
+    {
+        return Tree::next_codepoint_boundary(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::prev_codepoint_boundary(CharOffset offset) const
+    {
+        return Tree::prev_codepoint_boundary(buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::next_codepoint_boundary(CharOffset offset) const
+    {
+        return Tree::next_codepoint_boundary(buffers, root, offset);
+    }
+
+    namespace
+    {
+#ifdef _WIN32
+        // The CRT has no vectored write so each span is written on its own.
+        struct WriteBatch
+        {
+            explicit WriteBatch(int fd) : fd{ fd } { }
+
+            // Subsequent writes start at 'offset' rather than the current file position.
+            bool seek(size_t offset)
+            {
+                return _lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) >= 0;
+            }
+
+            bool add(std::string_view span, const BufferPin&)
+            {
+                while (not span.empty())
+                {
+                    auto n = _write(fd, span.data(), static_cast<unsigned>(std::min<size_t>(span.size(), INT_MAX)));
+                    if (n < 0)
+                        return false;
+                    // Nothing written means no progress will ever be made.
+                    if (n == 0)
+                    {
+                        errno = EIO;
+                        return false;
+                    }
+                    span.remove_prefix(n);
+                    written += n;
+                }
+                return true;
+            }
+
+            bool flush()
+            {
+                return true;
+            }
+
+            int fd;
+            size_t written = 0;
+        };
+#else
+        struct WriteBatch
+        {
+#ifdef IOV_MAX
+            static constexpr size_t max_spans = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+            static constexpr size_t max_spans = 16;
+#endif // IOV_MAX
+
+            explicit WriteBatch(int fd) : fd{ fd } { }
+
+            // Subsequent writes start at 'offset' rather than the current file position.
+            bool seek(size_t offset)
+            {
+                if (not flush())
+                    return false;
+                position = static_cast<off_t>(offset);
+                return true;
+            }
+
+            // The span must stay valid until it is flushed, which 'pin' ensures.
+            bool add(std::string_view span, const BufferPin& pin)
+            {
+                spans.push_back({ .iov_base = const_cast<char*>(span.data()), .iov_len = span.size() });
+                pins.push_back(pin);
+                return spans.size() < max_spans or flush();
+            }
+
+            bool flush()
+            {
+                size_t first = 0;
+                while (first != spans.size())
+                {
+                    auto count = static_cast<int>(spans.size() - first);
+                    auto n = position < 0 ? ::writev(fd, spans.data() + first, count)
+                                          : ::pwritev(fd, spans.data() + first, count, position);
+                    if (n < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        return false;
+                    }
+                    written += n;
+                    if (position >= 0)
+                    {
+                        position += n;
+                    }
+                    // Skip what was written, trimming a partially written span.
+                    auto remaining = static_cast<size_t>(n);
+                    while (first != spans.size() and remaining >= spans[first].iov_len)
+                    {
+                        remaining -= spans[first].iov_len;
+                        ++first;
+                    }
+                    if (remaining != 0)
+                    {
+                        spans[first].iov_base = static_cast<char*>(spans[first].iov_base) + remaining;
+                        spans[first].iov_len -= remaining;
+                    }
+                    // Nothing written while text remains means no progress will ever be made.  Empty spans are
+                    // skipped above, so this only fails a batch with text left in it.
+                    if (n == 0 and first != spans.size())
+                    {
+                        errno = EIO;
+                        return false;
+                    }
+                }
+                spans.clear();
+                pins.clear();
+                return true;
+            }
+
+            int fd;
+            size_t written = 0;
+            // Negative when writing at the current file position.
+            off_t position = -1;
+            std::vector<iovec> spans;
+            // Keeps the buffers of 'spans' alive.
+            std::vector<BufferPin> pins;
+        };
+#endif // _WIN32
+    } // namespace [anon]
+
+#ifndef _WIN32
+    namespace
+    {
+        mode_t process_umask()
+        {
+            // The umask can only be read by replacing it, so read it once.
+            static const mode_t mask = [] {
+                auto current = ::umask(0);
+                ::umask(current);
+                return current;
+            }();
+            return mask;
+        }
+
+        bool sync_directory(const std::filesystem::path& path)
+        {
+            auto dir = path.parent_path();
+            auto fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd < 0)
+                return false;
+            // Some file systems cannot flush directories; there is nothing more to do on those.
+            bool ok = ::fsync(fd) == 0 or errno == EINVAL;
+            auto err = errno;
+            ::close(fd);
+            errno = err;
+            return ok;
+        }
+    } // namespace [anon]
+#endif // _WIN32
+
+    SaveResult save(const OwningSnapshot& snap, int fd)
+    {
+        WriteBatch batch{ fd };
+        bool ok = true;
+        for_each_span(&snap.buffers, snap.root, CharOffset{ }, [&](std::string_view span, CharOffset, const Piece&, const BufferPin& pin) {
+            ok = batch.add(span, pin);
+            return ok;
+        });
+        ok = ok and batch.flush();
+        return { .success = ok, .error = ok ? 0 : errno, .bytes_written = Length{ batch.written } };
+    }
+
+    namespace
+    {
+        struct SourceRun
+        {
+            CharOffset offset;
+            BufferIndex index;
+            size_t buffer_offset;
+            size_t length;
+        };
+
+        void source_runs(std::vector<SourceRun>* runs, const BufferCollection* buffers, const RedBlackTree& root)
+        {
+            for_each_span(buffers, root, CharOffset{ }, [&](std::string_view span, CharOffset offset, const Piece& piece, const BufferPin&) {
+                auto buffer_offset = rep(buffers->buffer_offset(piece.index, piece.first));
+                runs->push_back({ .offset = offset, .index = piece.index, .buffer_offset = buffer_offset, .length = span.size() });
+                return true;
+            });
+        }
+
+        // Whether every buffer position 'previous' can refer to holds the same bytes in 'current', so that runs
+        // can be matched by position.  Original buffers never change, so sharing their storage is enough, and the
+        // mod buffer only grows.  This fails after 'restore_session' or between unrelated trees.
+        bool same_buffers(const BufferCollection& current, const BufferCollection& previous)
+        {
+            if (previous.orig_buffers.size() > current.orig_buffers.size())
+                return false;
+            for (size_t i = 0; i < previous.orig_buffers.size(); ++i)
+            {
+                if (previous.orig_buffers[i] != nullptr and previous.orig_buffers[i] == current.orig_buffers[i])
+                    continue;
+#ifdef TEXTBUF_COLD_BUFFERS
+                if (i < previous.orig_cold.size() and i < current.orig_cold.size()
+                    and previous.orig_cold[i] != nullptr and previous.orig_cold[i] == current.orig_cold[i])
+                    continue;
+#endif // TEXTBUF_COLD_BUFFERS
+                return false;
+            }
+            return current.mod_buffer.buffer.extends(previous.mod_buffer.buffer);
+        }
+
+        // Computes the ranges of 'current' whose bytes differ in origin from those at the same offsets in
+        // 'previous'.  Bytes are never compared: given 'same_buffers', identical buffer positions imply identical
+        // content since buffers are append-only.
+        void changed_ranges(std::vector<LineRange>* ranges, const std::vector<SourceRun>& current, const std::vector<SourceRun>& previous)
+        {
+            auto mark = [&](CharOffset first, CharOffset last) {
+                if (not ranges->empty() and ranges->back().last == first)
+                {
+                    ranges->back().last = last;
+                    return;
+                }
+                ranges->push_back({ .first = first, .last = last });
+            };
+            size_t j = 0;
+            for (auto& run : current)
+            {
+                auto first = rep(run.offset);
+                const auto last = first + run.length;
+                while (first != last)
+                {
+                    while (j != previous.size() and rep(previous[j].offset) + previous[j].length <= first)
+                    {
+                        ++j;
+                    }
+                    if (j == previous.size())
+                    {
+                        mark(CharOffset{ first }, CharOffset{ last });
+                        break;
+                    }
+                    auto& old = previous[j];
+                    auto overlap_last = std::min(last, rep(old.offset) + old.length);
+                    const bool same = old.index == run.index
+                                        and old.buffer_offset + (first - rep(old.offset)) == run.buffer_offset + (first - rep(run.offset));
+                    if (not same)
+                    {
+                        mark(CharOffset{ first }, CharOffset{ overlap_last });
+                    }
+                    first = overlap_last;
+                }
+            }
+        }
+
+        bool write_range(WriteBatch* batch, const BufferCollection* buffers, const RedBlackTree& root, CharOffset first, CharOffset last)
+        {
+            if (not batch->seek(rep(first)))
+                return false;
+            bool ok = true;
+            for_each_span(buffers, root, first, [&](std::string_view span, CharOffset offset, const Piece&, const BufferPin& pin) {
+                if (offset >= last)
+                    return false;
+                ok = batch->add(span.substr(0, rep(distance(offset, last))), pin);
+                return ok;
+            });
+            return ok and batch->flush();
+        }
+    } // namespace [anon]
+
+    SaveResult save_incremental(const OwningSnapshot& snap, const OwningSnapshot& on_disk, int fd)
+    {
+        const auto new_length = rep(snap.meta.total_content_length);
+        const auto old_length = rep(on_disk.meta.total_content_length);
+#ifdef _WIN32
+        auto file_size = _lseeki64(fd, 0, SEEK_END);
+        auto truncate = [&] { return _chsize_s(fd, static_cast<__int64>(new_length)) == 0; };
+        auto sync = [&] { return _commit(fd) == 0; };
+#else
+        struct stat st;
+        auto file_size = ::fstat(fd, &st) == 0 ? st.st_size : off_t{ -1 };
+        auto truncate = [&] { return ::ftruncate(fd, static_cast<off_t>(new_length)) == 0; };
+        auto sync = [&] { return ::fsync(fd) == 0; };
+#endif // _WIN32
+        if (file_size < 0)
+            return { .success = false, .error = errno, .bytes_written = { } };
+
+        std::vector<LineRange> ranges;
+        if (static_cast<size_t>(file_size) != old_length or not same_buffers(snap.buffers, on_disk.buffers))
+        {
+            // The file is not what we think it is, or the snapshots cannot be compared by buffer position.
+            ranges.push_back({ .first = CharOffset{ }, .last = CharOffset{ new_length } });
+        }
+        else
+        {
+            std::vector<SourceRun> current;
+            std::vector<SourceRun> previous;
+            source_runs(&current, &snap.buffers, snap.root);
+            source_runs(&previous, &on_disk.buffers, on_disk.root);
+            changed_ranges(&ranges, current, previous);
+            // A length change shifts everything after the first change, so rewrite the whole suffix.
+            if (new_length != old_length)
+            {
+                auto first = ranges.empty() ? std::min(new_length, old_length) : rep(ranges.front().first);
+                ranges.clear();
+                if (first != new_length)
+                {
+                    ranges.push_back({ .first = CharOffset{ first }, .last = CharOffset{ new_length } });
+                }
+            }
+        }
+
+#ifdef TEXTBUF_COLD_BUFFERS
+        // Paged buffers may read their text from the file being rewritten.  Move the text about to be
+        // overwritten aside first, so that neither this save nor the trees still paging from the file read
+        // the new text in its place.
+        std::vector<const BackingFile*> files;
+        for (auto* buffers : { &snap.buffers, &on_disk.buffers })
+        {
+            for (auto& cold : buffers->orig_cold)
+            {
+                if (cold != nullptr and cold->file != nullptr and std::find(begin(files), end(files), cold->file.get()) == end(files))
+                {
+                    files.push_back(cold->file.get());
+                }
+            }
+        }
+        for (auto* file : files)
+        {
+            if (not file->may_alias(fd))
+                continue;
+            bool preserved = true;
+            for (auto& range : ranges)
+            {
+                preserved = preserved and file->preserve(rep(range.first), rep(distance(range.first, range.last)));
+            }
+            // Truncating drops the tail as well.
+            if (static_cast<size_t>(file_size) > new_length)
+            {
+                preserved = preserved and file->preserve(new_length, static_cast<size_t>(file_size) - new_length);
+            }
+            if (not preserved)
+                return { .success = false, .error = errno, .bytes_written = { } };
+        }
+#endif // TEXTBUF_COLD_BUFFERS
+
+        WriteBatch batch{ fd };
+        bool ok = true;
+        for (auto& range : ranges)
+        {
+            ok = write_range(&batch, &snap.buffers, snap.root, range.first, range.last);
+            if (not ok)
+                break;
+        }
+        if (ok and static_cast<size_t>(file_size) != new_length)
+        {
+            ok = truncate();
+        }
+        ok = ok and sync();
+        return { .success = ok, .error = ok ? 0 : errno, .bytes_written = Length{ batch.written } };
+    }
+
+    SaveResult save_file(const OwningSnapshot& snap, const std::filesystem::path& path)
+    {
+        auto temp = path;
+#ifdef _WIN32
+        // Concurrent saves (from this or another process) must not share a temporary file.
+        static std::atomic<unsigned> save_count = 0;
+        std::string temp_name;
+        int fd = -1;
+        do
+        {
+            temp_name = temp.string() + ".save-" + std::to_string(_getpid()) + "-" + std::to_string(save_count++);
+            fd = _open(temp_name.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+        } while (fd < 0 and errno == EEXIST);
+#else
+        temp += ".save-XXXXXX";
+        auto temp_name = temp.string();
+        int fd = ::mkstemp(temp_name.data());
+#endif // _WIN32
+        if (fd < 0)
+            return { .success = false, .error = errno, .bytes_written = { } };
+
+#ifndef _WIN32
+        // Keep the permissions of the file being replaced.  A new file gets the permissions 'open' would have
+        // given it rather than the 0600 of 'mkstemp'.
+        struct stat existing;
+        if (::stat(path.c_str(), &existing) == 0)
+        {
+            ::fchmod(fd, existing.st_mode & 07777);
+        }
+        else
+        {
+            ::fchmod(fd, 0666 & ~process_umask());
+        }
+#endif // _WIN32
+        auto result = save(snap, fd);
+#ifdef _WIN32
+        if (result.success and _commit(fd) != 0)
+            result = { .success = false, .error = errno, .bytes_written = result.bytes_written };
+        if (_close(fd) != 0 and result.success)
+            result = { .success = false, .error = errno, .bytes_written = result.bytes_written };
+#else
+        if (result.success and ::fsync(fd) != 0)
+            result = { .success = false, .error = errno, .bytes_written = result.bytes_written };
+        if (::close(fd) != 0 and result.success)
+            result = { .success = false, .error = errno, .bytes_written = result.bytes_written };
+#endif // _WIN32
+        std::error_code ec;
+        if (result.success)
+        {
+            std::filesystem::rename(temp_name, path, ec);
+            if (ec)
+            {
+                result = { .success = false, .error = ec.value(), .bytes_written = result.bytes_written };
+            }
+#ifndef _WIN32
+            // The rename is only durable once the directory holding it is flushed.
+            else if (not sync_directory(path))
+            {
+                return { .success = false, .error = errno, .bytes_written = result.bytes_written };
+            }
+#endif // _WIN32
+        }
+        if (not result.success)
+        {
+            std::filesystem::remove(temp_name, ec);
+        }
+        return result;
     }
 
-    char TreeWalker::next()
+    namespace
     {
-        if (first_ptr == last_ptr)
+        // Session files are a sequence of native-endian 64-bit words.  Text is padded to a whole word so that
+        // every array in a mapped file stays aligned.
+        constexpr uint64_t session_magic = 0x3146554244455246; // "FREDBUF1"
+        constexpr uint64_t session_version = 2;
+        constexpr uint64_t session_endian = 0x0102030405060708;
+
+        enum class SessionBuffer : uint64_t { Embedded, Referenced };
+
+        static_assert(sizeof(LineStart) == sizeof(uint64_t));
+
+        uint64_t fnv1a(std::string_view txt)
         {
-            populate_ptrs();
-            // If this is exhausted, we're done.
-            if (exhausted())
-                return '\0';
-            // Catchall.
-            if (first_ptr == last_ptr)
-                return next();
+            uint64_t hash = 0xCBF29CE484222325;
+            for (auto c : txt)
+            {
+                hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001B3;
+            }
+            return hash;
         }
-        total_offset = total_offset + Length{ 1 };
-        return *first_ptr++;
+
+        struct SessionWriter
+        {
+            std::FILE* file;
+            bool ok = true;
+
+            void word(uint64_t value)
+            {
+                ok = ok and std::fwrite(&value, sizeof value, 1, file) == 1;
+            }
+
+            void bytes(std::string_view txt)
+            {
+                word(txt.size());
+                ok = ok and std::fwrite(txt.data(), 1, txt.size(), file) == txt.size();
+                padding(txt.size());
+            }
+
+            void bytes(const ChunkedText& txt)
+            {
+                word(txt.size());
+                txt.for_each_chunk([&](std::string_view chunk) {
+                    ok = ok and std::fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+                });
+                padding(txt.size());
+            }
+
+            void padding(size_t length)
+            {
+                constexpr char zeros[sizeof(uint64_t)] = { };
+                auto pad = (sizeof(uint64_t) - length % sizeof(uint64_t)) % sizeof(uint64_t);
+                ok = ok and std::fwrite(zeros, 1, pad, file) == pad;
+            }
+
+            void line_starts(const LineStarts& starts)
+            {
+                word(starts.size());
+                starts.for_each_chunk([&](std::span<const LineStart> chunk) {
+                    ok = ok and std::fwrite(chunk.data(), sizeof(LineStart), chunk.size(), file) == chunk.size();
+                });
+            }
+
+            void piece(const Piece& piece)
+            {
+                word(rep(piece.index));
+                word(rep(piece.first.line));
+                word(rep(piece.first.column));
+                word(rep(piece.last.line));
+                word(rep(piece.last.column));
+                word(rep(piece.length));
+                word(rep(piece.newline_count));
+            }
+        };
+
+        struct SessionReader
+        {
+            std::string_view data;
+            size_t pos = 0;
+            bool ok = true;
+
+            uint64_t word()
+            {
+                uint64_t value = 0;
+                if (data.size() - pos < sizeof value)
+                {
+                    ok = false;
+                    return value;
+                }
+                std::memcpy(&value, data.data() + pos, sizeof value);
+                pos += sizeof value;
+                return value;
+            }
+
+            // Reads a count of items each 'item_words' words long, failing on counts the data cannot hold.
+            size_t count(size_t item_words)
+            {
+                auto n = word();
+                if (item_words != 0 and n > (data.size() - pos) / (item_words * sizeof(uint64_t)))
+                {
+                    ok = false;
+                    return 0;
+                }
+                return n;
+            }
+
+            std::string_view bytes()
+            {
+                auto n = word();
+                auto padded = n + (sizeof(uint64_t) - n % sizeof(uint64_t)) % sizeof(uint64_t);
+                if (not ok or padded < n or data.size() - pos < padded)
+                {
+                    ok = false;
+                    return { };
+                }
+                auto txt = data.substr(pos, n);
+                pos += padded;
+                return txt;
+            }
+
+            void line_starts(LineStarts* starts)
+            {
+                auto n = count(1);
+                starts->clear();
+                for (size_t i = 0; i < n; ++i)
+                {
+                    LineStart start;
+                    std::memcpy(&start, data.data() + pos, sizeof start);
+                    pos += sizeof start;
+                    starts->push_back(start);
+                }
+            }
+
+            Piece piece()
+            {
+                Piece piece;
+                piece.index = BufferIndex{ word() };
+                piece.first = { .line = Line{ word() }, .column = Column{ word() } };
+                piece.last = { .line = Line{ word() }, .column = Column{ word() } };
+                piece.length = Length{ word() };
+                piece.newline_count = LFCount{ word() };
+                return piece;
+            }
+        };
+
+        // The whole file, mapped where possible.
+        class SessionFile
+        {
+        public:
+            SessionFile() = default;
+            SessionFile(const SessionFile&) = delete;
+            SessionFile& operator=(const SessionFile&) = delete;
+
+            ~SessionFile()
+            {
+#ifndef _WIN32
+                if (mapped != nullptr)
+                {
+                    ::munmap(mapped, size);
+                }
+#endif // _WIN32
+            }
+
+            bool open(const std::filesystem::path& path)
+            {
+#ifdef _WIN32
+                auto* file = std::fopen(path.string().c_str(), "rb");
+                if (file == nullptr)
+                    return false;
+                char chunk[1 << 16];
+                size_t n;
+                while ((n = std::fread(chunk, 1, sizeof chunk, file)) != 0)
+                {
+                    contents.append(chunk, n);
+                }
+                bool ok = not std::ferror(file);
+                std::fclose(file);
+                return ok;
+#else
+                auto fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return false;
+                struct stat st;
+                bool ok = ::fstat(fd, &st) == 0;
+                if (ok and st.st_size != 0)
+                {
+                    size = static_cast<size_t>(st.st_size);
+                    auto* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    ok = p != MAP_FAILED;
+                    mapped = ok ? p : nullptr;
+                }
+                auto err = errno;
+                ::close(fd);
+                errno = err;
+                return ok;
+#endif // _WIN32
+            }
+
+            std::string_view view() const
+            {
+#ifdef _WIN32
+                return contents;
+#else
+                return { static_cast<const char*>(mapped), mapped == nullptr ? 0 : size };
+#endif // _WIN32
+            }
+
+        private:
+#ifdef _WIN32
+            std::string contents;
+#else
+            void* mapped = nullptr;
+            size_t size = 0;
+#endif // _WIN32
+        };
+
+        // Cursors are canonical: the column stays within its line, whose LF counts as part of it.
+        bool cursor_in_bounds(const LineStarts& starts, size_t size, const BufferCursor& cursor, size_t* offset)
+        {
+            auto line = rep(cursor.line);
+            if (line >= starts.size())
+                return false;
+            auto line_end = line + 1 < starts.size() ? rep(starts[line + 1]) - 1 : size;
+            if (rep(cursor.column) > line_end - rep(starts[line]))
+                return false;
+            *offset = rep(starts[line]) + rep(cursor.column);
+            return true;
+        }
+
+        // Assumes the line starts of the buffers match their text.
+        bool piece_in_bounds(const BufferCollection& buffers, const Piece& piece)
+        {
+            if (piece.index != BufferIndex::ModBuf and rep(piece.index) >= buffers.orig_buffers.size())
+                return false;
+            auto size = piece.index == BufferIndex::ModBuf ? buffers.mod_buffer.buffer.size()
+                                                           : buffers.buffer_at(piece.index)->buffer.size();
+            auto& starts = buffers.line_starts(piece.index);
+            size_t first = 0;
+            size_t last = 0;
+            return cursor_in_bounds(starts, size, piece.first, &first)
+                and cursor_in_bounds(starts, size, piece.last, &last)
+                and first <= last and last - first == rep(piece.length)
+                and rep(piece.newline_count) == rep(piece.last.line) - rep(piece.first.line);
+        }
+
+        SessionResult write_session(const std::filesystem::path& path, const SessionOptions& options, const BufferCollection& buffers,
+                                    const RedBlackTree& root, const History& history, size_t history_base, HistoryId current_state)
+        {
+            // Number every distinct node in post order so that children precede their parents.
+            std::vector<RedBlackTree> roots = { root };
+            if (is_yes(options.history))
+            {
+                for (auto& entry : history)
+                {
+                    roots.push_back(entry.root);
+                }
+            }
+            struct PieceKey
+            {
+                std::array<size_t, 7> fields;
+                bool operator==(const PieceKey&) const = default;
+            };
+            struct PieceKeyHash
+            {
+                size_t operator()(const PieceKey& key) const
+                {
+                    size_t hash = 0;
+                    for (auto field : key.fields)
+                    {
+                        hash = hash * 0x9E3779B97F4A7C15 + field;
+                    }
+                    return hash;
+                }
+            };
+            std::unordered_map<PieceKey, uint64_t, PieceKeyHash> piece_ids;
+            std::vector<Piece> pieces;
+            std::unordered_map<const void*, uint64_t> node_ids;
+            std::vector<std::array<uint64_t, 4>> nodes;
+            // Ids are one-based so that 0 is the empty tree.
+            auto id_of = [&](const RedBlackTree& node) -> uint64_t {
+                return node.is_empty() ? 0 : node_ids.at(node.root_ptr());
+            };
+            std::vector<std::pair<RedBlackTree, bool>> stack;
+            for (auto& r : roots)
+            {
+                if (not r.is_empty())
+                {
+                    stack.push_back({ r, false });
+                }
+                while (not stack.empty())
+                {
+                    auto [node, children_done] = stack.back();
+                    stack.pop_back();
+                    if (node_ids.contains(node.root_ptr()))
+                        continue;
+                    if (not children_done)
+                    {
+                        stack.push_back({ node, true });
+                        for (auto child : { node.right(), node.left() })
+                        {
+                            if (not child.is_empty() and not node_ids.contains(child.root_ptr()))
+                            {
+                                stack.push_back({ child, false });
+                            }
+                        }
+                        continue;
+                    }
+                    auto& piece = node.root().piece;
+                    PieceKey key{ { rep(piece.index), rep(piece.first.line), rep(piece.first.column), rep(piece.last.line),
+                                    rep(piece.last.column), rep(piece.length), rep(piece.newline_count) } };
+                    auto [it, inserted] = piece_ids.try_emplace(key, pieces.size());
+                    if (inserted)
+                    {
+                        pieces.push_back(piece);
+                    }
+                    nodes.push_back({ static_cast<uint64_t>(node.root_color()), id_of(node.left()), it->second, id_of(node.right()) });
+                    node_ids.emplace(node.root_ptr(), nodes.size());
+                }
+            }
+
+            size_t source_size = 0;
+            if (not options.source.empty())
+            {
+                std::error_code ec;
+                source_size = std::filesystem::file_size(options.source, ec);
+                if (ec)
+                    return { .success = false, .error = ec.value() };
+            }
+
+            auto temp = path;
+            temp += ".tmp";
+            auto* file = std::fopen(temp.string().c_str(), "wb");
+            if (file == nullptr)
+                return { .success = false, .error = errno };
+            SessionWriter out{ .file = file };
+            out.word(session_magic);
+            out.word(session_version);
+            out.word(session_endian);
+            out.word(options.tag);
+            out.bytes(options.source.string());
+            out.word(buffers.orig_buffers.size());
+            size_t source_offset = 0;
+            for (size_t i = 0; i < buffers.orig_buffers.size(); ++i)
+            {
+                auto buf = buffers.buffer_at(BufferIndex{ i });
+                const bool referenced = source_offset + buf->buffer.size() <= source_size;
+                out.word(rep(referenced ? SessionBuffer::Referenced : SessionBuffer::Embedded));
+                out.word(fnv1a(buf->buffer));
+                out.line_starts(buffers.line_starts(BufferIndex{ i }));
+                if (referenced)
+                {
+                    out.word(source_offset);
+                    out.word(buf->buffer.size());
+                    source_offset += buf->buffer.size();
+                }
+                else
+                {
+                    out.bytes(buf->buffer);
+                }
+            }
+            out.bytes(buffers.mod_buffer.buffer);
+            out.line_starts(buffers.mod_buffer.line_starts);
+            out.word(pieces.size());
+            for (auto& piece : pieces)
+            {
+                out.piece(piece);
+            }
+            out.word(nodes.size());
+            for (auto& node : nodes)
+            {
+                for (auto field : node)
+                {
+                    out.word(field);
+                }
+            }
+            out.word(id_of(root));
+            if (is_yes(options.history))
+            {
+                out.word(history.size());
+                out.word(history_base);
+                out.word(rep(current_state));
+                for (auto& entry : history)
+                {
+                    out.word(id_of(entry.root));
+                    out.word(rep(entry.op_offset));
+                    out.word(rep(entry.redo_offset));
+                    out.word(rep(entry.parent));
+                    out.word(rep(entry.redo_child));
+                    out.word(entry.children.size());
+                    for (auto child : entry.children)
+                    {
+                        out.word(rep(child));
+                    }
+                }
+            }
+            else
+            {
+                out.word(0);
+                out.word(0);
+                out.word(0);
+            }
+            int err = out.ok and std::fflush(file) == 0 ? 0 : errno;
+            // The session must be on disk before it replaces the old one.
+    #ifdef _WIN32
+            if (err == 0 and _commit(_fileno(file)) != 0)
+    #else
+            if (err == 0 and ::fsync(fileno(file)) != 0)
+    #endif // _WIN32
+            {
+                err = errno;
+            }
+            if (std::fclose(file) != 0 and err == 0)
+            {
+                err = errno;
+            }
+            std::error_code ec;
+            if (err == 0)
+            {
+                std::filesystem::rename(temp, path, ec);
+                err = ec.value();
+            }
+            if (err != 0)
+            {
+                std::filesystem::remove(temp, ec);
+                return { .success = false, .error = err };
+            }
+            return { .success = true, .error = 0 };
+        }
+    } // namespace [anon]
+
+    SessionResult Tree::save_session(const std::filesystem::path& path, const SessionOptions& options) const
+    {
+        return write_session(path, options, buffers, root, history, history_base, current_state);
     }
 
-    char TreeWalker::current()
+    SessionState Tree::session_state(IncludeHistory include_history) const
     {
-        if (first_ptr == last_ptr)
+        SessionState state{ .buffers = buffers, .root = root, .history = { }, .history_base = 0, .current_state = current_state };
+        if (is_yes(include_history))
         {
-            populate_ptrs();
-            // If this is exhausted, we're done.
-            if (exhausted())
-                return '\0';
+            state.history = history;
+            state.history_base = history_base;
         }
-        return *first_ptr;
+        return state;
     }
 
-    void TreeWalker::seek(CharOffset offset)
+    SessionResult save_session(const SessionState& state, const std::filesystem::path& path, const SessionOptions& options)
     {
-        stack.clear();
-        stack.push_back({ root });
-        total_offset = offset;
-        fast_forward_to(offset);
+        return write_session(path, options, state.buffers, state.root, state.history, state.history_base, state.current_state);
     }
 
-    bool TreeWalker::exhausted() const
+    SessionResult Tree::restore_session(const std::filesystem::path& path, uint64_t* tag)
     {
-        if (stack.empty())
-            return true;
-        // If we have not exhausted the pointers, we're still active.
-        if (first_ptr != last_ptr)
-            return false;
-        // If there's more than one entry on the stack, we're still active.
-        if (stack.size() > 1)
-            return false;
-        // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
-        // we're done.
-        auto& entry = stack.back();
-        // We descended into a null child, we're done.
-        if (entry.node.is_empty())
-            return true;
-        if (entry.dir == Direction::Right and entry.node.right().is_empty())
+        SessionFile session;
+        if (not session.open(path))
+            return { .success = false, .error = errno };
+        constexpr SessionResult malformed = { .success = false, .error = EINVAL };
+        SessionReader in{ .data = session.view() };
+        if (in.word() != session_magic or in.word() != session_version or in.word() != session_endian)
+            return malformed;
+        auto session_tag = in.word();
+
+        BufferCollection restored;
+        // Line starts are checked against the text they index rather than trusted.
+        LineStarts expected_starts;
+        std::string source_name{ in.bytes() };
+        std::FILE* source = nullptr;
+        ScopeGuard close_source{ [&] {
+            if (source != nullptr)
+            {
+                std::fclose(source);
+            }
+        } };
+        auto buf_count = in.count(4);
+        for (size_t i = 0; in.ok and i < buf_count; ++i)
+        {
+            auto kind = SessionBuffer{ in.word() };
+            auto hash = in.word();
+            CharBuffer buf;
+            in.line_starts(&buf.line_starts);
+            if (kind == SessionBuffer::Referenced)
+            {
+                auto offset = in.word();
+                auto size = in.word();
+                if (source == nullptr)
+                {
+                    source = std::fopen(std::filesystem::path{ source_name }.string().c_str(), "rb");
+                    if (source == nullptr)
+                        return { .success = false, .error = errno };
+                }
+                buf.buffer.resize(size);
+                // Note: 'offset' may exceed 'long' on some platforms; a short read below catches any mismatch.
+                if (std::fseek(source, static_cast<long>(offset), SEEK_SET) != 0
+                    or std::fread(buf.buffer.data(), 1, size, source) != size)
+                    return malformed;
+            }
+            else
+            {
+                buf.buffer = in.bytes();
+            }
+            if (not in.ok or fnv1a(buf.buffer) != hash)
+                return malformed;
+            populate_line_starts(&expected_starts, buf.buffer);
+            if (buf.line_starts != expected_starts)
+                return malformed;
+            restored.orig_buffers.push_back(std::make_shared<CharBuffer>(std::move(buf)));
+        }
+        restored.mod_buffer.buffer.append(in.bytes());
+        in.line_starts(&restored.mod_buffer.line_starts);
+        if (not in.ok)
+            return malformed;
+        // Appended at once, so the text is in one chunk.
+        populate_line_starts(&expected_starts, restored.mod_buffer.buffer.text(0, restored.mod_buffer.buffer.size()));
+        if (restored.mod_buffer.line_starts != expected_starts)
+            return malformed;
+
+        std::vector<Piece> pieces(in.count(7));
+        for (auto& piece : pieces)
+        {
+            piece = in.piece();
+            if (not in.ok or not piece_in_bounds(restored, piece))
+                return malformed;
+        }
+        std::vector<std::array<uint64_t, 4>> nodes(in.count(4));
+        // Indexed by node id, so the empty tree counts as one black node.
+        std::vector<size_t> black_height(nodes.size() + 1, 1);
+        auto red = [&](uint64_t id) { return id != 0 and nodes[id - 1][0] == rep(Color::Red); };
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto& node = nodes[i];
+            for (auto& field : node)
+            {
+                field = in.word();
+            }
+            // Children always precede their parent.
+            if (node[0] > rep(Color::Black) or node[1] > i or node[2] >= pieces.size() or node[3] > i)
+                return malformed;
+            // Both children cross the same number of black nodes and a red node has no red child.
+            if (black_height[node[1]] != black_height[node[3]]
+                or (node[0] == rep(Color::Red) and (red(node[1]) or red(node[3]))))
+                return malformed;
+            black_height[i + 1] = black_height[node[1]] + (node[0] == rep(Color::Black) ? 1 : 0);
+        }
+        // Roots may share nodes with each other but a node appears at most once under any one root, or the tree
+        // would describe more text than the session holds.
+        std::vector<size_t> visited(nodes.size() + 1);
+        std::vector<bool> checked(nodes.size() + 1);
+        std::vector<uint64_t> pending;
+        size_t stamp = 0;
+        auto forms_tree = [&](uint64_t id) {
+            if (checked[id])
+                return true;
+            ++stamp;
+            pending.assign(1, id);
+            while (not pending.empty())
+            {
+                auto next = pending.back();
+                pending.pop_back();
+                if (next == 0)
+                    continue;
+                if (visited[next] == stamp)
+                    return false;
+                visited[next] = stamp;
+                pending.push_back(nodes[next - 1][1]);
+                pending.push_back(nodes[next - 1][3]);
+            }
+            checked[id] = true;
             return true;
-        return false;
+        };
+        auto root_id = in.word();
+        auto entry_count = in.count(6);
+        auto base = in.word();
+        auto current = in.word();
+        History restored_history;
+        for (size_t i = 0; in.ok and i < entry_count; ++i)
+        {
+            auto& entry = restored_history.emplace_back();
+            auto entry_root = in.word();
+            if (entry_root > nodes.size() or not forms_tree(entry_root))
+                return malformed;
+            // Stash the node id until the nodes are built.
+            entry.retained_bytes = entry_root;
+            entry.op_offset = CharOffset{ in.word() };
+            entry.redo_offset = CharOffset{ in.word() };
+            entry.parent = HistoryId{ in.word() };
+            entry.redo_child = HistoryId{ in.word() };
+            entry.children.resize(in.count(1));
+            for (auto& child : entry.children)
+            {
+                child = HistoryId{ in.word() };
+            }
+        }
+        auto valid_id = [&](HistoryId id) {
+            return id == HistoryId::Invalid or (rep(id) >= base and rep(id) - base < entry_count);
+        };
+        for (size_t i = 0; i < restored_history.size(); ++i)
+        {
+            // Ids are chronological, so a parent is older than its children and undo and redo always terminate.
+            // The parent of the oldest entries may have been evicted.
+            auto& entry = restored_history[i];
+            auto newer = [&](HistoryId id) {
+                return id == HistoryId::Invalid or (valid_id(id) and rep(id) - base > i);
+            };
+            if ((entry.parent != HistoryId::Invalid and rep(entry.parent) >= base and rep(entry.parent) - base >= i)
+                or not newer(entry.redo_child)
+                or not std::all_of(entry.children.begin(), entry.children.end(), newer))
+                return malformed;
+        }
+        if (not in.ok or root_id > nodes.size() or not forms_tree(root_id)
+            or (entry_count != 0 and (current < base or current - base >= entry_count)))
+            return malformed;
+
+        // Everything is validated, so commit.
+        if (tag != nullptr)
+        {
+            *tag = session_tag;
+        }
+        buffers = std::move(restored);
+        populate_orig_buffer_data();
+        extend_mod_buffer_data(&buffers);
+        std::vector<RedBlackTree> built(nodes.size() + 1);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto& [color, left, piece, right] = nodes[i];
+            built[i + 1] = RedBlackTree::compose(Color(color), built[left], node_data(pieces[piece]), built[right]);
+        }
+        root = built[root_id];
+        // New text is appended after the restored mod buffer.
+        auto& mod_starts = buffers.mod_buffer.line_starts;
+        last_insert = { .line = Line{ mod_starts.size() - 1 },
+                        .column = Column{ buffers.mod_buffer.buffer.size() - rep(mod_starts.back()) } };
+        end_last_insert = CharOffset::Sentinel;
+        compute_buffer_meta();
+        loaded_chunks.clear();
+        load_point = CharOffset::Sentinel;
+        if (entry_count == 0)
+        {
+            reset_history();
+            return { .success = true, .error = 0 };
+        }
+        for (auto& entry : history)
+        {
+            retire(std::move(entry.root));
+        }
+        history = std::move(restored_history);
+        history_base = base;
+        current_state = HistoryId{ current };
+        retained_bytes = 0;
+        for (size_t i = 0; i < history.size(); ++i)
+        {
+            auto& entry = history[i];
+            entry.root = built[entry.retained_bytes];
+        }
+        // Each state retains what the state it was left for does not share with it.  That is the child a redo
+        // moves to, or the current state if its redo branch was evicted.
+        for (size_t i = 0; i < history.size(); ++i)
+        {
+            auto& entry = history[i];
+            if (i + base == current)
+                continue;
+            auto* next = history_at(entry.redo_child);
+            entry.retained_bytes = unshared_bytes(entry.root, next != nullptr ? next->root : root);
+            retained_bytes += entry.retained_bytes;
+        }
+        rebuild_retained_sums();
+        evict_history();
+        return { .success = true, .error = 0 };
     }
 
-    Length TreeWalker::remaining() const
+    // Journal files start with a header of two words: a magic number and the tag of the checkpoint they follow.
+    // Each record is an op byte, two words of operands, the inserted text if any and a checksum of the record.
+    enum class EditJournal::Op : uint8_t { Insert, Remove, Undo, Redo, Commit };
+
+    namespace
+    {
+        constexpr uint64_t journal_magic = 0x314E524A44455246; // "FREDJRN1"
+        constexpr size_t journal_header_size = 2 * sizeof(uint64_t);
+        constexpr size_t journal_record_size = 1 + 3 * sizeof(uint64_t);
+
+        void append_word(std::string* out, uint64_t value)
+        {
+            out->append(reinterpret_cast<const char*>(&value), sizeof value);
+        }
+
+        uint64_t read_word(std::string_view data, size_t pos)
+        {
+            uint64_t value;
+            std::memcpy(&value, data.data() + pos, sizeof value);
+            return value;
+        }
+
+        bool write_all(int fd, std::string_view data)
+        {
+            while (not data.empty())
+            {
+#ifdef _WIN32
+                auto n = _write(fd, data.data(), static_cast<unsigned>(std::min<size_t>(data.size(), INT_MAX)));
+#else
+                auto n = ::write(fd, data.data(), data.size());
+#endif // _WIN32
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                // Nothing written means no progress will ever be made.
+                if (n == 0)
+                {
+                    errno = EIO;
+                    return false;
+                }
+                data.remove_prefix(static_cast<size_t>(n));
+            }
+            return true;
+        }
+
+        bool sync_fd(int fd)
+        {
+#ifdef _WIN32
+            return _commit(fd) == 0;
+#else
+            return ::fsync(fd) == 0;
+#endif // _WIN32
+        }
+
+        void close_fd(int fd)
+        {
+#ifdef _WIN32
+            _close(fd);
+#else
+            ::close(fd);
+#endif // _WIN32
+        }
+    } // namespace [anon]
+
+    EditJournal::EditJournal(Tree* tree, const JournalOptions& options):
+        tree{ tree },
+        options{ options },
+        // Generations only need to differ from whatever journal a previous process left behind.
+        generation{ static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()) }
     {
-        return meta.total_content_length - distance(CharOffset{}, total_offset);
+        checkpoint();
+        flusher = std::thread{ [this] { flush_loop(); } };
     }
 
-    void TreeWalker::populate_ptrs()
+    EditJournal::~EditJournal()
     {
-        if (exhausted())
-            return;
-        if (stack.back().node.is_empty())
         {
-            stack.pop_back();
-            populate_ptrs();
-            return;
+            std::lock_guard guard{ lock };
+            stopping = true;
         }
-
-        auto& [node, dir] = stack.back();
-        if (dir == Direction::Left)
+        wake.notify_one();
+        flusher.join();
+        sync();
+        if (fd >= 0)
         {
-            if (not node.left().is_empty())
-            {
-                auto left = node.left();
-                // Change the dir for when we pop back.
-                stack.back().dir = Direction::Center;
-                stack.push_back({ left });
-                populate_ptrs();
-                return;
-            }
-            // Otherwise, let's visit the center, we can actually fallthrough.
-            stack.back().dir = Direction::Center;
-            dir = Direction::Center;
+            close_fd(fd);
         }
+    }
 
-        if (dir == Direction::Center)
-        {
-            auto& piece = node.root().piece;
-            auto* buffer = buffers->buffer_at(piece.index);
-            auto first_offset = buffers->buffer_offset(piece.index, piece.first);
-            auto last_offset = buffers->buffer_offset(piece.index, piece.last);
-            first_ptr = buffer->buffer.data() + rep(first_offset);
-            last_ptr = buffer->buffer.data() + rep(last_offset);
-            // Change this direction.
-            stack.back().dir = Direction::Right;
-            return;
-        }
+    void EditJournal::insert(CharOffset offset, std::string_view txt, SuppressHistory suppress_history)
+    {
+        auto last = tree->history_last();
+        tree->insert(offset, txt, suppress_history);
+        record_history(last, offset);
+        record(Op::Insert, offset, Length{ txt.size() }, txt);
+        written();
+    }
 
-        assert(dir == Direction::Right);
-        auto right = node.right();
-        stack.pop_back();
-        stack.push_back({ right });
-        populate_ptrs();
+    void EditJournal::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    {
+        auto last = tree->history_last();
+        tree->remove(offset, count, suppress_history);
+        record_history(last, offset);
+        record(Op::Remove, offset, count);
+        written();
     }
 
-    void TreeWalker::fast_forward_to(CharOffset offset)
+    UndoRedoResult EditJournal::try_undo(CharOffset op_offset)
     {
-        auto node = root;
-        while (not node.is_empty())
+        auto old_root = tree->head();
+        auto result = tree->try_undo(op_offset);
+        if (result.success)
         {
-            if (rep(node.root().left_subtree_length) > rep(offset))
-            {
-                // For when we revisit this node.
-                stack.back().dir = Direction::Center;
-                node = node.left();
-                stack.push_back({ node });
-            }
-            // It is inside this node.
-            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(offset))
-            {
-                stack.back().dir = Direction::Right;
-                // Make the offset relative to this piece.
-                offset = retract(offset, rep(node.root().left_subtree_length));
-                auto& piece = node.root().piece;
-                auto* buffer = buffers->buffer_at(piece.index);
-                auto first_offset = buffers->buffer_offset(piece.index, piece.first);
-                auto last_offset = buffers->buffer_offset(piece.index, piece.last);
-                first_ptr = buffer->buffer.data() + rep(first_offset) + rep(offset);
-                last_ptr = buffer->buffer.data() + rep(last_offset);
-                return;
-            }
-            else
-            {
-                assert(not stack.empty());
-                // This parent is no longer relevant.
-                stack.pop_back();
-                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
-                offset = retract(offset, offset_amount);
-                node = node.right();
-                stack.push_back({ node });
-            }
+            record_move(Op::Undo, old_root, op_offset);
+            written();
         }
+        return result;
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(const Tree* tree, CharOffset offset):
-        buffers{ &tree->buffers },
-        root{ tree->root },
-        meta{ tree->meta },
-        stack{ { root } },
-        total_offset{ offset }
+    UndoRedoResult EditJournal::try_redo(CharOffset op_offset)
     {
-        fast_forward_to(offset);
+        auto old_root = tree->head();
+        auto result = tree->try_redo(op_offset);
+        if (result.success)
+        {
+            record_move(Op::Redo, old_root, op_offset);
+            written();
+        }
+        return result;
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(const OwningSnapshot* snap, CharOffset offset):
-        buffers{ &snap->buffers },
-        root{ snap->root },
-        meta{ snap->meta },
-        stack{ { root } },
-        total_offset{ offset }
+    void EditJournal::commit_head(CharOffset offset)
     {
-        fast_forward_to(offset);
+        tree->commit_head(offset);
+        record(Op::Commit, offset, Length{ });
+        written();
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(const ReferenceSnapshot* snap, CharOffset offset):
-        buffers{ snap->buffers },
-        root{ snap->root },
-        meta{ snap->meta },
-        stack{ { root } },
-        total_offset{ offset }
+    void EditJournal::record(Op op, CharOffset offset, Length count, std::string_view txt)
     {
-        fast_forward_to(offset);
+        std::unique_lock guard{ lock };
+        auto first = pending.size();
+        if (first == 0)
+        {
+            first_pending = std::chrono::steady_clock::now();
+        }
+        pending.push_back(static_cast<char>(op));
+        append_word(&pending, rep(offset));
+        append_word(&pending, rep(count));
+        pending += txt;
+        append_word(&pending, fnv1a(std::string_view{ pending }.substr(first)));
+        ++records;
+        // The flusher waits without a deadline while nothing is pending, so it needs waking to start the clock.
+        if (first == 0 or pending.size() >= options.group_bytes)
+        {
+            guard.unlock();
+            wake.notify_one();
+        }
     }
 
-    char ReverseTreeWalker::next()
+    void EditJournal::record_history(HistoryId last, CharOffset offset)
     {
-        if (first_ptr == last_ptr)
+        // The edit started a new undo group; replay it as an explicit commit.
+        if (tree->history_last() != last)
         {
-            populate_ptrs();
-            // If this is exhausted, we're done.
-            if (exhausted())
-                return '\0';
-            // Catchall.
-            if (first_ptr == last_ptr)
-                return next();
+            record(Op::Commit, offset, Length{ });
         }
-        // Since CharOffset is unsigned, this will end up wrapping, both 'exhausted' and
-        // 'remaining' will return 'true' and '0' respectively.
-        total_offset = retract(total_offset);
-        // A dereference is the pointer value _before_ this actual pointer, just like
-        // STL reverse iterator models.
-        return *(--first_ptr);
     }
 
-    char ReverseTreeWalker::current()
+    void EditJournal::record_move(Op op, const RedBlackTree& old_root, CharOffset op_offset)
     {
-        if (first_ptr == last_ptr)
+        if (options.history == IncludeHistory::Yes)
         {
-            populate_ptrs();
-            // If this is exhausted, we're done.
-            if (exhausted())
-                return '\0';
+            record(op, op_offset, Length{ });
+            return;
+        }
+        // Checkpoints without history cannot replay an undo which reaches past them, so record the text it
+        // changed instead.  Each range starts where the ranges before it have already been applied.
+        DiffRanges ranges;
+        tree->diff(&ranges, old_root, tree->head());
+        std::string txt;
+        for (auto& range : ranges)
+        {
+            if (range.old_length != Length{ })
+            {
+                record(Op::Remove, range.new_first, range.old_length);
+            }
+            if (range.new_length == Length{ })
+                continue;
+            txt.clear();
+            TreeWalker walker{ tree, range.new_first };
+            for (size_t i = 0; i < rep(range.new_length); ++i)
+            {
+                txt.push_back(walker.next());
+            }
+            record(Op::Insert, range.new_first, range.new_length, txt);
         }
-        return *(first_ptr - 1);
     }
 
-    void ReverseTreeWalker::seek(CharOffset offset)
+    void EditJournal::written()
     {
-        stack.clear();
-        stack.push_back({ root });
-        total_offset = offset;
-        fast_forward_to(offset);
+        if (options.checkpoint_records == 0 or records < options.checkpoint_records)
+            return;
+        // Writing the original buffers and syncing them takes far longer than an edit, so the flusher does it.
+        // A checkpoint it has not started yet is superseded along with the records before it.
+        auto state = std::make_unique<const SessionState>(tree->session_state(options.history));
+        {
+            std::lock_guard guard{ lock };
+            captured = std::move(state);
+            captured_pending += pending;
+            pending.clear();
+            records = 0;
+        }
+        wake.notify_one();
     }
 
-    bool ReverseTreeWalker::exhausted() const
+    bool EditJournal::start_journal()
     {
-        if (stack.empty())
-            return true;
-        // If we have not exhausted the pointers, we're still active.
-        if (first_ptr != last_ptr)
+        auto temp = options.journal;
+        temp += ".tmp";
+#ifdef _WIN32
+        int new_fd = _open(temp.string().c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int new_fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif // _WIN32
+        if (new_fd < 0)
             return false;
-        // If there's more than one entry on the stack, we're still active.
-        if (stack.size() > 1)
+        std::string header;
+        append_word(&header, journal_magic);
+        append_word(&header, generation);
+        std::error_code ec;
+        if (not write_all(new_fd, header) or not sync_fd(new_fd)
+            or (std::filesystem::rename(temp, options.journal, ec), ec))
+        {
+            auto err = ec ? ec.value() : errno;
+            close_fd(new_fd);
+            std::filesystem::remove(temp, ec);
+            errno = err;
             return false;
-        // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
-        // we're done.
-        auto& entry = stack.back();
-        // We descended into a null child, we're done.
-        if (entry.node.is_empty())
-            return true;
-        // Do we need this check for reverse iterators?
-        if (entry.dir == Direction::Left and entry.node.left().is_empty())
-            return true;
-        return false;
+        }
+        if (fd >= 0)
+        {
+            close_fd(fd);
+        }
+        fd = new_fd;
+        return true;
     }
 
-    Length ReverseTreeWalker::remaining() const
+    bool EditJournal::write_pending()
     {
-        return distance(CharOffset{}, extend(total_offset));
+        // Callers hold 'io', which keeps groups in order.  The records made before a captured checkpoint go to
+        // the old journal and the rest to the journal the checkpoint starts, or to the old one if it fails.
+        std::unique_ptr<const SessionState> state;
+        std::string before;
+        std::string group;
+        {
+            std::lock_guard guard{ lock };
+            state = std::move(captured);
+            before.swap(captured_pending);
+            group.swap(pending);
+        }
+        if (state != nullptr and write_group(before))
+        {
+            ++generation;
+            replace_checkpoint(save_session(*state, options.checkpoint, { .source = { }, .history = options.history, .tag = generation }));
+        }
+        return write_group(group);
     }
 
-    void ReverseTreeWalker::populate_ptrs()
+    bool EditJournal::write_group(std::string_view group)
     {
-        if (exhausted())
-            return;
-        if (stack.back().node.is_empty())
+        if (group.empty())
+            return true;
+        if (fd >= 0 and write_all(fd, group) and sync_fd(fd))
+            return true;
+        std::lock_guard guard{ lock };
+        if (failure == 0)
         {
-            stack.pop_back();
-            populate_ptrs();
-            return;
+            failure = fd < 0 ? EBADF : errno;
         }
+        return false;
+    }
 
-        auto& [node, dir] = stack.back();
-        if (dir == Direction::Right)
+    void EditJournal::flush_loop()
+    {
+        std::unique_lock guard{ lock };
+        while (not stopping)
         {
-            if (not node.right().is_empty())
+            // Captured checkpoints are written at once.
+            if (captured == nullptr and pending.empty())
             {
-                auto right = node.right();
-                // Change the dir for when we pop back.
-                stack.back().dir = Direction::Center;
-                stack.push_back({ right });
-                populate_ptrs();
-                return;
+                wake.wait(guard);
+                continue;
             }
-            // Otherwise, let's visit the center, we can actually fallthrough.
-            stack.back().dir = Direction::Center;
-            dir = Direction::Center;
+            auto deadline = first_pending + options.sync_interval;
+            if (captured == nullptr and pending.size() < options.group_bytes
+                and wake.wait_until(guard, deadline) != std::cv_status::timeout
+                and captured == nullptr and pending.size() < options.group_bytes)
+                continue;
+            guard.unlock();
+            {
+                std::lock_guard writing{ io };
+                write_pending();
+            }
+            guard.lock();
         }
+    }
 
-        if (dir == Direction::Center)
+    JournalResult EditJournal::sync()
+    {
+        std::lock_guard writing{ io };
+        bool ok = write_pending();
+        return { .success = ok, .error = ok ? 0 : error(), .replayed = 0 };
+    }
+
+    JournalResult EditJournal::checkpoint()
+    {
+        // The journal is flushed first so that, if we crash between replacing the checkpoint and the journal,
+        // everything in the old journal is in the new checkpoint and the mismatched generation discards it.
+        std::lock_guard writing{ io };
+        write_pending();
         {
-            auto& piece = node.root().piece;
-            auto* buffer = buffers->buffer_at(piece.index);
-            auto first_offset = buffers->buffer_offset(piece.index, piece.first);
-            auto last_offset = buffers->buffer_offset(piece.index, piece.last);
-            last_ptr = buffer->buffer.data() + rep(first_offset);
-            first_ptr = buffer->buffer.data() + rep(last_offset);
-            // Change this direction.
-            stack.back().dir = Direction::Left;
-            return;
+            std::lock_guard guard{ lock };
+            records = 0;
         }
-
-        assert(dir == Direction::Left);
-        auto left = node.left();
-        stack.pop_back();
-        stack.push_back({ left });
-        populate_ptrs();
+        ++generation;
+        return replace_checkpoint(tree->save_session(options.checkpoint, { .source = { }, .history = options.history, .tag = generation }));
     }
 
-    void ReverseTreeWalker::fast_forward_to(CharOffset offset)
+    JournalResult EditJournal::replace_checkpoint(const SessionResult& saved)
     {
-        auto node = root;
-        while (not node.is_empty())
+        // Callers hold 'io'.
+        int err = saved.error;
+        if (saved.success and not start_journal())
         {
-            if (rep(node.root().left_subtree_length) > rep(offset))
-            {
-                assert(not stack.empty());
-                // This parent is no longer relevant.
-                stack.pop_back();
-                node = node.left();
-                stack.push_back({ node });
-            }
-            // It is inside this node.
-            else if (rep(node.root().left_subtree_length + node.root().piece.length) > rep(offset))
+            err = errno;
+        }
+        if (err != 0)
+        {
+            std::lock_guard guard{ lock };
+            if (failure == 0)
             {
-                stack.back().dir = Direction::Left;
-                // Make the offset relative to this piece.
-                offset = retract(offset, rep(node.root().left_subtree_length));
-                auto& piece = node.root().piece;
-                auto* buffer = buffers->buffer_at(piece.index);
-                auto first_offset = buffers->buffer_offset(piece.index, piece.first);
-                last_ptr = buffer->buffer.data() + rep(first_offset);
-                // We extend offset because it is the point where we want to start and because this walker works by dereferencing
-                // 'first_ptr - 1', offset + 1 is our 'begin'.
-                first_ptr = buffer->buffer.data() + rep(first_offset) + rep(extend(offset));
-                return;
+                failure = err;
             }
-            else
+        }
+        return { .success = err == 0, .error = err, .replayed = 0 };
+    }
+
+    int EditJournal::error() const
+    {
+        std::lock_guard guard{ lock };
+        return failure;
+    }
+
+    JournalResult EditJournal::recover(Tree* tree, const JournalOptions& options)
+    {
+        uint64_t tag = 0;
+        auto restored = tree->restore_session(options.checkpoint, &tag);
+        if (not restored.success)
+            return { .success = false, .error = restored.error, .replayed = 0 };
+        SessionFile journal;
+        // A missing journal means nothing was recorded since the checkpoint.
+        if (not journal.open(options.journal))
+            return { .success = errno == ENOENT, .error = errno == ENOENT ? 0 : errno, .replayed = 0 };
+        auto data = journal.view();
+        if (data.size() < journal_header_size or read_word(data, 0) != journal_magic or read_word(data, 8) != tag)
+            return { .success = true, .error = 0, .replayed = 0 };
+        size_t replayed = 0;
+        size_t pos = journal_header_size;
+        while (data.size() - pos >= journal_record_size)
+        {
+            auto op = Op{ static_cast<uint8_t>(data[pos]) };
+            auto offset = CharOffset{ read_word(data, pos + 1) };
+            auto count = Length{ read_word(data, pos + 1 + sizeof(uint64_t)) };
+            auto txt_size = op == Op::Insert ? rep(count) : 0;
+            if (txt_size > data.size() - pos - journal_record_size)
+                break;
+            auto body = data.substr(pos, journal_record_size - sizeof(uint64_t) + txt_size);
+            if (read_word(data, pos + body.size()) != fnv1a(body))
+                break;
+            auto length = rep(tree->length());
+            switch (op)
             {
-                // For when we revisit this node.
-                stack.back().dir = Direction::Center;
-                auto offset_amount = rep(node.root().left_subtree_length + node.root().piece.length);
-                offset = retract(offset, offset_amount);
-                node = node.right();
-                stack.push_back({ node });
+            case Op::Insert:
+                if (rep(offset) > length)
+                    return { .success = false, .error = EINVAL, .replayed = replayed };
+                tree->insert(offset, body.substr(journal_record_size - sizeof(uint64_t)), SuppressHistory::Yes);
+                break;
+            case Op::Remove:
+                if (rep(offset) > length or rep(count) > length - rep(offset))
+                    return { .success = false, .error = EINVAL, .replayed = replayed };
+                tree->remove(offset, count, SuppressHistory::Yes);
+                break;
+            case Op::Undo:
+                if (not tree->try_undo(offset).success)
+                    return { .success = false, .error = EINVAL, .replayed = replayed };
+                break;
+            case Op::Redo:
+                if (not tree->try_redo(offset).success)
+                    return { .success = false, .error = EINVAL, .replayed = replayed };
+                break;
+            case Op::Commit:
+                tree->commit_head(offset);
+                break;
+            default:
+                return { .success = false, .error = EINVAL, .replayed = replayed };
             }
+            pos += body.size() + sizeof(uint64_t);
+            ++replayed;
         }
+        return { .success = true, .error = 0, .replayed = replayed };
     }
 } // namespace PieceTree
 
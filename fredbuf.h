@@ -1,11 +1,31 @@
 #pragma once
 
-#include <forward_list>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <regex>
+#include <shared_mutex>
+#include <span>
 #include <string_view>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "fredbuf-decorations.h"
+#include "fredbuf-markers.h"
 #include "fredbuf-rbtree.h"
 #include "types.h"
 
@@ -18,19 +38,208 @@
 // that this version is based on immutable data structures to achieve fast undo/redo.
 namespace PieceTree
 {
+    // Identifies a state in the undo history.  Ids are handed out in chronological order.
+    enum class HistoryId : size_t
+    {
+        Invalid = sentinel_for<HistoryId>
+    };
+
+    // A single state in the undo tree.  Because roots are persistent, every state can be retained cheaply
+    // and new edits after an undo create a new branch rather than discarding the redo history.
     struct UndoRedoEntry
     {
         RedBlackTree root;
+        // The offset reported when undoing back into this state.
         CharOffset op_offset;
+        // The offset reported when redoing into this state.
+        CharOffset redo_offset;
+        HistoryId parent = HistoryId::Invalid;
+        // The child a redo will move to.  This is the most recently created or visited branch.
+        HistoryId redo_child = HistoryId::Invalid;
+        std::vector<HistoryId> children;
+        // Estimated number of bytes this entry keeps alive which the current root may no longer reference.
+        size_t retained_bytes = 0;
+        // Progressive loading: the number of loaded chunks 'root' holds and where the next one goes in it, or the
+        // end of the document if loading started after the state was left.
+        size_t loaded_chunks = 0;
+        CharOffset load_point = CharOffset::Sentinel;
     };
 
-    // We need the ability to 'release' old entries in this stack.
-    using UndoStack = std::forward_list<UndoRedoEntry>;
-    using RedoStack = std::forward_list<UndoRedoEntry>;
+    // We need the ability to 'release' old entries in the history.  Entries are stored in id order so the
+    // oldest entries live at the front and can be evicted cheaply.
+    using History = std::deque<UndoRedoEntry>;
+
+    // Indicates whether consecutive insertions are split into separate undo entries at word boundaries.
+    enum class CoalesceWords : bool { No, Yes };
+
+    struct HistoryPolicy
+    {
+        // The maximum number of history entries to retain (not counting the current state).  A value of 0 means unbounded.
+        size_t max_entries = 0;
+        // The maximum estimated number of bytes retained by undo entries (those older than the current state, which
+        // are the ones eviction can release).  Redo entries do not count.  A value of 0 means unbounded.
+        size_t max_retained_bytes = 0;
+        // Consecutive insertions separated by more than this amount of time are split into separate undo
+        // entries.  A value of 0 disables the time check.
+        std::chrono::milliseconds coalesce_window = { };
+        CoalesceWords coalesce_words = CoalesceWords::No;
+    };
 
     enum class LineStart : size_t { };
 
-    using LineStarts = std::vector<LineStart>;
+    // An array which only grows at the end.  Its elements live in chunks, each twice the length of the one before,
+    // which never move once allocated.  Copies share the chunks, so copying is O(1) and a copy keeps reading its
+    // elements while the array it was copied from appends more.  A copy only appends to the shared chunks if no
+    // other copy has appended past it; otherwise it first copies its elements to chunks of its own.
+    template <typename T>
+    class AppendOnlyArray
+    {
+    public:
+        AppendOnlyArray() = default;
+        // The right to append to the shared chunks stays with 'other'.
+        AppendOnlyArray(const AppendOnlyArray& other):
+            storage{ other.storage },
+            count{ other.count },
+            reserved{ other.count } { }
+        AppendOnlyArray(AppendOnlyArray&& other):
+            storage{ std::move(other.storage) },
+            count{ std::exchange(other.count, 0) },
+            reserved{ std::exchange(other.reserved, 0) } { }
+        AppendOnlyArray& operator=(const AppendOnlyArray& other)
+        {
+            return *this = AppendOnlyArray{ other };
+        }
+        AppendOnlyArray& operator=(AppendOnlyArray&& other)
+        {
+            storage = std::move(other.storage);
+            count = std::exchange(other.count, 0);
+            reserved = std::exchange(other.reserved, 0);
+            return *this;
+        }
+
+        const T& operator[](size_t i) const
+        {
+            auto chunk = chunk_of(i);
+            return storage->chunks[chunk][i - chunk_first(chunk)];
+        }
+
+        const T& back() const
+        {
+            return (*this)[count - 1];
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        bool empty() const
+        {
+            return count == 0;
+        }
+
+        void push_back(const T& value)
+        {
+            if (count == reserved)
+            {
+                reserve_chunk();
+            }
+            auto chunk = chunk_of(count);
+            storage->chunks[chunk][count - chunk_first(chunk)] = value;
+            ++count;
+        }
+
+        void clear()
+        {
+            // Nothing else can see the chunks, so they are reused.
+            if (storage.use_count() == 1)
+            {
+                storage->claimed = 0;
+            }
+            else
+            {
+                storage = nullptr;
+            }
+            count = 0;
+            reserved = 0;
+        }
+
+        // Calls 'f' with consecutive spans of the elements.
+        template <typename F>
+        void for_each_chunk(F&& f) const
+        {
+            for (size_t chunk = 0; chunk_first(chunk) < count; ++chunk)
+            {
+                f(std::span<const T>{ storage->chunks[chunk].get(), std::min(count, chunk_first(chunk + 1)) - chunk_first(chunk) });
+            }
+        }
+
+        friend bool operator==(const AppendOnlyArray& lhs, const AppendOnlyArray& rhs)
+        {
+            if (lhs.count != rhs.count)
+                return false;
+            for (size_t i = 0; i < lhs.count; ++i)
+            {
+                if (lhs[i] != rhs[i])
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        static constexpr size_t first_chunk_length = 16;
+        static constexpr size_t max_chunks = 48;
+
+        struct Storage
+        {
+            std::array<std::unique_ptr<T[]>, max_chunks> chunks;
+            // The elements the copy allowed to append may write up to.
+            std::atomic<size_t> claimed = 0;
+        };
+
+        static constexpr size_t chunk_first(size_t chunk)
+        {
+            return first_chunk_length * ((size_t{ 1 } << chunk) - 1);
+        }
+
+        static size_t chunk_of(size_t i)
+        {
+            return static_cast<size_t>(std::bit_width(i / first_chunk_length + 1)) - 1;
+        }
+
+        // Claims the rest of the chunk holding element 'count'.  If another copy appended past this one, the
+        // elements are copied to chunks of its own first.
+        void reserve_chunk()
+        {
+            const auto chunk = chunk_of(count);
+            const auto last = chunk_first(chunk + 1);
+            auto expected = reserved;
+            if (storage == nullptr or not storage->claimed.compare_exchange_strong(expected, last))
+            {
+                auto own = std::make_shared<Storage>();
+                for (size_t i = 0; chunk_first(i) < count; ++i)
+                {
+                    auto length = chunk_first(i + 1) - chunk_first(i);
+                    own->chunks[i].reset(new T[length]);
+                    std::copy_n(storage->chunks[i].get(), std::min(count, chunk_first(i + 1)) - chunk_first(i), own->chunks[i].get());
+                }
+                own->claimed = last;
+                storage = std::move(own);
+            }
+            if (storage->chunks[chunk] == nullptr)
+            {
+                storage->chunks[chunk].reset(new T[chunk_first(chunk + 1) - chunk_first(chunk)]);
+            }
+            reserved = last;
+        }
+
+        std::shared_ptr<Storage> storage;
+        size_t count = 0;
+        // Elements up to here may be written to the shared chunks.
+        size_t reserved = 0;
+    };
+
+    using LineStarts = AppendOnlyArray<LineStart>;
 
     struct NodePosition
     {
@@ -50,17 +259,320 @@ namespace PieceTree
         LineStarts line_starts;
     };
 
+    // Text which only grows at the end, shared between copies in chunks which never move like 'AppendOnlyArray'.
+    // Each chunk is at least twice the size of the one before.  Text which does not fit in the last chunk starts a
+    // new one, so text appended to one chunk is contiguous.  A new chunk starts with a copy of the text from the
+    // 'alignment' boundary before the end of the previous one, so reading from such a boundary up to a byte of
+    // the new chunk does not cross chunks either.
+    class ChunkedText
+    {
+    public:
+        static constexpr size_t alignment = 128;
+
+        ChunkedText() = default;
+        // The right to append to the shared chunks stays with 'other'.
+        ChunkedText(const ChunkedText& other):
+            storage{ other.storage },
+            length{ other.length },
+            chunk_count{ other.chunk_count },
+            reserved{ other.length } { }
+        ChunkedText(ChunkedText&& other):
+            storage{ std::move(other.storage) },
+            length{ std::exchange(other.length, 0) },
+            chunk_count{ std::exchange(other.chunk_count, 0) },
+            reserved{ std::exchange(other.reserved, 0) } { }
+        ChunkedText& operator=(const ChunkedText& other)
+        {
+            return *this = ChunkedText{ other };
+        }
+        ChunkedText& operator=(ChunkedText&& other)
+        {
+            storage = std::move(other.storage);
+            length = std::exchange(other.length, 0);
+            chunk_count = std::exchange(other.chunk_count, 0);
+            reserved = std::exchange(other.reserved, 0);
+            return *this;
+        }
+
+        size_t size() const
+        {
+            return length;
+        }
+
+        // The text of [first, first + count), which must lie within text appended to one chunk or run to it from
+        // the last 'alignment' boundary before it.
+        std::string_view text(size_t first, size_t count) const;
+        // The text of the last chunk, which starts at offset '*first' and holds at least the byte before the text
+        // last appended.
+        std::string_view last_chunk(size_t* first) const;
+        // Whether 'count' more bytes are appended to the last chunk.
+        bool fits(size_t count) const;
+        // Whether this holds the text of 'previous' followed by anything appended since it was copied.
+        bool extends(const ChunkedText& previous) const;
+        void append(std::string_view txt);
+        void clear();
+
+        // Calls 'f' with consecutive views of the text.
+        template <typename F>
+        void for_each_chunk(F&& f) const
+        {
+            for (size_t chunk = 0; chunk < chunk_count; ++chunk)
+            {
+                auto last = chunk + 1 == chunk_count ? length : storage->firsts[chunk + 1];
+                f(std::string_view{ storage->chunks[chunk].get(), last - storage->firsts[chunk] });
+            }
+        }
+
+    private:
+        static constexpr size_t first_chunk_length = 4096;
+        static constexpr size_t max_chunks = 48;
+
+        struct Storage
+        {
+            std::array<std::unique_ptr<char[]>, max_chunks> chunks;
+            std::array<size_t, max_chunks> firsts = { };
+            std::array<size_t, max_chunks> capacities = { };
+            // The offset the copy allowed to append may write up to.
+            std::atomic<size_t> claimed = 0;
+        };
+
+        void reserve(size_t count);
+
+        std::shared_ptr<Storage> storage;
+        size_t length = 0;
+        size_t chunk_count = 0;
+        // Bytes up to here may be written to the shared chunks.
+        size_t reserved = 0;
+    };
+
+    struct ModBuffer
+    {
+        ChunkedText buffer;
+        LineStarts line_starts;
+    };
+
     using BufferReference = std::shared_ptr<const CharBuffer>;
 
     using Buffers = std::vector<BufferReference>;
 
+    // A trigram index over an immutable buffer.  The buffer is split into fixed size blocks and each block
+    // records a bitmap of the hashed trigrams which start within it.  Lookups may yield false positives but
+    // never false negatives.  Since original buffers never change the index never needs invalidation.
+    struct TrigramIndex
+    {
+        static constexpr size_t block_length = 4096;
+        static constexpr size_t block_bits = 4096;
+        static constexpr size_t block_words = block_bits / 64;
+
+        size_t block_count = 0;
+        std::vector<uint64_t> bits;
+
+        bool may_contain(size_t block, uint32_t trigram_hash) const
+        {
+            return (bits[block * block_words + trigram_hash / 64] >> (trigram_hash % 64)) & 1;
+        }
+    };
+
+    using TrigramIndexReference = std::shared_ptr<const TrigramIndex>;
+
+    // For each line start of a buffer, the number of line feeds before it in the buffer which follow a CR.  The
+    // CRLF pairs within a piece are then found by subtraction.
+    using CRLFCounts = AppendOnlyArray<LFCount>;
+    using CRLFCountsReference = std::shared_ptr<const CRLFCounts>;
+
+#ifdef TEXTBUF_CONTENT_HASH
+    // Hashes of the prefixes of a buffer taken every 'stride' bytes, so that hashing any piece of the buffer
+    // touches at most '2 * stride' bytes.
+    struct PrefixHashes
+    {
+        static constexpr size_t stride = 64;
+
+        // 'hashes[k]' is the hash of the first 'k * stride' bytes.
+        AppendOnlyArray<ContentHash> hashes;
+    };
+
+    using PrefixHashesReference = std::shared_ptr<const PrefixHashes>;
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
+    enum class CodePointOffset : size_t { };
+    enum class UTF16Offset : size_t { };
+
+    // Running UTF counts of a buffer taken every 'stride' bytes.  Converting an offset within any piece of the
+    // buffer scans at most 'stride' bytes.
+    struct PrefixUTFCounts
+    {
+        static constexpr size_t stride = 128;
+
+        // 'counts[k]' covers the first 'k * stride' bytes.
+        AppendOnlyArray<UTFCounts> counts;
+    };
+
+    using PrefixUTFCountsReference = std::shared_ptr<const PrefixUTFCounts>;
+#endif // TEXTBUF_UTF_COUNTS
+
+#ifdef TEXTBUF_COLD_BUFFERS
+    // Keeps a buffer in memory while it is held, even if the cache evicts a cold buffer meanwhile.
+    using BufferPin = BufferReference;
+#else
+    using BufferPin = const CharBuffer*;
+#endif // TEXTBUF_COLD_BUFFERS
+
+#ifdef TEXTBUF_COLD_BUFFERS
+    // A read-only file holding the text of paged original buffers.  It must not change while any tree or
+    // snapshot refers to it, except through 'save_incremental', which calls 'preserve' first.
+    class BackingFile
+    {
+    public:
+        explicit BackingFile(int fd);
+        ~BackingFile();
+        BackingFile(const BackingFile&) = delete;
+        BackingFile& operator=(const BackingFile&) = delete;
+
+        bool read(char* out, size_t count, size_t offset) const;
+        // Whether 'other' may be open on this file.  Without file identities (on Windows) it always may.
+        bool may_alias(int other) const;
+        // Copies [offset, offset + count) of the file to a temporary spill file, so that reads keep returning
+        // the text it held when it was loaded after that range is overwritten.  Ranges preserved before are
+        // left alone since the file may hold new text there.
+        bool preserve(size_t offset, size_t count) const;
+
+    private:
+        struct PreservedRange
+        {
+            size_t length;
+            size_t spill_offset;
+        };
+
+        int fd;
+        // The length of the file when it was opened.  Nothing past it is ever read.
+        size_t length;
+        // Writers of 'preserved' hold the lock exclusively.
+        mutable std::shared_mutex lock;
+        // Keyed by file offset.
+        mutable std::map<size_t, PreservedRange> preserved;
+        mutable std::FILE* spill = nullptr;
+        mutable size_t spill_length = 0;
+    };
+
+    using BackingFileReference = std::shared_ptr<const BackingFile>;
+
+    // An original buffer whose text is not resident.  The text is either compressed in memory or, when 'file'
+    // is set, read from 'file_offset' in a backing file.  The line starts stay resident so that a cold buffer
+    // can be described without loading it; loaded copies of its text leave theirs empty.
+    struct ColdBuffer
+    {
+        // Each block of text is compressed on its own, which bounds the compressor's window and lets a corrupt
+        // block be detected by itself.
+        static constexpr size_t block_length = 64 * 1024;
+
+        // Block 'k' holds the text from 'k * block_length'.
+        std::vector<std::string> blocks;
+        BackingFileReference file;
+        size_t file_offset;
+        size_t size;
+        LineStarts line_starts;
+    };
+
+    using ColdBufferReference = std::shared_ptr<const ColdBuffer>;
+
+    struct BufferFootprint
+    {
+        // Bytes of original buffer text held in memory uncompressed.
+        size_t resident_bytes;
+        // Bytes held by compressed copies of original buffers.
+        size_t compressed_bytes;
+        // The number of times a block of a cold buffer was decompressed or read back in.
+        size_t page_faults;
+        // The number of reads from a backing file which failed or compressed blocks which did not decompress.
+        // The missing text reads as NUL bytes.
+        size_t read_errors;
+    };
+
+    // The loaded blocks of cold buffers, kept in least recently used order.  Each block of a cold buffer is
+    // loaded on its own, so reading part of a large buffer only decompresses or reads the blocks covering it.
+    // When a byte budget is set, every load evicts the least recently used blocks until the cache is within it;
+    // a block larger than the budget is handed out without being kept.  Readers hold a 'BufferPin' for as long
+    // as they view a block, so eviction only drops the cache's reference.  Loading may happen from any thread
+    // reading the collection.
+    class BufferCache
+    {
+    public:
+        BufferCache() = default;
+        BufferCache(const BufferCache& other);
+        BufferCache& operator=(const BufferCache& other);
+
+        // The text of block 'block' of the cold buffer 'index'.
+        BufferReference load(size_t index, const ColdBuffer& cold, size_t block) const;
+        // Makes the blocks of 'buffer', the text of the cold buffer 'index', the least recently used entries.
+        void adopt(size_t index, const CharBuffer& buffer);
+        // Keeps only the blocks of the 'keep' most recently used buffers.
+        void trim(size_t keep);
+        // A budget of 0 means unbounded.
+        void budget(size_t bytes);
+        size_t resident_bytes() const;
+        size_t page_faults() const;
+        size_t read_errors() const;
+
+    private:
+        struct Entry
+        {
+            size_t index;
+            size_t block;
+            BufferReference text;
+        };
+
+        using Recency = std::list<Entry>;
+
+        void insert(Recency::iterator position, Entry entry) const;
+        void evict(Recency::iterator entry) const;
+        void evict_over_budget() const;
+
+        mutable std::mutex lock;
+        // Most recently used first.
+        mutable Recency recency;
+        // Keyed by buffer index, then block index.
+        mutable std::map<std::pair<size_t, size_t>, Recency::iterator> entries;
+        mutable size_t resident = 0;
+        mutable size_t faults = 0;
+        mutable size_t errors = 0;
+        size_t max_bytes = 0;
+    };
+#endif // TEXTBUF_COLD_BUFFERS
+
     struct BufferCollection
     {
-        const CharBuffer* buffer_at(BufferIndex index) const;
+        // An original buffer, whose views stay valid for as long as the pin is held.  Use 'line_starts' for line
+        // lookups, which never load a cold buffer, and 'buffer_text' to read part of a buffer, which only loads
+        // the blocks of a cold buffer covering it and is the only way to read the mod buffer.
+        BufferPin buffer_at(BufferIndex index) const;
+        // The text of [first, first + count) of a buffer, valid for as long as '*pin' is held.  A range within
+        // one block of a cold buffer is viewed in place; a longer one is copied out of the blocks it covers.  Text
+        // of the mod buffer is read as 'ChunkedText::text' allows and stays valid for as long as the collection.
+        std::string_view buffer_text(BufferIndex index, CharOffset first, Length count, BufferPin* pin) const;
+        const LineStarts& line_starts(BufferIndex index) const;
         CharOffset buffer_offset(BufferIndex index, const BufferCursor& cursor) const;
 
         Buffers orig_buffers;
-        CharBuffer mod_buffer;
+        ModBuffer mod_buffer;
+        // Optional search indexes for 'orig_buffers'.  Either empty or the same size as 'orig_buffers'.
+        std::vector<TrigramIndexReference> orig_indexes;
+        std::vector<CRLFCountsReference> orig_crlf_counts;
+        CRLFCounts mod_crlf_counts;
+#ifdef TEXTBUF_CONTENT_HASH
+        std::vector<PrefixHashesReference> orig_hashes;
+        PrefixHashes mod_hashes;
+#endif // TEXTBUF_CONTENT_HASH
+#ifdef TEXTBUF_UTF_COUNTS
+        std::vector<PrefixUTFCountsReference> orig_utf_counts;
+        PrefixUTFCounts mod_utf_counts;
+#endif // TEXTBUF_UTF_COUNTS
+#ifdef TEXTBUF_COLD_BUFFERS
+        // Compressed copies of 'orig_buffers'.  Either empty or the same size as 'orig_buffers'; a null entry in
+        // 'orig_buffers' means the buffer is cold and must be loaded through 'cache'.
+        std::vector<ColdBufferReference> orig_cold;
+        BufferCache cache;
+#endif // TEXTBUF_COLD_BUFFERS
     };
 
     struct LineRange
@@ -75,6 +587,35 @@ namespace PieceTree
         CharOffset op_offset;
     };
 
+    // A range of content which differs between two roots.  The range [old_first, old_first + old_length) in
+    // the old root was replaced by [new_first, new_first + new_length) in the new root.
+    struct DiffRange
+    {
+        CharOffset old_first;
+        Length old_length;
+        CharOffset new_first;
+        Length new_length;
+    };
+
+    using DiffRanges = std::vector<DiffRange>;
+
+    enum class SearchDirection : bool { Forward, Backward };
+
+    struct SearchMatch
+    {
+        CharOffset offset;
+        Line line;
+        Length length;
+    };
+
+    using SearchMatches = std::vector<SearchMatch>;
+
+    struct FindResult
+    {
+        bool found;
+        SearchMatch match;
+    };
+
     // Owning snapshot owns its own buffer data (performs a lightweight copy) so
     // that even if the original tree is destroyed, the owning snapshot can still
     // reference the underlying text.
@@ -84,6 +625,50 @@ namespace PieceTree
     // tree buffers are valid.
     class ReferenceSnapshot;
 
+    // A single edit within a batch.  The offset refers to the document before any edit in the batch is applied.
+    struct Edit
+    {
+        CharOffset offset;
+        // The number of characters to remove starting at 'offset'.
+        Length count;
+        // The text inserted at 'offset' once the range is removed.
+        std::string_view txt;
+    };
+
+    enum class LineEnding : bool { LF, CRLF };
+
+    enum class IncludeHistory : bool { No, Yes };
+
+    struct SessionOptions
+    {
+        // The file the original buffers were loaded from, in order.  Original buffers which lie within it are
+        // saved as a reference (offset, length and hash) rather than as text.  Empty to save all text.
+        std::filesystem::path source;
+        IncludeHistory history = IncludeHistory::Yes;
+        // An opaque value handed back by 'restore_session', e.g. to tie a journal to the session it follows.
+        uint64_t tag = 0;
+    };
+
+    struct SessionResult
+    {
+        bool success;
+        int error; // The errno value on failure; EINVAL for a malformed session or a changed source file.
+    };
+
+    // What 'Tree::save_session' writes, captured by 'Tree::session_state' so that it can be written on another
+    // thread while the tree is edited.  The roots are shared with the tree.
+    struct SessionState
+    {
+        BufferCollection buffers;
+        RedBlackTree root;
+        History history;
+        size_t history_base = 0;
+        HistoryId current_state = HistoryId::Invalid;
+    };
+
+    // Writes 'state' as 'Tree::save_session' would have written the tree it was captured from.
+    SessionResult save_session(const SessionState& state, const std::filesystem::path& path, const SessionOptions& options = { });
+
     // When mutating the tree nodes are saved by default into the undo stack.  This
     // allows callers to suppress this behavior.
     enum class SuppressHistory : bool { No, Yes };
@@ -91,6 +676,7 @@ namespace PieceTree
     struct BufferMeta
     {
         LFCount lf_count = { };
+        LFCount crlf_count = { };
         Length total_content_length = { };
     };
 
@@ -106,10 +692,48 @@ namespace PieceTree
         // Interface.
         // Initialization after populating initial immutable buffers from ctor.
         void build_tree();
+        // Builds the trigram index for each original buffer.  Literal searches (and regex searches given a
+        // required literal) then only scan blocks of original buffers which may contain a match, along with
+        // every mod buffer piece.
+        void build_search_index();
 
         // Manipulation.
         void insert(CharOffset offset, std::string_view txt, SuppressHistory suppress_history = SuppressHistory::No);
         void remove(CharOffset offset, Length count, SuppressHistory suppress_history = SuppressHistory::No);
+        // Applies a batch of edits sorted by offset and non-overlapping as a single undo entry.
+        void apply_edits(std::span<const Edit> edits, SuppressHistory suppress_history = SuppressHistory::No);
+        // Converts every line ending to 'target'.  Lone CRs are not line endings and are left alone.  The
+        // converted text becomes a new original buffer in one pass over the pieces, and the whole conversion
+        // is a single undo entry.  Nothing is done if the document already uses 'target' throughout.
+        void convert_line_endings(LineEnding target, SuppressHistory suppress_history = SuppressHistory::No);
+#ifdef TEXTBUF_COLD_BUFFERS
+        // Compresses the original buffers and keeps only the 'resident' most recently used of them decompressed.
+        // A cold buffer is decompressed again when a query or walker touches it and stays resident until the
+        // next call or until the cache budget evicts it, so views into the tree must not be held across this
+        // call.  Snapshots keep their own cache of the buffers they have touched.
+        void compress_cold_buffers(size_t resident);
+        // Replaces the content with the file at 'path' without keeping its text in memory.  The file is read once
+        // in blocks of 'block_size' to compute line starts (which stay resident) and each block becomes an
+        // original buffer which is read back in when touched.  The file must not change while the tree or any
+        // snapshot of it is alive, other than through 'save_incremental'.  The history and the attached marker and
+        // decoration trees are cleared.  Returns the errno value on failure, leaving the tree empty.
+        int load_paged(const std::filesystem::path& path, Length block_size = Length{ 1 << 20 });
+        // Limits the bytes of cold buffers held in memory at once; 0 means unbounded.  Snapshots taken afterwards
+        // inherit the budget.
+        void cold_buffer_budget(size_t bytes);
+        BufferFootprint buffer_footprint() const;
+#endif // TEXTBUF_COLD_BUFFERS
+        // Session restore.
+        // Writes the buffers, the node structure of the current root and optionally of every root in the undo
+        // history to 'path'.  Nodes shared between roots are written once.  Line starts are stored so that
+        // restoring never rescans for them.
+        SessionResult save_session(const std::filesystem::path& path, const SessionOptions& options = { }) const;
+        // Captures what 'save_session' writes without writing it.  This copies the history entries but shares
+        // the buffers.
+        SessionState session_state(IncludeHistory history = IncludeHistory::Yes) const;
+        // Replaces the content and history with a session written by 'save_session'.  The tree is unchanged on
+        // failure.  The history policy is kept.  The session's tag is stored in 'tag' if given.
+        SessionResult restore_session(const std::filesystem::path& path, uint64_t* tag = nullptr);
         UndoRedoResult try_undo(CharOffset op_offset);
         UndoRedoResult try_redo(CharOffset op_offset);
 
@@ -120,6 +744,57 @@ namespace PieceTree
         // Snaps the tree back to the specified root.  This needs to be called with a root that is derived from
         // the set of buffers based on its creation.
         void snap_to(const RedBlackTree& new_root);
+        // Hands the roots this tree lets go of (evicted history, 'snap_to', rebuilding) to 'reclaimer' rather
+        // than freeing their nodes in place.  A null reclaimer frees in place again.  Owning snapshots taken
+        // meanwhile, including published ones, hand their root to the same reclaimer when they are dropped.
+        void defer_reclamation(std::shared_ptr<NodeReclaimer> reclaimer);
+
+        // Markers.
+        // Attached marker trees are adjusted by every edit, line ending conversion and 'snap_to', and by undo,
+        // redo and jumps through the history, which map them through the ranges changed between the two roots
+        // (see 'diff').  Like an edit, undoing an insertion collapses the markers inside it.  'restore_session'
+        // replaces the content wholesale, so clients re-anchor their markers after it; 'load_paged' clears them.
+        // The marker tree must outlive its attachment.
+        void attach_markers(MarkerTree* markers);
+        void detach_markers(MarkerTree* markers);
+        // Decorations.
+        // Attached decoration trees are adjusted like marker trees and copied into every 'OwningSnapshot', in order
+        // of attachment, so highlighting threads see ranges consistent with the snapshot's text.
+        void attach_decorations(DecorationTree* decorations);
+        void detach_decorations(DecorationTree* decorations);
+
+        // Undo tree navigation.
+        HistoryId history_current() const
+        {
+            return current_state;
+        }
+        HistoryId history_first() const
+        {
+            return HistoryId{ history_base };
+        }
+        HistoryId history_last() const
+        {
+            return HistoryId{ history_base + history.size() - 1 };
+        }
+        // Returns nullptr if 'id' was evicted or never existed.
+        const UndoRedoEntry* history_at(HistoryId id) const;
+        // Moves the buffer to the state identified by 'id'.
+        UndoRedoResult jump_to(HistoryId id);
+        // Walk the history in chronological order, regardless of branches.
+        UndoRedoResult history_earlier();
+        UndoRedoResult history_later();
+
+        // History limits.
+        void history_policy(const HistoryPolicy& policy);
+        const HistoryPolicy& history_policy() const
+        {
+            return policy;
+        }
+        // An estimate of the memory retained by the history beyond the current root.
+        size_t history_retained_bytes() const
+        {
+            return retained_bytes;
+        }
 
         // Queries.
         void get_line_content(std::string* buf, Line line) const;
@@ -129,6 +804,27 @@ namespace PieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        // Computes the changed ranges between two roots derived from this tree's buffers (e.g. history
+        // entries or 'head()' before and after an edit).  Subtrees shared by both roots are skipped, so the
+        // cost is proportional to the number of changes rather than the document size.
+        void diff(DiffRanges* ranges, const RedBlackTree& old_root, const RedBlackTree& new_root) const;
+        // Searches for 'needle' without materializing the document.  A forward search finds the first match
+        // starting at or after 'from'; a backward search finds the last match ending at or before 'from'.
+        FindResult find(std::string_view needle, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        // Populates 'matches' with every non-overlapping match of 'needle' in document order.
+        void find_all(SearchMatches* matches, std::string_view needle) const;
+        // Regular expression search over the piece spans.  Matching is line-anchored: '^' and '$' match at line
+        // boundaries and matches never span a line feed.
+        FindResult find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern) const;
+        // Same as above but only lines containing 'required' (a literal every match must contain) are matched
+        // against 'pattern'.  Candidate lines are located through the search index when it is available.
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const;
+        // Code point boundaries around 'offset', located through the piece containing it rather than by walking
+        // from the start of the line.  'prev' yields the start of the code point holding 'offset - 1' and 'next'
+        // the end of the code point holding 'offset'; both clamp to the document.
+        CharOffset prev_codepoint_boundary(CharOffset offset) const;
+        CharOffset next_codepoint_boundary(CharOffset offset) const;
 
         Length length() const
         {
@@ -145,11 +841,40 @@ namespace PieceTree
             return meta.lf_count;
         }
 
+        // The number of line feeds preceded by a carriage return.  The document uses CRLF line endings throughout
+        // when this equals 'line_feed_count()'.
+        LFCount crlf_count() const
+        {
+            return meta.crlf_count;
+        }
+
         Length line_count() const
         {
             return Length{ rep(line_feed_count()) + 1 };
         }
 
+#ifdef TEXTBUF_CONTENT_HASH
+        // The hash of the document content.  It is maintained with each node so this is O(1), and equal
+        // content yields equal hashes regardless of how it is split into pieces.
+        ContentHash content_hash() const
+        {
+            return tree_hash(root);
+        }
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
+        // Conversions between byte offsets and code point or UTF-16 offsets.  These are O(log n) using the counts
+        // cached in each node.  An offset within a multi-byte sequence (or within a surrogate pair) maps to the
+        // start of its code point.
+        UTF16Offset offset_to_utf16(CharOffset offset) const;
+        CharOffset utf16_to_offset(UTF16Offset offset) const;
+        CodePointOffset offset_to_code_point(CharOffset offset) const;
+        CharOffset code_point_to_offset(CodePointOffset offset) const;
+        // Column conversions within a line, e.g. for LSP positions.  Columns past the end of the line clamp to it.
+        UTF16Offset utf16_column(CharOffset offset) const;
+        CharOffset utf16_column_to_offset(Line line, UTF16Offset column) const;
+#endif // TEXTBUF_UTF_COUNTS
+
         OwningSnapshot owning_snap() const;
         ReferenceSnapshot ref_snap() const;
     private:
@@ -157,23 +882,41 @@ namespace PieceTree
         friend class ReverseTreeWalker;
         friend class OwningSnapshot;
         friend class ReferenceSnapshot;
+        friend class ProgressiveLoader;
 #ifdef TEXTBUF_DEBUG
         friend void print_piece(const Piece& piece, const Tree* tree, int level);
         friend void print_tree(const Tree& tree);
 #endif // TEXTBUF_DEBUG
         void internal_insert(CharOffset offset, std::string_view txt);
         void internal_remove(CharOffset offset, Length count);
+        void internal_apply_edits(std::span<const Edit> edits);
 
         using Accumulator = Length(*)(const BufferCollection*, const Piece&, Line);
 
         template <Accumulator accumulate>
         static void line_start(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& node, Line line);
-        static void line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& root, const RedBlackTree& node, Line line);
+        // Computes the end of 'line - 1' excluding its LF or CRLF.  'preceded_by_cr' is whether the content before
+        // 'node' ends with CR.
+        static IncompleteCRLF line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& node, Line line, bool preceded_by_cr = false);
         static Length accumulate_value(const BufferCollection* buffers, const Piece& piece, Line index);
         static Length accumulate_value_no_lf(const BufferCollection* buffers, const Piece& piece, Line index);
         static void populate_from_node(std::string* buf, const BufferCollection* buffers, const RedBlackTree& node);
         static void populate_from_node(std::string* buf, const BufferCollection* buffers, const RedBlackTree& node, Line line_index);
         static LFCount line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end);
+        static FindResult find_literal(const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, CharOffset from, SearchDirection direction);
+        static void find_all_literal(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle);
+        static void find_all_literal_parallel(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, std::string_view needle, size_t thread_count);
+        static FindResult find_pattern(const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern, CharOffset from, SearchDirection direction);
+        static void find_all_pattern(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern);
+        static void find_all_pattern(SearchMatches* matches, const BufferCollection* buffers, const RedBlackTree& root, const std::regex& pattern, std::string_view required);
+#ifdef TEXTBUF_UTF_COUNTS
+        static size_t utf_offset(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset, size_t UTFCounts::* field);
+        static CharOffset utf_to_offset(const BufferCollection* buffers, const RedBlackTree& root, size_t units, size_t UTFCounts::* field);
+        static UTF16Offset utf16_column(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset);
+        static CharOffset utf16_column_to_offset(const BufferCollection* buffers, const RedBlackTree& root, Line line, UTF16Offset column);
+#endif // TEXTBUF_UTF_COUNTS
+        static CharOffset prev_codepoint_boundary(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset);
+        static CharOffset next_codepoint_boundary(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset);
         static NodePosition node_at(const BufferCollection* buffers, RedBlackTree node, CharOffset off);
         static BufferCursor buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder);
         static char char_at(const BufferCollection* buffers, const RedBlackTree& node, CharOffset offset);
@@ -191,10 +934,39 @@ namespace PieceTree
         // Direct mutations.
         void assemble_line(std::string* buf, const RedBlackTree& node, Line line) const;
         Piece build_piece(std::string_view txt);
+        Piece append_orig_buffer(CharBuffer&& buf);
+        void append_loaded(CharBuffer&& buf);
+        void catch_up_loaded(UndoRedoEntry* entry);
+        // Moves the load point and the attached marker and decoration trees past an edit.
+        void text_inserted(CharOffset offset, Length length);
+        void text_removed(CharOffset offset, Length length);
+        // Maps the attached marker and decoration trees from 'old_root' to 'new_root' through the ranges changed
+        // between them.
+        void map_attached(const RedBlackTree& old_root, const RedBlackTree& new_root);
+        void map_attached(CharOffset offset, Length removed, Length inserted);
+        // Maps a changed range whose two sides differ only in the CRs of their line endings (e.g. across a line
+        // ending conversion) one line ending at a time.  Returns false if the text differs otherwise.
+        bool map_line_endings(const RedBlackTree& old_root, const RedBlackTree& new_root, const DiffRange& range);
+        void populate_orig_buffer_data(size_t first = 0);
+        NodeData node_data(const Piece& piece) const;
         void combine_pieces(NodePosition existing_piece, Piece new_piece);
         void remove_node_range(NodePosition first, Length length);
         void compute_buffer_meta();
-        void append_undo(const RedBlackTree& old_root, CharOffset op_offset);
+        void append_undo(CharOffset op_offset);
+        // Counts the nodes the parent of the current state no longer shares with the root after an edit.
+        void measure_parent();
+        bool coalesce_insert(std::string_view txt) const;
+        void reset_history();
+        UndoRedoEntry& history_entry(HistoryId id);
+        void leave_current_state();
+        void enter_state(HistoryId id);
+        void evict_history();
+        void set_retained_bytes(HistoryId id, size_t bytes);
+        // The part of 'retained_bytes' held by entries older than the current state.
+        size_t undo_bytes() const;
+        size_t retained_prefix(size_t count) const;
+        void rebuild_retained_sums();
+        void retire(RedBlackTree&& old_root);
 
         BufferCollection buffers;
         //Buffers buffers;
@@ -205,15 +977,65 @@ namespace PieceTree
         // Note: This is absolute position.  Initialize to nonsense value.
         CharOffset end_last_insert = CharOffset::Sentinel;
         BufferMeta meta;
-        UndoStack undo_stack;
-        RedoStack redo_stack;
+        History history;
+        // The id of the first entry in 'history'.
+        size_t history_base = 0;
+        HistoryId current_state = HistoryId::Invalid;
+        HistoryPolicy policy;
+        size_t retained_bytes = 0;
+        // A Fenwick tree over the 'retained_bytes' of the entries in id order, starting at 'retained_sums_base', so
+        // 'undo_bytes' is a prefix sum however far a navigation jumps.  Evicted entries count as zero until the
+        // tree is rebuilt.  Sums wrap around like the deltas they are built from.
+        std::vector<size_t> retained_sums;
+        size_t retained_sums_base = 0;
+        // Used by the coalescing heuristics to decide where an undo group ends.
+        std::chrono::steady_clock::time_point last_insert_time = { };
+        char last_insert_char = '\0';
+        std::shared_ptr<NodeReclaimer> reclaimer;
+        // Progressive loading.  Every chunk appended since the history was last reset, in file order, and where
+        // the next chunk goes in 'root'.  Text inserted at the load point stays after the rest of the file.
+        std::vector<NodeData> loaded_chunks;
+        CharOffset load_point = CharOffset::Sentinel;
+        std::vector<MarkerTree*> marker_trees;
+        std::vector<DecorationTree*> decoration_trees;
+    };
+
+    struct SaveResult
+    {
+        bool success;
+        int error; // The errno value on failure.
+        Length bytes_written;
     };
 
+    // Streams the snapshot to 'fd' by gathering piece spans into vectored writes.  No copy of the content is
+    // made; extra memory is bounded by a single batch of spans.
+    SaveResult save(const OwningSnapshot& snap, int fd);
+    // Saves to a temporary file next to 'path', flushes it and renames it over 'path' so that readers see either
+    // the old or the new content.  Since an owning snapshot is independent of its tree, this can run on a worker
+    // thread while editing continues.
+    SaveResult save_file(const OwningSnapshot& snap, const std::filesystem::path& path);
+    // Rewrites only what changed in the file open as 'fd', given that it currently holds 'on_disk' (e.g. the
+    // snapshot taken after loading or after the previous save).  Regions which still come from the same buffer
+    // bytes at the same offset are skipped.  If the length is unchanged only the changed regions are written;
+    // otherwise everything from the first change onwards is rewritten and the file is truncated.  The file is
+    // written in place, so unlike 'save_file' this is not atomic.  If the file size does not match 'on_disk', or
+    // 'on_disk' is not an earlier snapshot of the same buffers (e.g. it was taken before 'restore_session' or
+    // comes from another tree), the whole file is rewritten.  When paged buffers of either snapshot read from
+    // the file (see 'load_paged'), the text about to be overwritten is first copied to a temporary file so that
+    // they keep reading what was loaded.
+    SaveResult save_incremental(const OwningSnapshot& snap, const OwningSnapshot& on_disk, int fd);
+
     class OwningSnapshot
     {
     public:
         explicit OwningSnapshot(const Tree* tree);
         explicit OwningSnapshot(const Tree* tree, const RedBlackTree& dt);
+        OwningSnapshot(const OwningSnapshot&) = default;
+        OwningSnapshot(OwningSnapshot&&) = default;
+        // Dropping or replacing the snapshot retires its root if its tree deferred reclamation.
+        OwningSnapshot& operator=(const OwningSnapshot& other);
+        OwningSnapshot& operator=(OwningSnapshot&& other);
+        ~OwningSnapshot();
 
         // Queries.
         void get_line_content(std::string* buf, Line line) const;
@@ -222,6 +1044,16 @@ namespace PieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        FindResult find(std::string_view needle, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        void find_all(SearchMatches* matches, std::string_view needle) const;
+        FindResult find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern) const;
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const;
+        // Same as 'find_all' but the snapshot is partitioned at piece boundaries and scanned on 'thread_count'
+        // threads (0 selects the hardware concurrency).  Results are still in document order.
+        void find_all_parallel(SearchMatches* matches, std::string_view needle, size_t thread_count = 0) const;
+        CharOffset prev_codepoint_boundary(CharOffset offset) const;
+        CharOffset next_codepoint_boundary(CharOffset offset) const;
         bool is_empty() const
         {
             return meta.total_content_length == Length{};
@@ -231,15 +1063,41 @@ namespace PieceTree
         {
             return Length{ rep(meta.lf_count) + 1 };
         }
+
+        // The tree's attached decoration trees as of the snapshot.
+        std::span<const DecorationTree> decorations() const
+        {
+            return decoration_trees;
+        }
+
+#ifdef TEXTBUF_CONTENT_HASH
+        ContentHash content_hash() const
+        {
+            return tree_hash(root);
+        }
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
+        UTF16Offset offset_to_utf16(CharOffset offset) const;
+        CharOffset utf16_to_offset(UTF16Offset offset) const;
+        CodePointOffset offset_to_code_point(CharOffset offset) const;
+        CharOffset code_point_to_offset(CodePointOffset offset) const;
+        UTF16Offset utf16_column(CharOffset offset) const;
+        CharOffset utf16_column_to_offset(Line line, UTF16Offset column) const;
+#endif // TEXTBUF_UTF_COUNTS
     private:
         friend class TreeWalker;
         friend class ReverseTreeWalker;
+        friend SaveResult save(const OwningSnapshot& snap, int fd);
+        friend SaveResult save_incremental(const OwningSnapshot& snap, const OwningSnapshot& on_disk, int fd);
 
         RedBlackTree root;
         BufferMeta meta;
         // This should be fairly lightweight.  The original buffers
         // will retain the majority of the memory consumption.
         BufferCollection buffers;
+        std::vector<DecorationTree> decoration_trees;
+        std::shared_ptr<NodeReclaimer> reclaimer;
     };
 
     class ReferenceSnapshot
@@ -255,6 +1113,16 @@ namespace PieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        FindResult find(std::string_view needle, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        void find_all(SearchMatches* matches, std::string_view needle) const;
+        FindResult find_regex(const std::regex& pattern, CharOffset from, SearchDirection direction = SearchDirection::Forward) const;
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern) const;
+        void find_all_regex(SearchMatches* matches, const std::regex& pattern, std::string_view required) const;
+        // Same as 'find_all' but the snapshot is partitioned at piece boundaries and scanned on 'thread_count'
+        // threads (0 selects the hardware concurrency).  Results are still in document order.
+        void find_all_parallel(SearchMatches* matches, std::string_view needle, size_t thread_count = 0) const;
+        CharOffset prev_codepoint_boundary(CharOffset offset) const;
+        CharOffset next_codepoint_boundary(CharOffset offset) const;
         bool is_empty() const
         {
             return meta.total_content_length == Length{};
@@ -264,6 +1132,22 @@ namespace PieceTree
         {
             return Length{ rep(meta.lf_count) + 1 };
         }
+
+#ifdef TEXTBUF_CONTENT_HASH
+        ContentHash content_hash() const
+        {
+            return tree_hash(root);
+        }
+#endif // TEXTBUF_CONTENT_HASH
+
+#ifdef TEXTBUF_UTF_COUNTS
+        UTF16Offset offset_to_utf16(CharOffset offset) const;
+        CharOffset utf16_to_offset(UTF16Offset offset) const;
+        CodePointOffset offset_to_code_point(CharOffset offset) const;
+        CharOffset code_point_to_offset(CodePointOffset offset) const;
+        UTF16Offset utf16_column(CharOffset offset) const;
+        CharOffset utf16_column_to_offset(Line line, UTF16Offset column) const;
+#endif // TEXTBUF_UTF_COUNTS
     private:
         friend class TreeWalker;
         friend class ReverseTreeWalker;
@@ -274,6 +1158,94 @@ namespace PieceTree
         const BufferCollection* buffers;
     };
 
+    struct PublishedSnapshot
+    {
+        OwningSnapshot snap;
+        // Increases with each publication.
+        size_t generation;
+    };
+
+    using PublishedSnapshotReference = std::shared_ptr<const PublishedSnapshot>;
+
+    // Shares the state of a tree between one writer and many readers.  The tree itself stays single threaded:
+    // the writer thread owns it, edits it (including undo, redo and 'snap_to') and calls 'publish' whenever
+    // readers should see the result, e.g. after each edit or once per frame.  Reader threads call 'acquire' to
+    // get the last published state as a consistent snapshot of root, meta and buffers.  A published snapshot
+    // owns everything it refers to, so no buffer memory is freed while a reader still holds it; the last
+    // reader to let go of a superseded snapshot releases it.  If the tree defers reclamation, that reader only
+    // retires the snapshot's root rather than freeing its nodes.
+    // Publishing takes an 'OwningSnapshot', which shares every buffer with the tree: the mod buffer and the
+    // data derived from it are append-only chunks which the tree keeps appending to past the snapshot (see
+    // 'ChunkedText').  Its cost does not depend on how much text has been typed.
+    class SnapshotPublisher
+    {
+    public:
+        explicit SnapshotPublisher(const Tree& tree);
+
+        // Writer only.
+        void publish(const Tree& tree);
+        // Any thread.
+        PublishedSnapshotReference acquire() const;
+
+    private:
+        std::atomic<PublishedSnapshotReference> current;
+        // Only touched by the writer.
+        size_t generation = 0;
+    };
+
+    // An edit which owns its text, for changes which outlive the buffers they were made from.
+    struct OwnedEdit
+    {
+        CharOffset offset;
+        Length count;
+        std::string txt;
+    };
+
+    // A batch of edits, with the same rules as for 'Tree::apply_edits'.
+    using Change = std::vector<OwnedEdit>;
+
+    // Decides the order of text inserted at the same offset by two concurrent changes.
+    enum class TieBreak : bool { AppliedFirst, ChangeFirst };
+
+    // Rebases 'change' over 'applied', where both were made against the same document, so that the result
+    // applies to the document after 'applied'.  Text which 'applied' inserted inside a range removed by 'change'
+    // survives, splitting the removal.  Transforming each change over the other with opposite tie breaks yields
+    // the same document either way.
+    void transform_change(Change* out, const Change& change, const Change& applied, TieBreak tie = TieBreak::AppliedFirst);
+
+    enum class Revision : size_t
+    {
+        Invalid = sentinel_for<Revision>
+    };
+
+    // Serializes concurrent writers through a tree with operational transformation.  Each client submits a
+    // change made against the revision it last saw.  The change is rebased over every change accepted since and
+    // applied as one batch without touching the tree's undo history, so local undo stays separate from remote
+    // edits.  Accepted changes are logged so that clients can catch up.
+    class CollabSession
+    {
+    public:
+        explicit CollabSession(Tree* tree);
+
+        Revision revision() const
+        {
+            return Revision{ log_base + log.size() };
+        }
+        // Returns the new revision, or 'Revision::Invalid' if 'base' was discarded or is in the future.  The
+        // change as applied is stored in 'accepted' if given.
+        Revision submit(Revision base, const Change& change, Change* accepted = nullptr);
+        // The changes accepted after 'base' in order.  Empty if 'base' was discarded.
+        std::span<const Change> changes_since(Revision base) const;
+        // Drops the log before 'oldest'.  Submissions against an earlier revision fail afterwards.
+        void discard_before(Revision oldest);
+
+    private:
+        Tree* tree;
+        std::vector<Change> log;
+        // The revision 'log.front()' was made against.
+        size_t log_base = 0;
+    };
+
     struct TreeBuilder
     {
         Buffers buffers;
@@ -287,6 +1259,137 @@ namespace PieceTree
         }
     };
 
+    struct LoadProgress
+    {
+        // The number of bytes appended to the tree so far.
+        Length loaded;
+        // Whether the whole file has been appended (or reading failed).
+        bool finished;
+        int error; // The errno value if reading failed.
+    };
+
+    // Reads a file on a background thread and hands it to a tree in chunks.  Line starts are computed on the
+    // reader thread while the thread owning the tree calls 'pump' (e.g. once per frame) to append whatever has
+    // been read so far, so the first screen can be shown long before the whole file is in.  The tree may be
+    // edited while loading: the unread remainder of the file goes right after the text loaded so far, wherever
+    // edits move it, so text typed at the end of the partial document ends up after the rest of the file.
+    // Undo never drops loaded text: a state in the history gains the chunks loaded since it was left when it is
+    // entered again.  A tree is loaded progressively at most once.
+    class ProgressiveLoader
+    {
+    public:
+        explicit ProgressiveLoader(const std::filesystem::path& path, Length chunk_size = Length{ 1 << 20 });
+        ~ProgressiveLoader();
+        ProgressiveLoader(const ProgressiveLoader&) = delete;
+        ProgressiveLoader& operator=(const ProgressiveLoader&) = delete;
+
+        // Appends at most 'max_chunks' of the chunks read so far, which bounds the work done per call.
+        LoadProgress pump(Tree* tree, size_t max_chunks = std::numeric_limits<size_t>::max());
+    private:
+        void read_file(std::filesystem::path path, size_t chunk_size);
+
+        std::mutex lock;
+        // Guarded by 'lock'.
+        std::deque<CharBuffer> ready;
+        bool done = false;
+        int error = 0;
+
+        Length loaded = { };
+        std::atomic<bool> cancelled = false;
+        std::thread reader;
+    };
+
+    struct JournalOptions
+    {
+        std::filesystem::path journal;
+        std::filesystem::path checkpoint;
+        // Pending records are written and flushed together once this many bytes are pending or 'sync_interval'
+        // has passed since they were recorded.
+        size_t group_bytes = 64 << 10;
+        std::chrono::milliseconds sync_interval{ 100 };
+        // A checkpoint is taken once the journal holds this many records, bounding the replay on recovery.  The
+        // edit which reaches the count only captures the tree's state; the flusher thread writes it.  0 to
+        // checkpoint only on request.
+        size_t checkpoint_records = 10000;
+        IncludeHistory history = IncludeHistory::Yes;
+    };
+
+    struct JournalResult
+    {
+        bool success;
+        int error; // The errno value on failure; EINVAL for a malformed checkpoint.
+        // The number of journal records replayed by 'recover'.
+        size_t replayed;
+    };
+
+    // An append-only journal of the edits made through it, for recovering unsaved edits after a crash.  Each
+    // edit is applied to the tree and recorded in memory; a background thread writes and flushes the pending
+    // records in groups, so a crash loses at most the last 'sync_interval' of edits, plus those made while the
+    // flusher writes a checkpoint.  Checkpoints save the tree as a session and start a fresh journal, so recovery
+    // restores the checkpoint and replays only the tail.
+    // Undo groups are recorded explicitly, so the replayed history matches the original regardless of the
+    // coalescing policy.  Without history in the checkpoints, an undo or redo is recorded as the text it changed.
+    class EditJournal
+    {
+    public:
+        // Starts a journal for 'tree' with a checkpoint of its current state.  Check 'error' afterwards.
+        EditJournal(Tree* tree, const JournalOptions& options);
+        // Flushes pending records.
+        ~EditJournal();
+        EditJournal(const EditJournal&) = delete;
+        EditJournal& operator=(const EditJournal&) = delete;
+
+        void insert(CharOffset offset, std::string_view txt, SuppressHistory suppress_history = SuppressHistory::No);
+        void remove(CharOffset offset, Length count, SuppressHistory suppress_history = SuppressHistory::No);
+        UndoRedoResult try_undo(CharOffset op_offset);
+        UndoRedoResult try_redo(CharOffset op_offset);
+        void commit_head(CharOffset offset);
+
+        // Writes and flushes every pending record before returning.
+        JournalResult sync();
+        // Saves the tree to the checkpoint file and truncates the journal before returning.
+        JournalResult checkpoint();
+        // The first write failure, if any.  Records made after a failure are not durable.
+        int error() const;
+
+        // Restores the checkpoint into 'tree' and replays the journal written after it.  Replay stops at the
+        // first torn or corrupt record.  A journal left behind by a crash during a checkpoint is ignored since
+        // the checkpoint already holds its edits.
+        static JournalResult recover(Tree* tree, const JournalOptions& options);
+    private:
+        enum class Op : uint8_t;
+
+        void record(Op op, CharOffset offset, Length count, std::string_view txt = { });
+        void record_history(HistoryId last, CharOffset offset);
+        void record_move(Op op, const RedBlackTree& old_root, CharOffset op_offset);
+        void written();
+        bool start_journal();
+        bool write_pending();
+        bool write_group(std::string_view group);
+        JournalResult replace_checkpoint(const SessionResult& saved);
+        void flush_loop();
+
+        Tree* tree;
+        JournalOptions options;
+        uint64_t generation = 0;
+        size_t records = 0;
+        int fd = -1;
+
+        // Held while writing to 'fd'.
+        std::mutex io;
+        mutable std::mutex lock;
+        std::condition_variable wake;
+        // Guarded by 'lock'.
+        std::string pending;
+        // A checkpoint captured by an edit and the records made before it, which the flusher writes first.
+        std::unique_ptr<const SessionState> captured;
+        std::string captured_pending;
+        std::chrono::steady_clock::time_point first_pending = { };
+        bool stopping = false;
+        int failure = 0;
+        std::thread flusher;
+    };
+
     class TreeWalker
     {
     public:
@@ -334,6 +1437,8 @@ namespace PieceTree
         CharOffset total_offset = CharOffset{ 0 };
         const char* first_ptr = nullptr;
         const char* last_ptr = nullptr;
+        // The buffer 'first_ptr' points into.
+        BufferPin pinned = { };
     };
 
     class ReverseTreeWalker
@@ -383,6 +1488,60 @@ namespace PieceTree
         CharOffset total_offset = CharOffset{ 0 };
         const char* first_ptr = nullptr;
         const char* last_ptr = nullptr;
+        // The buffer 'first_ptr' points into.
+        BufferPin pinned = { };
+    };
+
+    // Walks UTF-8 code points on top of the byte walkers.  A byte which does not begin a well-formed sequence
+    // (a stray continuation byte, or a lead byte without enough continuation bytes) decodes on its own as
+    // U+FFFD, so both directions agree on where code points begin.
+    class CodePointWalker
+    {
+    public:
+        static constexpr char32_t replacement = 0xFFFD;
+
+        CodePointWalker(const Tree* tree, CharOffset offset = CharOffset{ });
+        CodePointWalker(const OwningSnapshot* snap, CharOffset offset = CharOffset{ });
+        CodePointWalker(const ReferenceSnapshot* snap, CharOffset offset = CharOffset{ });
+        CodePointWalker(const CodePointWalker&) = delete;
+
+        char32_t next();
+        bool exhausted() const;
+        CharOffset offset() const
+        {
+            return retract(walker.offset(), pending_count);
+        }
+    private:
+        void fill();
+
+        TreeWalker walker;
+        // Bytes read from 'walker' but not yet decoded.
+        std::array<char, 4> pending = { };
+        size_t pending_count = 0;
+    };
+
+    // Yields the code point containing the byte at 'offset', then each preceding code point.
+    class ReverseCodePointWalker
+    {
+    public:
+        ReverseCodePointWalker(const Tree* tree, CharOffset offset = CharOffset{ });
+        ReverseCodePointWalker(const OwningSnapshot* snap, CharOffset offset = CharOffset{ });
+        ReverseCodePointWalker(const ReferenceSnapshot* snap, CharOffset offset = CharOffset{ });
+        ReverseCodePointWalker(const ReverseCodePointWalker&) = delete;
+
+        char32_t next();
+        bool exhausted() const;
+        CharOffset offset() const
+        {
+            return extend(walker.offset(), pending_count);
+        }
+    private:
+        void fill();
+
+        ReverseTreeWalker walker;
+        // Bytes read from 'walker' but not yet decoded, nearest to 'offset()' first.
+        std::array<char, 4> pending = { };
+        size_t pending_count = 0;
     };
 
     struct WalkSentinel { };